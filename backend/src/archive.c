@@ -0,0 +1,1098 @@
+#include "archive.h"
+
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <ulfius.h>
+
+#include "atomic.h"
+#include "common.h"
+#include "compress.h"
+#include "config.h"
+#include "durable.h"
+#include "lock.h"
+#include "path.h"
+#include "trash.h"
+#include "upload.h"
+
+#define TAR_BLOCK 512
+#define TAR_PAX_MAX (8 * 1024)
+#define TAR_SIZE_MAX 077777777777LL
+
+enum _archive_state
+{
+	ARCHIVE_HEADER,
+	ARCHIVE_DATA,
+	ARCHIVE_PAD,
+	ARCHIVE_PAX,
+	ARCHIVE_SKIP,
+	ARCHIVE_END
+};
+
+struct archive_writer
+{
+	DIR *dh;
+	int fd;
+	off_t size;
+	off_t offset;
+	int done;
+	char pending[4 * TAR_BLOCK];
+	size_t pending_length;
+	size_t pending_offset;
+	char id[NAME_MAX + 1];       /* project exported, if any */
+	struct archive_writer *next; /* next export in progress */
+};
+
+struct archive_reader
+{
+	int dfd;
+	enum _archive_state state;
+	char block[TAR_BLOCK];
+	size_t block_length;
+	unsigned long long remaining;
+	size_t pad;
+	int zero_blocks;
+	int times;
+	time_t mtime;
+	char pax[TAR_PAX_MAX];
+	size_t pax_length;
+	char pax_path[NAME_MAX + 1];
+	long long pax_size;
+	struct atomic_file file;
+	int file_open;
+	unsigned int files;
+};
+
+struct _archive_import
+{
+	int root;
+	int sfd;
+	char staging[NAME_MAX + 1];
+	struct archive_reader *reader;
+	struct compress_decoder *decoder;
+	unsigned int files;
+};
+
+static int _archive_encoding(const struct _u_request *, enum compress_t *);
+static ssize_t _archive_stream(void *, uint64_t, char *, size_t);
+static void _archive_stream_free(void *);
+static int _archive_next(struct archive_writer *);
+static void _archive_header(char *, const char *, char, unsigned long long, const struct stat *);
+static size_t _archive_pax_record(char *, size_t, const char *, const char *);
+static int _archive_feed(void *, const char *, size_t);
+static int _archive_publish(int, int);
+static int _archive_import_open(int, enum compress_t, struct _archive_import **);
+static int _archive_import_write(void *, const char *, size_t);
+static int _archive_import_finish(struct _archive_import *, int);
+static void _archive_import_free(void *);
+static int _archive_upload_open(int, const struct _u_request *, void **);
+static int _archive_entry(struct archive_reader *);
+static int _archive_complete(struct archive_reader *);
+static void _archive_pax_parse(struct archive_reader *);
+static unsigned long long _archive_octal(const char *, size_t);
+
+static struct
+{
+	pthread_mutex_t lock;
+	struct archive_writer *exports;
+} _archive = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+const struct upload_sink archive_upload = {
+	_archive_upload_open,
+	_archive_import_write,
+	_archive_import_free
+};
+
+/* archive_get_project
+ *
+ * Streams all files of a project as a tar archive, generated while it is
+ * being sent. File contents are read straight into the outgoing buffers, so
+ * nothing is staged in memory or on disk.
+ *
+ * The 'format' query parameter selects 'tar' (default), 'tar.gz' or 'tar.zst'.
+ */
+int
+archive_get_project(const struct _u_request *request, struct _u_response *response, void *user_data)
+{
+	char path[PATH_MAX] = {0};
+	struct archive_writer *writer;
+	enum compress_t encoding;
+	const char *id;
+	int rc;
+
+	UNUSED(user_data);
+
+	id = u_map_get(request->map_url, "id");
+	if (!id || id[0] == '.') {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "No project id was specified.");
+		return ulfius_set_empty_response(response, HTTP_BAD_REQUEST);
+	}
+
+	if (_archive_encoding(request, &encoding) != 0)
+		return ulfius_set_empty_response(response, HTTP_BAD_REQUEST);
+
+	rc = path_project(id, path, sizeof(path), FALSE);
+	if (rc != 0) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to resolve project path: %s", id);
+		return ulfius_set_empty_response(response,
+		    EINVAL == rc ? HTTP_BAD_REQUEST : HTTP_INTERNAL_SERVER_ERROR);
+	}
+
+	/* a batch swapping the project in the meantime waits, or sees the
+	 * export and leaves the project alone */
+	lock_project(id);
+
+	if ((writer = archive_writer_open(path))) {
+		snprintf(writer->id, sizeof(writer->id), "%s", id);
+
+		pthread_mutex_lock(&_archive.lock);
+		writer->next = _archive.exports;
+		_archive.exports = writer;
+		pthread_mutex_unlock(&_archive.lock);
+	}
+
+	rc = errno;
+	unlock_project(id);
+
+	if (!writer) {
+		if (ENOMEM == rc)
+			return U_ERROR_MEMORY;
+
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Tried to archive project that doesn't exist: %s", id);
+		return ulfius_set_empty_response(response, HTTP_NOT_FOUND);
+	}
+
+	u_map_put(response->map_header, "Content-Type",
+	    encoding == COMPRESS_ZSTD ? "application/zstd" :
+	    encoding == COMPRESS_GZIP ? "application/gzip" : "application/x-tar");
+
+	y_log_message(Y_LOG_LEVEL_DEBUG, "Archive for project '%s' requested.", id);
+
+	return compress_stream_response(response, HTTP_OK, encoding,
+	    _archive_stream, _archive_stream_free, writer);
+}
+
+/* archive_put_project
+ *
+ * Extracts a tar archive into a project, creating the project if needed.
+ *
+ * The archive is extracted into a staging directory in the upload area,
+ * made durable in one go, and only then moved into the project under its
+ * lock, replacing any existing file of the same name. A malformed archive
+ * leaves the project untouched. Entries other than regular files, and
+ * names that are hidden or contain a path, are skipped.
+ *
+ * The 'format' query parameter selects 'tar' (default), 'tar.gz' or 'tar.zst'.
+ *
+ * Sent as the file part of a multipart/form-data body, the archive is
+ * decoded and extracted while it arrives, so neither it nor its content is
+ * ever held in memory and it can exceed MAX_BODY_SIZE. A raw body is
+ * buffered by ulfius first.
+ */
+int
+archive_put_project(const struct _u_request *request, struct _u_response *response, void *user_data)
+{
+	char path[PATH_MAX] = {0};
+	struct _archive_import *import = NULL;
+	enum compress_t encoding;
+	const char *id;
+	int status;
+	int dfd;
+	int rc;
+
+	UNUSED(user_data);
+
+	rc = upload_claim(request, &archive_upload, (void **) &import);
+	if (ENOENT == rc) {
+		if (_archive_encoding(request, &encoding) != 0)
+			return ulfius_set_empty_response(response, HTTP_BAD_REQUEST);
+
+		if ((rc = _archive_import_open(upload_directory(), encoding, &import)) == 0)
+			rc = _archive_import_write(import, request->binary_body, request->binary_body_length);
+	}
+
+	if (import)
+		rc = _archive_import_finish(import, rc);
+
+	switch (rc) {
+	case 0:
+		break;
+	case EINVAL:
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Malformed archive upload.");
+		status = HTTP_BAD_REQUEST;
+		goto discard;
+	default:
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to extract archive upload.");
+		status = HTTP_INTERNAL_SERVER_ERROR;
+		goto discard;
+	}
+
+	id = u_map_get(request->map_url, "id");
+	if (!id || id[0] == '.') {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "No project id was specified.");
+		status = HTTP_BAD_REQUEST;
+		goto discard;
+	}
+
+	/* moved under the lock, so a batch or delete can't move it away */
+	lock_project(id);
+
+	rc = path_project(id, path, sizeof(path), TRUE);
+	if (rc != 0) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to resolve project path: %s", id);
+		status = EINVAL == rc ? HTTP_BAD_REQUEST : HTTP_INTERNAL_SERVER_ERROR;
+		goto unlock;
+	}
+
+	status = HTTP_INTERNAL_SERVER_ERROR;
+
+	if (mkdir(path, S_IRWXU) == -1 && EEXIST != errno) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to create project directory: %s", path);
+		goto unlock;
+	}
+
+	dfd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (dfd == -1) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to open project directory: %s", path);
+		goto unlock;
+	}
+
+	if (_archive_publish(import->sfd, dfd) == 0) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Imported %u files into project '%s'.", import->files, id);
+		status = HTTP_NO_CONTENT;
+	} else {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to move imported files into project '%s'.", id);
+	}
+
+	close(dfd);
+
+unlock:
+	unlock_project(id);
+
+discard:
+	if (import)
+		_archive_import_free(import);
+
+	return ulfius_set_empty_response(response, status);
+}
+
+/* archive_writer_open
+ *
+ * Function starts a tar archive of the regular files in the directory
+ * 'path', to be read with archive_writer_read. Hidden files are left out.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the writer, or NULL with errno set on failure.
+ */
+struct archive_writer *
+archive_writer_open(const char *path)
+{
+	struct archive_writer *writer;
+
+	writer = calloc(1, sizeof(*writer));
+	if (!writer)
+		return NULL;
+
+	writer->fd = -1;
+
+	if (!(writer->dh = opendir(path))) {
+		free(writer);
+		return NULL;
+	}
+
+	return writer;
+}
+
+/* archive_writer_read
+ *
+ * Function fills 'buffer' with up to 'max' more bytes of the archive.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the number of bytes written to 'buffer', zero
+ * (0) once the archive is complete, or -1 on failure.
+ */
+ssize_t
+archive_writer_read(struct archive_writer *writer, char *buffer, size_t max)
+{
+	size_t written = 0;
+	size_t chunk;
+	ssize_t bread;
+
+	while (written < max) {
+		if (writer->pending_offset < writer->pending_length) {
+			chunk = writer->pending_length - writer->pending_offset;
+			if (chunk > max - written)
+				chunk = max - written;
+
+			memcpy(buffer + written, writer->pending + writer->pending_offset, chunk);
+			writer->pending_offset += chunk;
+			written += chunk;
+			continue;
+		}
+
+		if (writer->fd != -1 && writer->offset < writer->size) {
+			chunk = max - written;
+			if ((off_t) chunk > writer->size - writer->offset)
+				chunk = writer->size - writer->offset;
+
+			bread = pread(writer->fd, buffer + written, chunk, writer->offset);
+			if (bread == -1 && EINTR == errno)
+				continue;
+
+			if (bread == -1) {
+				y_log_message(Y_LOG_LEVEL_ERROR, "Failed to read file for archive.");
+				return -1;
+			}
+
+			/* file shrank since its header went out, keep the archive valid */
+			if (bread == 0) {
+				memset(buffer + written, 0, chunk);
+				bread = chunk;
+			}
+
+			writer->offset += bread;
+			written += bread;
+			continue;
+		}
+
+		if (writer->done)
+			break;
+
+		if (_archive_next(writer) != 0)
+			return -1;
+	}
+
+	return written;
+}
+
+void
+archive_writer_close(struct archive_writer *writer)
+{
+	if (writer->fd != -1)
+		close(writer->fd);
+
+	closedir(writer->dh);
+	free(writer);
+}
+
+/* archive_busy
+ *
+ * Function tells whether project 'id' is being exported, so that its files
+ * must stay where they are.
+ */
+int
+archive_busy(const char *id)
+{
+	struct archive_writer *writer;
+	int busy = FALSE;
+
+	pthread_mutex_lock(&_archive.lock);
+	for (writer = _archive.exports; writer && !busy; writer = writer->next)
+		busy = strcmp(writer->id, id) == 0;
+	pthread_mutex_unlock(&_archive.lock);
+
+	return busy;
+}
+
+/* archive_reader_open
+ *
+ * Function starts extracting a tar archive into the directory 'dfd', fed
+ * with archive_reader_feed. With 'times' set, files keep the modification
+ * time recorded in the archive rather than that of their extraction.
+ *
+ * Extracted files are not made durable; 'dfd' is meant to be a staging
+ * directory the caller syncs once and publishes afterwards.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the reader, or NULL if out of memory.
+ */
+struct archive_reader *
+archive_reader_open(int dfd, int times)
+{
+	struct archive_reader *reader;
+
+	reader = calloc(1, sizeof(*reader));
+	if (!reader)
+		return NULL;
+
+	reader->dfd = dfd;
+	reader->times = times;
+	reader->state = ARCHIVE_HEADER;
+	reader->pax_size = -1;
+
+	return reader;
+}
+
+/* archive_reader_feed
+ *
+ * Function extracts the next 'length' bytes of the archive.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, EINVAL if the archive is
+ * malformed, or any other errno value on failure.
+ */
+int
+archive_reader_feed(struct archive_reader *reader, const char *buffer, size_t length)
+{
+	return _archive_feed(reader, buffer, length);
+}
+
+/* archive_reader_close
+ *
+ * Function ends the extraction, 'rc' being the outcome of the last feed.
+ * A file still being written is discarded.
+ *
+ * RETURN VALUES
+ *
+ * The function will return 'rc', or EINVAL if the archive ended in the
+ * middle of an entry.
+ */
+int
+archive_reader_close(struct archive_reader *reader, int rc)
+{
+	/* archive ends in the middle of an entry or a header */
+	if (rc == 0 && reader->state != ARCHIVE_END &&
+	    (reader->state != ARCHIVE_HEADER || reader->block_length != 0))
+		rc = EINVAL;
+
+	if (reader->file_open)
+		atomic_abort(&reader->file);
+
+	free(reader);
+
+	return rc;
+}
+
+/*****************************************************************************/
+
+int
+_archive_encoding(const struct _u_request *request, enum compress_t *encoding)
+{
+	const char *format;
+
+	format = u_map_get(request->map_url, "format");
+	if (!format || strcmp(format, "tar") == 0) {
+		*encoding = COMPRESS_IDENTITY;
+		return 0;
+	}
+
+	if (strcmp(format, "tar.gz") == 0 && compress_available(COMPRESS_GZIP)) {
+		*encoding = COMPRESS_GZIP;
+		return 0;
+	}
+
+	if (strcmp(format, "tar.zst") == 0 && compress_available(COMPRESS_ZSTD)) {
+		*encoding = COMPRESS_ZSTD;
+		return 0;
+	}
+
+	y_log_message(Y_LOG_LEVEL_DEBUG, "Unsupported archive format requested: %s", format);
+	return -1;
+}
+
+ssize_t
+_archive_stream(void *stream_user_data, uint64_t offset, char *out_buf, size_t max)
+{
+	ssize_t written;
+
+	UNUSED(offset);
+
+	written = archive_writer_read(stream_user_data, out_buf, max);
+	if (written == -1)
+		return ULFIUS_STREAM_ERROR;
+
+	return written > 0 ? written : ULFIUS_STREAM_END;
+}
+
+void
+_archive_stream_free(void *stream_user_data)
+{
+	struct archive_writer *writer = stream_user_data;
+	struct archive_writer **link;
+
+	pthread_mutex_lock(&_archive.lock);
+	for (link = &_archive.exports; *link != writer; link = &(*link)->next)
+		;
+	*link = writer->next;
+	pthread_mutex_unlock(&_archive.lock);
+
+	archive_writer_close(writer);
+}
+
+/* _archive_next
+ *
+ * Function finishes the current archive member and queues the headers of
+ * the next one, or the end-of-archive marker.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success and -1 on failure.
+ */
+int
+_archive_next(struct archive_writer *writer)
+{
+	struct dirent *dentry;
+	struct stat st;
+	char size[24];
+	size_t pad;
+	size_t pax;
+	int fd;
+
+	writer->pending_offset = 0;
+	writer->pending_length = 0;
+
+	if (writer->fd != -1) {
+		close(writer->fd);
+		writer->fd = -1;
+
+		pad = (TAR_BLOCK - writer->size % TAR_BLOCK) % TAR_BLOCK;
+		memset(writer->pending, 0, pad);
+		writer->pending_length = pad;
+	}
+
+	while ((dentry = readdir(writer->dh))) {
+		if (dentry->d_name[0] == '.' ||
+		    (dentry->d_type != DT_REG && dentry->d_type != DT_UNKNOWN))
+			continue;
+
+		fd = openat(dirfd(writer->dh), dentry->d_name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+		if (fd == -1)
+			continue;
+
+		if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+			close(fd);
+			continue;
+		}
+
+		writer->fd = fd;
+		writer->size = st.st_size;
+		writer->offset = 0;
+
+		/* names and sizes that don't fit ustar go into a pax header */
+		if (strlen(dentry->d_name) >= 100 || st.st_size > TAR_SIZE_MAX) {
+			char *records = writer->pending + writer->pending_length + TAR_BLOCK;
+
+			pax = 0;
+			if (strlen(dentry->d_name) >= 100)
+				pax += _archive_pax_record(records + pax, 2 * TAR_BLOCK - pax, "path", dentry->d_name);
+			if (st.st_size > TAR_SIZE_MAX) {
+				snprintf(size, sizeof(size), "%lld", (long long) st.st_size);
+				pax += _archive_pax_record(records + pax, 2 * TAR_BLOCK - pax, "size", size);
+			}
+
+			_archive_header(writer->pending + writer->pending_length,
+			    "PaxHeader", 'x', pax, &st);
+			writer->pending_length += TAR_BLOCK;
+
+			memset(records + pax, 0, (TAR_BLOCK - pax % TAR_BLOCK) % TAR_BLOCK);
+			writer->pending_length += (pax + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+		}
+
+		_archive_header(writer->pending + writer->pending_length,
+		    dentry->d_name, '0', st.st_size, &st);
+		writer->pending_length += TAR_BLOCK;
+
+		return 0;
+	}
+
+	/* end of archive is marked by two zero blocks */
+	memset(writer->pending + writer->pending_length, 0, 2 * TAR_BLOCK);
+	writer->pending_length += 2 * TAR_BLOCK;
+	writer->done = TRUE;
+
+	return 0;
+}
+
+/* _archive_header
+ *
+ * Function formats a ustar header block for a member called 'name'.
+ */
+void
+_archive_header(char *block, const char *name, char type, unsigned long long size, const struct stat *fstat)
+{
+	unsigned int checksum = 0;
+	int i;
+
+	memset(block, 0, TAR_BLOCK);
+
+	strncpy(block, name, 99);
+	snprintf(block + 100, 8, "%07o", (unsigned int) fstat->st_mode & 0777);
+	snprintf(block + 108, 8, "%07o", 0);
+	snprintf(block + 116, 8, "%07o", 0);
+	snprintf(block + 124, 12, "%011llo", size > TAR_SIZE_MAX ? 0 : size);
+	snprintf(block + 136, 12, "%011llo", (unsigned long long) fstat->st_mtime);
+	block[156] = type;
+	memcpy(block + 257, "ustar", 6);
+	memcpy(block + 263, "00", 2);
+
+	memset(block + 148, ' ', 8);
+	for (i = 0; i < TAR_BLOCK; ++i)
+		checksum += (unsigned char) block[i];
+	snprintf(block + 148, 8, "%06o", checksum);
+	block[155] = ' ';
+}
+
+/* _archive_pax_record
+ *
+ * Function formats a "<length> <key>=<value>\n" pax record, where the
+ * length includes its own digits.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the number of bytes written.
+ */
+size_t
+_archive_pax_record(char *out, size_t length, const char *key, const char *value)
+{
+	size_t size = strlen(key) + strlen(value) + 3;
+	size_t digits = 1;
+	size_t total;
+
+	for (total = size + digits; snprintf(NULL, 0, "%zu", total) > (int) digits;
+	     total = size + ++digits);
+
+	if (total >= length)
+		return 0;
+
+	snprintf(out, length, "%zu %s=%s\n", total, key, value);
+
+	return total;
+}
+
+/* _archive_feed
+ *
+ * Function pushes 'length' bytes of archive data into the extractor.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, EINVAL if the archive is
+ * malformed, or any other errno value on failure.
+ */
+int
+_archive_feed(void *data, const char *buffer, size_t length)
+{
+	struct archive_reader *reader = data;
+	size_t chunk;
+	int rc;
+
+	while (length > 0) {
+		switch (reader->state) {
+		case ARCHIVE_HEADER:
+			chunk = TAR_BLOCK - reader->block_length;
+			if (chunk > length)
+				chunk = length;
+
+			memcpy(reader->block + reader->block_length, buffer, chunk);
+			reader->block_length += chunk;
+			buffer += chunk;
+			length -= chunk;
+
+			if (reader->block_length == TAR_BLOCK) {
+				reader->block_length = 0;
+				if ((rc = _archive_entry(reader)) != 0)
+					return rc;
+			}
+			break;
+
+		case ARCHIVE_DATA:
+		case ARCHIVE_PAX:
+		case ARCHIVE_SKIP:
+			chunk = reader->remaining < length ? reader->remaining : length;
+
+			if (reader->state == ARCHIVE_DATA) {
+				if ((rc = atomic_write(&reader->file, buffer, chunk)) != 0)
+					return rc;
+			} else if (reader->state == ARCHIVE_PAX &&
+			           reader->pax_length + chunk < sizeof(reader->pax)) {
+				memcpy(reader->pax + reader->pax_length, buffer, chunk);
+				reader->pax_length += chunk;
+			}
+
+			buffer += chunk;
+			length -= chunk;
+			reader->remaining -= chunk;
+
+			if (reader->remaining == 0 && (rc = _archive_complete(reader)) != 0)
+				return rc;
+			break;
+
+		case ARCHIVE_PAD:
+			chunk = reader->pad < length ? reader->pad : length;
+			buffer += chunk;
+			length -= chunk;
+			reader->pad -= chunk;
+
+			if (reader->pad == 0)
+				reader->state = ARCHIVE_HEADER;
+			break;
+
+		case ARCHIVE_END:
+			return 0;
+		}
+	}
+
+	return 0;
+}
+
+/* _archive_publish
+ *
+ * Function makes everything extracted into the staging directory 'sfd'
+ * durable with a single sync, then moves it into the project directory
+ * 'dfd' and syncs that once.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+_archive_publish(int sfd, int dfd)
+{
+	struct dirent *dentry;
+	DIR *dh;
+	int fd;
+	int rc;
+
+	if ((rc = durable_sync(sfd, DURABLE_FILESYSTEM)) != 0)
+		return rc;
+
+	if ((fd = dup(sfd)) == -1)
+		return errno;
+
+	if (!(dh = fdopendir(fd))) {
+		rc = errno;
+		close(fd);
+		return rc;
+	}
+
+	rewinddir(dh);
+
+	while (rc == 0 && (dentry = readdir(dh))) {
+		if (dentry->d_name[0] == '.')
+			continue;
+
+		if (renameat(sfd, dentry->d_name, dfd, dentry->d_name) == -1)
+			rc = errno;
+	}
+
+	closedir(dh);
+
+	if (rc != 0)
+		return rc;
+
+	return durable_sync(dfd, DURABLE_DIRECTORY);
+}
+
+/* _archive_import_open
+ *
+ * Function starts extracting a 'encoding' encoded tar archive, fed with
+ * _archive_import_write, into a new staging directory inside 'root'.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+_archive_import_open(int root, enum compress_t encoding, struct _archive_import **result)
+{
+	static unsigned int counter;
+	struct _archive_import *import;
+	int rc;
+
+	if (!(import = calloc(1, sizeof(*import))))
+		return ENOMEM;
+
+	import->root = root;
+
+	snprintf(import->staging, sizeof(import->staging), ".import.%d.%u",
+	    getpid(), __sync_fetch_and_add(&counter, 1));
+
+	if (mkdirat(root, import->staging, S_IRWXU) == -1) {
+		rc = errno;
+		free(import);
+		return rc;
+	}
+
+	import->sfd = openat(root, import->staging, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (import->sfd == -1 ||
+	    !(import->reader = archive_reader_open(import->sfd, FALSE)) ||
+	    !(import->decoder = compress_decoder_open(encoding, _archive_feed, import->reader))) {
+		rc = errno;
+		_archive_import_free(import);
+		return rc;
+	}
+
+	*result = import;
+	return 0;
+}
+
+int
+_archive_import_write(void *data, const char *buffer, size_t length)
+{
+	struct _archive_import *import = data;
+
+	return compress_decoder_feed(import->decoder, buffer, length);
+}
+
+/* _archive_import_finish
+ *
+ * Function completes the extraction, 'rc' being the outcome of feeding the
+ * archive so far. The extracted files stay in the staging directory.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, EINVAL if the archive is
+ * malformed or truncated, or any other errno value on failure.
+ */
+int
+_archive_import_finish(struct _archive_import *import, int rc)
+{
+	rc = compress_decoder_close(import->decoder, rc);
+	import->decoder = NULL;
+
+	import->files = import->reader->files;
+
+	rc = archive_reader_close(import->reader, rc);
+	import->reader = NULL;
+
+	return rc;
+}
+
+/* _archive_import_free
+ *
+ * Function discards the import along with whatever is left in its staging
+ * directory.
+ */
+void
+_archive_import_free(void *data)
+{
+	struct _archive_import *import = data;
+
+	if (import->decoder)
+		compress_decoder_close(import->decoder, ECANCELED);
+
+	if (import->reader)
+		archive_reader_close(import->reader, ECANCELED);
+
+	if (import->sfd != -1)
+		close(import->sfd);
+
+	if (trash_put(import->root, import->staging) != 0)
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to discard import staging: %s", import->staging);
+
+	free(import);
+}
+
+/* _archive_upload_open
+ *
+ * Function starts extracting an archive uploaded to the upload directory
+ * 'dfd' while it arrives. Which project it is for is only known, and
+ * looked up under the project lock, once the endpoint runs.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, EINVAL if the format isn't
+ * supported, or any other errno value on failure.
+ */
+int
+_archive_upload_open(int dfd, const struct _u_request *request, void **data)
+{
+	struct _archive_import *import;
+	enum compress_t encoding;
+	int rc;
+
+	if (_archive_encoding(request, &encoding) != 0)
+		return EINVAL;
+
+	if ((rc = _archive_import_open(dfd, encoding, &import)) != 0)
+		return rc;
+
+	*data = import;
+	return 0;
+}
+
+/* _archive_entry
+ *
+ * Function interprets the header block that was just received.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, EINVAL if the header is
+ * malformed, or any other errno value on failure.
+ */
+int
+_archive_entry(struct archive_reader *reader)
+{
+	char name[NAME_MAX + 1];
+	unsigned long long size;
+	unsigned int checksum = 0;
+	char type;
+	int i;
+
+	for (i = 0; i < TAR_BLOCK && reader->block[i] == 0; ++i);
+	if (i == TAR_BLOCK) {
+		if (++reader->zero_blocks == 2)
+			reader->state = ARCHIVE_END;
+		return 0;
+	}
+
+	reader->zero_blocks = 0;
+
+	for (i = 0; i < TAR_BLOCK; ++i)
+		checksum += (unsigned char) (i >= 148 && i < 156 ? ' ' : reader->block[i]);
+	if (checksum != _archive_octal(reader->block + 148, 8))
+		return EINVAL;
+
+	type = reader->block[156];
+	size = reader->pax_size >= 0 ? (unsigned long long) reader->pax_size
+	                             : _archive_octal(reader->block + 124, 12);
+
+	if (reader->pax_path[0]) {
+		snprintf(name, sizeof(name), "%s", reader->pax_path);
+	} else if (reader->block[345] && memcmp(reader->block + 257, "ustar", 5) == 0) {
+		snprintf(name, sizeof(name), "%.155s/%.100s", reader->block + 345, reader->block);
+	} else {
+		snprintf(name, sizeof(name), "%.100s", reader->block);
+	}
+
+	reader->remaining = size;
+	reader->pad = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+	reader->mtime = _archive_octal(reader->block + 136, 12);
+
+	/* pax attributes only apply to the member that follows them */
+	if (type != 'x') {
+		reader->pax_path[0] = '\0';
+		reader->pax_size = -1;
+	}
+
+	switch (type) {
+	case 'x':
+		reader->pax_length = 0;
+		reader->state = ARCHIVE_PAX;
+		break;
+
+	case '0':
+	case '\0':
+		if (name[0] == '.' || name[0] == '\0' || strchr(name, '/')) {
+			y_log_message(Y_LOG_LEVEL_DEBUG, "Skipping archive member: %s", name);
+			reader->state = ARCHIVE_SKIP;
+			break;
+		}
+
+		if ((i = atomic_open(&reader->file, reader->dfd, name)) != 0)
+			return i;
+
+		reader->file_open = TRUE;
+		reader->state = ARCHIVE_DATA;
+		break;
+
+	default:
+		reader->state = ARCHIVE_SKIP;
+		break;
+	}
+
+	/* empty members are complete right away */
+	if (reader->remaining == 0)
+		return _archive_complete(reader);
+
+	return 0;
+}
+
+/* _archive_complete
+ *
+ * Function finishes the member whose data was just received in full and
+ * moves on to the padding that follows it.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+_archive_complete(struct archive_reader *reader)
+{
+	int rc;
+
+	switch (reader->state) {
+	case ARCHIVE_DATA:
+		if (reader->times) {
+			struct timespec times[2] = {
+				{ reader->mtime, 0 },
+				{ reader->mtime, 0 }
+			};
+
+			futimens(reader->file.fd, times);
+		}
+
+		reader->file_open = FALSE;
+		if ((rc = atomic_stage(&reader->file, ATOMIC_ANY)) != 0)
+			return rc;
+		++reader->files;
+		break;
+
+	case ARCHIVE_PAX:
+		_archive_pax_parse(reader);
+		break;
+
+	default:
+		break;
+	}
+
+	reader->state = reader->pad > 0 ? ARCHIVE_PAD : ARCHIVE_HEADER;
+
+	return 0;
+}
+
+/* _archive_pax_parse
+ *
+ * Function picks the attributes we care about out of a pax extended header.
+ */
+void
+_archive_pax_parse(struct archive_reader *reader)
+{
+	char *cursor = reader->pax;
+	char *end = reader->pax + reader->pax_length;
+	char *record;
+	char *value;
+	long length;
+
+	while (cursor < end) {
+		length = strtol(cursor, &record, 10);
+		if (length <= 0 || cursor + length > end || *record != ' ')
+			break;
+
+		++record;
+		value = memchr(record, '=', cursor + length - record);
+		if (value) {
+			*value++ = '\0';
+			cursor[length - 1] = '\0';
+
+			if (strcmp(record, "path") == 0)
+				snprintf(reader->pax_path, sizeof(reader->pax_path), "%s", value);
+			else if (strcmp(record, "size") == 0)
+				reader->pax_size = strtoll(value, NULL, 10);
+		}
+
+		cursor += length;
+	}
+}
+
+unsigned long long
+_archive_octal(const char *field, size_t length)
+{
+	unsigned long long value = 0;
+	size_t i = 0;
+
+	while (i < length && field[i] == ' ')
+		++i;
+
+	for (; i < length && field[i] >= '0' && field[i] <= '7'; ++i)
+		value = value * 8 + (field[i] - '0');
+
+	return value;
+}
@@ -0,0 +1,26 @@
+#ifndef CREDENTARIUS_ARCHIVE_H
+#define CREDENTARIUS_ARCHIVE_H 1
+
+#include <sys/types.h>
+
+struct _u_request;
+struct _u_response;
+struct archive_writer;
+struct archive_reader;
+struct upload_sink;
+
+int archive_get_project(const struct _u_request *, struct _u_response *, void *);
+int archive_put_project(const struct _u_request *, struct _u_response *, void *);
+
+extern const struct upload_sink archive_upload;
+
+struct archive_writer *archive_writer_open(const char *);
+ssize_t archive_writer_read(struct archive_writer *, char *, size_t);
+void archive_writer_close(struct archive_writer *);
+int archive_busy(const char *);
+
+struct archive_reader *archive_reader_open(int, int);
+int archive_reader_feed(struct archive_reader *, const char *, size_t);
+int archive_reader_close(struct archive_reader *, int);
+
+#endif
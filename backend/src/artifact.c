@@ -0,0 +1,129 @@
+#include "artifact.h"
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <ulfius.h>
+
+#include "cache.h"
+#include "common.h"
+#include "config.h"
+#include "path.h"
+#include "sha256.h"
+#include "stream.h"
+
+static int _artifact_get(const struct _u_request *, struct _u_response *, const char *, const char *, const char *);
+
+int
+artifact_get_firmware(const struct _u_request *request, struct _u_response *response, void *user_data)
+{
+	UNUSED(user_data);
+
+	return _artifact_get(request, response, ARTIFACT_FIRMWARE,
+	    "application/octet-stream", "firmware.bin");
+}
+
+int
+artifact_get_map(const struct _u_request *request, struct _u_response *response, void *user_data)
+{
+	UNUSED(user_data);
+
+	return _artifact_get(request, response, ARTIFACT_MAP,
+	    "text/plain", "firmware.map");
+}
+
+int
+artifact_get_elf(const struct _u_request *request, struct _u_response *response, void *user_data)
+{
+	UNUSED(user_data);
+
+	return _artifact_get(request, response, ARTIFACT_ELF,
+	    "application/x-elf", "firmware.elf");
+}
+
+/*****************************************************************************/
+
+/* _artifact_get
+ *
+ * Function serves the build output 'name' of a project, straight from its
+ * descriptor and with byte range support.
+ *
+ * The entity tag is the SHA-256 digest of the content, so identical builds
+ * keep validating caches. Clients that pass the digest they expect as the
+ * 'hash' query parameter get a response that may be cached forever, or a
+ * 404 once the artifact changed.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the ulfius status of setting the response.
+ */
+int
+_artifact_get(const struct _u_request *request, struct _u_response *response,
+    const char *name, const char *type, const char *filename)
+{
+	char path[PATH_MAX] = {0};
+	char hex[SHA256_HEX_SIZE];
+	char etag[SHA256_HEX_SIZE + 2];
+	char disposition[64];
+	const char *hash;
+	struct stat st;
+	const char *id;
+	int fd;
+	int rc;
+
+	id = u_map_get(request->map_url, "id");
+	if (!id || id[0] == '.') {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "No project id was specified.");
+		return ulfius_set_empty_response(response, HTTP_BAD_REQUEST);
+	}
+
+	rc = path_project_file(id, name, path, sizeof(path));
+	if (rc != 0) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to resolve artifact path: %s/%s", id, name);
+		return ulfius_set_empty_response(response,
+		    EINVAL == rc ? HTTP_BAD_REQUEST : HTTP_INTERNAL_SERVER_ERROR);
+	}
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd == -1) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "No build artifact: %s", path);
+		return ulfius_set_empty_response(response, HTTP_NOT_FOUND);
+	}
+
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return ulfius_set_empty_response(response, HTTP_NOT_FOUND);
+	}
+
+	if (cache_digest(fd, &st, hex) != 0) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to hash build artifact: %s", path);
+		close(fd);
+		return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
+	}
+
+	hash = u_map_get(request->map_url, "hash");
+	if (hash && strcmp(hash, hex) != 0) {
+		close(fd);
+		return ulfius_set_empty_response(response, HTTP_NOT_FOUND);
+	}
+
+	snprintf(etag, sizeof(etag), "\"%s\"", hex);
+	u_map_put(response->map_header, "ETag", etag);
+	u_map_put(response->map_header, "Accept-Ranges", "bytes");
+	u_map_put(response->map_header, "Cache-Control",
+	    hash ? "public, max-age=31536000, immutable" : "no-cache");
+
+	if (cache_etag_match(u_map_get_case(request->map_header, "If-None-Match"), etag)) {
+		close(fd);
+		return ulfius_set_empty_response(response, HTTP_NOT_MODIFIED);
+	}
+
+	snprintf(disposition, sizeof(disposition), "attachment; filename=\"%s\"", filename);
+	u_map_put(response->map_header, "Content-Type", type);
+	u_map_put(response->map_header, "Content-Disposition", disposition);
+
+	return stream_range_response(request, response, fd, st.st_size, etag);
+}
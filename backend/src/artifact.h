@@ -0,0 +1,16 @@
+#ifndef CREDENTARIUS_ARTIFACT_H
+#define CREDENTARIUS_ARTIFACT_H 1
+
+/* build outputs, relative to the project directory */
+#define ARTIFACT_FIRMWARE ".firmware.bin"
+#define ARTIFACT_MAP ".firmware.map"
+#define ARTIFACT_ELF ".firmware.elf"
+
+struct _u_request;
+struct _u_response;
+
+int artifact_get_firmware(const struct _u_request *, struct _u_response *, void *);
+int artifact_get_map(const struct _u_request *, struct _u_response *, void *);
+int artifact_get_elf(const struct _u_request *, struct _u_response *, void *);
+
+#endif
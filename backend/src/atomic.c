@@ -0,0 +1,349 @@
+#include "atomic.h"
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blob.h"
+#include "durable.h"
+
+#define ATOMIC_BLOCK_SIZE (64 * 1024)
+
+static int _atomic_rename(struct atomic_file *, enum atomic_t);
+
+/* atomic_open
+ *
+ * Function starts writing a new version of 'name' inside the directory
+ * 'dfd'.
+ *
+ * Data goes to a hidden temporary file next to the target, which only
+ * replaces the target once atomic_commit is called. Readers therefore
+ * either see the old or the new content, never a partial file.
+ *
+ * The directory descriptor is borrowed and must outlive the atomic file.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+atomic_open(struct atomic_file *file, int dfd, const char *name)
+{
+	static unsigned int counter;
+	int rc;
+
+	file->dfd = dfd;
+	file->fd = -1;
+
+	rc = snprintf(file->name, sizeof(file->name), "%s", name);
+	if (rc <= 0 || (size_t) rc >= sizeof(file->name))
+		return ENAMETOOLONG;
+
+	do {
+		rc = snprintf(file->temp, sizeof(file->temp), ".%.200s.%d.%u",
+		    name, getpid(), __sync_fetch_and_add(&counter, 1));
+		if (rc <= 0 || (size_t) rc >= sizeof(file->temp))
+			return ENAMETOOLONG;
+
+		file->fd = openat(dfd, file->temp, O_CREAT|O_EXCL|O_WRONLY|O_CLOEXEC,
+		                  S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	} while (file->fd == -1 && EEXIST == errno);
+
+	if (file->fd == -1)
+		return errno;
+
+	return 0;
+}
+
+/* atomic_write
+ *
+ * Function appends 'length' bytes from 'data' to the atomic file, in blocks.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+atomic_write(struct atomic_file *file, const void *data, size_t length)
+{
+	const char *buffer = data;
+	ssize_t bwritten;
+	size_t chunk;
+
+	while (length > 0) {
+		chunk = length < ATOMIC_BLOCK_SIZE ? length : ATOMIC_BLOCK_SIZE;
+
+		bwritten = write(file->fd, buffer, chunk);
+		if (bwritten == -1) {
+			if (EINTR == errno)
+				continue;
+
+			return errno;
+		}
+
+		buffer += bwritten;
+		length -= bwritten;
+	}
+
+	return 0;
+}
+
+/* atomic_copy
+ *
+ * Function appends 'length' bytes read from 'fd' at 'offset' to the atomic
+ * file. The copy happens in the kernel, which may share the extents instead
+ * of duplicating them on file systems that support it.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, EIO if 'fd' ends before
+ * 'length' bytes were copied, or any other errno value on failure.
+ */
+int
+atomic_copy(struct atomic_file *file, int fd, off_t offset, size_t length)
+{
+	char buffer[ATOMIC_BLOCK_SIZE / 4];
+	ssize_t bcopied;
+	int rc;
+
+	while (length > 0) {
+		bcopied = copy_file_range(fd, &offset, file->fd, NULL, length, 0);
+		if (bcopied > 0) {
+			length -= bcopied;
+			continue;
+		}
+
+		if (bcopied == 0)
+			return EIO;
+
+		if (EINTR == errno)
+			continue;
+
+		if (EXDEV != errno && EINVAL != errno && ENOSYS != errno && EOPNOTSUPP != errno)
+			return errno;
+
+		/* no in-kernel copy between these descriptors, bounce it */
+		bcopied = pread(fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer), offset);
+		if (bcopied == -1 && EINTR == errno)
+			continue;
+
+		if (bcopied <= 0)
+			return bcopied == 0 ? EIO : errno;
+
+		if ((rc = atomic_write(file, buffer, bcopied)) != 0)
+			return rc;
+
+		offset += bcopied;
+		length -= bcopied;
+	}
+
+	return 0;
+}
+
+/* atomic_clone
+ *
+ * Function copies 'name' from the directory 'src' to 'dst', replacing it.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, ENOENT if 'src' has no
+ * such file, or any other errno value on failure.
+ */
+int
+atomic_clone(int src, int dst, const char *name)
+{
+	struct atomic_file afile;
+	struct stat st;
+	int fd;
+	int rc;
+
+	fd = openat(src, name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	if (fd == -1)
+		return errno;
+
+	if (fstat(fd, &st) == -1) {
+		rc = errno;
+		goto close;
+	}
+
+	if ((rc = atomic_open(&afile, dst, name)) != 0)
+		goto close;
+
+	if ((rc = atomic_copy(&afile, fd, 0, st.st_size)) != 0) {
+		atomic_abort(&afile);
+		goto close;
+	}
+
+	if (fchmod(afile.fd, st.st_mode & 07777) == -1) {
+		rc = errno;
+		atomic_abort(&afile);
+		goto close;
+	}
+
+	rc = atomic_commit(&afile, ATOMIC_ANY);
+
+close:
+	close(fd);
+	return rc;
+}
+
+/* atomic_move
+ *
+ * Function moves the atomic file to the directory 'dfd', where it will
+ * replace 'name' once committed. Both directories must be on the same file
+ * system; data written before and after the move all ends up in the file.
+ *
+ * This lets content be received before it is known, or safe to look up,
+ * where it belongs.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on
+ * failure, in which case the file is left where it was.
+ */
+int
+atomic_move(struct atomic_file *file, int dfd, const char *name)
+{
+	char target[NAME_MAX + 1];
+	int rc;
+
+	rc = snprintf(target, sizeof(target), "%s", name);
+	if (rc <= 0 || (size_t) rc >= sizeof(target))
+		return ENAMETOOLONG;
+
+	if (renameat2(file->dfd, file->temp, dfd, file->temp, RENAME_NOREPLACE) == -1)
+		return errno;
+
+	file->dfd = dfd;
+	memcpy(file->name, target, sizeof(file->name));
+
+	return 0;
+}
+
+/* atomic_commit
+ *
+ * Function renames the completed atomic file over its target, subject to
+ * 'mode'. On failure the temporary file is removed.
+ *
+ * The content is interned in the blob store first, so the target may end up
+ * sharing its blocks with identical files elsewhere. Failing to intern is
+ * not an error, the file is then simply stored on its own.
+ *
+ * The content is made durable before the rename and the directory after
+ * it, so a crash leaves either the old or the complete new file behind.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, EEXIST or ENOENT if the
+ * 'mode' precondition was not met, or any other errno value on failure.
+ * A failure to sync the directory is reported even though the target has
+ * already been replaced.
+ */
+int
+atomic_commit(struct atomic_file *file, enum atomic_t mode)
+{
+	int rc;
+
+	if ((rc = durable_sync(file->fd, DURABLE_DATA)) != 0) {
+		atomic_abort(file);
+		return rc;
+	}
+
+	if ((rc = _atomic_rename(file, mode)) != 0)
+		return rc;
+
+	return durable_sync(file->dfd, DURABLE_DIRECTORY);
+}
+
+/* atomic_stage
+ *
+ * Function renames the completed atomic file over its target like
+ * atomic_commit, but without making anything durable.
+ *
+ * It is meant for directories that only go live later, once the writer
+ * made all of them durable at once with durable_sync(..., DURABLE_FILESYSTEM).
+ * Syncing every staged file would otherwise hold the writer's lock for one
+ * sync window per file.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, EEXIST or ENOENT if the
+ * 'mode' precondition was not met, or any other errno value on failure.
+ */
+int
+atomic_stage(struct atomic_file *file, enum atomic_t mode)
+{
+	return _atomic_rename(file, mode);
+}
+
+/* atomic_abort
+ *
+ * Function discards the atomic file, leaving the target untouched.
+ */
+void
+atomic_abort(struct atomic_file *file)
+{
+	if (file->fd != -1) {
+		close(file->fd);
+		file->fd = -1;
+	}
+
+	unlinkat(file->dfd, file->temp, 0);
+}
+
+/*****************************************************************************/
+
+/* _atomic_rename
+ *
+ * Function closes the atomic file, interns it and renames it over its
+ * target, subject to 'mode'. On failure the temporary file is removed.
+ */
+int
+_atomic_rename(struct atomic_file *file, enum atomic_t mode)
+{
+	struct stat fstat;
+	int rc;
+
+	rc = close(file->fd);
+	file->fd = -1;
+
+	if (rc == -1) {
+		rc = errno;
+		goto abort;
+	}
+
+	blob_intern(file->dfd, file->temp);
+
+	switch (mode) {
+	case ATOMIC_CREATE:
+		rc = renameat2(file->dfd, file->temp, file->dfd, file->name, RENAME_NOREPLACE);
+		break;
+
+	case ATOMIC_REPLACE:
+		if (fstatat(file->dfd, file->name, &fstat, AT_SYMLINK_NOFOLLOW) == -1) {
+			rc = errno;
+			goto abort;
+		}
+
+		/* fall-through */
+
+	case ATOMIC_ANY:
+		rc = renameat(file->dfd, file->temp, file->dfd, file->name);
+		break;
+	}
+
+	if (rc == -1) {
+		rc = errno;
+		goto abort;
+	}
+
+	return 0;
+
+abort:
+	atomic_abort(file);
+	return rc;
+}
@@ -0,0 +1,31 @@
+#ifndef CREDENTARIUS_ATOMIC_H
+#define CREDENTARIUS_ATOMIC_H 1
+
+#include <limits.h>
+#include <sys/types.h>
+
+enum atomic_t
+{
+	ATOMIC_CREATE,  /* fail if the target exists */
+	ATOMIC_REPLACE, /* fail if the target doesn't exist */
+	ATOMIC_ANY
+};
+
+struct atomic_file
+{
+	int dfd;
+	int fd;
+	char name[NAME_MAX + 1];
+	char temp[NAME_MAX + 1];
+};
+
+int atomic_open(struct atomic_file *, int, const char *);
+int atomic_write(struct atomic_file *, const void *, size_t);
+int atomic_copy(struct atomic_file *, int, off_t, size_t);
+int atomic_clone(int, int, const char *);
+int atomic_move(struct atomic_file *, int, const char *);
+int atomic_commit(struct atomic_file *, enum atomic_t);
+int atomic_stage(struct atomic_file *, enum atomic_t);
+void atomic_abort(struct atomic_file *);
+
+#endif
@@ -0,0 +1,341 @@
+#include "batch.h"
+
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ulfius.h>
+
+#include "archive.h"
+#include "atomic.h"
+#include "build.h"
+#include "common.h"
+#include "config.h"
+#include "durable.h"
+#include "lock.h"
+#include "path.h"
+#include "trash.h"
+
+#define BATCH_HEADER_SIZE 7
+
+enum _batch_op
+{
+	BATCH_PUT    = 'P',
+	BATCH_DELETE = 'D'
+};
+
+struct _batch_record
+{
+	enum _batch_op op;
+	char name[NAME_MAX + 1];
+	const char *data;
+	size_t length;
+};
+
+static int _batch_parse(const char *, size_t, size_t *, struct _batch_record *);
+static int _batch_snapshot(int, int);
+static int _batch_apply(int, const struct _batch_record *);
+
+/* batch_post_project
+ *
+ * Applies a batch of file creates, updates and deletes to a project as one
+ * atomic change.
+ *
+ * The body is a sequence of records, each made of a one byte operation
+ * ('P' to write a file, 'D' to delete one), the big-endian 16-bit length of
+ * the file name, the big-endian 32-bit length of the file data, the name
+ * and the data (always empty for deletes).
+ *
+ * The whole batch is validated first, then applied to a hard-linked copy of
+ * the project which is exchanged with the live directory in a single
+ * rename. Readers, including builds, see either all changes or none.
+ *
+ * The previous version is thrown away right after, so a batch is refused
+ * with 409 Conflict while a build or a flash of the project runs, or an
+ * archive of it is being exported; they would lose the directory they
+ * work in.
+ */
+int
+batch_post_project(const struct _u_request *request, struct _u_response *response, void *user_data)
+{
+	char path[PATH_MAX] = {0};
+	char snapshot[NAME_MAX + 1];
+	static unsigned int counter;
+	struct _batch_record record;
+	const char *id;
+	size_t offset;
+	unsigned int records = 0;
+	int root;
+	int pfd;
+	int sfd;
+	int rc;
+
+	UNUSED(user_data);
+
+	id = u_map_get(request->map_url, "id");
+	if (!id || id[0] == '.') {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "No project id was specified.");
+		return ulfius_set_empty_response(response, HTTP_BAD_REQUEST);
+	}
+
+	/* reject malformed batches before touching anything */
+	for (offset = 0; offset < request->binary_body_length; ++records) {
+		if (_batch_parse(request->binary_body, request->binary_body_length, &offset, &record) != 0) {
+			y_log_message(Y_LOG_LEVEL_DEBUG, "Malformed batch record #%u for project '%s'.", records, id);
+			return ulfius_set_empty_response(response, HTTP_BAD_REQUEST);
+		}
+	}
+
+	rc = snprintf(snapshot, sizeof(snapshot), ".%.200s.batch.%u", id,
+	    __sync_fetch_and_add(&counter, 1));
+	if (rc <= 0 || (size_t) rc >= sizeof(snapshot))
+		return ulfius_set_empty_response(response, HTTP_BAD_REQUEST);
+
+	root = open(PROJECT_PATH, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (root == -1) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to open project root: %s", PROJECT_PATH);
+		return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
+	}
+
+	lock_project(id);
+
+	/* resolved under the lock, so a migration can't leave it a link */
+	rc = path_project(id, path, sizeof(path), FALSE);
+	if (rc != 0) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to resolve project path: %s", id);
+		rc = EINVAL == rc ? HTTP_BAD_REQUEST : HTTP_INTERNAL_SERVER_ERROR;
+		goto unlock;
+	}
+
+	pfd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (pfd == -1) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Tried to batch update project that doesn't exist: %s", id);
+		rc = ENOENT == errno ? HTTP_NOT_FOUND : HTTP_INTERNAL_SERVER_ERROR;
+		goto unlock;
+	}
+
+	/* builds, flashes and exports take the project lock as they start, so
+	 * none begins between this check and the swap */
+	if (build_busy(id) || archive_busy(id)) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Project is being built, flashed or exported, batch refused: %s", id);
+		rc = HTTP_CONFLICT;
+		goto close_project;
+	}
+
+	if (mkdirat(root, snapshot, S_IRWXU) == -1) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to create batch snapshot: %s", snapshot);
+		rc = HTTP_INTERNAL_SERVER_ERROR;
+		goto close_project;
+	}
+
+	sfd = openat(root, snapshot, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (sfd == -1 || _batch_snapshot(pfd, sfd) != 0) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to populate batch snapshot: %s", snapshot);
+		rc = HTTP_INTERNAL_SERVER_ERROR;
+		goto discard;
+	}
+
+	for (offset = 0; offset < request->binary_body_length;) {
+		_batch_parse(request->binary_body, request->binary_body_length, &offset, &record);
+
+		switch (_batch_apply(sfd, &record)) {
+		case 0: continue;
+		case ENOENT:
+			y_log_message(Y_LOG_LEVEL_DEBUG, "Batch deletes non-existent file: %s", record.name);
+			rc = HTTP_NOT_FOUND;
+			goto discard;
+		default:
+			y_log_message(Y_LOG_LEVEL_ERROR, "Failed to stage batch file: %s", record.name);
+			rc = HTTP_INTERNAL_SERVER_ERROR;
+			goto discard;
+		}
+	}
+
+	/* the staged files and the snapshot's entries, all in one go */
+	if (durable_sync(sfd, DURABLE_FILESYSTEM) != 0) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to sync batch snapshot: %s", snapshot);
+		rc = HTTP_INTERNAL_SERVER_ERROR;
+		goto discard;
+	}
+
+	if (renameat2(root, snapshot, AT_FDCWD, path, RENAME_EXCHANGE) == -1) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to commit batch for project '%s'.", id);
+		rc = HTTP_INTERNAL_SERVER_ERROR;
+		goto discard;
+	}
+
+	/* the new version is live already; failing now would only mislead */
+	if (durable_parent(path) != 0)
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to sync batch for project '%s'.", id);
+
+	y_log_message(Y_LOG_LEVEL_DEBUG, "Committed %u batched changes to project '%s'.", records, id);
+
+	/* 'snapshot' now names the previous version of the project */
+	rc = HTTP_NO_CONTENT;
+
+discard:
+	if (sfd != -1)
+		close(sfd);
+	trash_put(root, snapshot);
+
+close_project:
+	close(pfd);
+
+unlock:
+	unlock_project(id);
+	close(root);
+
+	return ulfius_set_empty_response(response, rc);
+}
+
+/*****************************************************************************/
+
+/* _batch_parse
+ *
+ * Function decodes the record at 'offset' in 'body' into 'record' and moves
+ * 'offset' past it.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success and -1 if the record is
+ * malformed.
+ */
+int
+_batch_parse(const char *body, size_t length, size_t *offset, struct _batch_record *record)
+{
+	const unsigned char *header = (const unsigned char *) body + *offset;
+	size_t name_length;
+
+	if (length - *offset < BATCH_HEADER_SIZE)
+		return -1;
+
+	record->op = header[0];
+	name_length = (size_t) header[1] << 8 | header[2];
+	record->length = (size_t) header[3] << 24 | (size_t) header[4] << 16 |
+	                 (size_t) header[5] << 8 | header[6];
+
+	if ((record->op != BATCH_PUT && record->op != BATCH_DELETE) ||
+	    (record->op == BATCH_DELETE && record->length > 0) ||
+	    name_length == 0 || name_length > NAME_MAX ||
+	    length - *offset - BATCH_HEADER_SIZE < name_length + record->length)
+		return -1;
+
+	memcpy(record->name, header + BATCH_HEADER_SIZE, name_length);
+	record->name[name_length] = '\0';
+
+	if (record->name[0] == '.' || strlen(record->name) != name_length ||
+	    strchr(record->name, '/'))
+		return -1;
+
+	record->data = (const char *) header + BATCH_HEADER_SIZE + name_length;
+	*offset += BATCH_HEADER_SIZE + name_length + record->length;
+
+	return 0;
+}
+
+/* _batch_snapshot
+ *
+ * Function mirrors the directory 'src' into the empty directory 'dst' using
+ * hard links, recreating sub-directories.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success and -1 on failure.
+ */
+int
+_batch_snapshot(int src, int dst)
+{
+	struct dirent *dentry;
+	struct stat fstat;
+	DIR *dh;
+	int sub_src;
+	int sub_dst;
+	int rc = 0;
+	int fd;
+
+	if ((fd = dup(src)) == -1)
+		return -1;
+
+	if (!(dh = fdopendir(fd))) {
+		close(fd);
+		return -1;
+	}
+
+	rewinddir(dh);
+
+	while (rc == 0 && (dentry = readdir(dh))) {
+		if (strcmp(dentry->d_name, ".") == 0 ||
+		    strcmp(dentry->d_name, "..") == 0)
+			continue;
+
+		if (fstatat(src, dentry->d_name, &fstat, AT_SYMLINK_NOFOLLOW) == -1) {
+			rc = -1;
+			break;
+		}
+
+		if (!S_ISDIR(fstat.st_mode)) {
+			if (linkat(src, dentry->d_name, dst, dentry->d_name, 0) == -1)
+				rc = -1;
+			continue;
+		}
+
+		if (mkdirat(dst, dentry->d_name, fstat.st_mode & 07777) == -1) {
+			rc = -1;
+			break;
+		}
+
+		sub_src = openat(src, dentry->d_name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+		sub_dst = openat(dst, dentry->d_name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+
+		if (sub_src == -1 || sub_dst == -1 || _batch_snapshot(sub_src, sub_dst) != 0)
+			rc = -1;
+
+		if (sub_src != -1)
+			close(sub_src);
+		if (sub_dst != -1)
+			close(sub_dst);
+	}
+
+	closedir(dh);
+
+	return rc;
+}
+
+/* _batch_apply
+ *
+ * Function applies a single record to the snapshot directory 'dfd'. Files
+ * are replaced by new inodes, so the live project sharing the old inodes
+ * through hard links is never modified.
+ *
+ * Nothing is synced here; the caller makes the whole snapshot durable
+ * once before swapping it in.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+_batch_apply(int dfd, const struct _batch_record *record)
+{
+	struct atomic_file file;
+	int rc;
+
+	switch (record->op) {
+	case BATCH_DELETE:
+		return unlinkat(dfd, record->name, 0) == -1 ? errno : 0;
+
+	case BATCH_PUT:
+		if ((rc = atomic_open(&file, dfd, record->name)) != 0)
+			return rc;
+
+		if ((rc = atomic_write(&file, record->data, record->length)) != 0) {
+			atomic_abort(&file);
+			return rc;
+		}
+
+		return atomic_stage(&file, ATOMIC_ANY);
+	}
+
+	return EINVAL;
+}
@@ -0,0 +1,9 @@
+#ifndef CREDENTARIUS_BATCH_H
+#define CREDENTARIUS_BATCH_H 1
+
+struct _u_request;
+struct _u_response;
+
+int batch_post_project(const struct _u_request *, struct _u_response *, void *);
+
+#endif
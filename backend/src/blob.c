@@ -0,0 +1,403 @@
+#include "blob.h"
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <jansson.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <ulfius.h>
+#include <unistd.h>
+
+#include "atomic.h"
+#include "common.h"
+#include "config.h"
+#include "sha256.h"
+
+#define BLOB_PATH PROJECT_PATH "/.blobs"
+
+/* "ab/" followed by the full hex digest */
+#define BLOB_NAME_MAX (3 + SHA256_HEX_SIZE)
+
+/* blobs no write matched for this long are dropped from the store */
+#define BLOB_IDLE (24 * 60 * 60)
+
+static struct
+{
+	int store;
+	unsigned long interned;
+	unsigned long shared;
+	unsigned long long shared_bytes;
+	unsigned long collected;
+} _blob = {
+	.store = -1
+};
+
+static int _blob_name(int, char *, off_t *);
+static int _blob_store(int, const char *);
+static int _blob_reflinks(void);
+
+/* blob_init
+ *
+ * Function opens the content-addressed blob store inside the project root.
+ *
+ * Every file written to a project is hashed, and a reflinked copy of it is
+ * kept in the store under its SHA-256 digest. Identical files written later
+ * are reflinked from there, so they share their disk blocks while every
+ * file keeps an inode of its own: its own modification time, and
+ * copy-on-write if a build rewrites it in place. The page cache isn't
+ * shared.
+ *
+ * Without reflinks on the project root, e.g. on ext4, the store stays off.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success and -1 on failure.
+ */
+int
+blob_init(void)
+{
+#ifdef BLOB_STORE
+	if (mkdir(PROJECT_PATH, S_IRWXU) == -1 && EEXIST != errno) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to create project root: %s", PROJECT_PATH);
+		return -1;
+	}
+
+	if (mkdir(BLOB_PATH, S_IRWXU) == -1 && EEXIST != errno) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to create blob store: %s", BLOB_PATH);
+		return -1;
+	}
+
+	_blob.store = open(BLOB_PATH, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (_blob.store == -1) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to open blob store: %s", BLOB_PATH);
+		return -1;
+	}
+
+	if (!_blob_reflinks()) {
+		y_log_message(Y_LOG_LEVEL_INFO, "No reflinks in %s, blob store disabled.", PROJECT_PATH);
+		blob_fini();
+	}
+#endif
+
+	return 0;
+}
+
+void
+blob_fini(void)
+{
+	if (_blob.store == -1)
+		return;
+
+	close(_blob.store);
+	_blob.store = -1;
+}
+
+/* blob_intern
+ *
+ * Function deduplicates the file 'name' inside the directory 'dfd', which
+ * no one else may be writing to.
+ *
+ * If the store has no blob with the same content yet, a reflinked copy of
+ * the file becomes that blob. Otherwise the file is reflinked from the
+ * existing blob, releasing its own blocks. Either way the file keeps its
+ * inode, and the blob is read-only.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, ENOTSUP if the store is
+ * disabled, or any other errno value on failure. On failure 'name' keeps its
+ * own content.
+ */
+int
+blob_intern(int dfd, const char *name)
+{
+	char blob[BLOB_NAME_MAX];
+	off_t size;
+	int bfd;
+	int rc;
+	int fd;
+
+	if (_blob.store == -1)
+		return ENOTSUP;
+
+	fd = openat(dfd, name, O_RDWR|O_NOFOLLOW|O_CLOEXEC);
+	if (fd == -1)
+		return errno;
+
+	if ((rc = _blob_name(fd, blob, &size)) != 0)
+		goto close_file;
+
+	for (;;) {
+		bfd = openat(_blob.store, blob, O_RDONLY|O_CLOEXEC);
+		if (bfd != -1)
+			break;
+
+		if (ENOENT != errno) {
+			rc = errno;
+			goto close_file;
+		}
+
+		rc = _blob_store(fd, blob);
+		if (rc == 0)
+			__sync_fetch_and_add(&_blob.interned, 1);
+
+		/* unless it was stored in the meantime */
+		if (rc != EEXIST)
+			goto close_file;
+	}
+
+	if (ioctl(fd, FICLONE, bfd) == -1) {
+		rc = errno;
+		goto close_blob;
+	}
+
+	/* the blob's own time, it tells when its content was last written */
+	futimens(bfd, NULL);
+
+	__sync_fetch_and_add(&_blob.shared, 1);
+	__sync_fetch_and_add(&_blob.shared_bytes, size);
+
+close_blob:
+	close(bfd);
+
+close_file:
+	close(fd);
+
+	return rc;
+}
+
+/* blob_import
+ *
+ * Function creates 'name' inside the directory 'dfd' with the first 'size'
+ * bytes of 'fd'. Content already in the store is reflinked without copying
+ * any data, anything else is copied once and interned.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, ENOTSUP if the store is
+ * disabled, or any other errno value on failure.
+ */
+int
+blob_import(int fd, off_t size, int dfd, const char *name)
+{
+	struct atomic_file afile;
+	char blob[BLOB_NAME_MAX];
+	int bfd;
+	int rc;
+
+	if (_blob.store == -1)
+		return ENOTSUP;
+
+	if ((rc = _blob_name(fd, blob, NULL)) != 0)
+		return rc;
+
+	if ((bfd = openat(_blob.store, blob, O_RDONLY|O_CLOEXEC)) == -1 && ENOENT != errno)
+		return errno;
+
+	if ((rc = atomic_open(&afile, dfd, name)) != 0)
+		goto close_blob;
+
+	if (bfd != -1)
+		rc = ioctl(afile.fd, FICLONE, bfd) == -1 ? errno : 0;
+	else
+		rc = atomic_copy(&afile, fd, 0, size);
+
+	if (rc != 0) {
+		atomic_abort(&afile);
+		goto close_blob;
+	}
+
+	rc = atomic_commit(&afile, ATOMIC_CREATE);
+
+close_blob:
+	if (bfd != -1)
+		close(bfd);
+
+	return rc;
+}
+
+/* blob_collect
+ *
+ * Function removes every blob no write matched for BLOB_IDLE seconds, and
+ * what failed attempts to store a blob left behind. Files reflinked from a
+ * blob keep their blocks.
+ */
+void
+blob_collect(void)
+{
+	struct dirent *dentry;
+	struct stat st;
+	char fanout[3];
+	time_t idle;
+	DIR *dh;
+	int dfd;
+	int i;
+
+	if (_blob.store == -1)
+		return;
+
+	idle = time(NULL) - BLOB_IDLE;
+
+	for (i = 0; i < 256; ++i) {
+		snprintf(fanout, sizeof(fanout), "%02x", i);
+
+		dfd = openat(_blob.store, fanout, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+		if (dfd == -1)
+			continue;
+
+		if (!(dh = fdopendir(dfd))) {
+			close(dfd);
+			continue;
+		}
+
+		while ((dentry = readdir(dh))) {
+			if (strcmp(dentry->d_name, ".") == 0 || strcmp(dentry->d_name, "..") == 0)
+				continue;
+
+			if (fstatat(dfd, dentry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+			    st.st_mtime > idle)
+				continue;
+
+			if (unlinkat(dfd, dentry->d_name, 0) == 0)
+				__sync_fetch_and_add(&_blob.collected, 1);
+		}
+
+		closedir(dh);
+	}
+}
+
+void
+blob_stats(struct json_t *root)
+{
+	json_t *stats;
+
+	if (_blob.store == -1)
+		return;
+
+	stats = json_object();
+	if (!stats)
+		return;
+
+	json_object_set_new(stats, "interned", json_integer(_blob.interned));
+	json_object_set_new(stats, "shared", json_integer(_blob.shared));
+	json_object_set_new(stats, "shared_bytes", json_integer(_blob.shared_bytes));
+	json_object_set_new(stats, "collected", json_integer(_blob.collected));
+
+	json_object_set_new(root, "blobs", stats);
+}
+
+/*****************************************************************************/
+
+/* _blob_name
+ *
+ * Function hashes the content of 'fd' into its path inside the store and
+ * optionally reports its size.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+_blob_name(int fd, char *blob, off_t *size)
+{
+	unsigned char digest[SHA256_SIZE];
+	char hex[SHA256_HEX_SIZE];
+	struct stat st;
+	int rc;
+
+	if (size) {
+		if (fstat(fd, &st) == -1)
+			return errno;
+
+		*size = st.st_size;
+	}
+
+	if ((rc = sha256_fd(fd, digest)) != 0)
+		return rc;
+
+	sha256_hex(digest, hex);
+	snprintf(blob, BLOB_NAME_MAX, "%.2s/%s", hex, hex);
+
+	return 0;
+}
+
+/* _blob_store
+ *
+ * Function stores a read-only, reflinked copy of 'fd' as 'blob'.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, EEXIST if the store has
+ * the blob already, or any other errno value on failure.
+ */
+int
+_blob_store(int fd, const char *blob)
+{
+	static unsigned int counter;
+	char temp[NAME_MAX + 1];
+	int tfd;
+	int rc;
+
+	/* next to the blob, collected eventually if left behind */
+	snprintf(temp, sizeof(temp), "%.2s/.%d.%u", blob, getpid(),
+	    __sync_fetch_and_add(&counter, 1));
+
+	for (;;) {
+		tfd = openat(_blob.store, temp, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC,
+		    S_IRUSR|S_IRGRP|S_IROTH);
+		if (tfd != -1)
+			break;
+
+		if (ENOENT != errno)
+			return errno;
+
+		/* first blob in this fan-out directory */
+		temp[2] = '\0';
+		rc = mkdirat(_blob.store, temp, S_IRWXU);
+		temp[2] = '/';
+
+		if (rc == -1 && EEXIST != errno)
+			return errno;
+	}
+
+	rc = ioctl(tfd, FICLONE, fd) == -1 ? errno : 0;
+	close(tfd);
+
+	if (rc == 0 && renameat2(_blob.store, temp, _blob.store, blob, RENAME_NOREPLACE) == -1)
+		rc = errno;
+
+	if (rc != 0)
+		unlinkat(_blob.store, temp, 0);
+
+	return rc;
+}
+
+/* _blob_reflinks
+ *
+ * Function tells whether files in the store can be reflinked.
+ */
+int
+_blob_reflinks(void)
+{
+	int reflinks;
+	int src;
+	int dst;
+
+	src = openat(_blob.store, ".", O_TMPFILE|O_RDWR|O_CLOEXEC, S_IRUSR|S_IWUSR);
+	dst = openat(_blob.store, ".", O_TMPFILE|O_RDWR|O_CLOEXEC, S_IRUSR|S_IWUSR);
+
+	reflinks = src != -1 && dst != -1 && ioctl(dst, FICLONE, src) == 0;
+
+	if (src != -1)
+		close(src);
+	if (dst != -1)
+		close(dst);
+
+	return reflinks;
+}
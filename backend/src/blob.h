@@ -0,0 +1,17 @@
+#ifndef CREDENTARIUS_BLOB_H
+#define CREDENTARIUS_BLOB_H 1
+
+#include <sys/types.h>
+
+struct json_t;
+
+int blob_init(void);
+void blob_fini(void);
+
+int blob_intern(int, const char *);
+int blob_import(int, off_t, int, const char *);
+void blob_collect(void);
+
+void blob_stats(struct json_t *);
+
+#endif
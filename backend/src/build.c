@@ -0,0 +1,1239 @@
+#include "build.h"
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <jansson.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ulfius.h>
+#include <unistd.h>
+
+#include "atomic.h"
+#include "buildcache.h"
+#include "buildlog.h"
+#include "common.h"
+#include "config.h"
+#include "launch.h"
+#include "lock.h"
+#include "remote.h"
+#include "scratch.h"
+
+/* assumed duration of a build until one has completed, in milliseconds */
+#define BUILD_ESTIMATE_MS 10000
+
+/* longest a reader waits without news, and for more output to gather */
+#define BUILD_WAIT_MS 1000
+#define BUILD_LINGER_MS 50
+
+#define BUILD_FAILED "Failed to start the build.\n"
+#define BUILD_LOST "\nLost the connection to the build worker.\n"
+
+/* intermediate build outputs, relative to the project directory */
+#define BUILD_DIRECTORY ".build"
+#define BUILD_FINGERPRINT "fingerprint"
+
+static const char *const _build_all[] = { "all", NULL };
+static const char *const _build_clean_all[] = { "clean", "all", NULL };
+
+struct build
+{
+	unsigned int refs;
+	unsigned int clients;
+	enum build_state_t state;
+	int superseded;
+	int cached;
+	int status;
+	pid_t pid;
+	struct remote *remote;
+	unsigned long serial;
+	struct buildlog log;
+	char key[SHA256_HEX_SIZE];
+	char id[NAME_MAX + 1];
+	char path[PATH_MAX];
+	struct build *successor; /* the build that superseded this one */
+	struct build *next;      /* next in the queue */
+	struct build *active;    /* next in flight */
+};
+
+/* a project some other make runs in, see build_claim */
+struct _build_claim
+{
+	char id[NAME_MAX + 1];
+	struct _build_claim *next;
+};
+
+static void *_build_work(void *);
+static struct build *_build_find(const char *, enum build_state_t);
+static struct _build_claim **_build_claimed(const char *);
+static void _build_enqueue(struct build *);
+static void _build_supersede(struct build *, struct build *);
+static void _build_finish(struct build *);
+static void _build_run(struct build *);
+static int _build_local(struct build *, const char *);
+static void _build_remote(struct build *, struct remote *);
+static int _build_replay(struct build *);
+static int _build_fingerprint(const char *, char *);
+static void _build_retain(struct build *);
+static void _build_unref(struct build *);
+static unsigned long _build_elapsed(const struct timespec *);
+static void _build_deadline(struct timespec *, unsigned long);
+
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t progress; /* output, state or queue changed */
+	pthread_t *threads;
+	unsigned int workers;
+	unsigned int busy;
+	int running;
+	struct build *queue;
+	struct build **tail;
+	unsigned int queued;
+	unsigned long moves;
+	struct build *active;
+	struct _build_claim *claims;
+	unsigned long serial;
+
+	unsigned long completed;
+	unsigned long rejected;
+	unsigned long coalesced;
+	unsigned long superseded;
+	unsigned long average_ms;
+} _build = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.progress = PTHREAD_COND_INITIALIZER,
+	.tail = &_build.queue,
+	.average_ms = BUILD_ESTIMATE_MS
+};
+
+/* build_init
+ *
+ * Function starts BUILD_WORKERS worker threads, or one per online processor
+ * if that is zero. Each worker runs one build at a time, taking them from
+ * a queue of at most BUILD_QUEUE_SIZE waiting builds in order.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success and -1 on failure.
+ */
+int
+build_init(void)
+{
+	long workers = BUILD_WORKERS;
+	unsigned int i;
+
+	if (workers <= 0)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers <= 0)
+		workers = 1;
+
+	_build.threads = calloc(workers, sizeof(pthread_t));
+	if (!_build.threads) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to allocate build workers.");
+		return -1;
+	}
+
+	_build.running = TRUE;
+
+	for (i = 0; i < (unsigned int) workers; ++i) {
+		if (pthread_create(&_build.threads[i], NULL, _build_work, NULL) != 0) {
+			y_log_message(Y_LOG_LEVEL_ERROR, "Failed to start build worker thread.");
+			build_fini();
+			return -1;
+		}
+
+		++_build.workers;
+	}
+
+	y_log_message(Y_LOG_LEVEL_DEBUG, "Started %u build workers.", _build.workers);
+
+	return 0;
+}
+
+void
+build_fini(void)
+{
+	struct build *build;
+	unsigned int i;
+
+	if (!_build.threads)
+		return;
+
+	pthread_mutex_lock(&_build.lock);
+	_build.running = FALSE;
+	pthread_cond_broadcast(&_build.cond);
+	pthread_mutex_unlock(&_build.lock);
+
+	for (i = 0; i < _build.workers; ++i)
+		pthread_join(_build.threads[i], NULL);
+
+	/* builds that never started only keep their client reference */
+	pthread_mutex_lock(&_build.lock);
+	while ((build = _build.queue)) {
+		_build.queue = build->next;
+		_build_finish(build);
+		_build_unref(build);
+	}
+
+	_build.tail = &_build.queue;
+	_build.queued = 0;
+	pthread_mutex_unlock(&_build.lock);
+
+	free(_build.threads);
+	_build.threads = NULL;
+	_build.workers = 0;
+}
+
+/* build_queue
+ *
+ * Function queues a build of the project 'id' in the directory 'path'. The returned
+ * handle must be passed to build_release once the caller is done with it.
+ *
+ * There is at most one build in flight per project. A request for the
+ * same sources joins it and gets the same output. A request for changed
+ * sources supersedes it: a queued build is replaced in its place in the
+ * queue, a running one is killed and followed by the new one.
+ *
+ * If the build cache knows the outcome of building the current sources,
+ * the build is done right away without ever entering the queue.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, EAGAIN if the queue is
+ * full, or any other errno value on failure.
+ */
+int
+build_queue(const char *id, const char *path, struct build **handle)
+{
+	struct build *active;
+	struct build *build;
+	int rc;
+
+	build = calloc(1, sizeof(*build));
+	if (!build)
+		return ENOMEM;
+
+	rc = snprintf(build->path, sizeof(build->path), "%s", path);
+	if (rc <= 0 || (size_t) rc >= sizeof(build->path) ||
+	    snprintf(build->id, sizeof(build->id), "%s", id) >= (int) sizeof(build->id)) {
+		free(build);
+		return ENAMETOOLONG;
+	}
+
+	build->status = -1;
+	build->clients = 1;
+	build->serial = __sync_add_and_fetch(&_build.serial, 1);
+
+	if (buildcache_key(build->path, build->key) != 0)
+		build->key[0] = '\0';
+
+	/* requests for a project are taken one at a time, so that nothing
+	 * is restored from the cache next to a build in flight, nor next to
+	 * any other modification of the project */
+	lock_project(build->id);
+	pthread_mutex_lock(&_build.lock);
+
+	active = _build_find(build->id, BUILD_QUEUED);
+
+	if (active && build->key[0] && strcmp(active->key, build->key) == 0) {
+		++active->refs;
+		++active->clients;
+		++_build.coalesced;
+		pthread_mutex_unlock(&_build.lock);
+		unlock_project(build->id);
+
+		free(build);
+		*handle = active;
+		return 0;
+	}
+
+	if (!active) {
+		pthread_mutex_unlock(&_build.lock);
+
+		if (build->key[0] && _build_replay(build) == 0) {
+			unlock_project(build->id);
+
+			build->refs = 1;
+			build->state = BUILD_DONE;
+			_build_retain(build);
+			*handle = build;
+			return 0;
+		}
+
+		pthread_mutex_lock(&_build.lock);
+	}
+
+	if (!_build.running || (!active && _build.queued >= BUILD_QUEUE_SIZE)) {
+		++_build.rejected;
+		pthread_mutex_unlock(&_build.lock);
+		unlock_project(build->id);
+
+		free(build);
+		return EAGAIN;
+	}
+
+	build->refs = 2; /* the caller's and the queue's */
+	build->state = BUILD_QUEUED;
+	build->active = _build.active;
+	_build.active = build;
+
+	if (active)
+		_build_supersede(active, build);
+	else
+		_build_enqueue(build);
+
+	pthread_cond_signal(&_build.cond);
+	pthread_mutex_unlock(&_build.lock);
+	unlock_project(build->id);
+
+	*handle = build;
+
+	return 0;
+}
+
+/* build_attach
+ *
+ * Function joins the build of the project 'id' in flight, or else recovers
+ * the last build of its directory 'path' from the retained logs, done
+ * already. The returned handle must be passed to build_release.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, ENOENT if there is no build
+ * to show, or any other errno value on failure.
+ */
+int
+build_attach(const char *id, const char *path, struct build **handle)
+{
+	struct build *build;
+	int rc;
+
+	pthread_mutex_lock(&_build.lock);
+
+	if ((build = _build_find(id, BUILD_QUEUED))) {
+		++build->refs;
+		++build->clients;
+		pthread_mutex_unlock(&_build.lock);
+
+		*handle = build;
+		return 0;
+	}
+
+	pthread_mutex_unlock(&_build.lock);
+
+	build = calloc(1, sizeof(*build));
+	if (!build)
+		return ENOMEM;
+
+	rc = snprintf(build->path, sizeof(build->path), "%s", path);
+	if (rc <= 0 || (size_t) rc >= sizeof(build->path)) {
+		free(build);
+		return ENAMETOOLONG;
+	}
+
+	rc = buildlog_restore(path, &build->serial, &build->log, &build->status, &build->cached);
+	if (rc != 0) {
+		free(build);
+		return rc;
+	}
+
+	build->refs = 1;
+	build->clients = 1;
+	build->state = BUILD_DONE;
+	*handle = build;
+
+	return 0;
+}
+
+/* build_poll
+ *
+ * Function reports the progress of 'build'. While it is queued, 'position'
+ * is set to its place in the queue, counting from one, and to zero after.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the state of the build.
+ */
+enum build_state_t
+build_poll(struct build *build, unsigned int *position)
+{
+	enum build_state_t state;
+	struct build *ahead;
+
+	*position = 0;
+
+	pthread_mutex_lock(&_build.lock);
+
+	state = build->state;
+
+	if (state == BUILD_QUEUED) {
+		for (ahead = _build.queue; ahead && ahead != build; ahead = ahead->next)
+			if (ahead->clients > 0)
+				++*position;
+
+		++*position;
+	}
+
+	pthread_mutex_unlock(&_build.lock);
+
+	return state;
+}
+
+/* build_read
+ *
+ * Function copies up to 'max' bytes of the build output, starting at
+ * 'offset', into 'buffer' and moves 'offset' past them. Only the latest
+ * BUILD_LOG_SIZE bytes are kept; if the output at 'offset' is gone,
+ * reading skips ahead to the oldest output still there.
+ *
+ * Any number of readers may follow the same build, each at its own offset.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the number of bytes copied, zero (0) if there
+ * is no more output yet, or -1 once the build is done and all of its output
+ * has been read.
+ */
+ssize_t
+build_read(struct build *build, uint64_t *offset, char *buffer, size_t max)
+{
+	ssize_t length;
+
+	pthread_mutex_lock(&_build.lock);
+
+	length = buildlog_read(&build->log, offset, buffer, max);
+	if (length > 0)
+		*offset += length;
+	else if (build->state == BUILD_DONE)
+		length = -1;
+
+	pthread_mutex_unlock(&_build.lock);
+
+	return length;
+}
+
+/* build_wait
+ *
+ * Function blocks until there is output of 'build' past 'offset', it
+ * changed state, or, while it is queued, the queue moved. Output is given
+ * up to BUILD_LINGER_MS to add up to 'want' bytes, so that it is sent in
+ * fewer, larger writes. It returns after BUILD_WAIT_MS regardless.
+ */
+void
+build_wait(struct build *build, uint64_t offset, size_t want)
+{
+	struct timespec deadline;
+	enum build_state_t state;
+	unsigned long moves;
+
+	pthread_mutex_lock(&_build.lock);
+
+	state = build->state;
+	moves = _build.moves;
+
+	_build_deadline(&deadline, BUILD_WAIT_MS);
+	while (state != BUILD_DONE && build->state == state && build->log.end <= offset &&
+	    (state != BUILD_QUEUED || _build.moves == moves))
+		if (pthread_cond_timedwait(&_build.progress, &_build.lock, &deadline) == ETIMEDOUT)
+			break;
+
+	_build_deadline(&deadline, BUILD_LINGER_MS);
+	while (build->state == BUILD_RUNNING && build->log.end > offset &&
+	    build->log.end - offset < want)
+		if (pthread_cond_timedwait(&_build.progress, &_build.lock, &deadline) == ETIMEDOUT)
+			break;
+
+	pthread_mutex_unlock(&_build.lock);
+}
+
+/* build_result
+ *
+ * Function reports whether a finished 'build' was replayed from the build
+ * cache through 'cached'.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the exit status of the build, or -1 if it could
+ * not be run at all.
+ */
+int
+build_result(struct build *build, int *cached)
+{
+	int status;
+
+	pthread_mutex_lock(&_build.lock);
+	status = build->status;
+	*cached = build->cached;
+	pthread_mutex_unlock(&_build.lock);
+
+	return status;
+}
+
+/* build_serial
+ *
+ * Function returns the number identifying 'build' among all builds since
+ * the server started, so that offsets into its output are not mistaken for
+ * offsets into the output of another.
+ */
+unsigned long
+build_serial(struct build *build)
+{
+	return build->serial;
+}
+
+/* build_release
+ *
+ * Function drops the caller's reference to 'build'. A build that hasn't
+ * started yet is cancelled once nobody waits for it anymore; a running one
+ * completes, so that its outcome is still cached.
+ */
+void
+build_release(struct build *build)
+{
+	pthread_mutex_lock(&_build.lock);
+
+	/* those behind a cancelled build move up */
+	if (--build->clients == 0 && build->state == BUILD_QUEUED) {
+		++_build.moves;
+		pthread_cond_broadcast(&_build.progress);
+	}
+
+	_build_unref(build);
+
+	pthread_mutex_unlock(&_build.lock);
+}
+
+/* build_follow
+ *
+ * Function moves the caller from a superseded 'build' on to the build that
+ * replaced it, releasing 'build'.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the newer build, or NULL if 'build' wasn't
+ * superseded, in which case it is not released.
+ */
+struct build *
+build_follow(struct build *build)
+{
+	struct build *successor;
+
+	pthread_mutex_lock(&_build.lock);
+
+	successor = build->successor;
+	if (successor) {
+		++successor->refs;
+		++successor->clients;
+
+		--build->clients;
+		_build_unref(build);
+	}
+
+	pthread_mutex_unlock(&_build.lock);
+
+	return successor;
+}
+
+/* build_busy
+ *
+ * Function tells whether a build of the project 'id' is running, or it is
+ * claimed, so that its directory must stay where it is.
+ */
+int
+build_busy(const char *id)
+{
+	int busy;
+
+	pthread_mutex_lock(&_build.lock);
+	busy = _build_find(id, BUILD_RUNNING) || *_build_claimed(id);
+	pthread_mutex_unlock(&_build.lock);
+
+	return busy;
+}
+
+/* build_claim
+ *
+ * Function reserves the project 'id' for a make run outside the build
+ * queue, such as flashing, until build_unclaim. Builds of the project
+ * queued meanwhile wait for it.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, EBUSY if a build of the
+ * project is in flight or it is claimed already, or any other errno value
+ * on failure.
+ */
+int
+build_claim(const char *id)
+{
+	struct _build_claim *claim;
+
+	claim = calloc(1, sizeof(*claim));
+	if (!claim)
+		return ENOMEM;
+
+	if (snprintf(claim->id, sizeof(claim->id), "%s", id) >= (int) sizeof(claim->id)) {
+		free(claim);
+		return ENAMETOOLONG;
+	}
+
+	pthread_mutex_lock(&_build.lock);
+
+	if (_build_find(id, BUILD_QUEUED) || _build_find(id, BUILD_RUNNING) || *_build_claimed(id)) {
+		pthread_mutex_unlock(&_build.lock);
+		free(claim);
+		return EBUSY;
+	}
+
+	claim->next = _build.claims;
+	_build.claims = claim;
+
+	pthread_mutex_unlock(&_build.lock);
+
+	return 0;
+}
+
+void
+build_unclaim(const char *id)
+{
+	struct _build_claim **link;
+	struct _build_claim *claim;
+
+	pthread_mutex_lock(&_build.lock);
+
+	if ((claim = *(link = _build_claimed(id)))) {
+		*link = claim->next;
+		free(claim);
+
+		/* a build waiting for this project may start now */
+		pthread_cond_broadcast(&_build.cond);
+	}
+
+	pthread_mutex_unlock(&_build.lock);
+}
+
+/* build_retry_after
+ *
+ * Function estimates in how many seconds the queue will have room again,
+ * from the average duration of recent builds.
+ */
+unsigned int
+build_retry_after(void)
+{
+	unsigned long seconds;
+
+	pthread_mutex_lock(&_build.lock);
+	seconds = (_build.average_ms * (_build.queued + 1) / (_build.workers ? _build.workers : 1) + 999) / 1000;
+	pthread_mutex_unlock(&_build.lock);
+
+	return seconds > 0 ? seconds : 1;
+}
+
+void
+build_stats(struct json_t *root)
+{
+	json_t *stats;
+
+	stats = json_object();
+	if (!stats)
+		return;
+
+	pthread_mutex_lock(&_build.lock);
+	json_object_set_new(stats, "workers", json_integer(_build.workers));
+	json_object_set_new(stats, "busy", json_integer(_build.busy));
+	json_object_set_new(stats, "queued", json_integer(_build.queued));
+	json_object_set_new(stats, "completed", json_integer(_build.completed));
+	json_object_set_new(stats, "rejected", json_integer(_build.rejected));
+	json_object_set_new(stats, "coalesced", json_integer(_build.coalesced));
+	json_object_set_new(stats, "superseded", json_integer(_build.superseded));
+	json_object_set_new(stats, "average_ms", json_integer(_build.average_ms));
+	pthread_mutex_unlock(&_build.lock);
+
+	json_object_set_new(root, "builds", stats);
+}
+
+/* build_stale
+ *
+ * Function decides whether the build directory 'path' must be built from
+ * scratch, because its objects were built with another 'fingerprint'.
+ */
+int
+build_stale(const char *path, const char *fingerprint)
+{
+	char previous[SHA256_HEX_SIZE] = {0};
+	char name[PATH_MAX];
+	ssize_t bread;
+	int fd;
+
+	snprintf(name, sizeof(name), "%s/" BUILD_DIRECTORY "/" BUILD_FINGERPRINT, path);
+
+	fd = open(name, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return TRUE;
+
+	bread = read(fd, previous, sizeof(previous) - 1);
+	close(fd);
+
+	return bread != SHA256_HEX_SIZE - 1 || strcmp(previous, fingerprint) != 0;
+}
+
+/* build_commit
+ *
+ * Function records the 'fingerprint' the objects of the build directory
+ * 'path' were just built with from scratch.
+ */
+void
+build_commit(const char *path, const char *fingerprint)
+{
+	struct atomic_file afile;
+	int dfd;
+	int fd;
+
+	dfd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (dfd == -1)
+		return;
+
+	/* older Makefiles keep their objects elsewhere */
+	if (mkdirat(dfd, BUILD_DIRECTORY, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH) == -1 && EEXIST != errno)
+		goto close_project;
+
+	fd = openat(dfd, BUILD_DIRECTORY, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd == -1)
+		goto close_project;
+
+	if (atomic_open(&afile, fd, BUILD_FINGERPRINT) == 0) {
+		if (atomic_write(&afile, fingerprint, SHA256_HEX_SIZE - 1) == 0)
+			atomic_commit(&afile, ATOMIC_ANY);
+		else
+			atomic_abort(&afile);
+	}
+
+	close(fd);
+
+close_project:
+	close(dfd);
+}
+
+/*****************************************************************************/
+
+void *
+_build_work(void *user_data)
+{
+	struct build **link;
+	struct build *build;
+	struct timespec start;
+	unsigned long elapsed;
+
+	UNUSED(user_data);
+
+	pthread_mutex_lock(&_build.lock);
+
+	while (_build.running) {
+		/* the first build whose project isn't still busy with another,
+		 * nor with a make run outside the queue */
+		for (link = &_build.queue; *link; link = &(*link)->next)
+			if (!_build_find((*link)->id, BUILD_RUNNING) && !*_build_claimed((*link)->id))
+				break;
+
+		if (!*link) {
+			pthread_cond_wait(&_build.cond, &_build.lock);
+			continue;
+		}
+
+		build = *link;
+		*link = build->next;
+		if (_build.tail == &build->next)
+			_build.tail = link;
+		--_build.queued;
+		++_build.moves;
+		pthread_cond_broadcast(&_build.progress);
+
+		if (build->clients == 0) {
+			_build_finish(build);
+			_build_unref(build);
+			continue;
+		}
+
+		build->state = BUILD_RUNNING;
+		++_build.busy;
+		pthread_mutex_unlock(&_build.lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		_build_run(build);
+		elapsed = _build_elapsed(&start);
+		_build_retain(build);
+
+		pthread_mutex_lock(&_build.lock);
+		_build_finish(build);
+		--_build.busy;
+		++_build.completed;
+		_build.average_ms = _build.completed == 1 ? elapsed :
+		    (_build.average_ms * 7 + elapsed) / 8;
+		_build_unref(build);
+
+		/* a build waiting for this project may start now */
+		pthread_cond_broadcast(&_build.cond);
+	}
+
+	pthread_mutex_unlock(&_build.lock);
+
+	return NULL;
+}
+
+/* _build_find
+ *
+ * Function looks for a build of the project 'id' in flight. For
+ * 'BUILD_QUEUED', that is the latest build that wasn't superseded, queued or
+ * running; for 'BUILD_RUNNING', any running build. Must be called with the
+ * lock held.
+ *
+ * Builds are found by project id, not directory, which is where the
+ * project happens to be when the build was queued.
+ */
+struct build *
+_build_find(const char *id, enum build_state_t state)
+{
+	struct build *build;
+
+	for (build = _build.active; build; build = build->active) {
+		if (strcmp(build->id, id) != 0)
+			continue;
+
+		if (state == BUILD_RUNNING ? build->state == BUILD_RUNNING : !build->superseded)
+			return build;
+	}
+
+	return NULL;
+}
+
+/* _build_claimed
+ *
+ * Function looks for the claim on the project 'id'. Must be called with the
+ * lock held.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the link to the claim, pointing to NULL if the
+ * project isn't claimed.
+ */
+struct _build_claim **
+_build_claimed(const char *id)
+{
+	struct _build_claim **link;
+
+	for (link = &_build.claims; *link; link = &(*link)->next)
+		if (strcmp((*link)->id, id) == 0)
+			break;
+
+	return link;
+}
+
+/* _build_enqueue
+ *
+ * Function appends 'build' to the queue. Must be called with the lock held.
+ */
+void
+_build_enqueue(struct build *build)
+{
+	*_build.tail = build;
+	_build.tail = &build->next;
+	++_build.queued;
+}
+
+/* _build_supersede
+ *
+ * Function replaces the build in flight 'old' by 'build'. Must be called
+ * with the lock held.
+ */
+void
+_build_supersede(struct build *old, struct build *build)
+{
+	struct build **link;
+
+	old->superseded = TRUE;
+	old->successor = build;
+	++build->refs;
+	++_build.superseded;
+
+	if (old->state == BUILD_RUNNING) {
+		/* the new build waits for this one to be gone */
+		if (old->pid > 0)
+			kill(-old->pid, SIGTERM);
+		else if (old->remote)
+			remote_cancel(old->remote);
+
+		_build_enqueue(build);
+		return;
+	}
+
+	for (link = &_build.queue; *link != old; link = &(*link)->next)
+		;
+
+	build->next = old->next;
+	*link = build;
+	if (_build.tail == &old->next)
+		_build.tail = &build->next;
+
+	_build_finish(old);
+	_build_unref(old);
+}
+
+/* _build_finish
+ *
+ * Function marks 'build' as done and no longer in flight. Must be called
+ * with the lock held.
+ */
+void
+_build_finish(struct build *build)
+{
+	struct build **link;
+
+	build->state = BUILD_DONE;
+	pthread_cond_broadcast(&_build.progress);
+
+	for (link = &_build.active; *link; link = &(*link)->active) {
+		if (*link == build) {
+			*link = build->active;
+			break;
+		}
+	}
+}
+
+/* _build_run
+ *
+ * Function has a build worker run the build when there is one, see
+ * remote_build, or else runs it here. The sources are hashed before and
+ * after, and the outcome is only cached if they didn't change while the
+ * build was running.
+ *
+ * Builds are incremental; make only recompiles what changed. Objects are
+ * only thrown away when the toolchain or the Makefile differ from those of
+ * the previous build of the project.
+ */
+void
+_build_run(struct build *build)
+{
+	char fingerprint[SHA256_HEX_SIZE];
+	char key[SHA256_HEX_SIZE];
+	struct remote *remote;
+	size_t length;
+	char *log;
+	int done;
+	int rc;
+
+	/* the sources may have changed, or a build just like it finished,
+	 * while this one was waiting. The project stays locked until the
+	 * outcome may have been restored from the cache, which also lets a
+	 * batch that found no build of it running finish its swap first */
+	lock_project(build->id);
+
+	if (buildcache_key(build->path, key) != 0)
+		key[0] = '\0';
+
+	pthread_mutex_lock(&_build.lock);
+	memcpy(build->key, key, sizeof(key));
+	done = build->superseded;
+	pthread_mutex_unlock(&_build.lock);
+
+	if (!done && key[0])
+		done = _build_replay(build) == 0;
+
+	unlock_project(build->id);
+
+	if (done)
+		return;
+
+	/* without one, the objects are always thrown away */
+	if (_build_fingerprint(build->path, fingerprint) != 0)
+		fingerprint[0] = '\0';
+
+	rc = remote_build(build->path, fingerprint, &remote);
+	if (rc == 0) {
+		_build_remote(build, remote);
+	} else {
+		if (ENOTSUP != rc)
+			y_log_message(Y_LOG_LEVEL_ERROR, "Failed to hand build to a worker, building here: %s", build->path);
+
+		if (_build_local(build, fingerprint) != 0) {
+			pthread_mutex_lock(&_build.lock);
+			buildlog_append(&build->log, BUILD_FAILED, sizeof(BUILD_FAILED) - 1);
+			pthread_cond_broadcast(&_build.progress);
+			pthread_mutex_unlock(&_build.lock);
+			return;
+		}
+	}
+
+	/* a build killed by a signal, such as an out of memory compiler, may
+	 * well succeed next time */
+	if (build->key[0] && !build->superseded && build->status >= 0 && build->status < 128 &&
+	    buildcache_key(build->path, key) == 0 && strcmp(key, build->key) == 0 &&
+	    buildlog_copy(&build->log, &log, &length) == 0) {
+		buildcache_store(build->key, build->path, log, length, build->status);
+		free(log);
+	}
+}
+
+/* _build_local
+ *
+ * Function runs the build in a child process, collecting its output until
+ * it exits. With a scratch area, the build runs out of tree and only its
+ * artifacts end up in the project directory.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value if the
+ * build couldn't be started.
+ */
+int
+_build_local(struct build *build, const char *fingerprint)
+{
+	char scratch[PATH_MAX];
+	char buffer[4096];
+	const char *dir = build->path;
+	ssize_t bread;
+	int status;
+	int clean;
+	int rc;
+	struct launch launch;
+
+	if ((rc = scratch_acquire(build->path, scratch, sizeof(scratch))) == 0)
+		dir = scratch;
+	else if (ENOTSUP != rc)
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to prepare build scratch, building in place: %s", build->path);
+
+	clean = !fingerprint[0] || build_stale(dir, fingerprint);
+
+	rc = launch_make(dir, clean ? _build_clean_all : _build_all, &launch);
+	if (rc != 0) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to start build: %s", strerror(rc));
+
+		if (dir == scratch)
+			scratch_release(build->path, scratch);
+
+		return rc;
+	}
+
+	pthread_mutex_lock(&_build.lock);
+	build->pid = launch.pid;
+	if (build->superseded)
+		kill(-launch.pid, SIGTERM);
+	pthread_mutex_unlock(&_build.lock);
+
+	y_log_message(Y_LOG_LEVEL_DEBUG, "Build started%s: %s", clean ? " from scratch" : "", build->path);
+
+	for (;;) {
+		bread = read(launch.fd, buffer, sizeof(buffer));
+		if (bread == -1 && EINTR == errno)
+			continue;
+
+		if (bread <= 0)
+			break;
+
+		pthread_mutex_lock(&_build.lock);
+		buildlog_append(&build->log, buffer, bread);
+		pthread_cond_broadcast(&_build.progress);
+		pthread_mutex_unlock(&_build.lock);
+	}
+
+	close(launch.fd);
+	status = launch_wait(&launch);
+
+	/* the process group is gone, and its id may be reused */
+	pthread_mutex_lock(&_build.lock);
+	build->pid = 0;
+	build->status = status;
+	pthread_mutex_unlock(&_build.lock);
+
+	if (clean && fingerprint[0])
+		build_commit(dir, fingerprint);
+
+	if (dir == scratch)
+		scratch_release(build->path, scratch);
+
+	return 0;
+}
+
+/* _build_remote
+ *
+ * Function collects the output of 'build' from the build worker running it
+ * until it is done, the artifacts arriving in the project directory on the
+ * way. A build superseded meanwhile is cancelled by dropping the connection.
+ */
+void
+_build_remote(struct build *build, struct remote *remote)
+{
+	char buffer[4096];
+	ssize_t bread;
+	int status;
+
+	pthread_mutex_lock(&_build.lock);
+	build->remote = remote;
+	if (build->superseded)
+		remote_cancel(remote);
+	pthread_mutex_unlock(&_build.lock);
+
+	y_log_message(Y_LOG_LEVEL_DEBUG, "Build handed to a worker: %s", build->path);
+
+	while ((bread = remote_read(remote, buffer, sizeof(buffer))) > 0) {
+		pthread_mutex_lock(&_build.lock);
+		buildlog_append(&build->log, buffer, bread);
+		pthread_cond_broadcast(&_build.progress);
+		pthread_mutex_unlock(&_build.lock);
+	}
+
+	pthread_mutex_lock(&_build.lock);
+	build->remote = NULL;
+	if (bread == -1 && !build->superseded)
+		buildlog_append(&build->log, BUILD_LOST, sizeof(BUILD_LOST) - 1);
+	pthread_mutex_unlock(&_build.lock);
+
+	status = remote_wait(remote);
+
+	pthread_mutex_lock(&_build.lock);
+	build->status = status;
+	pthread_cond_broadcast(&_build.progress);
+	pthread_mutex_unlock(&_build.lock);
+}
+
+/* _build_replay
+ *
+ * Function looks the outcome of 'build' up in the build cache by its key.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) if the build was replayed from the
+ * cache, and an errno value otherwise.
+ */
+int
+_build_replay(struct build *build)
+{
+	char *log = NULL;
+	size_t length;
+	int status;
+	int rc;
+
+	if ((rc = buildcache_lookup(build->key, build->path, &log, &length, &status)) != 0)
+		return rc;
+
+	pthread_mutex_lock(&_build.lock);
+	buildlog_append(&build->log, log, length);
+	build->status = status;
+	build->cached = TRUE;
+	pthread_cond_broadcast(&_build.progress);
+	pthread_mutex_unlock(&_build.lock);
+
+	free(log);
+
+	y_log_message(Y_LOG_LEVEL_DEBUG, "Build replayed from cache: %s", build->path);
+
+	return 0;
+}
+
+/* _build_fingerprint
+ *
+ * Function derives what the objects of the project directory 'path' depend
+ * on besides the sources themselves into 'fingerprint': the toolchain and
+ * the Makefile, with the flags it passes.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+_build_fingerprint(const char *path, char *fingerprint)
+{
+	unsigned char digest[SHA256_SIZE];
+	char makefile[PATH_MAX];
+	struct sha256 sha;
+	int fd;
+	int rc;
+
+	rc = snprintf(makefile, sizeof(makefile), "%s/Makefile", path);
+	if (rc <= 0 || (size_t) rc >= sizeof(makefile))
+		return ENAMETOOLONG;
+
+	fd = open(makefile, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return errno;
+
+	rc = sha256_fd(fd, digest);
+	close(fd);
+
+	if (rc != 0)
+		return rc;
+
+	sha256_init(&sha);
+	buildcache_toolchain(&sha);
+	sha256_update(&sha, digest, sizeof(digest));
+	sha256_final(&sha, digest);
+	sha256_hex(digest, fingerprint);
+
+	return 0;
+}
+
+/* _build_retain
+ *
+ * Function keeps the output of the finished 'build' for build_attach, unless
+ * it was superseded and a newer build will tell more.
+ */
+void
+_build_retain(struct build *build)
+{
+	int superseded;
+
+	pthread_mutex_lock(&_build.lock);
+	superseded = build->superseded;
+	pthread_mutex_unlock(&_build.lock);
+
+	if (!superseded)
+		buildlog_retain(build->path, build->serial, &build->log, build->status, build->cached);
+}
+
+/* _build_unref
+ *
+ * Function drops a reference to 'build'. Must be called with the lock held.
+ */
+void
+_build_unref(struct build *build)
+{
+	if (--build->refs > 0)
+		return;
+
+	if (build->successor)
+		_build_unref(build->successor);
+
+	buildlog_free(&build->log);
+	free(build);
+}
+
+unsigned long
+_build_elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000UL + (now.tv_nsec - start->tv_nsec) / 1000000L;
+}
+
+void
+_build_deadline(struct timespec *deadline, unsigned long ms)
+{
+	clock_gettime(CLOCK_REALTIME, deadline);
+
+	deadline->tv_sec += ms / 1000;
+	deadline->tv_nsec += (ms % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L) {
+		++deadline->tv_sec;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
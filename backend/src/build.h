@@ -0,0 +1,39 @@
+#ifndef CREDENTARIUS_BUILD_H
+#define CREDENTARIUS_BUILD_H 1
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct json_t;
+struct build;
+
+enum build_state_t
+{
+	BUILD_QUEUED,
+	BUILD_RUNNING,
+	BUILD_DONE
+};
+
+int build_init(void);
+void build_fini(void);
+
+int build_queue(const char *, const char *, struct build **);
+int build_attach(const char *, const char *, struct build **);
+enum build_state_t build_poll(struct build *, unsigned int *);
+ssize_t build_read(struct build *, uint64_t *, char *, size_t);
+void build_wait(struct build *, uint64_t, size_t);
+int build_result(struct build *, int *);
+unsigned long build_serial(struct build *);
+void build_release(struct build *);
+struct build *build_follow(struct build *);
+int build_busy(const char *);
+int build_claim(const char *);
+void build_unclaim(const char *);
+unsigned int build_retry_after(void);
+
+int build_stale(const char *, const char *);
+void build_commit(const char *, const char *);
+
+void build_stats(struct json_t *);
+
+#endif
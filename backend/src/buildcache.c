@@ -0,0 +1,533 @@
+#include "buildcache.h"
+
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <jansson.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ulfius.h>
+#include <unistd.h>
+
+#include "artifact.h"
+#include "atomic.h"
+#include "common.h"
+#include "config.h"
+#include "trash.h"
+
+#define BUILDCACHE_PATH PROJECT_PATH "/.builds"
+
+/* bumped whenever the key derivation or the entry layout changes */
+#define BUILDCACHE_VERSION "credentarius-build-1"
+
+#define BUILDCACHE_LOG "log"
+#define BUILDCACHE_STATUS "status"
+
+static const char *_buildcache_artifacts[] = {
+	ARTIFACT_FIRMWARE,
+	ARTIFACT_MAP,
+	ARTIFACT_ELF
+};
+
+static int _buildcache_filter(const struct dirent *);
+static int _buildcache_read(int, const char *, char **, size_t *);
+static void _buildcache_evict(void);
+
+static struct
+{
+	int cache;
+	unsigned long entries;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long stored;
+	unsigned long evicted;
+} _buildcache = { .cache = -1 };
+
+/* buildcache_init
+ *
+ * Function opens the build cache, which remembers the outcome of up to
+ * BUILD_CACHE_SIZE builds by the content of their inputs. A size of zero
+ * disables the cache. Must be called after trash_init.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success and -1 on failure.
+ */
+int
+buildcache_init(void)
+{
+	struct dirent *dentry;
+	DIR *dh;
+	int fd;
+
+	if (BUILD_CACHE_SIZE <= 0)
+		return 0;
+
+	if (mkdir(PROJECT_PATH, S_IRWXU) == -1 && EEXIST != errno) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to create project root: %s", PROJECT_PATH);
+		return -1;
+	}
+
+	if (mkdir(BUILDCACHE_PATH, S_IRWXU) == -1 && EEXIST != errno) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to create build cache: %s", BUILDCACHE_PATH);
+		return -1;
+	}
+
+	_buildcache.cache = open(BUILDCACHE_PATH, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (_buildcache.cache == -1) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to open build cache: %s", BUILDCACHE_PATH);
+		return -1;
+	}
+
+	if ((fd = dup(_buildcache.cache)) == -1 || !(dh = fdopendir(fd))) {
+		if (fd != -1)
+			close(fd);
+		return 0;
+	}
+
+	rewinddir(dh);
+
+	while ((dentry = readdir(dh))) {
+		if (dentry->d_name[0] != '.')
+			++_buildcache.entries;
+		else if (strcmp(dentry->d_name, ".") != 0 && strcmp(dentry->d_name, "..") != 0)
+			trash_put(fd, dentry->d_name); /* left half written */
+	}
+
+	closedir(dh);
+
+	return 0;
+}
+
+void
+buildcache_fini(void)
+{
+	if (_buildcache.cache == -1)
+		return;
+
+	close(_buildcache.cache);
+	_buildcache.cache = -1;
+}
+
+/* buildcache_key
+ *
+ * Function derives the cache key of building the project directory 'path'
+ * into 'key', SHA256_HEX_SIZE bytes. It covers the name and content of
+ * every source file, including the Makefile, and the identity of the
+ * toolchain. Hidden files are build outputs and don't count.
+ *
+ * The key doesn't depend on the cache being enabled, it identifies the
+ * sources of builds in flight as well.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+buildcache_key(const char *path, char *key)
+{
+	unsigned char digest[SHA256_SIZE];
+	struct dirent **files;
+	struct sha256 sha;
+	int count;
+	int dfd;
+	int fd;
+	int rc = 0;
+	int i;
+
+	dfd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (dfd == -1)
+		return errno;
+
+	count = scandirat(dfd, ".", &files, _buildcache_filter, alphasort);
+	if (count == -1) {
+		rc = errno;
+		close(dfd);
+		return rc;
+	}
+
+	sha256_init(&sha);
+	sha256_update(&sha, BUILDCACHE_VERSION, sizeof(BUILDCACHE_VERSION));
+	buildcache_toolchain(&sha);
+
+	for (i = 0; i < count; ++i) {
+		if (rc == 0) {
+			fd = openat(dfd, files[i]->d_name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+			if (fd != -1) {
+				rc = sha256_fd(fd, digest);
+				close(fd);
+
+				sha256_update(&sha, files[i]->d_name, strlen(files[i]->d_name) + 1);
+				sha256_update(&sha, digest, sizeof(digest));
+			} else if (ELOOP != errno && ENOENT != errno) {
+				rc = errno;
+			}
+		}
+
+		free(files[i]);
+	}
+
+	free(files);
+	close(dfd);
+
+	if (rc != 0)
+		return rc;
+
+	sha256_final(&sha, digest);
+	sha256_hex(digest, key);
+
+	return 0;
+}
+
+/* buildcache_lookup
+ *
+ * Function looks for the outcome of the build 'key'. On a hit, the stored
+ * artifacts replace those of the project directory 'path', as if the build
+ * had just run, and the build log and exit status are returned. The log
+ * must be freed by the caller.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on a hit, ENOENT on a miss, or any
+ * other errno value on failure.
+ */
+int
+buildcache_lookup(const char *key, const char *path, char **log, size_t *length, int *status)
+{
+	char *text = NULL;
+	size_t size;
+	size_t i;
+	int entry;
+	int dfd;
+	int rc;
+
+	if (_buildcache.cache == -1)
+		return ENOTSUP;
+
+	/* the descriptor keeps working should the entry get evicted */
+	entry = openat(_buildcache.cache, key, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (entry == -1)
+		return errno;
+
+	if ((rc = _buildcache_read(entry, BUILDCACHE_STATUS, &text, &size)) != 0 ||
+	    sscanf(text, "%d", status) != 1) {
+		rc = rc ? rc : EINVAL;
+		goto close_entry;
+	}
+
+	if ((rc = _buildcache_read(entry, BUILDCACHE_LOG, log, length)) != 0)
+		goto close_entry;
+
+	dfd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (dfd == -1) {
+		rc = errno;
+		goto free_log;
+	}
+
+	for (i = 0; i < sizeof(_buildcache_artifacts) / sizeof(_buildcache_artifacts[0]); ++i) {
+		rc = atomic_clone(entry, dfd, _buildcache_artifacts[i]);
+		if (rc == ENOENT) {
+			/* not produced by this build, so don't leave a stale one */
+			rc = unlinkat(dfd, _buildcache_artifacts[i], 0) == -1 && ENOENT != errno ? errno : 0;
+		}
+
+		if (rc != 0)
+			break;
+	}
+
+	close(dfd);
+
+	if (rc != 0)
+		goto free_log;
+
+	/* entries are evicted least recently used first */
+	utimensat(_buildcache.cache, key, NULL, 0);
+	__sync_fetch_and_add(&_buildcache.hits, 1);
+
+	goto close_entry;
+
+free_log:
+	free(*log);
+	*log = NULL;
+
+close_entry:
+	free(text);
+	close(entry);
+
+	if (rc != 0 && rc != ENOENT)
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to restore cached build: %s", key);
+
+	return rc;
+}
+
+/* buildcache_store
+ *
+ * Function records the outcome of the build 'key' of the project directory
+ * 'path': its 'log', exit 'status' and the artifacts it left behind.
+ *
+ * Every build that had to run ends up here, so this counts the misses.
+ *
+ * The entry is assembled aside and renamed into place, so lookups never
+ * see it half written. Storing a key that is already present is a no-op.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+buildcache_store(const char *key, const char *path, const char *log, size_t length, int status)
+{
+	static unsigned int counter;
+	struct atomic_file afile;
+	char temp[NAME_MAX + 1];
+	char text[16];
+	size_t i;
+	int entry;
+	int dfd;
+	int rc;
+
+	if (_buildcache.cache == -1)
+		return ENOTSUP;
+
+	__sync_fetch_and_add(&_buildcache.misses, 1);
+
+	snprintf(temp, sizeof(temp), ".%s.%d.%u", key, getpid(), __sync_fetch_and_add(&counter, 1));
+
+	if (mkdirat(_buildcache.cache, temp, S_IRWXU) == -1)
+		return errno;
+
+	entry = openat(_buildcache.cache, temp, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (entry == -1) {
+		rc = errno;
+		goto discard;
+	}
+
+	dfd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (dfd == -1) {
+		rc = errno;
+		goto close_entry;
+	}
+
+	for (i = 0; i < sizeof(_buildcache_artifacts) / sizeof(_buildcache_artifacts[0]); ++i) {
+		rc = atomic_clone(dfd, entry, _buildcache_artifacts[i]);
+		if (rc != 0 && rc != ENOENT)
+			break;
+
+		rc = 0;
+	}
+
+	close(dfd);
+
+	if (rc != 0)
+		goto close_entry;
+
+	if ((rc = atomic_open(&afile, entry, BUILDCACHE_LOG)) != 0)
+		goto close_entry;
+
+	if ((rc = atomic_write(&afile, log, length)) != 0 ||
+	    (rc = atomic_commit(&afile, ATOMIC_CREATE)) != 0) {
+		atomic_abort(&afile);
+		goto close_entry;
+	}
+
+	if ((rc = atomic_open(&afile, entry, BUILDCACHE_STATUS)) != 0)
+		goto close_entry;
+
+	snprintf(text, sizeof(text), "%d\n", status);
+
+	if ((rc = atomic_write(&afile, text, strlen(text))) != 0 ||
+	    (rc = atomic_commit(&afile, ATOMIC_CREATE)) != 0) {
+		atomic_abort(&afile);
+		goto close_entry;
+	}
+
+	close(entry);
+
+	if (renameat2(_buildcache.cache, temp, _buildcache.cache, key, RENAME_NOREPLACE) == -1) {
+		rc = EEXIST == errno ? 0 : errno;
+		goto discard;
+	}
+
+	__sync_fetch_and_add(&_buildcache.stored, 1);
+
+	if (__sync_add_and_fetch(&_buildcache.entries, 1) > BUILD_CACHE_SIZE)
+		_buildcache_evict();
+
+	return 0;
+
+close_entry:
+	close(entry);
+
+discard:
+	trash_put(_buildcache.cache, temp);
+	return rc;
+}
+
+/* buildcache_toolchain
+ *
+ * Function adds the identity of each BUILD_TOOLCHAIN executable to 'sha':
+ * where it resolves to, and the size, inode and modification time of that
+ * file. Upgrading the toolchain thereby invalidates every entry.
+ */
+void
+buildcache_toolchain(struct sha256 *sha)
+{
+	char tools[] = BUILD_TOOLCHAIN;
+	char resolved[PATH_MAX];
+	char identity[PATH_MAX + 96];
+	struct stat st;
+	char *state;
+	char *tool;
+	int length;
+
+	for (tool = strtok_r(tools, " ", &state); tool; tool = strtok_r(NULL, " ", &state)) {
+		if (!realpath(tool, resolved) || stat(resolved, &st) == -1)
+			length = snprintf(identity, sizeof(identity), "%s missing", tool);
+		else
+			length = snprintf(identity, sizeof(identity), "%s %lld %llu %lld.%09ld",
+			    resolved, (long long) st.st_size, (unsigned long long) st.st_ino,
+			    (long long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+
+		sha256_update(sha, identity, length + 1);
+	}
+}
+
+void
+buildcache_stats(struct json_t *root)
+{
+	unsigned long lookups;
+	json_t *stats;
+
+	if (_buildcache.cache == -1)
+		return;
+
+	stats = json_object();
+	if (!stats)
+		return;
+
+	lookups = _buildcache.hits + _buildcache.misses;
+
+	json_object_set_new(stats, "entries", json_integer(_buildcache.entries));
+	json_object_set_new(stats, "hits", json_integer(_buildcache.hits));
+	json_object_set_new(stats, "misses", json_integer(_buildcache.misses));
+	json_object_set_new(stats, "hit_rate", json_real(lookups ? (double) _buildcache.hits / lookups : 0.0));
+	json_object_set_new(stats, "stored", json_integer(_buildcache.stored));
+	json_object_set_new(stats, "evicted", json_integer(_buildcache.evicted));
+
+	json_object_set_new(root, "build_cache", stats);
+}
+
+/*****************************************************************************/
+
+int
+_buildcache_filter(const struct dirent *dentry)
+{
+	return dentry->d_name[0] != '.' && (dentry->d_type == DT_REG || dentry->d_type == DT_UNKNOWN);
+}
+
+/* _buildcache_read
+ *
+ * Function reads all of 'name' inside the directory 'dfd' into a newly
+ * allocated, NUL terminated buffer.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+_buildcache_read(int dfd, const char *name, char **data, size_t *length)
+{
+	struct stat st;
+	ssize_t bread;
+	size_t offset;
+	int fd;
+	int rc = 0;
+
+	fd = openat(dfd, name, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return errno;
+
+	if (fstat(fd, &st) == -1) {
+		rc = errno;
+		goto close;
+	}
+
+	*data = malloc(st.st_size + 1);
+	if (!*data) {
+		rc = ENOMEM;
+		goto close;
+	}
+
+	for (offset = 0; offset < (size_t) st.st_size; offset += bread) {
+		bread = pread(fd, *data + offset, st.st_size - offset, offset);
+		if (bread == -1 && EINTR == errno) {
+			bread = 0;
+			continue;
+		}
+
+		if (bread <= 0) {
+			rc = bread == 0 ? EIO : errno;
+			free(*data);
+			*data = NULL;
+			goto close;
+		}
+	}
+
+	(*data)[offset] = '\0';
+	*length = offset;
+
+close:
+	close(fd);
+	return rc;
+}
+
+/* _buildcache_evict
+ *
+ * Function drops the least recently used entry.
+ */
+void
+_buildcache_evict(void)
+{
+	char oldest[NAME_MAX + 1] = {0};
+	struct timespec mtime = {0};
+	struct dirent *dentry;
+	struct stat st;
+	DIR *dh;
+	int fd;
+
+	if ((fd = dup(_buildcache.cache)) == -1)
+		return;
+
+	if (!(dh = fdopendir(fd))) {
+		close(fd);
+		return;
+	}
+
+	/* the duplicate shares its offset with every scan before this one */
+	rewinddir(dh);
+
+	while ((dentry = readdir(dh))) {
+		if (dentry->d_name[0] == '.')
+			continue;
+
+		if (fstatat(fd, dentry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+			continue;
+
+		if (!oldest[0] || st.st_mtim.tv_sec < mtime.tv_sec ||
+		    (st.st_mtim.tv_sec == mtime.tv_sec && st.st_mtim.tv_nsec < mtime.tv_nsec)) {
+			snprintf(oldest, sizeof(oldest), "%s", dentry->d_name);
+			mtime = st.st_mtim;
+		}
+	}
+
+	if (oldest[0] && trash_put(fd, oldest) == 0) {
+		__sync_fetch_and_sub(&_buildcache.entries, 1);
+		__sync_fetch_and_add(&_buildcache.evicted, 1);
+	}
+
+	closedir(dh);
+}
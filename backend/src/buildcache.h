@@ -0,0 +1,20 @@
+#ifndef CREDENTARIUS_BUILDCACHE_H
+#define CREDENTARIUS_BUILDCACHE_H 1
+
+#include <stddef.h>
+
+#include "sha256.h"
+
+struct json_t;
+
+int buildcache_init(void);
+void buildcache_fini(void);
+
+int buildcache_key(const char *, char *);
+void buildcache_toolchain(struct sha256 *);
+int buildcache_lookup(const char *, const char *, char **, size_t *, int *);
+int buildcache_store(const char *, const char *, const char *, size_t, int);
+
+void buildcache_stats(struct json_t *);
+
+#endif
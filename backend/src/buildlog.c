@@ -0,0 +1,396 @@
+#include "buildlog.h"
+
+#include <errno.h>
+#include <jansson.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ulfius.h>
+
+#include "common.h"
+#include "compress.h"
+#include "config.h"
+
+struct _buildlog_entry
+{
+	char path[PATH_MAX];
+	unsigned long serial;
+	int status;
+	int cached;
+	uint64_t start;
+	uint64_t end;
+	enum compress_t encoding;
+	char *data;
+	size_t size;
+	struct _buildlog_entry *next;
+};
+
+static void _buildlog_put(char *, size_t, uint64_t, const char *, size_t);
+static int _buildlog_grow(struct buildlog *, size_t);
+static int _buildlog_sink(void *, const char *, size_t);
+static void _buildlog_drop(struct _buildlog_entry *);
+
+static struct
+{
+	pthread_mutex_t lock;
+	struct _buildlog_entry *entries; /* most recently used first */
+	size_t size;
+	unsigned long retained;
+	unsigned long restored;
+	unsigned long evicted;
+	unsigned long long plain;
+	unsigned long long compressed;
+} _buildlog = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* buildlog_append
+ *
+ * Function adds 'length' bytes of output to the log. Once the log holds
+ * BUILD_LOG_SIZE bytes, the oldest output is overwritten. The log is not
+ * locked, that is up to the caller.
+ */
+void
+buildlog_append(struct buildlog *log, const void *data, size_t length)
+{
+	const char *bytes = data;
+
+	if (length > BUILD_LOG_SIZE) {
+		/* only the tail would survive anyway */
+		log->end += length - BUILD_LOG_SIZE;
+		log->start = log->end;
+		bytes += length - BUILD_LOG_SIZE;
+		length = BUILD_LOG_SIZE;
+	}
+
+	if (log->end - log->start + length > log->capacity &&
+	    log->capacity < BUILD_LOG_SIZE &&
+	    _buildlog_grow(log, log->end - log->start + length) != 0)
+		return;
+
+	_buildlog_put(log->ring, log->capacity, log->end, bytes, length);
+	log->end += length;
+
+	if (log->end - log->start > log->capacity)
+		log->start = log->end - log->capacity;
+}
+
+/* buildlog_read
+ *
+ * Function copies up to 'max' bytes of output, starting at 'offset', into
+ * 'buffer'. An 'offset' whose output was already overwritten is moved up to
+ * the oldest output still held.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the number of bytes copied.
+ */
+size_t
+buildlog_read(const struct buildlog *log, uint64_t *offset, char *buffer, size_t max)
+{
+	size_t length;
+	size_t index;
+	size_t first;
+
+	if (*offset < log->start)
+		*offset = log->start;
+
+	if (*offset >= log->end)
+		return 0;
+
+	length = log->end - *offset < max ? log->end - *offset : max;
+	index = *offset % log->capacity;
+	first = log->capacity - index < length ? log->capacity - index : length;
+
+	memcpy(buffer, log->ring + index, first);
+	memcpy(buffer + first, log->ring, length - first);
+
+	return length;
+}
+
+/* buildlog_copy
+ *
+ * Function copies the output held by the log into one newly allocated
+ * buffer.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or ENOMEM on failure.
+ */
+int
+buildlog_copy(const struct buildlog *log, char **data, size_t *length)
+{
+	uint64_t offset = log->start;
+
+	*length = log->end - log->start;
+	*data = malloc(*length + 1);
+	if (!*data)
+		return ENOMEM;
+
+	if (*length > 0)
+		buildlog_read(log, &offset, *data, *length);
+
+	return 0;
+}
+
+void
+buildlog_free(struct buildlog *log)
+{
+	free(log->ring);
+	memset(log, 0, sizeof(*log));
+}
+
+void
+buildlog_fini(void)
+{
+	struct _buildlog_entry *entry;
+
+	pthread_mutex_lock(&_buildlog.lock);
+	while ((entry = _buildlog.entries)) {
+		_buildlog.entries = entry->next;
+		_buildlog_drop(entry);
+	}
+	pthread_mutex_unlock(&_buildlog.lock);
+}
+
+/* buildlog_retain
+ *
+ * Function keeps the finished 'log' of build 'serial' of the project
+ * directory 'path' for later, compressed, replacing the one of the previous
+ * build. The least recently used logs are dropped to keep their total size
+ * below BUILD_LOG_RETAIN bytes.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+buildlog_retain(const char *path, unsigned long serial, const struct buildlog *log, int status, int cached)
+{
+	struct _buildlog_entry **link;
+	struct _buildlog_entry *entry;
+	struct _buildlog_entry *old;
+	enum compress_t encoding;
+	char *plain;
+	size_t length;
+	int rc;
+
+	if (BUILD_LOG_RETAIN <= 0)
+		return ENOTSUP;
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return ENOMEM;
+
+	rc = snprintf(entry->path, sizeof(entry->path), "%s", path);
+	if (rc <= 0 || (size_t) rc >= sizeof(entry->path)) {
+		free(entry);
+		return ENAMETOOLONG;
+	}
+
+	if ((rc = buildlog_copy(log, &plain, &length)) != 0) {
+		free(entry);
+		return rc;
+	}
+
+	entry->serial = serial;
+	entry->status = status;
+	entry->cached = cached;
+	entry->start = log->start;
+	entry->end = log->end;
+
+	for (encoding = COMPRESS_ZSTD; encoding != COMPRESS_IDENTITY; --encoding)
+		if (compress_available(encoding) &&
+		    compress_buffer(encoding, plain, length, &entry->data, &entry->size) == 0)
+			break;
+
+	entry->encoding = encoding;
+	if (encoding == COMPRESS_IDENTITY) {
+		entry->data = plain;
+		entry->size = length;
+	} else {
+		free(plain);
+	}
+
+	if (entry->size > BUILD_LOG_RETAIN) {
+		_buildlog_drop(entry);
+		return EFBIG;
+	}
+
+	pthread_mutex_lock(&_buildlog.lock);
+
+	for (link = &_buildlog.entries; *link; link = &(*link)->next) {
+		if (strcmp((*link)->path, path) == 0) {
+			old = *link;
+			*link = old->next;
+			_buildlog.size -= old->size;
+			_buildlog_drop(old);
+			break;
+		}
+	}
+
+	entry->next = _buildlog.entries;
+	_buildlog.entries = entry;
+	_buildlog.size += entry->size;
+	_buildlog.plain += length;
+	_buildlog.compressed += entry->size;
+	++_buildlog.retained;
+
+	while (_buildlog.size > BUILD_LOG_RETAIN) {
+		for (link = &_buildlog.entries; (*link)->next; link = &(*link)->next)
+			;
+
+		_buildlog.size -= (*link)->size;
+		_buildlog_drop(*link);
+		*link = NULL;
+		++_buildlog.evicted;
+	}
+
+	pthread_mutex_unlock(&_buildlog.lock);
+
+	return 0;
+}
+
+/* buildlog_restore
+ *
+ * Function decompresses the retained log of the last build of the project
+ * directory 'path' into the empty 'log', keeping its offsets.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, ENOENT if no log is kept
+ * for the project, or any other errno value on failure.
+ */
+int
+buildlog_restore(const char *path, unsigned long *serial, struct buildlog *log, int *status, int *cached)
+{
+	struct _buildlog_entry **link;
+	struct _buildlog_entry *entry;
+	int rc;
+
+	pthread_mutex_lock(&_buildlog.lock);
+
+	for (link = &_buildlog.entries; *link; link = &(*link)->next)
+		if (strcmp((*link)->path, path) == 0)
+			break;
+
+	if (!(entry = *link)) {
+		pthread_mutex_unlock(&_buildlog.lock);
+		return ENOENT;
+	}
+
+	/* most recently used first */
+	*link = entry->next;
+	entry->next = _buildlog.entries;
+	_buildlog.entries = entry;
+
+	*serial = entry->serial;
+	*status = entry->status;
+	*cached = entry->cached;
+
+	log->start = log->end = entry->start;
+	rc = compress_decode(entry->encoding, entry->data, entry->size, _buildlog_sink, log);
+	if (rc == 0)
+		++_buildlog.restored;
+
+	pthread_mutex_unlock(&_buildlog.lock);
+
+	if (rc != 0)
+		buildlog_free(log);
+
+	return rc;
+}
+
+void
+buildlog_stats(struct json_t *root)
+{
+	json_t *stats;
+
+	stats = json_object();
+	if (!stats)
+		return;
+
+	pthread_mutex_lock(&_buildlog.lock);
+	json_object_set_new(stats, "size", json_integer(_buildlog.size));
+	json_object_set_new(stats, "retained", json_integer(_buildlog.retained));
+	json_object_set_new(stats, "restored", json_integer(_buildlog.restored));
+	json_object_set_new(stats, "evicted", json_integer(_buildlog.evicted));
+	json_object_set_new(stats, "ratio", json_real(_buildlog.compressed ?
+	    (double) _buildlog.plain / _buildlog.compressed : 0.0));
+	pthread_mutex_unlock(&_buildlog.lock);
+
+	json_object_set_new(root, "build_logs", stats);
+}
+
+/*****************************************************************************/
+
+void
+_buildlog_put(char *ring, size_t capacity, uint64_t offset, const char *data, size_t length)
+{
+	size_t index = offset % capacity;
+	size_t first = capacity - index < length ? capacity - index : length;
+
+	memcpy(ring + index, data, first);
+	memcpy(ring, data + first, length - first);
+}
+
+/* _buildlog_grow
+ *
+ * Function enlarges the log to hold at least 'needed' bytes, up to
+ * BUILD_LOG_SIZE, moving what it holds to where its offsets now belong.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or ENOMEM on failure.
+ */
+int
+_buildlog_grow(struct buildlog *log, size_t needed)
+{
+	size_t capacity = log->capacity ? log->capacity : 4096;
+	char *held = NULL;
+	size_t length = 0;
+	char *ring;
+
+	while (capacity < needed)
+		capacity *= 2;
+
+	if (capacity > BUILD_LOG_SIZE)
+		capacity = BUILD_LOG_SIZE;
+
+	if (log->ring && buildlog_copy(log, &held, &length) != 0)
+		return ENOMEM;
+
+	ring = malloc(capacity);
+	if (!ring) {
+		free(held);
+		return ENOMEM;
+	}
+
+	if (length > 0)
+		_buildlog_put(ring, capacity, log->start, held, length);
+
+	free(held);
+	free(log->ring);
+
+	log->ring = ring;
+	log->capacity = capacity;
+
+	return 0;
+}
+
+int
+_buildlog_sink(void *user_data, const char *data, size_t length)
+{
+	struct buildlog *log = user_data;
+
+	buildlog_append(log, data, length);
+
+	return 0;
+}
+
+void
+_buildlog_drop(struct _buildlog_entry *entry)
+{
+	free(entry->data);
+	free(entry);
+}
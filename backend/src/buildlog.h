@@ -0,0 +1,31 @@
+#ifndef CREDENTARIUS_BUILDLOG_H
+#define CREDENTARIUS_BUILDLOG_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct json_t;
+
+/* the latest BUILD_LOG_SIZE bytes of a build's output, addressed by their
+ * offset in the whole output */
+struct buildlog
+{
+	char *ring;
+	size_t capacity;
+	uint64_t start;
+	uint64_t end;
+};
+
+void buildlog_append(struct buildlog *, const void *, size_t);
+size_t buildlog_read(const struct buildlog *, uint64_t *, char *, size_t);
+int buildlog_copy(const struct buildlog *, char **, size_t *);
+void buildlog_free(struct buildlog *);
+
+void buildlog_fini(void);
+
+int buildlog_retain(const char *, unsigned long, const struct buildlog *, int, int);
+int buildlog_restore(const char *, unsigned long *, struct buildlog *, int *, int *);
+
+void buildlog_stats(struct json_t *);
+
+#endif
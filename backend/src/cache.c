@@ -0,0 +1,473 @@
+#include "cache.h"
+
+#include <pthread.h>
+#include <jansson.h>
+#include <ulfius.h>
+
+#include "common.h"
+#include "sha256.h"
+
+#define CACHE_BUCKETS 1024
+#define CACHE_ENTRY_MAX (256 * 1024)
+
+/* number of file digests remembered, replaced round-robin */
+#define CACHE_DIGESTS 256
+
+struct _cache_entry
+{
+	struct _cache_entry *chain;
+	struct _cache_entry *prev;
+	struct _cache_entry *next;
+	unsigned int hash;
+	char *key;
+	enum compress_t encoding;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	size_t length;
+	char data[];
+};
+
+struct _cache_digest
+{
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	char hex[SHA256_HEX_SIZE];
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	struct _cache_entry *buckets[CACHE_BUCKETS];
+	struct _cache_entry *head; /* most recently used */
+	struct _cache_entry *tail; /* least recently used */
+	size_t capacity;
+	size_t bytes;
+	size_t entries;
+	size_t variants;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long stale;
+	unsigned long evictions;
+	struct _cache_digest digests[CACHE_DIGESTS];
+	unsigned int next_digest;
+} _cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static unsigned int _cache_hash(const char *);
+static struct _cache_entry **_cache_find(const char *, enum compress_t, unsigned int);
+static int _cache_valid(const struct _cache_entry *, const struct stat *);
+static void _cache_unlink(struct _cache_entry *);
+static void _cache_touch(struct _cache_entry *);
+static void _cache_remove(struct _cache_entry **);
+
+/* cache_init
+ *
+ * Function sets the total number of content bytes the cache may hold.
+ * A capacity of zero (0) disables the cache.
+ */
+int
+cache_init(size_t capacity)
+{
+	pthread_mutex_lock(&_cache.lock);
+	_cache.capacity = capacity;
+	pthread_mutex_unlock(&_cache.lock);
+
+	y_log_message(Y_LOG_LEVEL_DEBUG, "File cache initialized with %zu bytes.", capacity);
+
+	return 0;
+}
+
+void
+cache_fini(void)
+{
+	struct _cache_entry *entry;
+
+	pthread_mutex_lock(&_cache.lock);
+	while ((entry = _cache.tail))
+		_cache_remove(_cache_find(entry->key, entry->encoding, entry->hash));
+	_cache.capacity = 0;
+	pthread_mutex_unlock(&_cache.lock);
+}
+
+/* cache_get
+ *
+ * Function looks up the 'encoding' variant of 'key' and, if the cached copy
+ * still matches the file described by 'st', sets it as the body of
+ * 'response'.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on a cache hit and -1 otherwise.
+ */
+int
+cache_get(const char *key, enum compress_t encoding, const struct stat *st, struct _u_response *response, unsigned int status)
+{
+	struct _cache_entry **slot;
+	unsigned int hash;
+	int rc = -1;
+
+	hash = _cache_hash(key);
+
+	pthread_mutex_lock(&_cache.lock);
+
+	slot = _cache_find(key, encoding, hash);
+	if (!*slot) {
+		++_cache.misses;
+	} else if (!_cache_valid(*slot, st)) {
+		++_cache.stale;
+		++_cache.misses;
+		_cache_remove(slot);
+	} else {
+		++_cache.hits;
+		_cache_touch(*slot);
+		rc = ulfius_set_binary_response(response, status,
+		    (*slot)->data, (*slot)->length) == U_OK ? 0 : -1;
+	}
+
+	pthread_mutex_unlock(&_cache.lock);
+
+	return rc;
+}
+
+/* cache_length
+ *
+ * Function looks up the length of the 'encoding' variant of 'key', without
+ * counting the lookup as a hit or a miss.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the cached length, or -1 if there is no valid
+ * entry.
+ */
+ssize_t
+cache_length(const char *key, enum compress_t encoding, const struct stat *st)
+{
+	struct _cache_entry **slot;
+	ssize_t length = -1;
+
+	pthread_mutex_lock(&_cache.lock);
+
+	slot = _cache_find(key, encoding, _cache_hash(key));
+	if (*slot && _cache_valid(*slot, st))
+		length = (*slot)->length;
+
+	pthread_mutex_unlock(&_cache.lock);
+
+	return length;
+}
+
+/* cache_put
+ *
+ * Function stores a copy of 'data' as the 'encoding' variant of 'key',
+ * tagged with the identity of the file described by 'st'. Least recently
+ * used entries are evicted until the new entry fits.
+ *
+ * Encoded variants are kept next to the plain copy so that unchanged files
+ * are compressed only once, not on every request.
+ */
+void
+cache_put(const char *key, enum compress_t encoding, const struct stat *st, const void *data, size_t length)
+{
+	struct _cache_entry *entry;
+	struct _cache_entry **slot;
+	unsigned int hash;
+
+	if (!cache_cacheable(length))
+		return;
+
+	entry = malloc(sizeof(*entry) + length);
+	if (!entry)
+		return;
+
+	entry->key = strdup(key);
+	if (!entry->key) {
+		free(entry);
+		return;
+	}
+
+	entry->hash = hash = _cache_hash(key);
+	entry->encoding = encoding;
+	entry->dev = st->st_dev;
+	entry->ino = st->st_ino;
+	entry->size = st->st_size;
+	entry->mtime = st->st_mtim;
+	entry->length = length;
+	memcpy(entry->data, data, length);
+
+	pthread_mutex_lock(&_cache.lock);
+
+	slot = _cache_find(key, encoding, hash);
+	if (*slot)
+		_cache_remove(slot);
+
+	while (_cache.tail && _cache.bytes + length > _cache.capacity) {
+		++_cache.evictions;
+		_cache_remove(_cache_find(_cache.tail->key, _cache.tail->encoding, _cache.tail->hash));
+	}
+
+	if (_cache.bytes + length > _cache.capacity) {
+		pthread_mutex_unlock(&_cache.lock);
+		free(entry->key);
+		free(entry);
+		return;
+	}
+
+	slot = &_cache.buckets[hash % CACHE_BUCKETS];
+	entry->chain = *slot;
+	*slot = entry;
+
+	entry->prev = NULL;
+	entry->next = NULL;
+	_cache_touch(entry);
+
+	_cache.bytes += length;
+	++_cache.entries;
+	if (encoding != COMPRESS_IDENTITY)
+		++_cache.variants;
+
+	pthread_mutex_unlock(&_cache.lock);
+}
+
+/* cache_cacheable
+ *
+ * Function tells callers whether a body of 'length' bytes is worth reading
+ * into memory for the cache, or should be streamed instead.
+ */
+int
+cache_cacheable(size_t length)
+{
+	return length <= CACHE_ENTRY_MAX && length <= _cache.capacity;
+}
+
+/* cache_etag
+ *
+ * Function formats a strong entity tag for the file described by 'st'.
+ *
+ * The inode number together with size and modification time changes
+ * whenever the content does, and no inode is shared between projects:
+ * the blob store shares blocks only.
+ */
+void
+cache_etag(const struct stat *st, char *etag, size_t length)
+{
+	snprintf(etag, length, "\"%lx-%lx-%llx-%lx.%lx\"",
+	    (unsigned long) st->st_dev, (unsigned long) st->st_ino,
+	    (unsigned long long) st->st_size,
+	    (unsigned long) st->st_mtim.tv_sec,
+	    (unsigned long) st->st_mtim.tv_nsec);
+}
+
+/* cache_digest
+ *
+ * Function stores the hex SHA-256 digest of the file 'fd', described by
+ * 'st', in 'hex'. Digests are remembered per inode, size and modification
+ * time, so an unchanged file is only hashed once.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+cache_digest(int fd, const struct stat *st, char *hex)
+{
+	unsigned char digest[SHA256_SIZE];
+	struct _cache_digest *entry;
+	struct stat after;
+	unsigned int i;
+	int rc;
+
+	pthread_mutex_lock(&_cache.lock);
+
+	for (i = 0; i < CACHE_DIGESTS; ++i) {
+		entry = &_cache.digests[i];
+		if (entry->ino == st->st_ino && entry->dev == st->st_dev &&
+		    entry->size == st->st_size &&
+		    entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+		    entry->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+			memcpy(hex, entry->hex, SHA256_HEX_SIZE);
+			pthread_mutex_unlock(&_cache.lock);
+			return 0;
+		}
+	}
+
+	pthread_mutex_unlock(&_cache.lock);
+
+	if ((rc = sha256_fd(fd, digest)) != 0)
+		return rc;
+
+	sha256_hex(digest, hex);
+
+	/* only remember it if nothing rewrote the file while hashing */
+	if (fstat(fd, &after) == -1 || after.st_size != st->st_size ||
+	    after.st_mtim.tv_sec != st->st_mtim.tv_sec ||
+	    after.st_mtim.tv_nsec != st->st_mtim.tv_nsec)
+		return 0;
+
+	pthread_mutex_lock(&_cache.lock);
+
+	entry = &_cache.digests[_cache.next_digest++ % CACHE_DIGESTS];
+	entry->dev = st->st_dev;
+	entry->ino = st->st_ino;
+	entry->size = st->st_size;
+	entry->mtime = st->st_mtim;
+	memcpy(entry->hex, hex, SHA256_HEX_SIZE);
+
+	pthread_mutex_unlock(&_cache.lock);
+
+	return 0;
+}
+
+/* cache_etag_match
+ *
+ * Function checks whether 'etag' is listed in the If-None-Match style
+ * 'header' value.
+ *
+ * RETURN VALUES
+ *
+ * The function will return TRUE (1) if it matches and FALSE (0) otherwise.
+ */
+int
+cache_etag_match(const char *header, const char *etag)
+{
+	size_t length = strlen(etag);
+	const char *cursor = header;
+
+	if (!header)
+		return FALSE;
+
+	while (*cursor) {
+		while (*cursor == ' ' || *cursor == '\t' || *cursor == ',')
+			++cursor;
+
+		if (*cursor == '*')
+			return TRUE;
+
+		if (strncmp(cursor, "W/", 2) == 0)
+			cursor += 2;
+
+		if (strncmp(cursor, etag, length) == 0 &&
+		    (cursor[length] == '\0' || cursor[length] == ',' ||
+		     cursor[length] == ' ' || cursor[length] == '\t'))
+			return TRUE;
+
+		while (*cursor && *cursor != ',')
+			++cursor;
+	}
+
+	return FALSE;
+}
+
+void
+cache_stats(struct json_t *root)
+{
+	json_t *stats;
+
+	stats = json_object();
+	if (!stats)
+		return;
+
+	pthread_mutex_lock(&_cache.lock);
+	json_object_set_new(stats, "capacity", json_integer(_cache.capacity));
+	json_object_set_new(stats, "bytes", json_integer(_cache.bytes));
+	json_object_set_new(stats, "entries", json_integer(_cache.entries));
+	json_object_set_new(stats, "variants", json_integer(_cache.variants));
+	json_object_set_new(stats, "hits", json_integer(_cache.hits));
+	json_object_set_new(stats, "misses", json_integer(_cache.misses));
+	json_object_set_new(stats, "stale", json_integer(_cache.stale));
+	json_object_set_new(stats, "evictions", json_integer(_cache.evictions));
+	pthread_mutex_unlock(&_cache.lock);
+
+	json_object_set_new(root, "cache", stats);
+}
+
+/*****************************************************************************/
+
+unsigned int
+_cache_hash(const char *key)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*key) {
+		hash ^= (unsigned char) *key++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+struct _cache_entry **
+_cache_find(const char *key, enum compress_t encoding, unsigned int hash)
+{
+	struct _cache_entry **slot = &_cache.buckets[hash % CACHE_BUCKETS];
+
+	while (*slot && ((*slot)->hash != hash || (*slot)->encoding != encoding ||
+	    strcmp((*slot)->key, key) != 0))
+		slot = &(*slot)->chain;
+
+	return slot;
+}
+
+int
+_cache_valid(const struct _cache_entry *entry, const struct stat *st)
+{
+	return entry->dev == st->st_dev &&
+	       entry->ino == st->st_ino &&
+	       entry->size == st->st_size &&
+	       entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+	       entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+void
+_cache_unlink(struct _cache_entry *entry)
+{
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		_cache.head = entry->next;
+
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		_cache.tail = entry->prev;
+
+	entry->prev = NULL;
+	entry->next = NULL;
+}
+
+void
+_cache_touch(struct _cache_entry *entry)
+{
+	if (_cache.head == entry)
+		return;
+
+	if (entry->prev || entry->next || _cache.tail == entry)
+		_cache_unlink(entry);
+
+	entry->next = _cache.head;
+	if (_cache.head)
+		_cache.head->prev = entry;
+	_cache.head = entry;
+
+	if (!_cache.tail)
+		_cache.tail = entry;
+}
+
+void
+_cache_remove(struct _cache_entry **slot)
+{
+	struct _cache_entry *entry = *slot;
+
+	*slot = entry->chain;
+	_cache_unlink(entry);
+
+	_cache.bytes -= entry->length;
+	--_cache.entries;
+	if (entry->encoding != COMPRESS_IDENTITY)
+		--_cache.variants;
+
+	free(entry->key);
+	free(entry);
+}
@@ -0,0 +1,30 @@
+#ifndef CREDENTARIUS_CACHE_H
+#define CREDENTARIUS_CACHE_H 1
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "compress.h"
+
+/* five 64-bit hex fields with their separators and quotes, and an
+ * encoding suffix */
+#define CACHE_ETAG_MAX 96
+
+struct _u_response;
+struct json_t;
+
+int cache_init(size_t);
+void cache_fini(void);
+
+int cache_get(const char *, enum compress_t, const struct stat *, struct _u_response *, unsigned int);
+ssize_t cache_length(const char *, enum compress_t, const struct stat *);
+void cache_put(const char *, enum compress_t, const struct stat *, const void *, size_t);
+int cache_cacheable(size_t);
+
+void cache_etag(const struct stat *, char *, size_t);
+int cache_digest(int, const struct stat *, char *);
+int cache_etag_match(const char *, const char *);
+
+void cache_stats(struct json_t *);
+
+#endif
@@ -14,9 +14,16 @@ enum http_t
 	HTTP_OK          = 200,
 	HTTP_CREATED     = 201,
 	HTTP_NO_CONTENT  = 204,
+	HTTP_PARTIAL_CONTENT = 206,
+	HTTP_NOT_MODIFIED = 304,
 	HTTP_BAD_REQUEST = 400,
 	HTTP_NOT_FOUND   = 404,
 	HTTP_CONFLICT    = 409,
+	HTTP_PRECONDITION_FAILED = 412,
+	HTTP_UNSUPPORTED_MEDIA_TYPE = 415,
+	HTTP_RANGE_NOT_SATISFIABLE = 416,
+	HTTP_PRECONDITION_REQUIRED = 428,
+	HTTP_TOO_MANY_REQUESTS = 429,
 	HTTP_INTERNAL_SERVER_ERROR = 500
 };
 
@@ -6,21 +6,51 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <jansson.h>
+#include <stdlib.h>
 #include <ulfius.h>
 
+#include "build.h"
 #include "common.h"
 #include "config.h"
+#include "path.h"
 
+/* an unterminated line is sent as it is once it grows this long */
+#define COMPILE_LINE_MAX 512
+
+/* output is sent in writes of up to this size */
+#define COMPILE_BLOCK_SIZE (16 * 1024)
+
+struct _compile
+{
+	struct build *build;
+	unsigned int position;
+	uint64_t offset;
+	int events;
+	int finished;
+};
+
+static int _compile_stream(const struct _u_request *, struct _u_response *, struct _compile *);
 static ssize_t _stream_log(void *, uint64_t, char *, size_t);
+static ssize_t _stream_events(struct _compile *, const char *, size_t, int, char *, size_t);
 static void _stream_log_free(void *);
 
+/* compile_put_project
+ *
+ * Function queues a build of the project and streams its output, followed
+ * by its exit status. While the build waits for a worker, its position in
+ * the queue is reported whenever it changes. Requests for a project that is
+ * already being built share that build, or replace it if the sources
+ * changed in the meantime. When the queue is full, the
+ * client is told to come back later with 429 and a Retry-After estimate.
+ */
 int
 compile_put_project(const struct _u_request *request, struct _u_response *response, void *user_data)
 {
 	char path[PATH_MAX] = {0};
+	char retry[16];
+	struct _compile *compile;
 	struct stat fstat;
 	const char *id;
-	int *fd;
 	int rc;
 
 	UNUSED(user_data);
@@ -31,10 +61,11 @@ compile_put_project(const struct _u_request *request, struct _u_response *respon
 		return ulfius_set_empty_response(response, HTTP_BAD_REQUEST);
 	}
 
-	rc = snprintf(path, sizeof(path), "%s/%s", PROJECT_PATH, id);
-	if (rc <= 0) {
-		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to generate project file path.");
-		return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
+	rc = path_project(id, path, sizeof(path), FALSE);
+	if (rc != 0) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to resolve project path: %s", id);
+		return ulfius_set_empty_response(response,
+		    EINVAL == rc ? HTTP_BAD_REQUEST : HTTP_INTERNAL_SERVER_ERROR);
 	}
 
 	if (stat(path, &fstat) == -1) {
@@ -42,76 +73,288 @@ compile_put_project(const struct _u_request *request, struct _u_response *respon
 		return ulfius_set_empty_response(response, HTTP_NOT_FOUND);
 	}
 
-	fd = calloc(2, sizeof(int));
+	compile = calloc(1, sizeof(*compile));
+	if (!compile)
+		return U_ERROR_MEMORY;
 
-	if (pipe(fd) == -1) {
-		perror("pipe");
-		return U_ERROR;
-	}
+	rc = build_queue(id, path, &compile->build);
+	if (rc != 0) {
+		free(compile);
 
-	fcntl(fd[0], F_SETFD, FD_CLOEXEC);
-	fcntl(fd[1], F_SETFD, FD_CLOEXEC);
-	fcntl(fd[0], F_SETFL, O_NONBLOCK);
-
-	switch (fork()) {
-	case -1:
-		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to fork process!");
-		return U_ERROR;
-	case 0:
-		while (dup2(fd[1], STDERR_FILENO) == -1 && EINTR == errno);
-		while (dup2(fd[1], STDOUT_FILENO) == -1 && EINTR == errno);
-
-		if (chdir(path) == -1) {
-		    perror("execl");
-		    _exit(1);
+		if (EAGAIN != rc) {
+			y_log_message(Y_LOG_LEVEL_ERROR, "Failed to queue build: %s", id);
+			return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
 		}
 
-		execl("/usr/bin/make", "make", "clean", "all", NULL);
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Build queue is full, rejected: %s", id);
+		snprintf(retry, sizeof(retry), "%u", build_retry_after());
+		u_map_put(response->map_header, "Retry-After", retry);
+		return ulfius_set_empty_response(response, HTTP_TOO_MANY_REQUESTS);
+	}
+
+	return _compile_stream(request, response, compile);
+}
+
+/* compile_get_log
+ *
+ * Function streams the output of the project's build in flight, or of its
+ * last build, without starting a new one. Any number of clients may watch
+ * the same build.
+ *
+ * A client that lost its connection resumes where it left off, either from
+ * the byte offset given as 'offset' in the query, or from the Last-Event-ID
+ * of an event stream. Output that is no longer kept is skipped with a note
+ * telling how much is missing.
+ */
+int
+compile_get_log(const struct _u_request *request, struct _u_response *response, void *user_data)
+{
+	char path[PATH_MAX] = {0};
+	struct _compile *compile;
+	const char *id;
+	int rc;
+
+	UNUSED(user_data);
+
+	id = u_map_get(request->map_url, "id");
+	if (!id) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "No project id was specified.");
+		return ulfius_set_empty_response(response, HTTP_BAD_REQUEST);
+	}
 
-		perror("execl");
-		_exit(1);
+	rc = path_project(id, path, sizeof(path), FALSE);
+	if (rc != 0) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to resolve project path: %s", id);
+		return ulfius_set_empty_response(response,
+		    EINVAL == rc ? HTTP_BAD_REQUEST : HTTP_INTERNAL_SERVER_ERROR);
 	}
 
-	close(fd[1]);
+	compile = calloc(1, sizeof(*compile));
+	if (!compile)
+		return U_ERROR_MEMORY;
+
+	rc = build_attach(id, path, &compile->build);
+	if (rc != 0) {
+		free(compile);
 
-	y_log_message(Y_LOG_LEVEL_DEBUG, "Child process created.");
+		if (ENOENT != rc) {
+			y_log_message(Y_LOG_LEVEL_ERROR, "Failed to attach to build: %s", id);
+			return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
+		}
+
+		y_log_message(Y_LOG_LEVEL_DEBUG, "No build output to show for project: %s", id);
+		return ulfius_set_empty_response(response, HTTP_NOT_FOUND);
+	}
 
-	return ulfius_set_stream_response(response, HTTP_OK, _stream_log, _stream_log_free, -1, 1024, fd);
+	return _compile_stream(request, response, compile);
 }
 
 /*****************************************************************************/
 
+/* _compile_stream
+ *
+ * Function starts streaming the output of the build held by 'compile', as
+ * an event stream if the client accepts one and as plain text otherwise.
+ *
+ * Event ids are "<serial>:<offset>", so that a resumed stream only picks
+ * the offset up if it still refers to the same build.
+ */
+int
+_compile_stream(const struct _u_request *request, struct _u_response *response, struct _compile *compile)
+{
+	unsigned long serial;
+	const char *accept;
+	const char *resume;
+	char *end;
+
+	accept = u_map_get_case(request->map_header, "Accept");
+	compile->events = accept && strstr(accept, "text/event-stream");
+
+	if ((resume = u_map_get(request->map_url, "offset"))) {
+		compile->offset = strtoull(resume, &end, 10);
+		if (end == resume || *end != '\0')
+			compile->offset = 0;
+	} else if ((resume = u_map_get_case(request->map_header, "Last-Event-ID"))) {
+		serial = strtoul(resume, &end, 10);
+		if (end != resume && *end == ':' && serial == build_serial(compile->build))
+			compile->offset = strtoull(end + 1, NULL, 10);
+	}
+
+	if (compile->events) {
+		u_map_put(response->map_header, "Content-Type", "text/event-stream");
+		u_map_put(response->map_header, "Cache-Control", "no-cache");
+	} else {
+		u_map_put(response->map_header, "Content-Type", "text/plain; charset=utf-8");
+	}
+
+	return ulfius_set_stream_response(response, HTTP_OK, _stream_log, _stream_log_free, -1, COMPILE_BLOCK_SIZE, compile);
+}
+
 ssize_t
 _stream_log(void *stream_user_data, uint64_t offset, char *out_buf, size_t max)
 {
-	int *fd = stream_user_data;
+	struct _compile *compile = stream_user_data;
+	struct build *successor;
+	enum build_state_t state;
+	unsigned int position;
+	char buffer[COMPILE_BLOCK_SIZE];
+	uint64_t start;
 	ssize_t bread;
+	int cached;
+	int status;
 
 	UNUSED(offset);
 
-	bread = read(fd[0], out_buf, max);
-	switch (bread) {
-	case -1:
-		if (EAGAIN == errno)
-			return 0;
+	if (max > sizeof(buffer))
+		max = sizeof(buffer);
+
+	/* this connection has a thread of its own, it sleeps until there is
+	 * something to send */
+	for (;;) {
+		if ((state = build_poll(compile->build, &position)) == BUILD_QUEUED) {
+			if (position != compile->position)
+				break;
+
+			build_wait(compile->build, compile->offset, max);
+			continue;
+		}
+
+		start = compile->offset;
+		bread = build_read(compile->build, &start, buffer, max);
+
+		if (bread < 0)
+			break;
+
+		if (bread > 0) {
+			/* the output at our offset was already dropped */
+			if (start - bread > compile->offset) {
+				bread = snprintf(out_buf, max, compile->events ?
+				    "data: [%llu bytes of output dropped]\n\n" :
+				    "\n[%llu bytes of output dropped]\n",
+				    (unsigned long long) (start - bread - compile->offset));
+				compile->offset = start - bread;
+				return bread;
+			}
+
+			if (!compile->events) {
+				memcpy(out_buf, buffer, bread);
+				compile->offset += bread;
+				return bread;
+			}
+
+			if ((bread = _stream_events(compile, buffer, bread, state == BUILD_DONE, out_buf, max)) > 0)
+				return bread;
+		}
+
+		/* nothing new, or only part of a line */
+		build_wait(compile->build, start, max);
+	}
+
+	if (state == BUILD_QUEUED) {
+		compile->position = position;
+		return snprintf(out_buf, max, compile->events ?
+		    "event: queued\ndata: %u\n\n" :
+		    "Waiting for a build worker, position %u in queue.\n", position);
+	}
+
+	if (compile->finished)
+		return ULFIUS_STREAM_END;
+
+	if ((successor = build_follow(compile->build))) {
+		compile->build = successor;
+		compile->position = 0;
+		compile->offset = 0;
+		return snprintf(out_buf, max, compile->events ?
+		    "event: restart\ndata: %lu\n\n" :
+		    "\nThe sources changed, continuing with a newer build.\n", build_serial(successor));
+	}
+
+	compile->finished = TRUE;
+	status = build_result(compile->build, &cached);
 
-		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to read from child stdout.");
+	if (compile->events)
+		return snprintf(out_buf, max, "event: exit\ndata: {\"status\": %d, \"cached\": %s}\n\n",
+		    status, cached ? "true" : "false");
 
-		/* fall-through */
+	return snprintf(out_buf, max, "\nBuild finished with exit status %d%s.\n",
+	    status, cached ? " (cached)" : "");
+}
+
+/* _stream_events
+ *
+ * Function turns the complete lines of the 'length' bytes of output in
+ * 'data' into one event, as many as fit in 'max'. The rest is left for the
+ * next event, unless the build is 'done' or the line is too long to wait
+ * for its end.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the size of the event, or zero (0) if there is
+ * no complete line yet.
+ */
+ssize_t
+_stream_events(struct _compile *compile, const char *data, size_t length, int done, char *out_buf, size_t max)
+{
+	const char *line = data;
+	const char *eol;
+	size_t consumed = 0;
+	size_t written = 0;
+	size_t size;
+	char id[64];
+	int rc;
+
+	/* room for the id of the event, whatever its offset */
+	snprintf(id, sizeof(id), "id: %lu:%llu\n\n", build_serial(compile->build), ~0ULL);
+	max -= strlen(id);
+
+	while (consumed < length) {
+		eol = memchr(line, '\n', length - consumed);
+		if (eol) {
+			size = eol - line;
+		} else if (done || length - consumed >= COMPILE_LINE_MAX) {
+			size = length - consumed;
+		} else {
+			break;
+		}
+
+		if (written + sizeof("data: \n") - 1 + size > max) {
+			if (written > 0)
+				break;
 
-	case 0: return ULFIUS_STREAM_END;
+			/* cut the line; not even one fits */
+			size = max - written - (sizeof("data: \n") - 1);
+			eol = NULL;
+		}
+
+		consumed += size + (eol ? 1 : 0);
+
+		if (size > 0 && line[size - 1] == '\r')
+			--size;
+
+		memcpy(out_buf + written, "data: ", 6);
+		memcpy(out_buf + written + 6, line, size);
+		out_buf[written + 6 + size] = '\n';
+		written += 6 + size + 1;
+
+		line = data + consumed;
 	}
 
-	y_log_message(Y_LOG_LEVEL_DEBUG, "Read %ld bytes from child output.", bread);
+	if (consumed == 0)
+		return 0;
 
-	return bread;
+	compile->offset += consumed;
+
+	rc = snprintf(out_buf + written, strlen(id) + 1, "id: %lu:%llu\n\n",
+	    build_serial(compile->build), (unsigned long long) compile->offset);
+
+	return written + rc;
 }
 
 void
 _stream_log_free(void * stream_user_data)
 {
-	int *fd = stream_user_data;
-	close(fd[0]);
-	free(fd);
-}
+	struct _compile *compile = stream_user_data;
 
+	build_release(compile->build);
+	free(compile);
+}
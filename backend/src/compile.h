@@ -5,5 +5,6 @@ struct _u_request;
 struct _u_response;
 
 int compile_put_project(const struct _u_request *, struct _u_response *, void *);
+int compile_get_log(const struct _u_request *, struct _u_response *, void *);
 
 #endif
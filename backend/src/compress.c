@@ -0,0 +1,769 @@
+#include "compress.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ulfius.h>
+
+#include "common.h"
+#include "config.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define COMPRESS_BLOCK_SIZE (64 * 1024)
+
+/* gzip only knows levels 1 to 9 */
+#define COMPRESS_GZIP_LEVEL (COMPRESS_LEVEL < 1 ? 1 : COMPRESS_LEVEL > 9 ? 9 : COMPRESS_LEVEL)
+
+struct _compress
+{
+	enum compress_t type;
+	compress_source_t source;
+	void (*source_free)(void *);
+	void *source_data;
+	uint64_t source_offset;
+	int ended;
+	int finished;
+	char *in;
+	size_t in_length;
+	size_t in_offset;
+#ifdef HAVE_ZLIB
+	z_stream zlib;
+	int unflushed;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx *zstd;
+#endif
+};
+
+struct compress_decoder
+{
+	enum compress_t type;
+	compress_sink_t sink;
+	void *sink_data;
+	char *out;
+	int ended;
+#ifdef HAVE_ZLIB
+	z_stream zlib;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_DCtx *zstd;
+	size_t pending;
+#endif
+};
+
+static ssize_t _compress_stream(void *, uint64_t, char *, size_t);
+static void _compress_free(void *);
+static int _compress_step(struct _compress *, char *, size_t, size_t *, int);
+static double _compress_quality(const char *, const char *);
+
+/* compress_available
+ *
+ * Function checks whether support for the encoding 'type' was built in.
+ */
+int
+compress_available(enum compress_t type)
+{
+	switch (type) {
+	case COMPRESS_IDENTITY:
+		return TRUE;
+	case COMPRESS_GZIP:
+#ifdef HAVE_ZLIB
+		return TRUE;
+#else
+		return FALSE;
+#endif
+	case COMPRESS_ZSTD:
+#ifdef HAVE_ZSTD
+		return TRUE;
+#else
+		return FALSE;
+#endif
+	}
+
+	return FALSE;
+}
+
+/* compress_name
+ *
+ * Function returns the HTTP content-coding token of the encoding 'type'.
+ */
+const char *
+compress_name(enum compress_t type)
+{
+	switch (type) {
+	case COMPRESS_GZIP: return "gzip";
+	case COMPRESS_ZSTD: return "zstd";
+	default: break;
+	}
+
+	return "identity";
+}
+
+/* compress_negotiate
+ *
+ * Function picks the encoding for a response of 'length' bytes (negative if
+ * not known in advance) from the request's Accept-Encoding header, and
+ * marks the response as varying with it.
+ *
+ * Responses smaller than COMPRESS_MIN_SIZE are never worth encoding. Among
+ * the acceptable encodings the highest quality wins, zstd before gzip on a
+ * tie.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the negotiated encoding, COMPRESS_IDENTITY if
+ * there is nothing better.
+ */
+enum compress_t
+compress_negotiate(const struct _u_request *request, struct _u_response *response, ssize_t length)
+{
+	enum compress_t types[] = { COMPRESS_ZSTD, COMPRESS_GZIP };
+	enum compress_t best = COMPRESS_IDENTITY;
+	double best_quality = 0;
+	double any_quality;
+	double quality;
+	const char *accept;
+	size_t i;
+
+	if (!compress_available(COMPRESS_GZIP) && !compress_available(COMPRESS_ZSTD))
+		return COMPRESS_IDENTITY;
+
+	u_map_put(response->map_header, "Vary", "Accept-Encoding");
+
+	if (length >= 0 && length < COMPRESS_MIN_SIZE)
+		return COMPRESS_IDENTITY;
+
+	accept = u_map_get_case(request->map_header, "Accept-Encoding");
+	if (!accept)
+		return COMPRESS_IDENTITY;
+
+	any_quality = _compress_quality(accept, "*");
+
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+		if (!compress_available(types[i]))
+			continue;
+
+		quality = _compress_quality(accept, compress_name(types[i]));
+		if (quality < 0)
+			quality = any_quality;
+
+		if (quality > best_quality) {
+			best_quality = quality;
+			best = types[i];
+		}
+	}
+
+	return best;
+}
+
+/* compress_header
+ *
+ * Function labels the response body as encoded with 'type'.
+ */
+void
+compress_header(struct _u_response *response, enum compress_t type)
+{
+	if (type != COMPRESS_IDENTITY)
+		u_map_put(response->map_header, "Content-Encoding", compress_name(type));
+}
+
+/* compress_etag
+ *
+ * Function turns the entity tag 'etag' of a plain representation into the
+ * one of its 'type' encoded variant, which must differ as the bytes do.
+ */
+void
+compress_etag(char *etag, size_t size, enum compress_t type)
+{
+	const char *name = compress_name(type);
+	size_t length = strlen(etag);
+
+	if (type == COMPRESS_IDENTITY || length < 2 || etag[length - 1] != '"' ||
+	    length + strlen(name) + 1 >= size)
+		return;
+
+	snprintf(etag + length - 1, size - length + 1, "-%s\"", name);
+}
+
+/* compress_stream_response
+ *
+ * Sets up a stream response that encodes the output of 'source' on the fly,
+ * one block at a time, so neither the plain nor the encoded body is ever held
+ * in memory as a whole.
+ *
+ * 'source' follows the ulfius stream callback contract, and 'source_free' is
+ * called with 'source_data' once the response is done, even if the call
+ * fails. Whether the encoding is labelled as Content-Encoding is up to the
+ * caller, see compress_header.
+ */
+int
+compress_stream_response(struct _u_response *response, unsigned int status, enum compress_t type,
+    compress_source_t source, void (*source_free)(void *), void *source_data)
+{
+	struct _compress *compress;
+
+	if (type == COMPRESS_IDENTITY)
+		return ulfius_set_stream_response(response, status, source,
+		    source_free, -1, COMPRESS_BLOCK_SIZE, source_data);
+
+	compress = calloc(1, sizeof(*compress));
+	if (!compress) {
+		source_free(source_data);
+		return U_ERROR_MEMORY;
+	}
+
+	compress->type = type;
+	compress->source = source;
+	compress->source_free = source_free;
+	compress->source_data = source_data;
+
+	if (!(compress->in = malloc(COMPRESS_BLOCK_SIZE)))
+		goto error;
+
+	switch (type) {
+	case COMPRESS_GZIP:
+#ifdef HAVE_ZLIB
+		if (deflateInit2(&compress->zlib, COMPRESS_GZIP_LEVEL, Z_DEFLATED,
+		    MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			goto error;
+		break;
+#endif
+		/* fall-through */
+
+	case COMPRESS_ZSTD:
+#ifdef HAVE_ZSTD
+		if (!(compress->zstd = ZSTD_createCCtx()))
+			goto error;
+
+		ZSTD_CCtx_setParameter(compress->zstd, ZSTD_c_compressionLevel, COMPRESS_LEVEL);
+		break;
+#endif
+		/* fall-through */
+
+	default:
+		y_log_message(Y_LOG_LEVEL_ERROR, "Unsupported response encoding requested.");
+		goto error;
+	}
+
+	return ulfius_set_stream_response(response, status, _compress_stream,
+	    _compress_free, -1, COMPRESS_BLOCK_SIZE, compress);
+
+error:
+	_compress_free(compress);
+	return U_ERROR_MEMORY;
+}
+
+/* compress_buffer
+ *
+ * Function encodes 'length' bytes of 'data' with 'type' in one go, storing
+ * a newly allocated buffer in 'out' that the caller has to free.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, ENOTSUP if the encoding is
+ * not supported, or any other errno value on failure.
+ */
+int
+compress_buffer(enum compress_t type, const void *data, size_t length, char **out, size_t *out_length)
+{
+#ifdef HAVE_ZLIB
+	z_stream zlib;
+#endif
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+	size_t bound;
+	int rc = 0;
+#endif
+
+	*out = NULL;
+
+	switch (type) {
+	case COMPRESS_GZIP:
+#ifdef HAVE_ZLIB
+		memset(&zlib, 0, sizeof(zlib));
+
+		if (deflateInit2(&zlib, COMPRESS_GZIP_LEVEL, Z_DEFLATED,
+		    MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			return ENOMEM;
+
+		bound = deflateBound(&zlib, length);
+		if (!(*out = malloc(bound))) {
+			deflateEnd(&zlib);
+			return ENOMEM;
+		}
+
+		zlib.next_in = (Bytef *) data;
+		zlib.avail_in = length;
+		zlib.next_out = (Bytef *) *out;
+		zlib.avail_out = bound;
+
+		if (deflate(&zlib, Z_FINISH) != Z_STREAM_END)
+			rc = EIO;
+
+		*out_length = zlib.total_out;
+		deflateEnd(&zlib);
+		break;
+#else
+		return ENOTSUP;
+#endif
+
+	case COMPRESS_ZSTD:
+#ifdef HAVE_ZSTD
+		bound = ZSTD_compressBound(length);
+		if (!(*out = malloc(bound)))
+			return ENOMEM;
+
+		*out_length = ZSTD_compress(*out, bound, data, length, COMPRESS_LEVEL);
+		if (ZSTD_isError(*out_length)) {
+			y_log_message(Y_LOG_LEVEL_ERROR, "zstd: %s", ZSTD_getErrorName(*out_length));
+			rc = EIO;
+		}
+		break;
+#else
+		return ENOTSUP;
+#endif
+
+	default:
+		return ENOTSUP;
+	}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+	if (rc != 0) {
+		free(*out);
+		*out = NULL;
+	}
+
+	return rc;
+#endif
+}
+
+/* compress_decode
+ *
+ * Function decodes 'length' bytes of 'type' encoded 'data', passing the
+ * plain output to 'sink' block by block.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, EINVAL if the data is not
+ * valid, ENOTSUP if the encoding is not supported, or the first non-zero
+ * value returned by 'sink'.
+ */
+int
+compress_decode(enum compress_t type, const void *data, size_t length, compress_sink_t sink, void *sink_data)
+{
+	struct compress_decoder *decoder;
+
+	if (!(decoder = compress_decoder_open(type, sink, sink_data)))
+		return errno;
+
+	return compress_decoder_close(decoder, compress_decoder_feed(decoder, data, length));
+}
+
+/* compress_decoder_open
+ *
+ * Function starts decoding a stream of 'type' encoded data that arrives in
+ * pieces, fed with compress_decoder_feed. The plain output is passed to
+ * 'sink' block by block as soon as it is available.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the decoder, or NULL with errno set to ENOTSUP
+ * if the encoding is not supported or ENOMEM if out of memory.
+ */
+struct compress_decoder *
+compress_decoder_open(enum compress_t type, compress_sink_t sink, void *sink_data)
+{
+	struct compress_decoder *decoder;
+
+	if (!compress_available(type)) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+
+	if (!(decoder = calloc(1, sizeof(*decoder))))
+		return NULL;
+
+	decoder->type = type;
+	decoder->sink = sink;
+	decoder->sink_data = sink_data;
+
+	if (type == COMPRESS_IDENTITY)
+		return decoder;
+
+	if (!(decoder->out = malloc(COMPRESS_BLOCK_SIZE)))
+		goto error;
+
+	switch (type) {
+	case COMPRESS_GZIP:
+#ifdef HAVE_ZLIB
+		/* accept both gzip and zlib framing */
+		if (inflateInit2(&decoder->zlib, MAX_WBITS + 32) != Z_OK)
+			goto error;
+#endif
+		break;
+
+	case COMPRESS_ZSTD:
+#ifdef HAVE_ZSTD
+		if (!(decoder->zstd = ZSTD_createDCtx()))
+			goto error;
+#endif
+		break;
+
+	default:
+		break;
+	}
+
+	return decoder;
+
+error:
+	free(decoder->out);
+	free(decoder);
+	errno = ENOMEM;
+	return NULL;
+}
+
+/* compress_decoder_feed
+ *
+ * Function decodes the next 'length' bytes of the stream. Data following
+ * the end of a compressed stream is ignored.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, EINVAL if the data is not
+ * valid, or the first non-zero value returned by the sink.
+ */
+int
+compress_decoder_feed(struct compress_decoder *decoder, const void *data, size_t length)
+{
+#ifdef HAVE_ZLIB
+	int zstatus;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_inBuffer in = { data, length, 0 };
+	ZSTD_outBuffer out;
+#endif
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+	int rc;
+#endif
+
+	switch (decoder->type) {
+	case COMPRESS_IDENTITY:
+		return length > 0 ? decoder->sink(decoder->sink_data, data, length) : 0;
+
+	case COMPRESS_GZIP:
+#ifdef HAVE_ZLIB
+		decoder->zlib.next_in = (Bytef *) data;
+		decoder->zlib.avail_in = length;
+
+		/* go on while there is input left or the output didn't fit */
+		while (!decoder->ended) {
+			decoder->zlib.next_out = (Bytef *) decoder->out;
+			decoder->zlib.avail_out = COMPRESS_BLOCK_SIZE;
+
+			zstatus = inflate(&decoder->zlib, Z_NO_FLUSH);
+			if (zstatus == Z_STREAM_END) {
+				decoder->ended = TRUE;
+			} else if (zstatus != Z_OK && zstatus != Z_BUF_ERROR) {
+				y_log_message(Y_LOG_LEVEL_DEBUG, "zlib: %s", decoder->zlib.msg ? decoder->zlib.msg : "invalid stream");
+				return EINVAL;
+			}
+
+			if (decoder->zlib.avail_out < COMPRESS_BLOCK_SIZE &&
+			    (rc = decoder->sink(decoder->sink_data, decoder->out,
+			                        COMPRESS_BLOCK_SIZE - decoder->zlib.avail_out)) != 0)
+				return rc;
+
+			if (decoder->zlib.avail_in == 0 && decoder->zlib.avail_out > 0)
+				break;
+		}
+#endif
+		return 0;
+
+	case COMPRESS_ZSTD:
+#ifdef HAVE_ZSTD
+		do {
+			out.dst = decoder->out;
+			out.size = COMPRESS_BLOCK_SIZE;
+			out.pos = 0;
+
+			decoder->pending = ZSTD_decompressStream(decoder->zstd, &out, &in);
+			if (ZSTD_isError(decoder->pending)) {
+				y_log_message(Y_LOG_LEVEL_DEBUG, "zstd: %s", ZSTD_getErrorName(decoder->pending));
+				return EINVAL;
+			}
+
+			if (out.pos > 0 && (rc = decoder->sink(decoder->sink_data, decoder->out, out.pos)) != 0)
+				return rc;
+		} while (in.pos < in.size || out.pos == out.size);
+#endif
+		return 0;
+	}
+
+	return ENOTSUP;
+}
+
+/* compress_decoder_close
+ *
+ * Function releases the decoder. 'rc' is the outcome of feeding it so far;
+ * if that was a success, the stream must also have been complete.
+ *
+ * RETURN VALUES
+ *
+ * The function will return 'rc', or EINVAL if the stream was truncated.
+ */
+int
+compress_decoder_close(struct compress_decoder *decoder, int rc)
+{
+	switch (decoder->type) {
+	case COMPRESS_GZIP:
+#ifdef HAVE_ZLIB
+		if (rc == 0 && !decoder->ended) {
+			y_log_message(Y_LOG_LEVEL_DEBUG, "zlib: truncated stream");
+			rc = EINVAL;
+		}
+
+		inflateEnd(&decoder->zlib);
+#endif
+		break;
+
+	case COMPRESS_ZSTD:
+#ifdef HAVE_ZSTD
+		if (rc == 0 && decoder->pending != 0) {
+			y_log_message(Y_LOG_LEVEL_DEBUG, "zstd: truncated frame");
+			rc = EINVAL;
+		}
+
+		ZSTD_freeDCtx(decoder->zstd);
+#endif
+		break;
+
+	default:
+		break;
+	}
+
+	free(decoder->out);
+	free(decoder);
+
+	return rc;
+}
+
+/*****************************************************************************/
+
+ssize_t
+_compress_stream(void *stream_user_data, uint64_t offset, char *out_buf, size_t max)
+{
+	struct _compress *compress = stream_user_data;
+	size_t produced = 0;
+	ssize_t bread;
+	int idle;
+
+	UNUSED(offset);
+
+	while (produced == 0 && !compress->finished) {
+		idle = FALSE;
+
+		if (compress->in_offset == compress->in_length && !compress->ended) {
+			bread = compress->source(compress->source_data,
+			    compress->source_offset, compress->in, COMPRESS_BLOCK_SIZE);
+
+			if (bread == ULFIUS_STREAM_END)
+				compress->ended = TRUE;
+			else if (bread < 0)
+				return ULFIUS_STREAM_ERROR;
+			else if (bread == 0)
+				idle = TRUE;
+
+			if (bread > 0) {
+				compress->in_length = bread;
+				compress->in_offset = 0;
+				compress->source_offset += bread;
+			}
+		}
+
+		/* source has nothing right now, push out what the encoder holds */
+		if (_compress_step(compress, out_buf, max, &produced, idle) != 0)
+			return ULFIUS_STREAM_ERROR;
+
+		if (idle)
+			break;
+	}
+
+	if (produced > 0)
+		return produced;
+
+	return compress->finished ? ULFIUS_STREAM_END : 0;
+}
+
+void
+_compress_free(void *stream_user_data)
+{
+	struct _compress *compress = stream_user_data;
+
+#ifdef HAVE_ZLIB
+	if (compress->type == COMPRESS_GZIP)
+		deflateEnd(&compress->zlib);
+#endif
+
+#ifdef HAVE_ZSTD
+	if (compress->zstd)
+		ZSTD_freeCCtx(compress->zstd);
+#endif
+
+	if (compress->source_free)
+		compress->source_free(compress->source_data);
+
+	free(compress->in);
+	free(compress);
+}
+
+/* _compress_step
+ *
+ * Function feeds pending input to the encoder and stores up to 'max' bytes
+ * of encoded output in 'out', adding their number to 'produced'. Once the
+ * source has ended the encoder is finalized; if 'flush' is set, buffered
+ * output is flushed instead.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success and -1 on failure.
+ */
+int
+_compress_step(struct _compress *compress, char *out, size_t max, size_t *produced, int flush)
+{
+#ifdef HAVE_ZLIB
+	int zstatus;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_inBuffer zin;
+	ZSTD_outBuffer zout;
+	ZSTD_EndDirective directive;
+	size_t remaining;
+#endif
+
+	switch (compress->type) {
+	case COMPRESS_GZIP:
+#ifdef HAVE_ZLIB
+		compress->zlib.next_in = (Bytef *) compress->in + compress->in_offset;
+		compress->zlib.avail_in = compress->in_length - compress->in_offset;
+		compress->zlib.next_out = (Bytef *) out + *produced;
+		compress->zlib.avail_out = max - *produced;
+
+		if (compress->zlib.avail_in > 0)
+			compress->unflushed = TRUE;
+
+		/* every flush emits a marker block, skip them when idle */
+		zstatus = deflate(&compress->zlib, compress->ended ? Z_FINISH :
+		    flush && compress->unflushed ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+		if (zstatus == Z_STREAM_ERROR) {
+			y_log_message(Y_LOG_LEVEL_ERROR, "zlib: deflate failed");
+			return -1;
+		}
+
+		if (flush && compress->zlib.avail_out > 0)
+			compress->unflushed = FALSE;
+
+		compress->in_offset = compress->in_length - compress->zlib.avail_in;
+		*produced = max - compress->zlib.avail_out;
+
+		if (compress->ended && zstatus == Z_STREAM_END)
+			compress->finished = TRUE;
+
+		return 0;
+#else
+		break;
+#endif
+
+	case COMPRESS_ZSTD:
+#ifdef HAVE_ZSTD
+		zin.src = compress->in + compress->in_offset;
+		zin.size = compress->in_length - compress->in_offset;
+		zin.pos = 0;
+
+		zout.dst = out + *produced;
+		zout.size = max - *produced;
+		zout.pos = 0;
+
+		directive = compress->ended ? ZSTD_e_end : flush ? ZSTD_e_flush : ZSTD_e_continue;
+
+		remaining = ZSTD_compressStream2(compress->zstd, &zout, &zin, directive);
+		if (ZSTD_isError(remaining)) {
+			y_log_message(Y_LOG_LEVEL_ERROR, "zstd: %s", ZSTD_getErrorName(remaining));
+			return -1;
+		}
+
+		compress->in_offset += zin.pos;
+		*produced += zout.pos;
+
+		if (compress->ended && remaining == 0)
+			compress->finished = TRUE;
+
+		return 0;
+#else
+		break;
+#endif
+
+	default:
+		break;
+	}
+
+	return -1;
+}
+
+/* _compress_quality
+ *
+ * Function looks up 'coding' in the Accept-Encoding header value 'accept'.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the quality value of the coding, 1 if none was
+ * given, or -1 if the coding is not listed.
+ */
+double
+_compress_quality(const char *accept, const char *coding)
+{
+	size_t length = strlen(coding);
+	const char *cursor = accept;
+	double quality;
+	char *end;
+
+	while (*cursor) {
+		while (*cursor == ' ' || *cursor == '\t' || *cursor == ',')
+			++cursor;
+
+		if (strncasecmp(cursor, coding, length) != 0 ||
+		    !strchr(" \t;,", cursor[length])) {
+			while (*cursor && *cursor != ',')
+				++cursor;
+			continue;
+		}
+
+		quality = 1;
+		cursor += length;
+
+		while (*cursor && *cursor != ',') {
+			if (*cursor++ != ';')
+				continue;
+
+			while (*cursor == ' ' || *cursor == '\t')
+				++cursor;
+
+			if (strncasecmp(cursor, "q=", 2) == 0) {
+				quality = strtod(cursor + 2, &end);
+				if (end == cursor + 2)
+					quality = 0;
+			}
+		}
+
+		return quality;
+	}
+
+	return -1;
+}
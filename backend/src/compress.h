@@ -0,0 +1,37 @@
+#ifndef CREDENTARIUS_COMPRESS_H
+#define CREDENTARIUS_COMPRESS_H 1
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct _u_request;
+struct _u_response;
+struct compress_decoder;
+
+enum compress_t
+{
+	COMPRESS_IDENTITY,
+	COMPRESS_GZIP,
+	COMPRESS_ZSTD
+};
+
+typedef ssize_t (*compress_source_t)(void *, uint64_t, char *, size_t);
+typedef int (*compress_sink_t)(void *, const char *, size_t);
+
+int compress_available(enum compress_t);
+const char *compress_name(enum compress_t);
+
+enum compress_t compress_negotiate(const struct _u_request *, struct _u_response *, ssize_t);
+void compress_header(struct _u_response *, enum compress_t);
+void compress_etag(char *, size_t, enum compress_t);
+
+int compress_stream_response(struct _u_response *, unsigned int, enum compress_t,
+    compress_source_t, void (*)(void *), void *);
+int compress_buffer(enum compress_t, const void *, size_t, char **, size_t *);
+int compress_decode(enum compress_t, const void *, size_t, compress_sink_t, void *);
+
+struct compress_decoder *compress_decoder_open(enum compress_t, compress_sink_t, void *);
+int compress_decoder_feed(struct compress_decoder *, const void *, size_t);
+int compress_decoder_close(struct compress_decoder *, int);
+
+#endif
@@ -0,0 +1,443 @@
+#include "durable.h"
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <jansson.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <ulfius.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "config.h"
+
+/* a commit window closes early once this many syncs are waiting */
+#define DURABLE_BATCH_MAX 64
+
+struct _durable_mode
+{
+	const char *name;
+	int (*sync)(int, enum durable_t);
+};
+
+struct _durable_waiter
+{
+	int fd;
+	enum durable_t type;
+	int rc;
+	int done;
+	struct stat st;
+	struct timespec queued;
+	struct _durable_waiter *next;
+};
+
+static int _durable_off(int, enum durable_t);
+static int _durable_direct(int, enum durable_t);
+static int _durable_group(int, enum durable_t);
+static void *_durable_commit(void *);
+static void _durable_flush(struct _durable_waiter *);
+static void _durable_account(unsigned long, unsigned long long, unsigned long long);
+static unsigned long long _durable_elapsed(const struct timespec *);
+static int _durable_one(int, enum durable_t);
+
+static const struct _durable_mode _durable_modes[] = {
+	{ "off", _durable_off },
+	{ "sync", _durable_direct },
+	{ "group", _durable_group }
+};
+
+static struct
+{
+	const struct _durable_mode *mode;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t done;
+	pthread_t thread;
+	int running;
+	struct _durable_waiter *queue;
+	struct _durable_waiter **tail;
+	unsigned long queued;
+
+	unsigned long batches;
+	unsigned long requests;
+	unsigned long batch_max;
+	unsigned long errors;
+	unsigned long long wait_ns;
+	unsigned long long wait_max_ns;
+	unsigned long long sync_ns;
+	unsigned long long sync_max_ns;
+} _durable = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+	.tail = &_durable.queue
+};
+
+/* durable_init
+ *
+ * Function selects the DURABILITY mode used to make writes survive a crash:
+ *
+ *   off   - leave it to the kernel, nothing is synced
+ *   sync  - every write is synced on its own
+ *   group - concurrent writes are synced together by a commit thread, which
+ *           collects them for up to DURABLE_WINDOW microseconds first
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success and -1 on failure.
+ */
+int
+durable_init(void)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(_durable_modes) / sizeof(_durable_modes[0]); ++i)
+		if (strcmp(_durable_modes[i].name, DURABILITY) == 0)
+			_durable.mode = &_durable_modes[i];
+
+	if (!_durable.mode) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Unknown durability mode: %s", DURABILITY);
+		return -1;
+	}
+
+	if (_durable.mode->sync != _durable_group)
+		return 0;
+
+	_durable.running = TRUE;
+
+	if (pthread_create(&_durable.thread, NULL, _durable_commit, NULL) != 0) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to start durable commit thread.");
+		_durable.running = FALSE;
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+durable_fini(void)
+{
+	if (!_durable.running)
+		return;
+
+	pthread_mutex_lock(&_durable.lock);
+	_durable.running = FALSE;
+	pthread_cond_signal(&_durable.cond);
+	pthread_mutex_unlock(&_durable.lock);
+
+	pthread_join(_durable.thread, NULL);
+}
+
+/* durable_sync
+ *
+ * Function makes the content ('DURABLE_DATA') or the entries
+ * ('DURABLE_DIRECTORY') of the file open as 'fd' durable, as far as the
+ * durability mode asks for it. The caller blocks until it is done.
+ *
+ * 'DURABLE_FILESYSTEM' makes everything on the file system of 'fd' durable
+ * at once, for writers that staged many files without syncing each.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+durable_sync(int fd, enum durable_t type)
+{
+	return _durable.mode ? _durable.mode->sync(fd, type) : 0;
+}
+
+/* durable_parent
+ *
+ * Function makes the entry of 'path' in its parent directory durable, for
+ * files and directories that were created or renamed without going through
+ * the atomic file functions.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+durable_parent(const char *path)
+{
+	char parent[PATH_MAX];
+	char *slash;
+	int fd;
+	int rc;
+
+	if (!_durable.mode || _durable.mode->sync == _durable_off)
+		return 0;
+
+	rc = snprintf(parent, sizeof(parent), "%s", path);
+	if (rc <= 0 || (size_t) rc >= sizeof(parent))
+		return ENAMETOOLONG;
+
+	slash = strrchr(parent, '/');
+	if (!slash)
+		strcpy(parent, ".");
+	else if (slash == parent)
+		slash[1] = '\0';
+	else
+		*slash = '\0';
+
+	fd = open(parent, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd == -1)
+		return errno;
+
+	rc = durable_sync(fd, DURABLE_DIRECTORY);
+	close(fd);
+
+	return rc;
+}
+
+void
+durable_stats(struct json_t *root)
+{
+	json_t *stats;
+
+	stats = json_object();
+	if (!stats)
+		return;
+
+	pthread_mutex_lock(&_durable.lock);
+	json_object_set_new(stats, "mode", json_string(_durable.mode ? _durable.mode->name : "off"));
+	json_object_set_new(stats, "batches", json_integer(_durable.batches));
+	json_object_set_new(stats, "requests", json_integer(_durable.requests));
+	json_object_set_new(stats, "errors", json_integer(_durable.errors));
+	json_object_set_new(stats, "batch_max", json_integer(_durable.batch_max));
+	json_object_set_new(stats, "batch_avg", json_real(_durable.batches ?
+	    (double) _durable.requests / _durable.batches : 0.0));
+	json_object_set_new(stats, "wait_avg_us", json_integer(_durable.requests ?
+	    _durable.wait_ns / _durable.requests / 1000 : 0));
+	json_object_set_new(stats, "wait_max_us", json_integer(_durable.wait_max_ns / 1000));
+	json_object_set_new(stats, "sync_avg_us", json_integer(_durable.batches ?
+	    _durable.sync_ns / _durable.batches / 1000 : 0));
+	json_object_set_new(stats, "sync_max_us", json_integer(_durable.sync_max_ns / 1000));
+	pthread_mutex_unlock(&_durable.lock);
+
+	json_object_set_new(root, "durability", stats);
+}
+
+/*****************************************************************************/
+
+int
+_durable_off(int fd, enum durable_t type)
+{
+	UNUSED(fd);
+	UNUSED(type);
+
+	return 0;
+}
+
+int
+_durable_direct(int fd, enum durable_t type)
+{
+	struct timespec start;
+	unsigned long long elapsed;
+	int rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	rc = _durable_one(fd, type) == -1 ? errno : 0;
+
+	elapsed = _durable_elapsed(&start);
+
+	pthread_mutex_lock(&_durable.lock);
+	_durable_account(1, elapsed, elapsed);
+	_durable.errors += rc != 0;
+	pthread_mutex_unlock(&_durable.lock);
+
+	return rc;
+}
+
+/* _durable_group
+ *
+ * Function queues the sync for the commit thread and waits for the batch
+ * it ends up in to be flushed. Once the commit thread is gone, syncs are
+ * done directly.
+ */
+int
+_durable_group(int fd, enum durable_t type)
+{
+	struct _durable_waiter waiter;
+
+	memset(&waiter, 0, sizeof(waiter));
+	waiter.fd = fd;
+	waiter.type = type;
+	clock_gettime(CLOCK_MONOTONIC, &waiter.queued);
+
+	pthread_mutex_lock(&_durable.lock);
+
+	if (!_durable.running) {
+		pthread_mutex_unlock(&_durable.lock);
+		return _durable_direct(fd, type);
+	}
+
+	*_durable.tail = &waiter;
+	_durable.tail = &waiter.next;
+
+	/* wake the commit thread to open a window, or to close it early */
+	if (++_durable.queued == 1 || _durable.queued >= DURABLE_BATCH_MAX)
+		pthread_cond_signal(&_durable.cond);
+
+	while (!waiter.done)
+		pthread_cond_wait(&_durable.done, &_durable.lock);
+
+	pthread_mutex_unlock(&_durable.lock);
+
+	return waiter.rc;
+}
+
+void *
+_durable_commit(void *user_data)
+{
+	struct _durable_waiter *batch;
+	struct _durable_waiter *waiter;
+	struct _durable_waiter *next;
+	struct timespec deadline;
+	struct timespec start;
+	unsigned long long wait;
+	unsigned long long elapsed;
+	unsigned long count;
+
+	UNUSED(user_data);
+
+	pthread_mutex_lock(&_durable.lock);
+
+	for (;;) {
+		while (!_durable.queue && _durable.running)
+			pthread_cond_wait(&_durable.cond, &_durable.lock);
+
+		if (!_durable.queue)
+			break;
+
+		/* let other writers join the batch for the rest of the window */
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += DURABLE_WINDOW * 1000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+
+		while (_durable.running && _durable.queued < DURABLE_BATCH_MAX &&
+		    pthread_cond_timedwait(&_durable.cond, &_durable.lock, &deadline) != ETIMEDOUT)
+			;
+
+		batch = _durable.queue;
+		count = _durable.queued;
+		_durable.queue = NULL;
+		_durable.tail = &_durable.queue;
+		_durable.queued = 0;
+
+		pthread_mutex_unlock(&_durable.lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		_durable_flush(batch);
+		elapsed = _durable_elapsed(&start);
+
+		pthread_mutex_lock(&_durable.lock);
+
+		wait = 0;
+		for (waiter = batch; waiter; waiter = next) {
+			/* the waiter's stack frame is gone once it sees 'done' */
+			next = waiter->next;
+			wait = _durable_elapsed(&waiter->queued);
+			_durable.wait_ns += wait;
+			if (wait > _durable.wait_max_ns)
+				_durable.wait_max_ns = wait;
+			_durable.errors += waiter->rc != 0;
+			waiter->done = TRUE;
+		}
+
+		_durable_account(count, elapsed, 0);
+		pthread_cond_broadcast(&_durable.done);
+	}
+
+	pthread_mutex_unlock(&_durable.lock);
+
+	return NULL;
+}
+
+/* _durable_flush
+ *
+ * Function syncs every file of the batch. Directories show up once per
+ * write that changed them, and file systems once per staging writer; each
+ * is only synced once.
+ */
+void
+_durable_flush(struct _durable_waiter *batch)
+{
+	struct _durable_waiter *waiter;
+	struct _durable_waiter *other;
+
+	for (waiter = batch; waiter; waiter = waiter->next) {
+		if (waiter->type == DURABLE_DATA) {
+			waiter->rc = fdatasync(waiter->fd) == -1 ? errno : 0;
+			continue;
+		}
+
+		if (fstat(waiter->fd, &waiter->st) == -1) {
+			waiter->rc = errno;
+			continue;
+		}
+
+		for (other = batch; other != waiter; other = other->next)
+			if (other->type == waiter->type &&
+			    other->st.st_dev == waiter->st.st_dev &&
+			    (other->type == DURABLE_FILESYSTEM || other->st.st_ino == waiter->st.st_ino))
+				break;
+
+		if (other != waiter)
+			waiter->rc = other->rc;
+		else
+			waiter->rc = _durable_one(waiter->fd, waiter->type) == -1 ? errno : 0;
+	}
+}
+
+/* _durable_account
+ *
+ * Function records a flushed batch of 'count' syncs. Must be called with
+ * the lock held.
+ */
+void
+_durable_account(unsigned long count, unsigned long long sync, unsigned long long wait)
+{
+	++_durable.batches;
+	_durable.requests += count;
+	if (count > _durable.batch_max)
+		_durable.batch_max = count;
+
+	_durable.sync_ns += sync;
+	if (sync > _durable.sync_max_ns)
+		_durable.sync_max_ns = sync;
+
+	_durable.wait_ns += wait;
+	if (wait > _durable.wait_max_ns)
+		_durable.wait_max_ns = wait;
+}
+
+unsigned long long
+_durable_elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000000000ULL + now.tv_nsec - start->tv_nsec;
+}
+
+int
+_durable_one(int fd, enum durable_t type)
+{
+	switch (type) {
+	case DURABLE_DATA:
+		return fdatasync(fd);
+	case DURABLE_DIRECTORY:
+		return fsync(fd);
+	default:
+		return syncfs(fd);
+	}
+}
@@ -0,0 +1,21 @@
+#ifndef CREDENTARIUS_DURABLE_H
+#define CREDENTARIUS_DURABLE_H 1
+
+struct json_t;
+
+enum durable_t
+{
+	DURABLE_DATA,      /* file content, fdatasync */
+	DURABLE_DIRECTORY, /* directory entries, fsync */
+	DURABLE_FILESYSTEM /* everything on the file system, syncfs */
+};
+
+int durable_init(void);
+void durable_fini(void);
+
+int durable_sync(int, enum durable_t);
+int durable_parent(const char *);
+
+void durable_stats(struct json_t *);
+
+#endif
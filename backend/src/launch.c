@@ -0,0 +1,607 @@
+#include "launch.h"
+
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <jansson.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ulfius.h>
+#include <unistd.h>
+
+#include "common.h"
+
+#define LAUNCH_MAKE "/usr/bin/make"
+#define LAUNCH_SELF "/proc/self/exe"
+#define LAUNCH_ARGS_MAX 8
+#define LAUNCH_TARGET_MAX 64
+
+/* where the helper finds its end of the socket */
+#define LAUNCH_SOCKET_FD 3
+
+struct _launch_request
+{
+	char path[PATH_MAX];
+	char targets[LAUNCH_ARGS_MAX][LAUNCH_TARGET_MAX];
+};
+
+struct _launch_reply
+{
+	int error;
+	pid_t pid;
+};
+
+/* a child of the helper, and where its exit status goes */
+struct _launch_child
+{
+	pid_t pid;
+	int status;
+	struct _launch_child *next;
+};
+
+static int _launch_start(void);
+static void _launch_stop(void);
+static int _launch_request(const struct _launch_request *, struct launch *);
+static int _launch_serve(int, struct _launch_child **);
+static void _launch_reap(struct _launch_child **);
+static int _launch_spawn(const char *, const char *const *, pid_t *, int *);
+
+extern char **environ;
+
+static struct
+{
+	pthread_mutex_t lock;
+	int socket;
+	pid_t helper;
+	unsigned long launched;
+	unsigned long failed;
+	unsigned long restarts;
+} _launch = { .lock = PTHREAD_MUTEX_INITIALIZER, .socket = -1 };
+
+/* launch_init
+ *
+ * Function starts the build helper, a small process running this same
+ * executable with LAUNCH_HELPER. The helper starts and reaps every make run
+ * on behalf of the server, so that neither the memory, the threads nor the
+ * file descriptors of the server are involved, and a build gone wrong only
+ * ever takes the helper down. The server restarts it when needed.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success and -1 on failure.
+ */
+int
+launch_init(void)
+{
+	int rc;
+
+	pthread_mutex_lock(&_launch.lock);
+	rc = _launch_start();
+	pthread_mutex_unlock(&_launch.lock);
+
+	if (rc != 0) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to start build helper: %s", strerror(rc));
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+launch_fini(void)
+{
+	pthread_mutex_lock(&_launch.lock);
+	_launch_stop();
+	pthread_mutex_unlock(&_launch.lock);
+}
+
+/* launch_helper
+ *
+ * Function is the main loop of the build helper. It serves requests coming
+ * in on LAUNCH_SOCKET_FD until the server goes away, then stops whatever is
+ * still running.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the exit code of the helper.
+ */
+int
+launch_helper(void)
+{
+	struct _launch_child *children = NULL;
+	struct _launch_child *child;
+	struct pollfd pfd[2];
+	sigset_t signals;
+
+	y_init_logs("credentarius-launch", Y_LOG_MODE_CONSOLE, Y_LOG_LEVEL_DEBUG, NULL, "Starting build helper");
+
+	/* the server decides when it's time to go */
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGINT, SIG_IGN);
+	signal(SIGQUIT, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &signals, NULL);
+
+	/* dup2 cleared close-on-exec; builds must not hold on to the socket,
+	 * both to keep Makefiles from talking to the helper and for the server
+	 * to notice when the helper is gone */
+	if (fcntl(LAUNCH_SOCKET_FD, F_SETFD, FD_CLOEXEC) == -1) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to protect the build helper socket.");
+		y_close_logs();
+		return EXIT_FAILURE;
+	}
+
+	pfd[0].fd = LAUNCH_SOCKET_FD;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = signalfd(-1, &signals, SFD_CLOEXEC);
+	pfd[1].events = POLLIN;
+
+	if (pfd[1].fd == -1) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to watch for exiting builds.");
+		y_close_logs();
+		return EXIT_FAILURE;
+	}
+
+	for (;;) {
+		if (poll(pfd, 2, -1) == -1) {
+			if (EINTR == errno)
+				continue;
+			break;
+		}
+
+		if (pfd[1].revents) {
+			struct signalfd_siginfo info;
+
+			while (read(pfd[1].fd, &info, sizeof(info)) == -1 && EINTR == errno);
+			_launch_reap(&children);
+		}
+
+		if (pfd[0].revents && _launch_serve(pfd[0].fd, &children) != 0)
+			break;
+	}
+
+	for (child = children; child; child = child->next)
+		kill(-child->pid, SIGTERM);
+
+	while (children) {
+		siginfo_t info;
+
+		/* leave the reaping to _launch_reap */
+		if (waitid(P_ALL, 0, &info, WEXITED|WNOWAIT) == -1 && EINTR != errno)
+			break;
+
+		_launch_reap(&children);
+	}
+
+	y_close_logs();
+
+	return EXIT_SUCCESS;
+}
+
+/* launch_make
+ *
+ * Function has the helper run make with the NULL-terminated list of
+ * 'targets' in the project directory 'path'. The child gets a process group
+ * of its own, so that all of it can be killed at once, and its standard
+ * output and error go to a pipe whose read end is returned in 'launch'.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure,
+ * including failure to execute make. The exit status must be collected
+ * with launch_wait.
+ */
+int
+launch_make(const char *path, const char *const *targets, struct launch *launch)
+{
+	struct _launch_request request;
+	size_t i;
+	int rc;
+
+	memset(&request, 0, sizeof(request));
+
+	rc = snprintf(request.path, sizeof(request.path), "%s", path);
+	if (rc <= 0 || (size_t) rc >= sizeof(request.path))
+		return ENAMETOOLONG;
+
+	for (i = 0; targets[i]; ++i) {
+		if (i == LAUNCH_ARGS_MAX || strlen(targets[i]) >= LAUNCH_TARGET_MAX)
+			return E2BIG;
+
+		strcpy(request.targets[i], targets[i]);
+	}
+
+	pthread_mutex_lock(&_launch.lock);
+
+	rc = _launch_request(&request, launch);
+
+	/* the helper is gone, start over with a new one */
+	if (rc == EPIPE) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Build helper died, restarting it.");
+		_launch_stop();
+
+		if ((rc = _launch_start()) == 0) {
+			++_launch.restarts;
+			rc = _launch_request(&request, launch);
+		}
+	}
+
+	if (rc == 0)
+		++_launch.launched;
+	else
+		++_launch.failed;
+
+	pthread_mutex_unlock(&_launch.lock);
+
+	return rc;
+}
+
+/* launch_wait
+ *
+ * Function waits for the child of 'launch' to exit. Its output must have
+ * been closed before.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the exit status of the child, 128 plus the
+ * number of the signal that killed it, or -1 on failure.
+ */
+int
+launch_wait(struct launch *launch)
+{
+	ssize_t bread;
+	int status;
+
+	while ((bread = read(launch->status, &status, sizeof(status))) == -1 && EINTR == errno);
+
+	close(launch->status);
+	launch->status = -1;
+
+	return bread == sizeof(status) ? status : -1;
+}
+
+void
+launch_stats(struct json_t *root)
+{
+	json_t *stats;
+
+	stats = json_object();
+	if (!stats)
+		return;
+
+	pthread_mutex_lock(&_launch.lock);
+	json_object_set_new(stats, "helper", json_integer(_launch.helper));
+	json_object_set_new(stats, "launched", json_integer(_launch.launched));
+	json_object_set_new(stats, "failed", json_integer(_launch.failed));
+	json_object_set_new(stats, "restarts", json_integer(_launch.restarts));
+	pthread_mutex_unlock(&_launch.lock);
+
+	json_object_set_new(root, "launcher", stats);
+}
+
+/*****************************************************************************/
+
+/* _launch_start
+ *
+ * Function starts the helper with its end of a new socket pair. Must be
+ * called with the lock held.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+_launch_start(void)
+{
+	char *const argv[] = { "credentarius", LAUNCH_HELPER, NULL };
+	posix_spawn_file_actions_t actions;
+	int pair[2];
+	int fd;
+	int rc;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, pair) == -1)
+		return errno;
+
+	/* dup2 onto itself would leave close-on-exec set */
+	if (pair[1] == LAUNCH_SOCKET_FD) {
+		fd = fcntl(pair[1], F_DUPFD_CLOEXEC, LAUNCH_SOCKET_FD + 1);
+		close(pair[1]);
+		if ((pair[1] = fd) == -1) {
+			rc = errno;
+			close(pair[0]);
+			return rc;
+		}
+	}
+
+	if ((rc = posix_spawn_file_actions_init(&actions)) != 0)
+		goto close_pair;
+
+	if ((rc = posix_spawn_file_actions_adddup2(&actions, pair[1], LAUNCH_SOCKET_FD)) == 0)
+		rc = posix_spawn(&_launch.helper, LAUNCH_SELF, &actions, NULL, argv, environ);
+
+	posix_spawn_file_actions_destroy(&actions);
+
+close_pair:
+	close(pair[1]);
+
+	if (rc != 0) {
+		close(pair[0]);
+		return rc;
+	}
+
+	_launch.socket = pair[0];
+
+	y_log_message(Y_LOG_LEVEL_DEBUG, "Started build helper %d.", (int) _launch.helper);
+
+	return 0;
+}
+
+/* _launch_stop
+ *
+ * Function makes the helper exit by closing its socket, and reaps it. Must
+ * be called with the lock held.
+ */
+void
+_launch_stop(void)
+{
+	if (_launch.socket == -1)
+		return;
+
+	close(_launch.socket);
+	_launch.socket = -1;
+
+	while (waitpid(_launch.helper, NULL, 0) == -1 && EINTR == errno);
+	_launch.helper = 0;
+}
+
+/* _launch_request
+ *
+ * Function sends 'request' to the helper and takes the child's pid and its
+ * output and status pipes from the reply. Must be called with the lock
+ * held.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, EPIPE if the helper is
+ * gone, or the errno value the helper failed with.
+ */
+int
+_launch_request(const struct _launch_request *request, struct launch *launch)
+{
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	struct _launch_reply reply;
+	struct msghdr msg = {0};
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	ssize_t bytes;
+	int fds[2];
+
+	if (_launch.socket == -1)
+		return EPIPE;
+
+	while ((bytes = send(_launch.socket, request, sizeof(*request), MSG_NOSIGNAL)) == -1 && EINTR == errno);
+	if (bytes != sizeof(*request))
+		return EPIPE;
+
+	iov.iov_base = &reply;
+	iov.iov_len = sizeof(reply);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	while ((bytes = recvmsg(_launch.socket, &msg, MSG_CMSG_CLOEXEC)) == -1 && EINTR == errno);
+	if (bytes != sizeof(reply))
+		return EPIPE;
+
+	if (reply.error != 0)
+		return reply.error;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+		return EPIPE;
+
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+	launch->pid = reply.pid;
+	launch->fd = fds[0];
+	launch->status = fds[1];
+
+	return 0;
+}
+
+/* _launch_serve
+ *
+ * Function handles one request of the server in the helper: it starts the
+ * child and passes the read ends of its output and status pipes back.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success and -1 once the server is
+ * gone.
+ */
+int
+_launch_serve(int sock, struct _launch_child **children)
+{
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	const char *targets[LAUNCH_ARGS_MAX + 1] = {0};
+	struct _launch_request request;
+	struct _launch_reply reply = {0};
+	struct _launch_child *child = NULL;
+	struct msghdr msg = {0};
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	ssize_t bytes;
+	int status[2] = { -1, -1 };
+	int output = -1;
+	size_t i;
+
+	while ((bytes = recv(sock, &request, sizeof(request), 0)) == -1 && EINTR == errno);
+	if (bytes <= 0)
+		return -1;
+
+	iov.iov_base = &reply;
+	iov.iov_len = sizeof(reply);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (bytes != sizeof(request)) {
+		reply.error = EINVAL;
+		goto reply;
+	}
+
+	request.path[sizeof(request.path) - 1] = '\0';
+	for (i = 0; i < LAUNCH_ARGS_MAX && request.targets[i][0]; ++i) {
+		request.targets[i][LAUNCH_TARGET_MAX - 1] = '\0';
+		targets[i] = request.targets[i];
+	}
+
+	if (!(child = calloc(1, sizeof(*child))) || pipe2(status, O_CLOEXEC) == -1) {
+		reply.error = errno;
+		goto reply;
+	}
+
+	if ((reply.error = _launch_spawn(request.path, targets, &reply.pid, &output)) != 0)
+		goto reply;
+
+	child->pid = reply.pid;
+	child->status = status[1];
+	child->next = *children;
+	*children = child;
+	child = NULL;
+	status[1] = -1;
+
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), (int []) { output, status[0] }, 2 * sizeof(int));
+
+reply:
+	while ((bytes = sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1 && EINTR == errno);
+
+	if (output != -1)
+		close(output);
+	if (status[0] != -1)
+		close(status[0]);
+	if (status[1] != -1)
+		close(status[1]);
+	free(child);
+
+	return bytes == -1 && EINTR != errno ? -1 : 0;
+}
+
+/* _launch_reap
+ *
+ * Function collects the children of the helper that exited, and reports
+ * their exit status to the server.
+ */
+void
+_launch_reap(struct _launch_child **children)
+{
+	struct _launch_child **link;
+	struct _launch_child *child;
+	int status;
+	pid_t pid;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (link = children; *link && (*link)->pid != pid; link = &(*link)->next)
+			;
+
+		if (!(child = *link))
+			continue;
+
+		status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+		while (write(child->status, &status, sizeof(status)) == -1 && EINTR == errno);
+
+		close(child->status);
+		*link = child->next;
+		free(child);
+	}
+}
+
+/* _launch_spawn
+ *
+ * Function runs make with 'targets' in the directory 'path', and returns the
+ * read end of its output in 'fd'.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+_launch_spawn(const char *path, const char *const *targets, pid_t *pid, int *fd)
+{
+	const char *argv[LAUNCH_ARGS_MAX + 2] = { "make" };
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t signals;
+	int pipefd[2];
+	size_t i;
+	int rc;
+
+	for (i = 0; targets[i]; ++i)
+		argv[i + 1] = targets[i];
+
+	if (pipe2(pipefd, O_CLOEXEC) == -1)
+		return errno;
+
+	if ((rc = posix_spawn_file_actions_init(&actions)) != 0)
+		goto close_pipe;
+
+	if ((rc = posix_spawnattr_init(&attr)) != 0)
+		goto destroy_actions;
+
+	/* dup2 clears close-on-exec on the copies */
+	if ((rc = posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO)) != 0 ||
+	    (rc = posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDERR_FILENO)) != 0 ||
+	    (rc = posix_spawn_file_actions_addchdir_np(&actions, path)) != 0)
+		goto destroy_attr;
+
+	/* nothing the helper blocks or ignores carries over */
+	sigemptyset(&signals);
+	if ((rc = posix_spawnattr_setsigmask(&attr, &signals)) != 0)
+		goto destroy_attr;
+
+	sigfillset(&signals);
+	if ((rc = posix_spawnattr_setsigdefault(&attr, &signals)) != 0 ||
+	    (rc = posix_spawnattr_setpgroup(&attr, 0)) != 0 ||
+	    (rc = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP|POSIX_SPAWN_SETSIGMASK|POSIX_SPAWN_SETSIGDEF)) != 0)
+		goto destroy_attr;
+
+	rc = posix_spawn(pid, LAUNCH_MAKE, &actions, &attr, (char *const *) argv, environ);
+
+destroy_attr:
+	posix_spawnattr_destroy(&attr);
+
+destroy_actions:
+	posix_spawn_file_actions_destroy(&actions);
+
+close_pipe:
+	close(pipefd[1]);
+
+	if (rc != 0) {
+		close(pipefd[0]);
+		return rc;
+	}
+
+	*fd = pipefd[0];
+
+	return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef CREDENTARIUS_LAUNCH_H
+#define CREDENTARIUS_LAUNCH_H 1
+
+#include <sys/types.h>
+
+/* argument making the executable run as the build helper */
+#define LAUNCH_HELPER "--launch-helper"
+
+struct json_t;
+
+struct launch
+{
+	pid_t pid;
+	int fd;     /* output of the child */
+	int status; /* the helper reports the exit status here */
+};
+
+int launch_init(void);
+void launch_fini(void);
+int launch_helper(void);
+
+int launch_make(const char *, const char *const *, struct launch *);
+int launch_wait(struct launch *);
+
+void launch_stats(struct json_t *);
+
+#endif
@@ -0,0 +1,646 @@
+#include "listing.h"
+
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ulfius.h>
+
+#include "common.h"
+#include "compress.h"
+#include "path.h"
+
+#define LISTING_BLOCK_SIZE (32 * 1024)
+#define LISTING_DENTS_SIZE (32 * 1024)
+#define LISTING_ENTRY_MAX  (NAME_MAX * 6 + 128)
+#define LISTING_PAGE_MAX   1000
+
+enum _listing_state
+{
+	LISTING_HEAD,
+	LISTING_ENTRIES,
+	LISTING_TAIL,
+	LISTING_DONE
+};
+
+struct _listing
+{
+	int fd;
+	unsigned int flags;
+	enum _listing_state state;
+	size_t limit;
+	size_t count;
+	off_t cursor;
+	int cursor_shard[2];
+	int more;
+
+	/* sharded walk: shard root, current first-level directory, and the
+	 * shard being read, -1 while still reading the top directory */
+	int shards;
+	int outer;
+	int shard[2];
+	int drained;
+	unsigned char present[2][32];
+
+	char *dents;
+	long dents_length;
+	long dents_offset;
+
+	char pending[LISTING_ENTRY_MAX];
+	size_t pending_length;
+	size_t pending_offset;
+};
+
+static ssize_t _listing_stream(void *, uint64_t, char *, size_t);
+static void _listing_free(void *);
+static int _listing_next(struct _listing *);
+static int _listing_entry(struct _listing *, const struct dirent64 *);
+static size_t _listing_escape(char *, size_t, const char *);
+static int _listing_utf8(const char *);
+static int _listing_resume(struct _listing *, const char *);
+static int _listing_shard_next(struct _listing *);
+static int _listing_shard_scan(int, unsigned char *);
+static int _listing_shard_bit(const unsigned char *, int);
+
+/* listing_requested
+ *
+ * Function checks if the request asks for any listing feature beyond the
+ * plain array of names.
+ */
+int
+listing_requested(const struct _u_request *request)
+{
+	return u_map_has_key(request->map_url, "limit") ||
+	       u_map_has_key(request->map_url, "after") ||
+	       u_map_has_key(request->map_url, "stat");
+}
+
+/* listing_response
+ *
+ * Sets up a response that streams the entries of the directory 'fd' as JSON
+ * while the directory is being read, so no listing is ever held in memory.
+ *
+ * The 'limit' and 'after' query parameters enable paging, in which case the
+ * body is an object holding the 'entries' array and the opaque 'next' cursor
+ * to pass as 'after' for the following page (null on the last page). Pages
+ * hold at most LISTING_PAGE_MAX entries, which is also what an 'after'
+ * without a 'limit' gets. The
+ * 'stat' query parameter turns each entry into an object with 'name', 'size'
+ * and 'mtime' members.
+ *
+ * With LISTING_SHARDED, the shards below 'fd' are walked as well, after the
+ * entries of 'fd' itself, and cursors name the shard they point into.
+ *
+ * Names that aren't valid UTF-8 can't be told apart in JSON and are left
+ * out.
+ *
+ * The body is compressed on the fly if the client accepts it.
+ *
+ * Ownership of the file descriptor is transferred to the response, even if
+ * the call fails.
+ */
+int
+listing_response(const struct _u_request *request, struct _u_response *response, int fd, unsigned int flags)
+{
+	struct _listing *listing;
+	enum compress_t encoding;
+	const char *value;
+	char *end;
+	long long number;
+
+	listing = calloc(1, sizeof(*listing));
+	if (!listing) {
+		close(fd);
+		return U_ERROR_MEMORY;
+	}
+
+	listing->fd = fd;
+	listing->flags = flags;
+	listing->state = LISTING_HEAD;
+	listing->outer = -1;
+	listing->shard[0] = listing->shard[1] = -1;
+	listing->cursor_shard[0] = listing->cursor_shard[1] = -1;
+
+	listing->shards = -1;
+	if (flags & LISTING_SHARDED) {
+		listing->shards = openat(fd, PATH_SHARDS, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+		if (listing->shards != -1 && _listing_shard_scan(listing->shards, listing->present[0]) != 0) {
+			_listing_free(listing);
+			return U_ERROR_MEMORY;
+		}
+	}
+
+	if ((value = u_map_get(request->map_url, "stat")) &&
+	    strcmp(value, "0") != 0 && strcmp(value, "false") != 0)
+		listing->flags |= LISTING_STAT;
+
+	if ((value = u_map_get(request->map_url, "limit"))) {
+		number = strtoll(value, &end, 10);
+		if (*value == '\0' || *end != '\0' || number <= 0)
+			goto bad_request;
+
+		listing->limit = number < LISTING_PAGE_MAX ? number : LISTING_PAGE_MAX;
+		listing->flags |= LISTING_PAGED;
+	}
+
+	if ((value = u_map_get(request->map_url, "after"))) {
+		if (_listing_resume(listing, value) != 0)
+			goto bad_request;
+
+		if (!listing->limit)
+			listing->limit = LISTING_PAGE_MAX;
+		listing->flags |= LISTING_PAGED;
+	}
+
+	listing->dents = malloc(LISTING_DENTS_SIZE);
+	if (!listing->dents) {
+		_listing_free(listing);
+		return U_ERROR_MEMORY;
+	}
+
+	u_map_put(response->map_header, "Content-Type", "application/json");
+
+	/* big directories are where listings are worth compressing */
+	encoding = compress_negotiate(request, response, -1);
+	if (encoding != COMPRESS_IDENTITY) {
+		compress_header(response, encoding);
+		return compress_stream_response(response, HTTP_OK, encoding,
+		    _listing_stream, _listing_free, listing);
+	}
+
+	return ulfius_set_stream_response(response, HTTP_OK, _listing_stream,
+	    _listing_free, -1, LISTING_BLOCK_SIZE, listing);
+
+bad_request:
+	y_log_message(Y_LOG_LEVEL_DEBUG, "Invalid listing parameters specified.");
+	_listing_free(listing);
+	return ulfius_set_empty_response(response, HTTP_BAD_REQUEST);
+}
+
+/*****************************************************************************/
+
+ssize_t
+_listing_stream(void *stream_user_data, uint64_t offset, char *out_buf, size_t max)
+{
+	struct _listing *listing = stream_user_data;
+	size_t written = 0;
+	size_t chunk;
+
+	UNUSED(offset);
+
+	while (written < max) {
+		if (listing->pending_offset == listing->pending_length) {
+			listing->pending_offset = 0;
+			listing->pending_length = 0;
+
+			if (listing->state == LISTING_DONE)
+				break;
+
+			if (_listing_next(listing) == -1)
+				return ULFIUS_STREAM_ERROR;
+
+			continue;
+		}
+
+		chunk = listing->pending_length - listing->pending_offset;
+		if (chunk > max - written)
+			chunk = max - written;
+
+		memcpy(out_buf + written, listing->pending + listing->pending_offset, chunk);
+		listing->pending_offset += chunk;
+		written += chunk;
+	}
+
+	return written > 0 ? (ssize_t) written : ULFIUS_STREAM_END;
+}
+
+void
+_listing_free(void *stream_user_data)
+{
+	struct _listing *listing = stream_user_data;
+	close(listing->fd);
+	if (listing->outer != -1)
+		close(listing->outer);
+	if (listing->shards != -1)
+		close(listing->shards);
+	free(listing->dents);
+	free(listing);
+}
+
+/* _listing_next
+ *
+ * Function formats the next piece of output into the pending buffer,
+ * reading another batch of directory entries when required.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success and -1 on failure.
+ */
+int
+_listing_next(struct _listing *listing)
+{
+	const struct dirent64 *dentry;
+
+	switch (listing->state) {
+	case LISTING_HEAD:
+		listing->pending_length = snprintf(listing->pending,
+		    sizeof(listing->pending), "%s",
+		    listing->flags & LISTING_PAGED ? "{\"entries\":[" : "[");
+		listing->state = LISTING_ENTRIES;
+		return 0;
+
+	case LISTING_ENTRIES:
+		while (listing->pending_length == 0) {
+			if (listing->dents_offset >= listing->dents_length) {
+				listing->dents_length = listing->drained ? 0 :
+				    getdents64(listing->fd, listing->dents, LISTING_DENTS_SIZE);
+				listing->dents_offset = 0;
+
+				if (listing->dents_length == -1) {
+					if (EINTR == errno) {
+						listing->dents_length = 0;
+						continue;
+					}
+
+					y_log_message(Y_LOG_LEVEL_ERROR, "Failed to read directory entries.");
+					return -1;
+				}
+
+				if (listing->dents_length == 0) {
+					switch (_listing_shard_next(listing)) {
+					case 1: continue;
+					case -1: return -1;
+					}
+
+					listing->state = LISTING_TAIL;
+					return 0;
+				}
+			}
+
+			dentry = (const struct dirent64 *) (listing->dents + listing->dents_offset);
+
+			if (listing->limit && listing->count == listing->limit) {
+				/* only peeking whether another page exists */
+				if (_listing_entry(listing, dentry) == 1) {
+					listing->pending_length = 0;
+					listing->more = TRUE;
+					listing->state = LISTING_TAIL;
+					return 0;
+				}
+			} else if (_listing_entry(listing, dentry) == 1) {
+				++listing->count;
+				listing->cursor = dentry->d_off;
+				listing->cursor_shard[0] = listing->shard[0];
+				listing->cursor_shard[1] = listing->shard[1];
+			}
+
+			listing->dents_offset += dentry->d_reclen;
+		}
+		return 0;
+
+	case LISTING_TAIL:
+		if (!(listing->flags & LISTING_PAGED))
+			listing->pending_length = snprintf(listing->pending,
+			    sizeof(listing->pending), "]");
+		else if (listing->more && listing->cursor_shard[0] != -1)
+			listing->pending_length = snprintf(listing->pending,
+			    sizeof(listing->pending), "],\"next\":\"%02x/%02x/%lld\"}",
+			    listing->cursor_shard[0], listing->cursor_shard[1],
+			    (long long) listing->cursor);
+		else if (listing->more)
+			listing->pending_length = snprintf(listing->pending,
+			    sizeof(listing->pending), "],\"next\":\"%lld\"}",
+			    (long long) listing->cursor);
+		else
+			listing->pending_length = snprintf(listing->pending,
+			    sizeof(listing->pending), "],\"next\":null}");
+		listing->state = LISTING_DONE;
+		return 0;
+
+	case LISTING_DONE:
+		break;
+	}
+
+	return 0;
+}
+
+/* _listing_entry
+ *
+ * Function formats 'dentry' into the pending buffer if it should be listed.
+ *
+ * RETURN VALUES
+ *
+ * The function will return one (1) if the entry was formatted and zero (0)
+ * if it was skipped.
+ */
+int
+_listing_entry(struct _listing *listing, const struct dirent64 *dentry)
+{
+	char name[NAME_MAX * 6 + 1];
+	struct statx stx;
+	unsigned char type;
+	int have_stat = FALSE;
+	char *out = listing->pending;
+	size_t length = sizeof(listing->pending);
+	size_t used = 0;
+
+	if (dentry->d_name[0] == '.')
+		return 0;
+
+	if (!_listing_utf8(dentry->d_name)) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Skipping name that isn't UTF-8 in listing.");
+		return 0;
+	}
+
+	type = dentry->d_type;
+
+	if (type == DT_UNKNOWN || (listing->flags & LISTING_STAT)) {
+		if (statx(listing->fd, dentry->d_name, AT_SYMLINK_NOFOLLOW|AT_STATX_DONT_SYNC,
+		          STATX_TYPE|STATX_SIZE|STATX_MTIME, &stx) == -1)
+			return 0;
+
+		have_stat = TRUE;
+		type = S_ISDIR(stx.stx_mode) ? DT_DIR : S_ISREG(stx.stx_mode) ? DT_REG : DT_UNKNOWN;
+	}
+
+	if (!((type == DT_DIR && (listing->flags & LISTING_DIRECTORIES)) ||
+	      (type == DT_REG && (listing->flags & LISTING_FILES))))
+		return 0;
+
+	_listing_escape(name, sizeof(name), dentry->d_name);
+
+	if (listing->count > 0)
+		out[used++] = ',';
+
+	if (have_stat && (listing->flags & LISTING_STAT)) {
+		used += snprintf(out + used, length - used,
+		    "{\"name\":\"%s\",\"size\":%llu,\"mtime\":%lld}", name,
+		    (unsigned long long) stx.stx_size, (long long) stx.stx_mtime.tv_sec);
+	} else {
+		used += snprintf(out + used, length - used, "\"%s\"", name);
+	}
+
+	listing->pending_length = used;
+
+	return 1;
+}
+
+/* _listing_escape
+ *
+ * Function copies 'in' to 'out' as the contents of a JSON string literal.
+ */
+size_t
+_listing_escape(char *out, size_t length, const char *in)
+{
+	size_t used = 0;
+	unsigned char c;
+
+	for (; (c = *in) && used + 7 < length; ++in) {
+		switch (c) {
+		case '"':  used += snprintf(out + used, length - used, "\\\""); break;
+		case '\\': used += snprintf(out + used, length - used, "\\\\"); break;
+		default:
+			if (c < 0x20)
+				used += snprintf(out + used, length - used, "\\u%04x", c);
+			else
+				out[used++] = c;
+			break;
+		}
+	}
+
+	out[used] = '\0';
+
+	return used;
+}
+
+/* _listing_utf8
+ *
+ * Function checks that 'in' is valid UTF-8: no stray or missing
+ * continuation bytes, overlong forms, surrogates or code points beyond
+ * U+10FFFF.
+ */
+int
+_listing_utf8(const char *in)
+{
+	const unsigned char *c = (const unsigned char *) in;
+	unsigned int point;
+	unsigned int least;
+	int follow;
+
+	while (*c) {
+		if (*c < 0x80) {
+			++c;
+			continue;
+		}
+
+		if ((*c & 0xe0) == 0xc0) {
+			point = *c & 0x1f;
+			least = 0x80;
+			follow = 1;
+		} else if ((*c & 0xf0) == 0xe0) {
+			point = *c & 0x0f;
+			least = 0x800;
+			follow = 2;
+		} else if ((*c & 0xf8) == 0xf0) {
+			point = *c & 0x07;
+			least = 0x10000;
+			follow = 3;
+		} else {
+			return FALSE;
+		}
+
+		for (++c; follow > 0; --follow, ++c) {
+			if ((*c & 0xc0) != 0x80)
+				return FALSE;
+			point = point << 6 | (*c & 0x3f);
+		}
+
+		if (point < least || (point >= 0xd800 && point <= 0xdfff) || point > 0x10ffff)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* _listing_resume
+ *
+ * Function positions the listing right after the 'after' cursor, either a
+ * plain offset into the top directory or "<ab>/<cd>/<offset>" into a shard.
+ * A shard that vanished in the meantime resumes with the next one.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success and -1 if the cursor is not
+ * valid.
+ */
+int
+_listing_resume(struct _listing *listing, const char *after)
+{
+	unsigned int outer;
+	unsigned int inner;
+	long long number;
+	char name[3];
+	char *end;
+	int length = 0;
+	int fd;
+
+	if (!strchr(after, '/')) {
+		number = strtoll(after, &end, 10);
+		if (*after == '\0' || *end != '\0' || number < 0)
+			return -1;
+
+		return lseek(listing->fd, number, SEEK_SET) == -1 ? -1 : 0;
+	}
+
+	if (!(listing->flags & LISTING_SHARDED) ||
+	    sscanf(after, "%2x/%2x/%lld%n", &outer, &inner, &number, &length) != 3 ||
+	    after[length] != '\0' || number < 0)
+		return -1;
+
+	/* the top directory was listed completely before any shard */
+	listing->drained = TRUE;
+	listing->shard[0] = outer;
+	listing->shard[1] = inner;
+
+	if (listing->shards == -1)
+		return 0;
+
+	snprintf(name, sizeof(name), "%02x", outer);
+	listing->outer = openat(listing->shards, name, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (listing->outer == -1)
+		return 0;
+
+	if (_listing_shard_scan(listing->outer, listing->present[1]) != 0)
+		return -1;
+
+	snprintf(name, sizeof(name), "%02x", inner);
+	fd = openat(listing->outer, name, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd == -1)
+		return 0;
+
+	if (lseek(fd, number, SEEK_SET) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	close(listing->fd);
+	listing->fd = fd;
+	listing->drained = FALSE;
+
+	return 0;
+}
+
+/* _listing_shard_next
+ *
+ * Function moves the listing on to the next non-empty shard directory, in
+ * hexadecimal order.
+ *
+ * RETURN VALUES
+ *
+ * The function will return one (1) if another shard is ready to be read,
+ * zero (0) if all shards were listed, and -1 on failure.
+ */
+int
+_listing_shard_next(struct _listing *listing)
+{
+	char name[3];
+	int next;
+	int fd;
+
+	if (!(listing->flags & LISTING_SHARDED))
+		return 0;
+
+	for (;;) {
+		if (listing->outer != -1) {
+			while ((next = _listing_shard_bit(listing->present[1], listing->shard[1])) != -1) {
+				listing->shard[1] = next;
+
+				snprintf(name, sizeof(name), "%02x", next);
+				fd = openat(listing->outer, name, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+				if (fd == -1)
+					continue;
+
+				close(listing->fd);
+				listing->fd = fd;
+				listing->drained = FALSE;
+				return 1;
+			}
+
+			close(listing->outer);
+			listing->outer = -1;
+		}
+
+		if (listing->shards == -1)
+			return 0;
+
+		next = _listing_shard_bit(listing->present[0], listing->shard[0]);
+		if (next == -1)
+			return 0;
+
+		listing->shard[0] = next;
+		listing->shard[1] = -1;
+
+		snprintf(name, sizeof(name), "%02x", next);
+		listing->outer = openat(listing->shards, name, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+		if (listing->outer == -1)
+			continue;
+
+		if (_listing_shard_scan(listing->outer, listing->present[1]) != 0)
+			return -1;
+	}
+}
+
+/* _listing_shard_scan
+ *
+ * Function records which of the 256 possible shard directories exist in
+ * 'fd' as bits of 'present'.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success and -1 on failure.
+ */
+int
+_listing_shard_scan(int fd, unsigned char *present)
+{
+	struct dirent *dentry;
+	unsigned int shard;
+	char *end;
+	DIR *dh;
+
+	memset(present, 0, 32);
+
+	if ((fd = dup(fd)) == -1)
+		return -1;
+
+	if (!(dh = fdopendir(fd))) {
+		close(fd);
+		return -1;
+	}
+
+	while ((dentry = readdir(dh))) {
+		if (strlen(dentry->d_name) != 2 || !isxdigit((unsigned char) dentry->d_name[0]))
+			continue;
+
+		shard = strtoul(dentry->d_name, &end, 16);
+		if (*end == '\0')
+			present[shard / 8] |= 1 << (shard % 8);
+	}
+
+	closedir(dh);
+
+	return 0;
+}
+
+int
+_listing_shard_bit(const unsigned char *present, int after)
+{
+	int shard;
+
+	for (shard = after + 1; shard < 256; ++shard)
+		if (present[shard / 8] & (1 << (shard % 8)))
+			return shard;
+
+	return -1;
+}
@@ -0,0 +1,19 @@
+#ifndef CREDENTARIUS_LISTING_H
+#define CREDENTARIUS_LISTING_H 1
+
+struct _u_request;
+struct _u_response;
+
+enum listing_t
+{
+	LISTING_DIRECTORIES = 1 << 0, /* list sub-directories */
+	LISTING_FILES       = 1 << 1, /* list regular files */
+	LISTING_STAT        = 1 << 2, /* include size and mtime per entry */
+	LISTING_PAGED       = 1 << 3, /* wrap entries in a page object */
+	LISTING_SHARDED     = 1 << 4  /* walk the project shards as well */
+};
+
+int listing_requested(const struct _u_request *);
+int listing_response(const struct _u_request *, struct _u_response *, int, unsigned int);
+
+#endif
@@ -0,0 +1,46 @@
+#include "lock.h"
+
+#include <pthread.h>
+
+#define LOCK_STRIPES 64
+
+static pthread_mutex_t _locks[LOCK_STRIPES] = {
+	[0 ... LOCK_STRIPES - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+static pthread_mutex_t *_lock_stripe(const char *);
+
+/* lock_project
+ *
+ * Function serializes modifications of the project 'id' with each other.
+ *
+ * Locks are striped by a hash of the project id, so unrelated projects may
+ * occasionally share a lock; it must therefore only be held for the
+ * duration of a single modification.
+ */
+void
+lock_project(const char *id)
+{
+	pthread_mutex_lock(_lock_stripe(id));
+}
+
+void
+unlock_project(const char *id)
+{
+	pthread_mutex_unlock(_lock_stripe(id));
+}
+
+/*****************************************************************************/
+
+pthread_mutex_t *
+_lock_stripe(const char *id)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*id) {
+		hash ^= (unsigned char) *id++;
+		hash *= 16777619u;
+	}
+
+	return &_locks[hash % LOCK_STRIPES];
+}
@@ -0,0 +1,7 @@
+#ifndef CREDENTARIUS_LOCK_H
+#define CREDENTARIUS_LOCK_H 1
+
+void lock_project(const char *);
+void unlock_project(const char *);
+
+#endif
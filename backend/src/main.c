@@ -1,14 +1,41 @@
 #include <signal.h>
+#include <string.h>
 
 #include <ulfius.h>
 
+#include "archive.h"
+#include "artifact.h"
+#include "batch.h"
+#include "blob.h"
+#include "build.h"
+#include "buildcache.h"
+#include "buildlog.h"
+#include "cache.h"
 #include "config.h"
 #include "common.h"
 #include "compile.h"
+#include "durable.h"
+#include "launch.h"
 #include "mcu.h"
+#include "path.h"
 #include "project.h"
+#include "remote.h"
+#include "scratch.h"
+#include "skel.h"
+#include "status.h"
+#include "trash.h"
+#include "upload.h"
+#include "worker.h"
 
 static void sig_nop(int);
+
+/* endpoints that take a multipart/form-data file part as it arrives */
+static const struct upload_route uploads[] = {
+	{ "POST", PREFIX "/project/", &project_upload },
+	{ "PUT", PREFIX "/project/", &project_upload },
+	{ "PUT", PREFIX "/archive/", &archive_upload },
+	{ NULL, NULL, NULL }
+};
 static int default_get(const struct _u_request *, struct _u_response *, void *);
 
 int
@@ -17,11 +44,24 @@ main(int argc, char *argv[])
 	struct _u_instance instance;
 	int rc;
 
-	UNUSED(argc);
-	UNUSED(argv);
+	/* the build helper and build workers are this same executable */
+	if (argc > 1 && strcmp(argv[1], LAUNCH_HELPER) == 0)
+		return launch_helper();
+
+	if (argc > 1 && strcmp(argv[1], WORKER_MODE) == 0)
+		return worker_main(argc - 2, argv + 2);
 
 	y_init_logs("credentarius", Y_LOG_MODE_CONSOLE, Y_LOG_LEVEL_DEBUG, NULL, "Starting credentarius");
 
+	cache_init(CACHE_SIZE);
+
+	if (launch_init() != 0 || durable_init() != 0 || path_init() != 0 || blob_init() != 0 || trash_init() != 0 ||
+	    upload_init() != 0 || skel_init() != 0 || buildcache_init() != 0 || scratch_init() != 0 ||
+	    remote_init() != 0 || build_init() != 0) {
+		rc = EXIT_FAILURE;
+		goto cleanup_logs;
+	}
+
 	rc = ulfius_init_instance(&instance, PORT, NULL);
 	if (U_OK != rc) {
 		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to initialize ulfius!");
@@ -30,24 +70,38 @@ main(int argc, char *argv[])
 	}
 
 	u_map_put(instance.default_headers, "Access-Control-Allow-Origin", "*");
-	u_map_put(instance.default_headers, "Access-Control-Allow-Methods", "POST, GET, OPTIONS, PUT, DELETE");
-	u_map_put(instance.default_headers, "Access-Control-Allow-Headers", "Content-Type");
-	instance.max_post_body_size = 1024 * 1024; /* 1 MB post limit */
+	u_map_put(instance.default_headers, "Access-Control-Allow-Methods", "POST, GET, OPTIONS, PUT, PATCH, DELETE");
+	u_map_put(instance.default_headers, "Access-Control-Allow-Headers", "Content-Type, Content-Range, If-Match, Range, If-Range, Last-Event-ID");
+	u_map_put(instance.default_headers, "Access-Control-Expose-Headers", "ETag, Content-Range, Accept-Ranges, Content-Disposition, Retry-After");
+	instance.max_post_body_size = MAX_BODY_SIZE; /* ulfius buffers raw bodies */
+	ulfius_set_upload_file_callback_function(&instance, &upload_receive, (void *) uploads);
 
 	ulfius_add_endpoint_by_val(&instance, "DELETE", PREFIX, "/project/:id", NULL, NULL, NULL, &project_delete_existing, NULL);
 	ulfius_add_endpoint_by_val(&instance, "DELETE", PREFIX, "/project/:id/:file", NULL, NULL, NULL, &project_delete_file, NULL);
 	ulfius_add_endpoint_by_val(&instance, "GET", PREFIX, "/project", NULL, NULL, NULL, &project_get_list, NULL);
 	ulfius_add_endpoint_by_val(&instance, "GET", PREFIX, "/project/:id", NULL, NULL, NULL, &project_get_files, NULL);
 	ulfius_add_endpoint_by_val(&instance, "GET", PREFIX, "/project/:id/:file", NULL, NULL, NULL, &project_get_file, NULL);
+	ulfius_add_endpoint_by_val(&instance, "PATCH", PREFIX, "/project/:id/:file", NULL, NULL, NULL, &project_patch_file, NULL);
 	ulfius_add_endpoint_by_val(&instance, "POST", PREFIX, "/project/:id/:file", NULL, NULL, NULL, &project_post_file, NULL);
 	ulfius_add_endpoint_by_val(&instance, "POST", PREFIX, "/project/new", NULL, NULL, NULL, &project_post_new, NULL);
 	ulfius_add_endpoint_by_val(&instance, "PUT", PREFIX, "/project/:id/:file", NULL, NULL, NULL, &project_put_file, NULL);
 
+	ulfius_add_endpoint_by_val(&instance, "GET", PREFIX, "/archive/:id", NULL, NULL, NULL, &archive_get_project, NULL);
+	ulfius_add_endpoint_by_val(&instance, "PUT", PREFIX, "/archive/:id", NULL, NULL, NULL, &archive_put_project, NULL);
+
+	ulfius_add_endpoint_by_val(&instance, "POST", PREFIX, "/batch/:id", NULL, NULL, NULL, &batch_post_project, NULL);
+
 	ulfius_add_endpoint_by_val(&instance, "PUT", PREFIX, "/compile/:id", NULL, NULL, NULL, &compile_put_project, NULL);
+	ulfius_add_endpoint_by_val(&instance, "GET", PREFIX, "/compile/:id/log", NULL, NULL, NULL, &compile_get_log, NULL);
+	ulfius_add_endpoint_by_val(&instance, "GET", PREFIX, "/compile/:id/artifact", NULL, NULL, NULL, &artifact_get_firmware, NULL);
+	ulfius_add_endpoint_by_val(&instance, "GET", PREFIX, "/compile/:id/map", NULL, NULL, NULL, &artifact_get_map, NULL);
+	ulfius_add_endpoint_by_val(&instance, "GET", PREFIX, "/compile/:id/elf", NULL, NULL, NULL, &artifact_get_elf, NULL);
 
 	ulfius_add_endpoint_by_val(&instance, "PUT", PREFIX, "/mcu/:id", NULL, NULL, NULL, &mcu_put_flash, NULL);
 	ulfius_add_endpoint_by_val(&instance, "PUT", PREFIX, "/mcu/reset", NULL, NULL, NULL, &mcu_put_reset, NULL);
 
+	ulfius_add_endpoint_by_val(&instance, "GET", PREFIX, "/status", NULL, NULL, NULL, &status_get, NULL);
+
 	ulfius_set_default_endpoint(&instance, NULL, NULL, NULL, &default_get, NULL);
 
 	rc = ulfius_start_framework(&instance);
@@ -62,7 +116,6 @@ main(int argc, char *argv[])
 	signal(SIGHUP, sig_nop);
 	signal(SIGINT, sig_nop);
 	signal(SIGQUIT, sig_nop);
-	signal(SIGCHLD, SIG_IGN);
 
 	/* wait until we get told to exit */
 	pause();
@@ -75,6 +128,20 @@ cleanup_instance:
 	ulfius_clean_instance(&instance);
 
 cleanup_logs:
+	build_fini();
+	remote_fini();
+	scratch_fini();
+	buildlog_fini();
+	buildcache_fini();
+	skel_fini();
+	path_fini();
+	upload_fini();
+	trash_fini();
+	blob_fini();
+	durable_fini();
+	launch_fini();
+	cache_fini();
+
 	y_log_message(Y_LOG_LEVEL_DEBUG, "Exited cleanly.");
 	y_close_logs();
 	return rc;
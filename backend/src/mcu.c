@@ -6,100 +6,90 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <jansson.h>
+#include <poll.h>
+#include <signal.h>
 #include <ulfius.h>
 
+#include "build.h"
 #include "common.h"
 #include "config.h"
+#include "launch.h"
+#include "lock.h"
+#include "path.h"
+#include "scratch.h"
 
+/* output is sent in writes of up to this size, given this long to gather */
+#define MCU_BLOCK_SIZE (16 * 1024)
+#define MCU_LINGER_MS 50
+
+struct _mcu
+{
+	struct launch launch;
+	const char *target;
+	char id[NAME_MAX + 1];
+	char path[PATH_MAX];
+	char scratch[PATH_MAX];
+	int scratched;
+	int claimed;
+	int finished;
+};
+
+static int _mcu_run(const struct _u_request *, struct _u_response *, const char *);
 static ssize_t _stream_log(void *, uint64_t, char *, size_t);
 static void _stream_log_free(void *);
+static void _mcu_release(struct _mcu *);
 
 int
 mcu_put_flash(const struct _u_request *request, struct _u_response *response, void *user_data)
 {
-	char path[PATH_MAX] = {0};
-	struct stat fstat;
-	const char *id;
-	int *fd;
-	int rc;
-
 	UNUSED(user_data);
 
-	id = u_map_get(request->map_url, "id");
-	if (!id) {
-		y_log_message(Y_LOG_LEVEL_DEBUG, "No project id was specified.");
-		return ulfius_set_empty_response(response, HTTP_BAD_REQUEST);
-	}
-
-	rc = snprintf(path, sizeof(path), "%s/%s", PROJECT_PATH, id);
-	if (rc <= 0) {
-		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to generate project file path.");
-		return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
-	}
-
-	if (stat(path, &fstat) == -1) {
-		y_log_message(Y_LOG_LEVEL_DEBUG, "Project path doesn't exist: %s", path);
-		return ulfius_set_empty_response(response, HTTP_NOT_FOUND);
-	}
-
-	fd = calloc(2, sizeof(int));
-
-	if (pipe(fd) == -1) {
-		perror("pipe");
-		return U_ERROR;
-	}
-
-	fcntl(fd[0], F_SETFD, FD_CLOEXEC);
-	fcntl(fd[1], F_SETFD, FD_CLOEXEC);
-	fcntl(fd[0], F_SETFL, O_NONBLOCK);
-
-	switch (fork()) {
-	case -1:
-		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to fork process!");
-		return U_ERROR;
-	case 0:
-		while (dup2(fd[1], STDERR_FILENO) == -1 && EINTR == errno);
-		while (dup2(fd[1], STDOUT_FILENO) == -1 && EINTR == errno);
-
-		if (chdir(path) == -1) {
-		    perror("execl");
-		    _exit(1);
-		}
-
-		execl("/usr/bin/make", "make", "flash", NULL);
-
-		perror("execl");
-		_exit(1);
-	}
-
-	close(fd[1]);
+	return _mcu_run(request, response, "flash");
+}
 
-	y_log_message(Y_LOG_LEVEL_DEBUG, "Child process created.");
+int
+mcu_put_reset(const struct _u_request *request, struct _u_response *response, void *user_data)
+{
+	UNUSED(user_data);
 
-	return ulfius_set_stream_response(response, HTTP_OK, _stream_log, _stream_log_free, -1, 1024, fd);
+	return _mcu_run(request, response, "reset");
 }
 
+/*****************************************************************************/
+
+/* _mcu_run
+ *
+ * Function runs make 'target' in the project directory and streams its
+ * output, followed by its exit status.
+ *
+ * With a scratch area, make runs there, next to the objects of the last
+ * build, and the artifacts it produces are copied back once it is done.
+ *
+ * make may rebuild the firmware first, so it claims the project from the
+ * build queue, see build_claim. While a build is in flight, the request is
+ * refused with 409 Conflict.
+ */
 int
-mcu_put_reset(const struct _u_request *request, struct _u_response *response, void *user_data)
+_mcu_run(const struct _u_request *request, struct _u_response *response, const char *target)
 {
+	const char *const targets[] = { target, NULL };
 	char path[PATH_MAX] = {0};
 	struct stat fstat;
+	struct _mcu *mcu;
 	const char *id;
-	int *fd;
 	int rc;
 
-	UNUSED(user_data);
-
 	id = u_map_get(request->map_url, "id");
 	if (!id) {
 		y_log_message(Y_LOG_LEVEL_DEBUG, "No project id was specified.");
 		return ulfius_set_empty_response(response, HTTP_BAD_REQUEST);
 	}
 
-	rc = snprintf(path, sizeof(path), "%s/%s", PROJECT_PATH, id);
-	if (rc <= 0) {
-		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to generate project file path.");
-		return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
+	rc = path_project(id, path, sizeof(path), FALSE);
+	if (rc != 0) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to resolve project path: %s", id);
+		return ulfius_set_empty_response(response,
+		    EINVAL == rc ? HTTP_BAD_REQUEST : HTTP_INTERNAL_SERVER_ERROR);
 	}
 
 	if (stat(path, &fstat) == -1) {
@@ -107,75 +97,147 @@ mcu_put_reset(const struct _u_request *request, struct _u_response *response, vo
 		return ulfius_set_empty_response(response, HTTP_NOT_FOUND);
 	}
 
-	fd = calloc(2, sizeof(int));
+	mcu = calloc(1, sizeof(*mcu));
+	if (!mcu)
+		return U_ERROR_MEMORY;
 
-	if (pipe(fd) == -1) {
-		perror("pipe");
-		return U_ERROR;
-	}
+	mcu->target = target;
+	/* a longer id would not have named an existing directory */
+	snprintf(mcu->id, sizeof(mcu->id), "%s", id);
+	strcpy(mcu->path, path);
 
-	fcntl(fd[0], F_SETFD, FD_CLOEXEC);
-	fcntl(fd[1], F_SETFD, FD_CLOEXEC);
-	fcntl(fd[0], F_SETFL, O_NONBLOCK);
-
-	switch (fork()) {
-	case -1:
-		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to fork process!");
-		return U_ERROR;
-	case 0:
-		while (dup2(fd[1], STDERR_FILENO) == -1 && EINTR == errno);
-		while (dup2(fd[1], STDOUT_FILENO) == -1 && EINTR == errno);
-
-		if (chdir(path) == -1) {
-		    perror("execl");
-		    _exit(1);
-		}
+	/* batches check for claims under the project lock */
+	lock_project(id);
+	rc = build_claim(id);
+	unlock_project(id);
 
-		execl("/usr/bin/make", "make", "reset", NULL);
+	if (rc != 0) {
+		free(mcu);
 
-		perror("execl");
-		_exit(1);
+		if (EBUSY != rc) {
+			y_log_message(Y_LOG_LEVEL_ERROR, "Failed to claim project for make %s: %s", target, id);
+			return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
+		}
+
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Project is being built, make %s refused: %s", target, id);
+		return ulfius_set_empty_response(response, HTTP_CONFLICT);
 	}
 
-	close(fd[1]);
+	mcu->claimed = TRUE;
+
+	rc = scratch_acquire(path, mcu->scratch, sizeof(mcu->scratch));
+	if (rc != 0 && ENOTSUP != rc)
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to prepare scratch, running make in place: %s", path);
+	mcu->scratched = rc == 0;
+
+	rc = launch_make(mcu->scratched ? mcu->scratch : path, targets, &mcu->launch);
+	if (rc != 0) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to run make %s: %s", target, strerror(rc));
+		_mcu_release(mcu);
+		free(mcu);
+		return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
+	}
 
 	y_log_message(Y_LOG_LEVEL_DEBUG, "Child process created.");
 
-	return ulfius_set_stream_response(response, HTTP_OK, _stream_log, _stream_log_free, -1, 1024, fd);
+	return ulfius_set_stream_response(response, HTTP_OK, _stream_log, _stream_log_free, -1, MCU_BLOCK_SIZE, mcu);
 }
 
-/*****************************************************************************/
-
+/* _stream_log
+ *
+ * Function sleeps until the child writes something, then keeps reading
+ * for up to MCU_LINGER_MS more, so that output goes out in larger writes.
+ * Every connection has a thread of its own to block in. Once the output
+ * ends, the child is reaped and its exit status sent.
+ */
 ssize_t
 _stream_log(void *stream_user_data, uint64_t offset, char *out_buf, size_t max)
 {
-	int *fd = stream_user_data;
+	struct _mcu *mcu = stream_user_data;
+	struct pollfd pfd = { .fd = mcu->launch.fd, .events = POLLIN };
+	size_t length = 0;
 	ssize_t bread;
+	int timeout = -1;
+	int rc;
 
 	UNUSED(offset);
 
-	bread = read(fd[0], out_buf, max);
-	switch (bread) {
-	case -1:
-		if (EAGAIN == errno)
-			return 0;
+	if (mcu->finished)
+		return ULFIUS_STREAM_END;
+
+	while (length < max) {
+		rc = poll(&pfd, 1, timeout);
+		if (rc == -1 && EINTR == errno)
+			continue;
+
+		if (rc == -1) {
+			y_log_message(Y_LOG_LEVEL_ERROR, "Failed to wait for child output.");
+			break;
+		}
+
+		/* nothing more within MCU_LINGER_MS */
+		if (rc == 0)
+			break;
 
-		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to read from child stdout.");
+		bread = read(mcu->launch.fd, out_buf + length, max - length);
+		if (bread == -1 && (EAGAIN == errno || EINTR == errno))
+			continue;
 
-		/* fall-through */
+		if (bread == -1)
+			y_log_message(Y_LOG_LEVEL_ERROR, "Failed to read from child stdout.");
 
-	case 0: return ULFIUS_STREAM_END;
+		if (bread <= 0)
+			break;
+
+		length += bread;
+		timeout = MCU_LINGER_MS;
 	}
 
-	y_log_message(Y_LOG_LEVEL_DEBUG, "Read %ld bytes from child output.", bread);
+	if (length > 0)
+		return length;
+
+	close(mcu->launch.fd);
+	mcu->launch.fd = -1;
+	mcu->finished = TRUE;
 
-	return bread;
+	rc = launch_wait(&mcu->launch);
+	_mcu_release(mcu);
+
+	return snprintf(out_buf, max, "\nmake %s finished with exit status %d.\n",
+	    mcu->target, rc);
 }
 
 void
 _stream_log_free(void * stream_user_data)
 {
-	int *fd = stream_user_data;
-	close(fd[0]);
-	free(fd);
+	struct _mcu *mcu = stream_user_data;
+
+	/* the client went away; stop the flash instead of waiting it out */
+	if (!mcu->finished) {
+		kill(-mcu->launch.pid, SIGTERM);
+		close(mcu->launch.fd);
+		launch_wait(&mcu->launch);
+		_mcu_release(mcu);
+	}
+
+	free(mcu);
+}
+
+/* _mcu_release
+ *
+ * Function hands the scratch directory make ran in back, if there is one,
+ * then lets builds of the project run again.
+ */
+void
+_mcu_release(struct _mcu *mcu)
+{
+	if (mcu->scratched) {
+		scratch_release(mcu->path, mcu->scratch);
+		mcu->scratched = FALSE;
+	}
+
+	if (mcu->claimed) {
+		build_unclaim(mcu->id);
+		mcu->claimed = FALSE;
+	}
 }
@@ -0,0 +1,358 @@
+#include "path.h"
+
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <jansson.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <ulfius.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "config.h"
+#include "lock.h"
+
+#define PATH_SHARD_ROOT PROJECT_PATH "/" PATH_SHARDS
+
+/* migration yields for PATH_PAUSE_NS after every PATH_BATCH projects */
+#define PATH_BATCH 64
+#define PATH_PAUSE_NS (5 * 1000 * 1000)
+
+struct _path_layout
+{
+	const char *name;
+	int (*resolve)(const char *, char *, size_t, int);
+};
+
+static int _path_flat(const char *, char *, size_t, int);
+static int _path_sharded(const char *, char *, size_t, int);
+static void *_path_migrate(void *);
+static unsigned int _path_hash(const char *);
+
+static const struct _path_layout _path_layouts[] = {
+	{ "flat", _path_flat },
+	{ "sharded", _path_sharded }
+};
+
+static struct
+{
+	const struct _path_layout *layout;
+	pthread_t thread;
+	int migrating;
+	int running;
+	unsigned long migrated;
+} _path;
+
+/* path_init
+ *
+ * Function selects the PROJECT_LAYOUT used to place projects below the
+ * project root.
+ *
+ * With the sharded layout, projects still found directly in the project
+ * root are moved into their shard by a background thread while the server
+ * keeps running. Until that is done, lookups fall back to the old location.
+ * A moved project leaves a symbolic link to its shard behind, so paths
+ * resolved before the move stay good; the links go on the next start.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success and -1 on failure.
+ */
+int
+path_init(void)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(_path_layouts) / sizeof(_path_layouts[0]); ++i)
+		if (strcmp(_path_layouts[i].name, PROJECT_LAYOUT) == 0)
+			_path.layout = &_path_layouts[i];
+
+	if (!_path.layout) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Unknown project layout: %s", PROJECT_LAYOUT);
+		return -1;
+	}
+
+	if (mkdir(PROJECT_PATH, S_IRWXU) == -1 && EEXIST != errno) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to create project root: %s", PROJECT_PATH);
+		return -1;
+	}
+
+	if (_path.layout->resolve != _path_sharded)
+		return 0;
+
+	if (mkdir(PATH_SHARD_ROOT, S_IRWXU) == -1 && EEXIST != errno) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to create shard root: %s", PATH_SHARD_ROOT);
+		return -1;
+	}
+
+	_path.migrating = TRUE;
+	_path.running = TRUE;
+
+	if (pthread_create(&_path.thread, NULL, _path_migrate, NULL) != 0) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to start project migration thread.");
+		_path.running = FALSE;
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+path_fini(void)
+{
+	if (!_path.running)
+		return;
+
+	_path.running = FALSE;
+	pthread_join(_path.thread, NULL);
+}
+
+/* path_project
+ *
+ * Function resolves the directory of project 'id' into 'path'. This is the
+ * only place that knows where projects live; every handler goes through it.
+ *
+ * If 'create' is set, missing intermediate directories are created so that
+ * the project directory itself can be made at 'path'.
+ *
+ * While projects are being migrated, the path may be a link to the project
+ * rather than the project itself. Callers that rename or replace the
+ * project directory must therefore resolve it with the project lock held,
+ * when it is always the directory.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, EINVAL if 'id' is not a
+ * valid project id, or any other errno value on failure.
+ */
+int
+path_project(const char *id, char *path, size_t size, int create)
+{
+	char legacy[PATH_MAX];
+	int rc;
+
+	if (!id || id[0] == '\0' || id[0] == '.' || strchr(id, '/'))
+		return EINVAL;
+
+	if ((rc = _path.layout->resolve(id, path, size, create)) != 0)
+		return rc;
+
+	/* not moved yet, keep serving it from where it is */
+	if (__atomic_load_n(&_path.migrating, __ATOMIC_ACQUIRE) &&
+	    access(path, F_OK) == -1 && ENOENT == errno &&
+	    _path_flat(id, legacy, sizeof(legacy), FALSE) == 0 &&
+	    access(legacy, F_OK) == 0 && strlen(legacy) < size)
+		strcpy(path, legacy);
+
+	return 0;
+}
+
+/* path_project_file
+ *
+ * Function resolves the file 'file' of project 'id' into 'path'.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, EINVAL if 'id' or 'file'
+ * are not valid, or any other errno value on failure.
+ */
+int
+path_project_file(const char *id, const char *file, char *path, size_t size)
+{
+	size_t length;
+	int rc;
+
+	if (!file || file[0] == '\0' || strchr(file, '/'))
+		return EINVAL;
+
+	if ((rc = path_project(id, path, size, FALSE)) != 0)
+		return rc;
+
+	length = strlen(path);
+	rc = snprintf(path + length, size - length, "/%s", file);
+	if (rc <= 0 || (size_t) rc >= size - length)
+		return ENAMETOOLONG;
+
+	return 0;
+}
+
+void
+path_stats(struct json_t *root)
+{
+	json_t *stats;
+
+	stats = json_object();
+	if (!stats)
+		return;
+
+	json_object_set_new(stats, "name", json_string(_path.layout->name));
+	json_object_set_new(stats, "migrating", json_boolean(__atomic_load_n(&_path.migrating, __ATOMIC_ACQUIRE)));
+	json_object_set_new(stats, "migrated", json_integer(_path.migrated));
+
+	json_object_set_new(root, "layout", stats);
+}
+
+/*****************************************************************************/
+
+int
+_path_flat(const char *id, char *path, size_t size, int create)
+{
+	int rc;
+
+	UNUSED(create);
+
+	rc = snprintf(path, size, "%s/%s", PROJECT_PATH, id);
+	if (rc <= 0 || (size_t) rc >= size)
+		return ENAMETOOLONG;
+
+	return 0;
+}
+
+/* _path_sharded
+ *
+ * Function places project 'id' two levels of hexadecimal fan-out below the
+ * shard root, e.g. ".shards/3f/a0/<id>", keeping every directory small no
+ * matter how many projects there are.
+ */
+int
+_path_sharded(const char *id, char *path, size_t size, int create)
+{
+	unsigned int hash = _path_hash(id);
+	char *cut;
+	int level;
+	int rc;
+
+	rc = snprintf(path, size, "%s/%02x/%02x/%s", PATH_SHARD_ROOT,
+	    hash & 0xff, (hash >> 8) & 0xff, id);
+	if (rc <= 0 || (size_t) rc >= size)
+		return ENAMETOOLONG;
+
+	if (!create)
+		return 0;
+
+	/* "<root>/ab", then "<root>/ab/cd" */
+	for (level = 1; level <= 2; ++level) {
+		cut = &path[sizeof(PATH_SHARD_ROOT) - 1 + 3 * level];
+
+		*cut = '\0';
+		rc = mkdir(path, S_IRWXU) == -1 && EEXIST != errno ? errno : 0;
+		*cut = '/';
+
+		if (rc != 0)
+			return rc;
+	}
+
+	return 0;
+}
+
+/* _path_migrate
+ *
+ * Thread moves every project found directly in the project root into its
+ * shard, one at a time and under the project lock, so writers never see a
+ * project half-way. The link left in its place keeps paths resolved before
+ * the move working.
+ */
+void *
+_path_migrate(void *data)
+{
+	struct timespec pause = { 0, PATH_PAUSE_NS };
+	char path[PATH_MAX];
+	char link[PATH_MAX];
+	struct dirent *dentry;
+	struct stat st;
+	unsigned int moved;
+	unsigned int seen = 0;
+	ssize_t length;
+	DIR *dh;
+	int fd;
+
+	UNUSED(data);
+
+	if (!(dh = opendir(PROJECT_PATH))) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to scan project root for migration.");
+		return NULL;
+	}
+
+	fd = dirfd(dh);
+
+	/* links left by the previous run, nobody holds their paths anymore */
+	while (_path.running && (dentry = readdir(dh))) {
+		if (dentry->d_name[0] == '.' ||
+		    (dentry->d_type != DT_LNK && dentry->d_type != DT_UNKNOWN) ||
+		    _path_sharded(dentry->d_name, path, sizeof(path), FALSE) != 0)
+			continue;
+
+		length = readlinkat(fd, dentry->d_name, link, sizeof(link) - 1);
+		if (length <= 0)
+			continue;
+
+		link[length] = '\0';
+		if (strcmp(link, path + sizeof(PROJECT_PATH)) == 0)
+			unlinkat(fd, dentry->d_name, 0);
+	}
+
+	/* renaming entries away while reading the directory may skip some */
+	do {
+		moved = 0;
+		rewinddir(dh);
+
+		while (_path.running && (dentry = readdir(dh))) {
+			if (dentry->d_name[0] == '.' ||
+			    (dentry->d_type != DT_DIR && dentry->d_type != DT_UNKNOWN))
+				continue;
+
+			if (dentry->d_type == DT_UNKNOWN &&
+			    (fstatat(fd, dentry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISDIR(st.st_mode)))
+				continue;
+
+			if (_path_sharded(dentry->d_name, path, sizeof(path), TRUE) != 0) {
+				y_log_message(Y_LOG_LEVEL_ERROR, "Failed to create shard for project '%s'.", dentry->d_name);
+				continue;
+			}
+
+			lock_project(dentry->d_name);
+
+			if (renameat2(fd, dentry->d_name, AT_FDCWD, path, RENAME_NOREPLACE) == 0) {
+				if (symlinkat(path + sizeof(PROJECT_PATH), fd, dentry->d_name) == -1)
+					y_log_message(Y_LOG_LEVEL_ERROR, "Failed to link migrated project '%s'.", dentry->d_name);
+
+				__sync_fetch_and_add(&_path.migrated, 1);
+				++moved;
+			} else if (ENOENT != errno && ENOTDIR != errno) {
+				y_log_message(Y_LOG_LEVEL_ERROR, "Failed to migrate project '%s'.", dentry->d_name);
+			}
+
+			unlock_project(dentry->d_name);
+
+			if (++seen % PATH_BATCH == 0)
+				nanosleep(&pause, NULL);
+		}
+	} while (_path.running && moved > 0);
+
+	closedir(dh);
+
+	if (_path.running) {
+		__atomic_store_n(&_path.migrating, FALSE, __ATOMIC_RELEASE);
+		y_log_message(Y_LOG_LEVEL_INFO, "Project migration finished, %lu projects moved.", _path.migrated);
+	}
+
+	return NULL;
+}
+
+unsigned int
+_path_hash(const char *id)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*id) {
+		hash ^= (unsigned char) *id++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
@@ -0,0 +1,19 @@
+#ifndef CREDENTARIUS_PATH_H
+#define CREDENTARIUS_PATH_H 1
+
+#include <stddef.h>
+
+/* sharded projects live below this hidden directory of the project root */
+#define PATH_SHARDS ".shards"
+
+struct json_t;
+
+int path_init(void);
+void path_fini(void);
+
+int path_project(const char *, char *, size_t, int);
+int path_project_file(const char *, const char *, char *, size_t);
+
+void path_stats(struct json_t *);
+
+#endif
@@ -3,22 +3,52 @@
 #include <sys/stat.h>
 
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <jansson.h>
+#include <limits.h>
+#include <time.h>
 #include <ulfius.h>
 
+#include "atomic.h"
+#include "cache.h"
 #include "common.h"
+#include "compress.h"
 #include "config.h"
+#include "durable.h"
+#include "listing.h"
+#include "lock.h"
+#include "path.h"
+#include "skel.h"
+#include "trash.h"
+#include "stream.h"
+#include "upload.h"
+
+/* edit scripts are a sequence of "@<offset>,<delete>,<insert>\n<insert bytes>" */
+#define PATCH_SCRIPT_TYPE "application/x-edit-script"
 
 static int _project_path_check(const char *, int);
+static int _project_store(const struct _u_request *, struct _u_response *, int);
+static int _project_write_file(const char *, const char *, const void *, size_t, struct atomic_file *, int);
+static int _project_patch_range(int, const char *, int, const struct stat *, const char *, const char *, size_t);
+static int _project_patch_script(int, const char *, int, const struct stat *, const char *, size_t);
+static void _project_touch(int, const struct stat *);
+static int _project_send(struct _u_response *, const char *, const struct stat *, enum compress_t, const char *, size_t);
+static int _project_upload_open(int, const struct _u_request *, void **);
+static int _project_upload_write(void *, const char *, size_t);
+static void _project_upload_abort(void *);
+
+const struct upload_sink project_upload = {
+	_project_upload_open,
+	_project_upload_write,
+	_project_upload_abort
+};
 
 int
 project_delete_existing(const struct _u_request *request, struct _u_response *response, void *user_data)
 {
 	char path[PATH_MAX] = {0};
-	struct dirent *dentry;
 	const char *id;
-	DIR *dh;
 	int rc;
 
 	UNUSED(user_data);
@@ -30,65 +60,49 @@ project_delete_existing(const struct _u_request *request, struct _u_response *re
 		goto finish_response;
 	}
 
-	rc = snprintf(path, sizeof(path), "%s/%s", PROJECT_PATH, id);
-	if (rc <= 0) {
-		y_log_message(Y_LOG_LEVEL_ERROR, "snprintf failed: %s/%s", PROJECT_PATH, id);
-		rc = HTTP_INTERNAL_SERVER_ERROR;
+	if (id[0] == '.') {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Invalid project id specified.");
+		rc = HTTP_BAD_REQUEST;
 		goto finish_response;
 	}
 
-	if (_project_path_check(path, FALSE) != 0) {
-		y_log_message(Y_LOG_LEVEL_DEBUG, "Tried to delete project that doesn't exist: %s", id);
-		rc = HTTP_NOT_FOUND;
-		goto finish_response;
-	}
+	/* resolved under the lock, so a migration can't leave it a link */
+	lock_project(id);
 
-	dh = opendir(path);
-	if (!dh) {
-		y_log_message(Y_LOG_LEVEL_ERROR, "opendir failed: %s", path);
-		rc = HTTP_INTERNAL_SERVER_ERROR;
-		goto finish_response;
+	rc = path_project(id, path, sizeof(path), FALSE);
+	if (rc != 0) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to resolve project path: %s", id);
+		rc = EINVAL == rc ? HTTP_BAD_REQUEST : HTTP_INTERNAL_SERVER_ERROR;
+		goto unlock;
 	}
 
-	/* currently not supporting multiple directory levels */
-
-	while ((dentry = readdir(dh))) {
-		switch (dentry->d_type) {
-		case DT_REG:
-		case DT_LNK:
-			if (unlinkat(dirfd(dh), dentry->d_name, 0) == -1) {
-				y_log_message(Y_LOG_LEVEL_DEBUG,
-				    "Failed to delete file in project '%s': %s",
-				    id, dentry->d_name);
-			}
-			break;
-		case DT_DIR:
-			if (strcmp(dentry->d_name, ".") == 0 ||
-			    strcmp(dentry->d_name, "..") == 0) {
-				break;
-			}
-
-			/* fall-through */
-		default:
-			y_log_message(Y_LOG_LEVEL_DEBUG,
-			    "Unsupported file uncounted in project '%s': %s",
-			    id, dentry->d_name);
-			break;
-		}
+	if (_project_path_check(path, FALSE) != 0) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Tried to delete project that doesn't exist: %s", id);
+		rc = HTTP_NOT_FOUND;
+		goto unlock;
 	}
 
-	closedir(dh);
-
-	if (rmdir(path) == -1) {
-		y_log_message(Y_LOG_LEVEL_ERROR, "rmdir failed: %s", path);
+	/* the reaper thread takes care of the actual removal */
+	rc = trash_put(AT_FDCWD, path);
+	switch (rc) {
+	case 0: break;
+	case ENOENT:
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Tried to delete project that doesn't exist: %s", id);
+		rc = HTTP_NOT_FOUND;
+		goto unlock;
+	default:
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to move project to trash: %s", path);
 		rc = HTTP_INTERNAL_SERVER_ERROR;
-		goto finish_response;
+		goto unlock;
 	}
 
 	y_log_message(Y_LOG_LEVEL_DEBUG, "Project '%s' was successfully deleted.", id);
 
 	rc = HTTP_NO_CONTENT;
 
+unlock:
+	unlock_project(id);
+
 finish_response:
 	return ulfius_set_empty_response(response, rc);
 }
@@ -117,15 +131,18 @@ project_delete_file(const struct _u_request *request, struct _u_response *respon
 		goto finish_response;
 	}
 
-	rc = snprintf(path, sizeof(path), "%s/%s/%s", PROJECT_PATH, id, file);
-	if (rc <= 0) {
-		y_log_message(Y_LOG_LEVEL_ERROR, "snprintf failed: %s/%s/%s",
-		    PROJECT_PATH, id, file);
-		rc = HTTP_INTERNAL_SERVER_ERROR;
+	rc = path_project_file(id, file, path, sizeof(path));
+	if (rc != 0) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to resolve project file path: %s/%s", id, file);
+		rc = EINVAL == rc ? HTTP_BAD_REQUEST : HTTP_INTERNAL_SERVER_ERROR;
 		goto finish_response;
 	}
 
-	if (unlink(path) == -1) {
+	lock_project(id);
+	rc = unlink(path);
+	unlock_project(id);
+
+	if (rc == -1) {
 		y_log_message(Y_LOG_LEVEL_ERROR, "unlink failed: %s", path);
 		rc = HTTP_NOT_FOUND;
 		goto finish_response;
@@ -143,10 +160,15 @@ int
 project_get_file(const struct _u_request *request, struct _u_response *response, void *user_data)
 {
 	char path[PATH_MAX] = {0};
-	struct stat fstat;
+	char etag[CACHE_ETAG_MAX];
+	enum compress_t encoding;
+	struct stat st;
 	const char *id;
 	const char *file;
 	char *buffer;
+	int ranged;
+	ssize_t bread;
+	size_t offset;
 	int fd;
 	int rc;
 
@@ -169,44 +191,90 @@ project_get_file(const struct _u_request *request, struct _u_response *response,
 		return ulfius_set_empty_response(response, HTTP_BAD_REQUEST);
 	}
 
-	rc = snprintf(path, sizeof(path), "%s/%s/%s", PROJECT_PATH, id, file);
-	if (rc <= 0) {
-		y_log_message(Y_LOG_LEVEL_ERROR, "snprintf failed: %s/%s/%s",
-		    PROJECT_PATH, id, file);
-		return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
+	rc = path_project_file(id, file, path, sizeof(path));
+	if (rc != 0) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to resolve project file path: %s/%s", id, file);
+		return ulfius_set_empty_response(response,
+		    EINVAL == rc ? HTTP_BAD_REQUEST : HTTP_INTERNAL_SERVER_ERROR);
 	}
 
-	if (stat(path, &fstat) == -1) {
-		y_log_message(Y_LOG_LEVEL_ERROR, "stat failed: %s", path);
+	if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "stat failed: %s", path);
 		return ulfius_set_empty_response(response, HTTP_NOT_FOUND);
 	}
 
-	buffer = malloc(fstat.st_size);
-	if (!buffer) {
-		y_log_message(Y_LOG_LEVEL_ERROR, "malloc failed: %s", path);
-		return U_ERROR_MEMORY;
+	u_map_put(response->map_header, "Accept-Ranges", "bytes");
+
+	/* ranges address the plain bytes, never an encoded variant */
+	encoding = compress_negotiate(request, response, st.st_size);
+	ranged = stream_range_requested(request);
+	if (ranged)
+		encoding = COMPRESS_IDENTITY;
+
+	cache_etag(&st, etag, sizeof(etag));
+	compress_etag(etag, sizeof(etag), encoding);
+	u_map_put(response->map_header, "ETag", etag);
+
+	if (cache_etag_match(u_map_get_case(request->map_header, "If-None-Match"), etag))
+		return ulfius_set_empty_response(response, HTTP_NOT_MODIFIED);
+
+	if (!ranged && cache_get(path, encoding, &st, response, HTTP_OK) == 0) {
+		compress_header(response, encoding);
+		return U_OK;
 	}
 
-	fd = open(path, O_RDONLY);
+	fd = open(path, O_RDONLY|O_CLOEXEC);
 	if (fd == -1) {
-		y_log_message(Y_LOG_LEVEL_ERROR, "open failed: %s", path);
-		rc = ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
-		goto free_buffer;
+		y_log_message(Y_LOG_LEVEL_DEBUG, "open failed: %s", path);
+		return ulfius_set_empty_response(response, HTTP_NOT_FOUND);
 	}
 
-	if (read(fd, buffer, fstat.st_size) != fstat.st_size) {
-		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to read project file: %s", path);
-		rc = ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
-		goto close_file;
+	/* file might have been replaced since stat, describe what we serve */
+	if (fstat(fd, &st) == -1) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "fstat failed: %s", path);
+		close(fd);
+		return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
 	}
 
-	rc = ulfius_set_binary_response(response, HTTP_OK, buffer, fstat.st_size);
+	cache_etag(&st, etag, sizeof(etag));
+	compress_etag(etag, sizeof(etag), encoding);
+	u_map_put(response->map_header, "ETag", etag);
 
-close_file:
-	close(fd);
+	if (ranged)
+		return stream_range_response(request, response, fd, st.st_size, etag);
+
+	/* large files are not worth keeping, stream them from the descriptor */
+	if (!cache_cacheable(st.st_size)) {
+		compress_header(response, encoding);
+		return stream_file_encoded_response(response, HTTP_OK, encoding, fd, 0, st.st_size);
+	}
+
+	buffer = malloc(st.st_size ? st.st_size : 1);
+	if (!buffer) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "malloc failed: %s", path);
+		close(fd);
+		return U_ERROR_MEMORY;
+	}
+
+	for (offset = 0; offset < (size_t) st.st_size; offset += bread) {
+		bread = pread(fd, buffer + offset, st.st_size - offset, offset);
+		if (bread == -1 && EINTR == errno) {
+			bread = 0;
+			continue;
+		}
+
+		if (bread <= 0) {
+			y_log_message(Y_LOG_LEVEL_ERROR, "Failed to read project file: %s", path);
+			rc = ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
+			goto free_buffer;
+		}
+	}
+
+	rc = _project_send(response, path, &st, encoding, buffer, st.st_size);
 
 free_buffer:
 	free(buffer);
+	close(fd);
 
 	return rc;
 }
@@ -215,10 +283,15 @@ int
 project_get_files(const struct _u_request *request, struct _u_response *response, void *user_data)
 {
 	char path[PATH_MAX] = {0};
+	char etag[CACHE_ETAG_MAX];
+	enum compress_t encoding;
+	struct stat st;
 	json_t *root;
 	struct dirent *dentry;
 	const char *id;
+	char *listing;
 	DIR *dh;
+	int fd;
 	int rc;
 
 	UNUSED(user_data);
@@ -229,23 +302,52 @@ project_get_files(const struct _u_request *request, struct _u_response *response
 		return ulfius_set_empty_response(response, HTTP_BAD_REQUEST);
 	}
 
-	rc = snprintf(path, sizeof(path), "%s/%s", PROJECT_PATH, id);
-	if (rc <= 0) {
-		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to calculate project path.");
-		return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
+	rc = path_project(id, path, sizeof(path), FALSE);
+	if (rc != 0) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to resolve project path: %s", id);
+		return ulfius_set_empty_response(response,
+		    EINVAL == rc ? HTTP_BAD_REQUEST : HTTP_INTERNAL_SERVER_ERROR);
 	}
 
-	if (_project_path_check(path, FALSE) != 0) {
-		y_log_message(Y_LOG_LEVEL_DEBUG, "Tried to delete project that doesn't exist: %s", id);
+	if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode)) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Tried to list project that doesn't exist: %s", id);
 		return ulfius_set_empty_response(response, HTTP_NOT_FOUND);
 	}
 
+	if (listing_requested(request)) {
+		if ((fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1) {
+			y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to iterate through directory: %s", path);
+			return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
+		}
+
+		return listing_response(request, response, fd, LISTING_FILES);
+	}
+
+	/* the listing size is only known once built, or cached */
+	encoding = compress_negotiate(request, response,
+	    cache_length(path, COMPRESS_IDENTITY, &st));
+
+	/* directory mtime changes whenever an entry is added, removed or replaced */
+	cache_etag(&st, etag, sizeof(etag));
+	compress_etag(etag, sizeof(etag), encoding);
+	u_map_put(response->map_header, "ETag", etag);
+	u_map_put(response->map_header, "Content-Type", "application/json");
+
+	if (cache_etag_match(u_map_get_case(request->map_header, "If-None-Match"), etag))
+		return ulfius_set_empty_response(response, HTTP_NOT_MODIFIED);
+
+	if (cache_get(path, encoding, &st, response, HTTP_OK) == 0) {
+		compress_header(response, encoding);
+		return U_OK;
+	}
+
 	root = json_array();
 	if (!root)
 		return U_ERROR_MEMORY;
 
 	if (!(dh = opendir(path))) {
 		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to iterate through directory: %s", path);
+		json_decref(root);
 		return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
 	}
 
@@ -257,50 +359,55 @@ project_get_files(const struct _u_request *request, struct _u_response *response
 
 	closedir(dh);
 
+	listing = json_dumps(root, JSON_COMPACT);
+	json_decref(root);
+	if (!listing)
+		return U_ERROR_MEMORY;
+
+	/* too small after all, send and tag it plain */
+	if (encoding != COMPRESS_IDENTITY && strlen(listing) < COMPRESS_MIN_SIZE) {
+		encoding = COMPRESS_IDENTITY;
+		cache_etag(&st, etag, sizeof(etag));
+		u_map_put(response->map_header, "ETag", etag);
+	}
+
 	y_log_message(Y_LOG_LEVEL_DEBUG, "Files for project '%s' requested.", id);
 
-	return ulfius_set_json_response(response, HTTP_OK, root);
+	rc = _project_send(response, path, &st, encoding, listing, strlen(listing));
+	free(listing);
+
+	return rc;
 }
 
 int
 project_get_list(const struct _u_request *request, struct _u_response *response, void *user_data)
 {
-	json_t *root;
-	struct dirent *dentry;
-	DIR *dh;
+	int fd;
 
-	UNUSED(request);
 	UNUSED(user_data);
 
 	_project_path_check(PROJECT_PATH, TRUE);
 
-	if (!(root = json_array()))
-		return U_ERROR_MEMORY;
-
-	if (!(dh = opendir(PROJECT_PATH))) {
+	if ((fd = open(PROJECT_PATH, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1) {
 		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to iterate through project directory.");
 		return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
 	}
 
-	while ((dentry = readdir(dh))) {
-		if (dentry->d_type == DT_DIR &&
-		    dentry->d_name[0] != '.') {
-			json_array_append_new(root, json_string(dentry->d_name));
-		}
-	}
-
-	closedir(dh);
-
-	return ulfius_set_json_response(response, HTTP_OK, root);
+	return listing_response(request, response, fd, LISTING_DIRECTORIES|LISTING_SHARDED);
 }
 
 int
-project_post_file(const struct _u_request *request, struct _u_response *response, void *user_data)
+project_patch_file(const struct _u_request *request, struct _u_response *response, void *user_data)
 {
 	char path[PATH_MAX] = {0};
-	struct stat fstat;
+	char etag[CACHE_ETAG_MAX];
+	const char *content_type;
+	const char *if_match;
+	const char *range;
+	struct stat st;
 	const char *id;
 	const char *file;
+	int dfd;
 	int fd;
 	int rc;
 
@@ -323,33 +430,84 @@ project_post_file(const struct _u_request *request, struct _u_response *response
 		return ulfius_set_empty_response(response, HTTP_BAD_REQUEST);
 	}
 
-	rc = snprintf(path, sizeof(path), "%s/%s/%s", PROJECT_PATH, id, file);
-	if (rc <= 0) {
-		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to calculate project file path.");
-		return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
+	/* partial updates are meaningless without knowing what they apply to */
+	if_match = u_map_get_case(request->map_header, "If-Match");
+	if (!if_match) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Tried to patch project file without If-Match.");
+		return ulfius_set_empty_response(response, HTTP_PRECONDITION_REQUIRED);
 	}
 
-	if (stat(path, &fstat) != -1) {
-		y_log_message(Y_LOG_LEVEL_DEBUG, "Tried to override project file: %s", path);
-		return ulfius_set_empty_response(response, HTTP_CONFLICT);
+	/* opened under the lock, so a batch or delete can't swap it meanwhile */
+	lock_project(id);
+
+	rc = path_project(id, path, sizeof(path), FALSE);
+	if (rc != 0) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to resolve project path: %s", id);
+		rc = EINVAL == rc ? HTTP_BAD_REQUEST : HTTP_INTERNAL_SERVER_ERROR;
+		goto unlock;
 	}
 
-	fd = open(path, O_CREAT|O_WRONLY, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
-	if (fd == -1) {
-		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to open project file for writing: %s", path);
-		return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
+	dfd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (dfd == -1) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Tried to patch file of non-existent project: %s", id);
+		rc = HTTP_NOT_FOUND;
+		goto unlock;
 	}
 
-	if (write(fd, request->binary_body, request->binary_body_length) != (ssize_t) request->binary_body_length) {
-		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to write project file: %s", path);
-		close(fd);
-		unlink(path);
-		return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
+	fd = openat(dfd, file, O_RDWR|O_NOFOLLOW|O_CLOEXEC);
+	if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Tried to patch non-existent project file: %s/%s", path, file);
+		rc = HTTP_NOT_FOUND;
+		goto close_file;
 	}
 
-	close(fd);
+	cache_etag(&st, etag, sizeof(etag));
+	if (!cache_etag_match(if_match, etag)) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Project file changed since it was read: %s/%s", path, file);
+		rc = HTTP_PRECONDITION_FAILED;
+		goto close_file;
+	}
+
+	content_type = u_map_get_case(request->map_header, "Content-Type");
+
+	if ((range = u_map_get_case(request->map_header, "Content-Range")))
+		rc = _project_patch_range(dfd, file, fd, &st, range,
+		    request->binary_body, request->binary_body_length);
+	else if (content_type && strncmp(content_type, PATCH_SCRIPT_TYPE, strlen(PATCH_SCRIPT_TYPE)) == 0)
+		rc = _project_patch_script(dfd, file, fd, &st,
+		    request->binary_body, request->binary_body_length);
+	else
+		rc = HTTP_UNSUPPORTED_MEDIA_TYPE;
+
+	if (rc == HTTP_NO_CONTENT && fstatat(dfd, file, &st, 0) == 0) {
+		cache_etag(&st, etag, sizeof(etag));
+		u_map_put(response->map_header, "ETag", etag);
+	}
+
+close_file:
+	if (fd != -1)
+		close(fd);
+
+	close(dfd);
+
+unlock:
+	unlock_project(id);
 
-	return ulfius_set_empty_response(response, HTTP_NO_CONTENT);
+	return ulfius_set_empty_response(response, rc);
+}
+
+/* project_post_file
+ *
+ * Creates a new project file. The content is either the raw request body,
+ * or the file part of a multipart/form-data body, which is written to disk
+ * as it arrives and can exceed MAX_BODY_SIZE.
+ */
+int
+project_post_file(const struct _u_request *request, struct _u_response *response, void *user_data)
+{
+	UNUSED(user_data);
+
+	return _project_store(request, response, FALSE);
 }
 
 int
@@ -357,12 +515,6 @@ project_post_new(const struct _u_request *request, struct _u_response *response,
 {
 	char path[PATH_MAX] = {0};
 	const char *id;
-	struct dirent *dentry;
-	struct stat fstat;
-	DIR *dh_path;
-	DIR *dh_skel;
-	int fd_path;
-	int fd_skel;
 	int rc;
 
 	UNUSED(user_data);
@@ -373,147 +525,185 @@ project_post_new(const struct _u_request *request, struct _u_response *response,
 		return ulfius_set_empty_response(response, HTTP_BAD_REQUEST);
 	}
 
-	rc = snprintf(path, sizeof(path), "%s/%s", PROJECT_PATH, id);
-	if (rc <= 0) {
-		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to calculate project path.");
-		return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
+	/* hidden names are reserved for the server's own bookkeeping */
+	if (id[0] == '.' || strchr(id, '/')) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Invalid project id specified.");
+		return ulfius_set_empty_response(response, HTTP_BAD_REQUEST);
 	}
 
-	rc = _project_path_check(PROJECT_PATH, TRUE);
-	if (rc == -1) {
-		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to create root projects directory.");
+	rc = path_project(id, path, sizeof(path), TRUE);
+	if (rc != 0) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to resolve project path: %s", id);
 		return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
 	}
 
-	rc = _project_path_check(path, TRUE);
-	if (rc != 1)
+	rc = skel_create(path);
+	switch (rc) {
+	case 0: break;
+	case EEXIST:
+	case ENOTEMPTY:
 		return ulfius_set_empty_response(response, HTTP_CONFLICT);
-
-	if (!(dh_path = opendir(path))) {
-		y_log_message(Y_LOG_LEVEL_ERROR,
-		    "Failed to open project directory: %s", path);
+	default:
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to create project '%s': %s", id, strerror(rc));
 		return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
 	}
 
-	if (!(dh_skel = opendir(SKEL_PATH))) {
-		y_log_message(Y_LOG_LEVEL_ERROR,
-		    "Failed to iterate through skel directory: %s",
-		    SKEL_PATH);
-		return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
-	}
-
-	while ((dentry = readdir(dh_skel))) {
-		switch (dentry->d_type) {
-		case DT_REG:
-		case DT_LNK:
-			rc = fstatat(dirfd(dh_skel), dentry->d_name, &fstat, 0);
-			if (rc == -1) {
-				y_log_message(Y_LOG_LEVEL_ERROR,
-				    "Failed to query skel directory file: %s",
-				    dentry->d_name);
-				continue;
-			}
-
-			fd_skel = openat(dirfd(dh_skel), dentry->d_name, O_RDONLY);
-			if (fd_skel == -1) {
-				y_log_message(Y_LOG_LEVEL_ERROR,
-				    "Failed to open skel directory file: %s",
-				    dentry->d_name);
-				continue;
-			}
-
-			fd_path = openat(dirfd(dh_path), dentry->d_name,
-			                 O_WRONLY|O_CREAT, S_IRUSR|S_IWUSR);
-			if (fd_path == -1) {
-				y_log_message(Y_LOG_LEVEL_ERROR,
-				    "Failed to create project file: %s",
-				    dentry->d_name);
-				close(fd_skel);
-				continue;
-			}
-
-			rc = sendfile(fd_path, fd_skel, NULL, fstat.st_size);
-			if (rc == -1) {
-				y_log_message(Y_LOG_LEVEL_ERROR,
-				    "Failed to copy skel directory file: %s",
-				    dentry->d_name);
-			}
-
-			close(fd_path);
-			close(fd_skel);
-			break;
-
-		default: break;
-		}
-	}
-
-	closedir(dh_skel);
-	closedir(dh_path);
-
 	y_log_message(Y_LOG_LEVEL_DEBUG, "Project '%s' was successfully created.", id);
 
 	return ulfius_set_empty_response(response, HTTP_CREATED);
 }
 
+/* project_put_file
+ *
+ * Replaces an existing project file, taking its content like
+ * project_post_file. The file only changes once the new content is
+ * complete.
+ */
 int
 project_put_file(const struct _u_request *request, struct _u_response *response, void *user_data)
+{
+	UNUSED(user_data);
+
+	return _project_store(request, response, TRUE);
+}
+
+/*****************************************************************************/
+
+/* _project_store
+ *
+ * Function writes the file named in the request, creating it or, with
+ * 'replace' set, replacing it.
+ */
+int
+_project_store(const struct _u_request *request, struct _u_response *response, int replace)
 {
 	char path[PATH_MAX] = {0};
-	struct stat fstat;
+	struct atomic_file *upload = NULL;
 	const char *id;
 	const char *file;
-	int fd;
 	int rc;
 
-	UNUSED(user_data);
+	switch (upload_claim(request, &project_upload, (void **) &upload)) {
+	case 0:
+	case ENOENT:
+		break;
+	case EINVAL:
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Upload without a file.");
+		return ulfius_set_empty_response(response, HTTP_BAD_REQUEST);
+	default:
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to receive upload.");
+		return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
+	}
 
 	id = u_map_get(request->map_url, "id");
 	if (!id) {
 		y_log_message(Y_LOG_LEVEL_DEBUG, "No project id was specified.");
-		return ulfius_set_empty_response(response, HTTP_BAD_REQUEST);
+		rc = HTTP_BAD_REQUEST;
+		goto discard;
 	}
 
 	file = u_map_get(request->map_url, "file");
 	if (!file) {
 		y_log_message(Y_LOG_LEVEL_DEBUG, "No file was specified.");
-		return ulfius_set_empty_response(response, HTTP_BAD_REQUEST);
+		rc = HTTP_BAD_REQUEST;
+		goto discard;
 	}
 
 	if (file[0] == '.') {
 		y_log_message(Y_LOG_LEVEL_DEBUG, "Invalid file name specified.");
-		return ulfius_set_empty_response(response, HTTP_BAD_REQUEST);
+		rc = HTTP_BAD_REQUEST;
+		goto discard;
 	}
 
-	rc = snprintf(path, sizeof(path), "%s/%s/%s", PROJECT_PATH, id, file);
-	if (rc <= 0) {
-		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to calculate project file path.");
-		return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
-	}
+	/* resolved under the lock, so a migration can't leave it a link */
+	lock_project(id);
 
-	if (stat(path, &fstat) == -1) {
-		y_log_message(Y_LOG_LEVEL_DEBUG, "Tried to override non-existent project file: %s", path);
-		return ulfius_set_empty_response(response, HTTP_NOT_FOUND);
+	rc = path_project(id, path, sizeof(path), FALSE);
+	if (rc != 0) {
+		unlock_project(id);
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to resolve project path: %s", id);
+		rc = EINVAL == rc ? HTTP_BAD_REQUEST : HTTP_INTERNAL_SERVER_ERROR;
+		goto discard;
 	}
 
-	fd = open(path, O_TRUNC|O_WRONLY);
-	if (fd == -1) {
-		y_log_message(Y_LOG_LEVEL_DEBUG, "Failed to open project file for writing: %s", path);
-		return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
+	/* consumes the upload either way */
+	rc = _project_write_file(path, file, request->binary_body,
+	    request->binary_body_length, upload, replace);
+	unlock_project(id);
+
+	free(upload);
+	upload = NULL;
+
+	switch (rc) {
+	case 0:
+		rc = HTTP_NO_CONTENT;
+		break;
+	case EEXIST:
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Tried to override project file: %s/%s", path, file);
+		rc = HTTP_CONFLICT;
+		break;
+	case ENOENT:
+		if (replace)
+			y_log_message(Y_LOG_LEVEL_DEBUG, "Tried to override non-existent project file: %s/%s", path, file);
+		else
+			y_log_message(Y_LOG_LEVEL_DEBUG, "Tried to write to non-existent project: %s", id);
+		rc = HTTP_NOT_FOUND;
+		break;
+	default:
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to write project file: %s/%s", path, file);
+		rc = HTTP_INTERNAL_SERVER_ERROR;
+		break;
 	}
 
-	if (write(fd, request->binary_body, request->binary_body_length) != (ssize_t) request->binary_body_length) {
-		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to write project file: %s", path);
-		close(fd);
-		unlink(path);
-		return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
+discard:
+	if (upload)
+		_project_upload_abort(upload);
+
+	return ulfius_set_empty_response(response, rc);
+}
+
+/* _project_upload_open
+ *
+ * Function starts receiving an uploaded project file into the upload
+ * directory 'dfd'. Where it goes is only known, and looked up under the
+ * project lock, once the endpoint runs.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+_project_upload_open(int dfd, const struct _u_request *request, void **data)
+{
+	struct atomic_file *file;
+	int rc;
+
+	UNUSED(request);
+
+	if (!(file = malloc(sizeof(*file))))
+		return ENOMEM;
+
+	if ((rc = atomic_open(file, dfd, "upload")) != 0) {
+		free(file);
+		return rc;
 	}
 
-	close(fd);
+	*data = file;
+	return 0;
+}
 
-	return ulfius_set_empty_response(response, HTTP_NO_CONTENT);
+int
+_project_upload_write(void *data, const char *buffer, size_t length)
+{
+	return atomic_write(data, buffer, length);
 }
 
-/*****************************************************************************/
+void
+_project_upload_abort(void *data)
+{
+	atomic_abort(data);
+	free(data);
+}
 
 /* _project_path_check
  *
@@ -537,7 +727,7 @@ _project_path_check(const char *path, int create)
 
 	if (stat(path, &fstat) == -1) {
 		if (create && mkdir(path, S_IRWXU) != -1)
-			rc = 1;
+			rc = durable_parent(path) == 0 ? 1 : -1;
 		else
 			rc = -1;
 	}
@@ -545,3 +735,291 @@ _project_path_check(const char *path, int create)
 	return rc;
 }
 
+
+/* _project_write_file
+ *
+ * Function atomically writes 'length' bytes from 'data' to 'file' inside
+ * the project directory 'path'. If 'upload' is given, the content received
+ * there is moved into place instead; it is committed or discarded either
+ * way, but left to the caller to free.
+ *
+ * If the 'replace' parameter is set to FALSE (0), the call will fail if the
+ * file already exists. Otherwise the call will fail if it does not.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, EEXIST or ENOENT if the
+ * 'replace' precondition was not met (ENOENT is also returned if the project
+ * does not exist), or any other errno value on failure.
+ */
+int
+_project_write_file(const char *path, const char *file, const void *data, size_t length,
+    struct atomic_file *upload, int replace)
+{
+	struct atomic_file afile;
+	struct stat fstat;
+	int dfd;
+	int rc;
+
+	dfd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (dfd == -1) {
+		rc = ENOENT == errno || ENOTDIR == errno ? ENOENT : errno;
+		goto discard;
+	}
+
+	/* don't bother writing anything that can't be committed */
+	if (replace && fstatat(dfd, file, &fstat, 0) == -1) {
+		rc = ENOENT == errno ? ENOENT : errno;
+		goto close_dir;
+	}
+
+	if (upload) {
+		if ((rc = atomic_move(upload, dfd, file)) != 0)
+			goto close_dir;
+
+		rc = atomic_commit(upload, replace ? ATOMIC_REPLACE : ATOMIC_CREATE);
+		upload = NULL;
+		goto close_dir;
+	}
+
+	if ((rc = atomic_open(&afile, dfd, file)) != 0)
+		goto close_dir;
+
+	if ((rc = atomic_write(&afile, data, length)) != 0) {
+		atomic_abort(&afile);
+		goto close_dir;
+	}
+
+	rc = atomic_commit(&afile, replace ? ATOMIC_REPLACE : ATOMIC_CREATE);
+
+close_dir:
+	close(dfd);
+
+discard:
+	if (upload)
+		atomic_abort(upload);
+
+	return rc;
+}
+
+/* _project_patch_range
+ *
+ * Function writes 'length' bytes from 'data' at the position given by the
+ * Content-Range header value 'range' ("bytes <first>-<last>/<size|*>").
+ * If a complete size is given, the file is truncated to it afterwards.
+ *
+ * The write happens in place, so its cost only depends on the size of the
+ * range. Blocks shared through the blob store are copied on write by the
+ * file system, and the file isn't interned again, so it keeps sharing only
+ * the blocks the patch didn't touch. A file still linked elsewhere, as by
+ * the snapshot of a batch until it is reaped, is never modified; a new
+ * copy is written instead.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the HTTP status for the request.
+ */
+int
+_project_patch_range(int dfd, const char *file, int fd, const struct stat *st,
+    const char *range, const char *data, size_t length)
+{
+	unsigned long long first;
+	unsigned long long last;
+	unsigned long long size;
+	unsigned long long end;
+	struct atomic_file afile;
+	char total[24] = {0};
+	ssize_t bwritten;
+	size_t offset;
+
+	if (sscanf(range, "bytes %llu-%llu/%23s", &first, &last, total) != 3 ||
+	    last < first || last == ULLONG_MAX || last - first + 1 != length)
+		return HTTP_BAD_REQUEST;
+
+	end = (unsigned long long) st->st_size > last + 1 ? (unsigned long long) st->st_size : last + 1;
+	size = end;
+
+	if (strcmp(total, "*") != 0) {
+		if (sscanf(total, "%llu", &size) != 1)
+			return HTTP_BAD_REQUEST;
+
+		if (size < last + 1 || size > end)
+			return HTTP_RANGE_NOT_SATISFIABLE;
+	}
+
+	/* ranges may extend the file, but must not leave holes */
+	if (first > (unsigned long long) st->st_size)
+		return HTTP_RANGE_NOT_SATISFIABLE;
+
+	if (st->st_nlink > 1) {
+		if (atomic_open(&afile, dfd, file) != 0)
+			return HTTP_INTERNAL_SERVER_ERROR;
+
+		if (atomic_copy(&afile, fd, 0, first) != 0 ||
+		    atomic_write(&afile, data, length) != 0 ||
+		    (size > last + 1 && atomic_copy(&afile, fd, last + 1, size - last - 1) != 0)) {
+			atomic_abort(&afile);
+			return HTTP_INTERNAL_SERVER_ERROR;
+		}
+
+		return atomic_commit(&afile, ATOMIC_REPLACE) == 0 ?
+		    HTTP_NO_CONTENT : HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	for (offset = 0; offset < length; offset += bwritten) {
+		bwritten = pwrite(fd, data + offset, length - offset, first + offset);
+		if (bwritten == -1 && EINTR == errno) {
+			bwritten = 0;
+			continue;
+		}
+
+		if (bwritten <= 0)
+			return HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	if (size < end && ftruncate(fd, size) == -1)
+		return HTTP_INTERNAL_SERVER_ERROR;
+
+	if (durable_sync(fd, DURABLE_DATA) != 0)
+		return HTTP_INTERNAL_SERVER_ERROR;
+
+	_project_touch(fd, st);
+
+	return HTTP_NO_CONTENT;
+}
+
+/* _project_patch_script
+ *
+ * Function applies an edit script to the file open as 'fd'.
+ *
+ * Each edit replaces <delete> bytes at <offset> of the current content with
+ * the <insert> bytes that follow its header line. Offsets refer to the
+ * current content and must be increasing and non-overlapping. The result is
+ * assembled in a new file, copying unchanged spans in the kernel, and
+ * renamed into place once every edit applied cleanly.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the HTTP status for the request.
+ */
+int
+_project_patch_script(int dfd, const char *file, int fd, const struct stat *st,
+    const char *script, size_t length)
+{
+	unsigned long long offset;
+	unsigned long long delete;
+	unsigned long long insert;
+	unsigned long long position = 0;
+	struct atomic_file afile;
+	const char *cursor = script;
+	const char *end = script + length;
+	const char *line;
+	char header[96];
+	int rc = HTTP_BAD_REQUEST;
+
+	if (atomic_open(&afile, dfd, file) != 0)
+		return HTTP_INTERNAL_SERVER_ERROR;
+
+	while (cursor < end) {
+		line = memchr(cursor, '\n', end - cursor);
+		if (!line || (size_t) (line - cursor) >= sizeof(header))
+			goto abort;
+
+		memcpy(header, cursor, line - cursor);
+		header[line - cursor] = '\0';
+		cursor = line + 1;
+
+		/* written not to overflow, whatever numbers come in */
+		if (sscanf(header, "@%llu,%llu,%llu", &offset, &delete, &insert) != 3 ||
+		    offset < position || delete > (unsigned long long) st->st_size ||
+		    offset > (unsigned long long) st->st_size - delete ||
+		    insert > (unsigned long long) (end - cursor))
+			goto abort;
+
+		if (atomic_copy(&afile, fd, position, offset - position) != 0 ||
+		    atomic_write(&afile, cursor, insert) != 0) {
+			rc = HTTP_INTERNAL_SERVER_ERROR;
+			goto abort;
+		}
+
+		cursor += insert;
+		position = offset + delete;
+	}
+
+	if (atomic_copy(&afile, fd, position, st->st_size - position) != 0) {
+		rc = HTTP_INTERNAL_SERVER_ERROR;
+		goto abort;
+	}
+
+	return atomic_commit(&afile, ATOMIC_REPLACE) == 0 ?
+	    HTTP_NO_CONTENT : HTTP_INTERNAL_SERVER_ERROR;
+
+abort:
+	atomic_abort(&afile);
+	return rc;
+}
+
+/* _project_touch
+ *
+ * Function sets the modification time of 'fd' to now, guaranteeing it
+ * differs from the previous one described by 'st'. In-place writes may
+ * keep size and inode, and entity tags depend on the time changing.
+ */
+void
+_project_touch(int fd, const struct stat *st)
+{
+	struct timespec times[2];
+
+	times[0].tv_sec = 0;
+	times[0].tv_nsec = UTIME_OMIT;
+
+	clock_gettime(CLOCK_REALTIME, &times[1]);
+
+	if (times[1].tv_sec < st->st_mtim.tv_sec ||
+	    (times[1].tv_sec == st->st_mtim.tv_sec && times[1].tv_nsec <= st->st_mtim.tv_nsec)) {
+		times[1] = st->st_mtim;
+		if (++times[1].tv_nsec == 1000000000) {
+			times[1].tv_nsec = 0;
+			++times[1].tv_sec;
+		}
+	}
+
+	futimens(fd, times);
+}
+
+/* _project_send
+ *
+ * Function caches the plain 'data' read from 'path' along with its
+ * 'encoding' variant, so an unchanged file is compressed only once, and sets
+ * the variant as the body of 'response'.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the ulfius status of setting the response.
+ */
+int
+_project_send(struct _u_response *response, const char *path, const struct stat *st,
+    enum compress_t encoding, const char *data, size_t length)
+{
+	size_t encoded_length;
+	char *encoded;
+	int rc;
+
+	cache_put(path, COMPRESS_IDENTITY, st, data, length);
+
+	if (encoding == COMPRESS_IDENTITY)
+		return ulfius_set_binary_response(response, HTTP_OK, data, length);
+
+	if (compress_buffer(encoding, data, length, &encoded, &encoded_length) != 0) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to compress response: %s", path);
+		return ulfius_set_empty_response(response, HTTP_INTERNAL_SERVER_ERROR);
+	}
+
+	cache_put(path, encoding, st, encoded, encoded_length);
+
+	compress_header(response, encoding);
+	rc = ulfius_set_binary_response(response, HTTP_OK, encoded, encoded_length);
+	free(encoded);
+
+	return rc;
+}
@@ -3,14 +3,18 @@
 
 struct _u_request;
 struct _u_response;
+struct upload_sink;
 
 int project_delete_existing(const struct _u_request *, struct _u_response *, void *);
 int project_delete_file(const struct _u_request *, struct _u_response *, void *);
 int project_get_file(const struct _u_request *, struct _u_response *, void *);
 int project_get_files(const struct _u_request *, struct _u_response *, void *);
 int project_get_list(const struct _u_request *, struct _u_response *, void *);
+int project_patch_file(const struct _u_request *, struct _u_response *, void *);
 int project_post_file(const struct _u_request *, struct _u_response *, void *);
 int project_post_new(const struct _u_request *, struct _u_response *, void *);
 int project_put_file(const struct _u_request *, struct _u_response *, void *);
 
+extern const struct upload_sink project_upload;
+
 #endif
@@ -0,0 +1,748 @@
+#include "remote.h"
+
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <jansson.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ulfius.h>
+#include <unistd.h>
+
+#include "archive.h"
+#include "artifact.h"
+#include "atomic.h"
+#include "common.h"
+#include "config.h"
+#include "wire.h"
+
+#define REMOTE_WORKERS_MAX 32
+#define REMOTE_ADDRESS_MAX 256
+
+/* workers are asked how they're doing every REMOTE_PING_MS */
+#define REMOTE_PING_MS 2000
+#define REMOTE_CONNECT_MS 1000
+
+/* a worker that says nothing for this long is taken for dead */
+#define REMOTE_TIMEOUT_MS (6 * WIRE_KEEPALIVE_MS)
+
+#define REMOTE_ARTIFACTS (sizeof(_remote_artifacts) / sizeof(_remote_artifacts[0]))
+
+struct _remote_worker
+{
+	char address[REMOTE_ADDRESS_MAX];
+	int healthy;
+	unsigned int load;     /* builds running and waiting, as last reported */
+	unsigned int capacity; /* builds it runs at once, as last reported */
+	unsigned int sent;     /* builds handed to it since it last reported */
+	unsigned int active;   /* builds of ours it is running */
+	unsigned long reports;
+	unsigned long builds;
+	unsigned long failures;
+};
+
+struct remote
+{
+	struct _remote_worker *worker;
+	unsigned long report; /* what the worker had last reported when it got the build */
+	int fd;
+	int dfd; /* the project directory, where the artifacts go */
+	int status;
+	int done;
+	int cancelled;
+	unsigned int received; /* artifacts received, one bit each */
+	struct atomic_file file;
+	int file_open;
+	size_t offset;
+	size_t length;
+	char buffer[WIRE_FRAME_MAX];
+};
+
+static struct _remote_worker *_remote_pick(const char *, const unsigned char *);
+static int _remote_start(struct remote *, const char *, const char *, size_t);
+static int _remote_artifact(struct remote *, enum wire_t, size_t);
+static void _remote_done(struct remote *);
+static void _remote_fail(struct remote *, int);
+static void *_remote_watch(void *);
+static int _remote_ping(const char *, unsigned int *, unsigned int *);
+static unsigned int _remote_hash(const char *, const char *);
+
+static const char *const _remote_artifacts[] = {
+	ARTIFACT_FIRMWARE,
+	ARTIFACT_MAP,
+	ARTIFACT_ELF
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int running;
+	struct _remote_worker workers[REMOTE_WORKERS_MAX];
+	unsigned int count;
+	unsigned long dispatched;
+	unsigned long lost;
+} _remote = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER
+};
+
+/* remote_init
+ *
+ * Function sets up the build workers listed in BUILD_REMOTE and starts the
+ * thread keeping track of their health and load. With none listed, every
+ * build runs here. Workers only take connections that prove they know the
+ * key in BUILD_KEY.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success and -1 on failure.
+ */
+int
+remote_init(void)
+{
+	char addresses[] = BUILD_REMOTE;
+	struct _remote_worker *worker;
+	char *address;
+	char *state;
+	int rc;
+
+	for (address = strtok_r(addresses, " ", &state); address;
+	     address = strtok_r(NULL, " ", &state)) {
+		if (_remote.count == REMOTE_WORKERS_MAX || strlen(address) >= REMOTE_ADDRESS_MAX) {
+			y_log_message(Y_LOG_LEVEL_ERROR, "Too many build workers, or address too long: %s", address);
+			return -1;
+		}
+
+		/* believed up until the first ping says otherwise */
+		worker = &_remote.workers[_remote.count++];
+		strcpy(worker->address, address);
+		worker->healthy = TRUE;
+		worker->capacity = 1;
+	}
+
+	if (_remote.count == 0)
+		return 0;
+
+	if ((rc = wire_init()) != 0) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to read build worker key %s: %s", BUILD_KEY, strerror(rc));
+		return -1;
+	}
+
+	_remote.running = TRUE;
+
+	if (pthread_create(&_remote.thread, NULL, _remote_watch, NULL) != 0) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to start build worker watch thread.");
+		_remote.running = FALSE;
+		return -1;
+	}
+
+	y_log_message(Y_LOG_LEVEL_INFO, "Using %u build workers.", _remote.count);
+
+	return 0;
+}
+
+void
+remote_fini(void)
+{
+	if (!_remote.running)
+		return;
+
+	pthread_mutex_lock(&_remote.lock);
+	_remote.running = FALSE;
+	pthread_cond_signal(&_remote.cond);
+	pthread_mutex_unlock(&_remote.lock);
+
+	pthread_join(_remote.thread, NULL);
+}
+
+/* remote_build
+ *
+ * Function hands the build of the project directory 'path' to the least
+ * loaded healthy worker, relative to its capacity. The worker gets a
+ * snapshot of the sources along with the 'fingerprint' of the toolchain,
+ * and keeps the objects of the project between builds.
+ *
+ * The output is then read with remote_read while the artifacts arrive in
+ * 'path'. A worker that can't be reached is marked as down and the next one
+ * tried.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, ENOTSUP if no worker is
+ * available, or any other errno value on failure. The outcome must be
+ * collected with remote_wait.
+ */
+int
+remote_build(const char *path, const char *fingerprint, struct remote **remote)
+{
+	unsigned char tried[REMOTE_WORKERS_MAX] = {0};
+	struct _remote_worker *worker;
+	struct remote *build;
+	const char *name;
+	size_t length;
+	int rc = ENOTSUP;
+
+	if (_remote.count == 0)
+		return ENOTSUP;
+
+	name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+
+	length = strlen(name) + 1 + strlen(fingerprint);
+	if (length > WIRE_FRAME_MAX)
+		return ENAMETOOLONG;
+
+	build = calloc(1, sizeof(*build));
+	if (!build)
+		return ENOMEM;
+
+	build->fd = -1;
+
+	build->dfd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (build->dfd == -1) {
+		rc = errno;
+		free(build);
+		return rc;
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&_remote.lock);
+		worker = _remote_pick(name, tried);
+		if (worker) {
+			tried[worker - _remote.workers] = TRUE;
+			build->worker = worker;
+			build->report = worker->reports;
+			++worker->sent;
+			++worker->active;
+		}
+		pthread_mutex_unlock(&_remote.lock);
+
+		if (!worker) {
+			rc = ENOTSUP;
+			break;
+		}
+
+		/* "<name>\0<fingerprint>" */
+		strcpy(build->buffer, name);
+		strcpy(build->buffer + strlen(name) + 1, fingerprint);
+
+		rc = _remote_start(build, worker->address, path, length);
+		if (rc == 0) {
+			pthread_mutex_lock(&_remote.lock);
+			++worker->builds;
+			++_remote.dispatched;
+			pthread_mutex_unlock(&_remote.lock);
+
+			*remote = build;
+			return 0;
+		}
+
+		if (build->fd != -1) {
+			close(build->fd);
+			build->fd = -1;
+		}
+
+		/* the project is gone, not the worker */
+		if (ENOENT == rc) {
+			pthread_mutex_lock(&_remote.lock);
+			_remote_done(build);
+			pthread_mutex_unlock(&_remote.lock);
+			break;
+		}
+
+		_remote_fail(build, rc);
+	}
+
+	close(build->dfd);
+	free(build);
+
+	return rc;
+}
+
+/* remote_read
+ *
+ * Function reads up to 'max' more bytes of build output into 'buffer',
+ * storing the artifacts coming along in the project directory.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the number of bytes read, zero (0) once make
+ * exited, or -1 if the worker was lost.
+ */
+ssize_t
+remote_read(struct remote *remote, char *buffer, size_t max)
+{
+	enum wire_t type;
+	size_t length;
+	int rc;
+
+	for (;;) {
+		if (remote->offset < remote->length) {
+			length = remote->length - remote->offset;
+			if (length > max)
+				length = max;
+
+			memcpy(buffer, remote->buffer + remote->offset, length);
+			remote->offset += length;
+
+			return length;
+		}
+
+		if (remote->done)
+			return 0;
+
+		remote->offset = remote->length = 0;
+
+		rc = wire_recv(remote->fd, &type, remote->buffer, sizeof(remote->buffer), &length);
+		if (rc != 0) {
+			if (!remote->cancelled)
+				y_log_message(Y_LOG_LEVEL_ERROR, "Lost build worker %s: %s", remote->worker->address, strerror(rc));
+			return -1;
+		}
+
+		switch (type) {
+		case WIRE_LOG:
+			/* empty ones just tell that the worker is still there */
+			remote->length = length;
+			break;
+
+		case WIRE_FILE:
+		case WIRE_DATA:
+		case WIRE_EXIT:
+			if (_remote_artifact(remote, type, length) != 0)
+				return -1;
+			break;
+
+		default:
+			y_log_message(Y_LOG_LEVEL_ERROR, "Unexpected frame '%c' from build worker %s.", type, remote->worker->address);
+			return -1;
+		}
+	}
+}
+
+/* remote_cancel
+ *
+ * Function drops the connection to the worker running 'remote', which then
+ * stops make. A remote_read in progress returns -1.
+ */
+void
+remote_cancel(struct remote *remote)
+{
+	remote->cancelled = TRUE;
+	shutdown(remote->fd, SHUT_RDWR);
+}
+
+/* remote_wait
+ *
+ * Function ends the build 'remote'. If make exited, the artifacts it left
+ * behind replace those of the project and any others are removed.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the exit status of make, or -1 if the worker
+ * was lost before it exited.
+ */
+int
+remote_wait(struct remote *remote)
+{
+	struct _remote_worker *worker = remote->worker;
+	int status = remote->done ? remote->status : -1;
+	size_t i;
+
+	if (remote->file_open)
+		atomic_abort(&remote->file);
+
+	if (remote->done) {
+		for (i = 0; i < REMOTE_ARTIFACTS; ++i)
+			if (!(remote->received & 1u << i))
+				unlinkat(remote->dfd, _remote_artifacts[i], 0);
+	}
+
+	close(remote->fd);
+	close(remote->dfd);
+
+	pthread_mutex_lock(&_remote.lock);
+	_remote_done(remote);
+	if (!remote->done && !remote->cancelled) {
+		++_remote.lost;
+		worker->healthy = FALSE;
+		++worker->failures;
+	}
+	pthread_mutex_unlock(&_remote.lock);
+
+	free(remote);
+
+	return status;
+}
+
+void
+remote_stats(struct json_t *root)
+{
+	struct _remote_worker *worker;
+	json_t *stats;
+	json_t *workers;
+	json_t *entry;
+	unsigned int i;
+
+	stats = json_object();
+	if (!stats)
+		return;
+
+	workers = json_array();
+
+	pthread_mutex_lock(&_remote.lock);
+	for (i = 0; i < _remote.count && workers; ++i) {
+		worker = &_remote.workers[i];
+
+		if (!(entry = json_object()))
+			continue;
+
+		json_object_set_new(entry, "address", json_string(worker->address));
+		json_object_set_new(entry, "healthy", json_boolean(worker->healthy));
+		json_object_set_new(entry, "load", json_integer(worker->load + worker->sent));
+		json_object_set_new(entry, "capacity", json_integer(worker->capacity));
+		json_object_set_new(entry, "active", json_integer(worker->active));
+		json_object_set_new(entry, "builds", json_integer(worker->builds));
+		json_object_set_new(entry, "failures", json_integer(worker->failures));
+		json_array_append_new(workers, entry);
+	}
+
+	json_object_set_new(stats, "dispatched", json_integer(_remote.dispatched));
+	json_object_set_new(stats, "lost", json_integer(_remote.lost));
+	pthread_mutex_unlock(&_remote.lock);
+
+	if (workers)
+		json_object_set_new(stats, "workers", workers);
+
+	json_object_set_new(root, "remote", stats);
+}
+
+/*****************************************************************************/
+
+/* _remote_pick
+ *
+ * Function picks a healthy worker, not 'tried' yet, for project 'name'.
+ *
+ * Each project has a home worker, the one ranking highest by a hash of the
+ * project name and its address, which keeps the objects of the project from
+ * one build to the next. Every server agrees on it, and it only changes
+ * when workers come or go. If the home worker is full, the build goes to
+ * the one with the fewest builds running and waiting for each it can run
+ * at once, builds handed to a worker since it last reported included.
+ *
+ * Must be called with the lock held.
+ */
+struct _remote_worker *
+_remote_pick(const char *name, const unsigned char *tried)
+{
+	struct _remote_worker *home = NULL;
+	struct _remote_worker *best = NULL;
+	struct _remote_worker *worker;
+	unsigned int rank = 0;
+	unsigned int hash;
+	unsigned int i;
+
+	for (i = 0; i < _remote.count; ++i) {
+		worker = &_remote.workers[i];
+
+		if (tried[i] || !worker->healthy)
+			continue;
+
+		hash = _remote_hash(worker->address, name);
+		if (!home || hash > rank) {
+			home = worker;
+			rank = hash;
+		}
+
+		/* load / capacity < best load / best capacity */
+		if (!best || (unsigned long) (worker->load + worker->sent) * best->capacity <
+		             (unsigned long) (best->load + best->sent) * worker->capacity)
+			best = worker;
+	}
+
+	if (home && home->load + home->sent < home->capacity)
+		return home;
+
+	return best;
+}
+
+/* _remote_start
+ *
+ * Function connects to the worker at 'address', asks it for a build with
+ * the 'length' bytes of request in the buffer of 'remote', and sends it a
+ * tar archive of the project directory 'path'.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, ENOENT if the project can't
+ * be read, or any other errno value if the worker failed.
+ */
+int
+_remote_start(struct remote *remote, const char *address, const char *path, size_t length)
+{
+	struct archive_writer *writer;
+	ssize_t bread;
+	int rc;
+
+	remote->fd = wire_connect(address, REMOTE_CONNECT_MS);
+	if (remote->fd == -1)
+		return errno;
+
+	if ((rc = wire_timeout(remote->fd, REMOTE_TIMEOUT_MS)) != 0 ||
+	    (rc = wire_send(remote->fd, WIRE_BUILD, remote->buffer, length)) != 0)
+		return rc;
+
+	if (!(writer = archive_writer_open(path)))
+		return ENOENT;
+
+	while ((bread = archive_writer_read(writer, remote->buffer, sizeof(remote->buffer))) > 0)
+		if ((rc = wire_send(remote->fd, WIRE_DATA, remote->buffer, bread)) != 0)
+			break;
+
+	archive_writer_close(writer);
+
+	if (bread == -1)
+		return ENOENT;
+
+	if (rc == 0)
+		rc = wire_send(remote->fd, WIRE_END, NULL, 0);
+
+	return rc;
+}
+
+/* _remote_artifact
+ *
+ * Function handles a frame of 'type' and 'length' in the buffer of 'remote'
+ * that carries an artifact, or the exit status that follows them. Only the
+ * known artifacts are accepted, and each is renamed into place once
+ * complete.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success and -1 on failure.
+ */
+int
+_remote_artifact(struct remote *remote, enum wire_t type, size_t length)
+{
+	size_t i;
+
+	if (type == WIRE_DATA) {
+		if (!remote->file_open)
+			return -1;
+
+		if (atomic_write(&remote->file, remote->buffer, length) != 0) {
+			y_log_message(Y_LOG_LEVEL_ERROR, "Failed to write build artifact: %s", remote->file.name);
+			return -1;
+		}
+
+		return 0;
+	}
+
+	/* the previous artifact is complete */
+	if (remote->file_open) {
+		remote->file_open = FALSE;
+		if (atomic_commit(&remote->file, ATOMIC_ANY) != 0) {
+			y_log_message(Y_LOG_LEVEL_ERROR, "Failed to store build artifact: %s", remote->file.name);
+			return -1;
+		}
+	}
+
+	if (type == WIRE_EXIT) {
+		if (length != 4)
+			return -1;
+
+		remote->status = (int32_t) wire_get32((unsigned char *) remote->buffer);
+		remote->done = TRUE;
+		return 0;
+	}
+
+	for (i = 0; i < REMOTE_ARTIFACTS; ++i)
+		if (strlen(_remote_artifacts[i]) == length &&
+		    memcmp(_remote_artifacts[i], remote->buffer, length) == 0)
+			break;
+
+	if (i == REMOTE_ARTIFACTS) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Unexpected artifact from build worker %s.", remote->worker->address);
+		return -1;
+	}
+
+	if (atomic_open(&remote->file, remote->dfd, _remote_artifacts[i]) != 0) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to create build artifact: %s", _remote_artifacts[i]);
+		return -1;
+	}
+
+	remote->file_open = TRUE;
+	remote->received |= 1u << i;
+
+	return 0;
+}
+
+/* _remote_done
+ *
+ * Function takes the build 'remote' off the load of its worker, from what
+ * it reported or from the builds it got since. Must be called with the
+ * lock held.
+ */
+void
+_remote_done(struct remote *remote)
+{
+	struct _remote_worker *worker = remote->worker;
+
+	--worker->active;
+
+	if (remote->report == worker->reports && worker->sent > 0)
+		--worker->sent;
+	else if (remote->report != worker->reports && worker->load > 0)
+		--worker->load;
+}
+
+/* _remote_fail
+ *
+ * Function marks the worker of 'remote' as down after it failed to take
+ * the build, until it answers a ping again.
+ */
+void
+_remote_fail(struct remote *remote, int rc)
+{
+	struct _remote_worker *worker = remote->worker;
+
+	pthread_mutex_lock(&_remote.lock);
+	_remote_done(remote);
+	++worker->failures;
+	worker->healthy = FALSE;
+	pthread_mutex_unlock(&_remote.lock);
+
+	y_log_message(Y_LOG_LEVEL_ERROR, "Build worker %s failed to take a build: %s", worker->address, strerror(rc));
+}
+
+/* _remote_watch
+ *
+ * Thread pings every worker each REMOTE_PING_MS, marking those that don't
+ * answer as down and those that do as up, along with their current load.
+ */
+void *
+_remote_watch(void *data)
+{
+	char address[REMOTE_ADDRESS_MAX];
+	struct _remote_worker *worker;
+	struct timespec deadline;
+	unsigned int capacity;
+	unsigned int load;
+	unsigned int i;
+	int rc;
+
+	UNUSED(data);
+
+	pthread_mutex_lock(&_remote.lock);
+
+	while (_remote.running) {
+		for (i = 0; i < _remote.count && _remote.running; ++i) {
+			worker = &_remote.workers[i];
+			strcpy(address, worker->address);
+
+			pthread_mutex_unlock(&_remote.lock);
+			rc = _remote_ping(address, &load, &capacity);
+			pthread_mutex_lock(&_remote.lock);
+
+			if (rc != 0) {
+				if (worker->healthy)
+					y_log_message(Y_LOG_LEVEL_ERROR, "Build worker %s is down: %s", address, strerror(rc));
+				worker->healthy = FALSE;
+				continue;
+			}
+
+			if (!worker->healthy)
+				y_log_message(Y_LOG_LEVEL_INFO, "Build worker %s is up.", address);
+
+			worker->healthy = TRUE;
+			worker->load = load;
+			worker->capacity = capacity > 0 ? capacity : 1;
+			worker->sent = 0;
+			++worker->reports;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += REMOTE_PING_MS / 1000;
+		deadline.tv_nsec += (REMOTE_PING_MS % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			++deadline.tv_sec;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		while (_remote.running &&
+		       pthread_cond_timedwait(&_remote.cond, &_remote.lock, &deadline) != ETIMEDOUT);
+	}
+
+	pthread_mutex_unlock(&_remote.lock);
+
+	return NULL;
+}
+
+/* _remote_ping
+ *
+ * Function asks the worker at 'address' for its 'load' and 'capacity'.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+_remote_ping(const char *address, unsigned int *load, unsigned int *capacity)
+{
+	unsigned char pong[8];
+	enum wire_t type;
+	size_t length;
+	int rc;
+	int fd;
+
+	fd = wire_connect(address, REMOTE_CONNECT_MS);
+	if (fd == -1)
+		return errno;
+
+	if ((rc = wire_timeout(fd, REMOTE_CONNECT_MS)) == 0 &&
+	    (rc = wire_send(fd, WIRE_PING, NULL, 0)) == 0 &&
+	    (rc = wire_recv(fd, &type, pong, sizeof(pong), &length)) == 0 &&
+	    (type != WIRE_PONG || length != sizeof(pong)))
+		rc = EPROTO;
+
+	close(fd);
+
+	if (rc != 0)
+		return rc;
+
+	*load = wire_get32(pong);
+	*capacity = wire_get32(pong + 4);
+
+	return 0;
+}
+
+unsigned int
+_remote_hash(const char *address, const char *name)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*address) {
+		hash ^= (unsigned char) *address++;
+		hash *= 16777619u;
+	}
+
+	while (*name) {
+		hash ^= (unsigned char) *name++;
+		hash *= 16777619u;
+	}
+
+	/* spread similar names over all workers */
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+
+	return hash;
+}
@@ -0,0 +1,19 @@
+#ifndef CREDENTARIUS_REMOTE_H
+#define CREDENTARIUS_REMOTE_H 1
+
+#include <sys/types.h>
+
+struct json_t;
+struct remote;
+
+int remote_init(void);
+void remote_fini(void);
+
+int remote_build(const char *, const char *, struct remote **);
+ssize_t remote_read(struct remote *, char *, size_t);
+void remote_cancel(struct remote *);
+int remote_wait(struct remote *);
+
+void remote_stats(struct json_t *);
+
+#endif
@@ -0,0 +1,539 @@
+#include "scratch.h"
+
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <jansson.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ulfius.h>
+#include <unistd.h>
+
+#include "artifact.h"
+#include "atomic.h"
+#include "common.h"
+#include "config.h"
+
+/* evicted directories are renamed to this first, then removed */
+#define SCRATCH_EVICTED ".evicted."
+
+/* scratch space kept free on the file system, in percent */
+#define SCRATCH_RESERVE 10
+
+struct _scratch_entry
+{
+	char name[NAME_MAX + 1];
+	unsigned int busy;
+	unsigned long long size;
+	time_t used;
+	struct _scratch_entry *next;
+};
+
+static const char *_scratch_artifacts[] = {
+	ARTIFACT_FIRMWARE,
+	ARTIFACT_MAP,
+	ARTIFACT_ELF
+};
+
+static struct _scratch_entry *_scratch_entry(const char *, int);
+static int _scratch_mirror(const char *, int);
+static unsigned long long _scratch_size(int);
+static void _scratch_evict(void);
+static int _scratch_full(void);
+static void _scratch_remove(int, const char *);
+
+static struct
+{
+	pthread_mutex_t lock;
+	int root;
+	struct _scratch_entry *entries;
+	unsigned long long size;
+	unsigned long evicted;
+	unsigned int counter;
+} _scratch = { .lock = PTHREAD_MUTEX_INITIALIZER, .root = -1 };
+
+/* scratch_init
+ *
+ * Function opens BUILD_SCRATCH, where builds run out of tree, away from the
+ * project root; it is meant to be on tmpfs. An empty BUILD_SCRATCH builds
+ * projects in place. Directories left by a previous run are kept, their
+ * objects are still good.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success and -1 on failure.
+ */
+int
+scratch_init(void)
+{
+	struct _scratch_entry *entry;
+	struct dirent *dentry;
+	DIR *dh;
+	int fd;
+
+	if (BUILD_SCRATCH[0] == '\0')
+		return 0;
+
+	if (mkdir(BUILD_SCRATCH, S_IRWXU) == -1 && EEXIST != errno) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to create build scratch: %s", BUILD_SCRATCH);
+		return -1;
+	}
+
+	_scratch.root = open(BUILD_SCRATCH, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (_scratch.root == -1) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to open build scratch: %s", BUILD_SCRATCH);
+		return -1;
+	}
+
+	if ((fd = dup(_scratch.root)) == -1 || !(dh = fdopendir(fd))) {
+		if (fd != -1)
+			close(fd);
+		return 0;
+	}
+
+	while ((dentry = readdir(dh))) {
+		if (strncmp(dentry->d_name, SCRATCH_EVICTED, sizeof(SCRATCH_EVICTED) - 1) == 0) {
+			_scratch_remove(_scratch.root, dentry->d_name);
+			continue;
+		}
+
+		if (dentry->d_name[0] == '.' || !(entry = _scratch_entry(dentry->d_name, TRUE)))
+			continue;
+
+		fd = openat(_scratch.root, entry->name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+		if (fd != -1) {
+			entry->size = _scratch_size(fd);
+			_scratch.size += entry->size;
+			close(fd);
+		}
+	}
+
+	closedir(dh);
+
+	_scratch_evict();
+
+	return 0;
+}
+
+void
+scratch_fini(void)
+{
+	struct _scratch_entry *entry;
+
+	while ((entry = _scratch.entries)) {
+		_scratch.entries = entry->next;
+		free(entry);
+	}
+
+	if (_scratch.root != -1)
+		close(_scratch.root);
+
+	_scratch.root = -1;
+	_scratch.size = 0;
+}
+
+/* scratch_acquire
+ *
+ * Function prepares the scratch directory of the project directory
+ * 'project' into 'path': every source of the project is linked into it, and
+ * links to sources that are gone are removed. Everything make writes stays
+ * in there. The directory is kept from eviction until scratch_release.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, ENOTSUP if there is no
+ * scratch area, or any other errno value on failure.
+ */
+int
+scratch_acquire(const char *project, char *path, size_t size)
+{
+	struct _scratch_entry *entry;
+	const char *name;
+	int fd;
+	int rc;
+
+	if (_scratch.root == -1)
+		return ENOTSUP;
+
+	name = strrchr(project, '/');
+	name = name ? name + 1 : project;
+
+	rc = snprintf(path, size, "%s/%s", BUILD_SCRATCH, name);
+	if (rc <= 0 || (size_t) rc >= size)
+		return ENAMETOOLONG;
+
+	pthread_mutex_lock(&_scratch.lock);
+	if ((entry = _scratch_entry(name, TRUE)))
+		++entry->busy;
+	pthread_mutex_unlock(&_scratch.lock);
+
+	if (!entry)
+		return ENOMEM;
+
+	if (mkdirat(_scratch.root, name, S_IRWXU) == -1 && EEXIST != errno) {
+		rc = errno;
+		goto failed;
+	}
+
+	fd = openat(_scratch.root, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+	if (fd == -1) {
+		rc = errno;
+		goto failed;
+	}
+
+	rc = _scratch_mirror(project, fd);
+	close(fd);
+
+	if (rc == 0)
+		return 0;
+
+failed:
+	pthread_mutex_lock(&_scratch.lock);
+	--entry->busy;
+	pthread_mutex_unlock(&_scratch.lock);
+
+	return rc;
+}
+
+/* scratch_release
+ *
+ * Function copies the artifacts make left in the scratch directory 'path'
+ * back to the project directory 'project', the only build outputs that are
+ * ever written there, and allows the directory to be evicted again. If the
+ * scratch area is getting full, the least recently used directories are
+ * evicted.
+ */
+void
+scratch_release(const char *project, const char *path)
+{
+	struct _scratch_entry *entry;
+	unsigned long long size = 0;
+	const char *name;
+	size_t i;
+	int dfd;
+	int fd;
+	int rc;
+
+	name = strrchr(path, '/') + 1;
+
+	fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	dfd = open(project, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+
+	if (fd != -1 && dfd != -1) {
+		for (i = 0; i < sizeof(_scratch_artifacts) / sizeof(_scratch_artifacts[0]); ++i) {
+			rc = atomic_clone(fd, dfd, _scratch_artifacts[i]);
+
+			/* make clean removed it */
+			if (ENOENT == rc)
+				rc = unlinkat(dfd, _scratch_artifacts[i], 0) == -1 && ENOENT != errno ? errno : 0;
+
+			if (rc != 0)
+				y_log_message(Y_LOG_LEVEL_ERROR, "Failed to copy back build artifact '%s': %s",
+				    _scratch_artifacts[i], project);
+		}
+	}
+
+	if (fd != -1) {
+		size = _scratch_size(fd);
+		close(fd);
+	}
+
+	if (dfd != -1)
+		close(dfd);
+
+	pthread_mutex_lock(&_scratch.lock);
+
+	if ((entry = _scratch_entry(name, FALSE))) {
+		_scratch.size += size - entry->size;
+		entry->size = size;
+		entry->used = time(NULL);
+		--entry->busy;
+	}
+
+	pthread_mutex_unlock(&_scratch.lock);
+
+	_scratch_evict();
+}
+
+void
+scratch_stats(struct json_t *root)
+{
+	struct _scratch_entry *entry;
+	unsigned int entries = 0;
+	json_t *stats;
+
+	stats = json_object();
+	if (!stats)
+		return;
+
+	pthread_mutex_lock(&_scratch.lock);
+	for (entry = _scratch.entries; entry; entry = entry->next)
+		++entries;
+
+	json_object_set_new(stats, "enabled", json_boolean(_scratch.root != -1));
+	json_object_set_new(stats, "entries", json_integer(entries));
+	json_object_set_new(stats, "size", json_integer(_scratch.size));
+	json_object_set_new(stats, "limit", json_integer(BUILD_SCRATCH_SIZE));
+	json_object_set_new(stats, "evicted", json_integer(_scratch.evicted));
+	pthread_mutex_unlock(&_scratch.lock);
+
+	json_object_set_new(root, "scratch", stats);
+}
+
+/*****************************************************************************/
+
+/* _scratch_entry
+ *
+ * Function looks up the scratch directory 'name', adding it if 'create' is
+ * set. Must be called with the lock held, or before any build runs.
+ */
+struct _scratch_entry *
+_scratch_entry(const char *name, int create)
+{
+	struct _scratch_entry *entry;
+
+	for (entry = _scratch.entries; entry; entry = entry->next)
+		if (strcmp(entry->name, name) == 0)
+			return entry;
+
+	if (!create || strlen(name) > NAME_MAX || !(entry = calloc(1, sizeof(*entry))))
+		return NULL;
+
+	strcpy(entry->name, name);
+	entry->used = time(NULL);
+	entry->next = _scratch.entries;
+	_scratch.entries = entry;
+
+	return entry;
+}
+
+/* _scratch_mirror
+ *
+ * Function links the sources of the project directory 'project' into the
+ * scratch directory 'fd', and drops links to sources that no longer exist.
+ * The links are symbolic, so files swapped in atomically are picked up too.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+_scratch_mirror(const char *project, int fd)
+{
+	char target[PATH_MAX];
+	char link[PATH_MAX];
+	struct dirent *dentry;
+	ssize_t length;
+	DIR *dh;
+	int pfd;
+	int rc = 0;
+
+	/* sources that are gone */
+	if ((pfd = dup(fd)) == -1)
+		return errno;
+
+	if (!(dh = fdopendir(pfd))) {
+		close(pfd);
+		return errno;
+	}
+
+	while ((dentry = readdir(dh))) {
+		if (dentry->d_name[0] == '.' || dentry->d_type != DT_LNK)
+			continue;
+
+		rc = snprintf(target, sizeof(target), "%s/%s", project, dentry->d_name);
+		length = readlinkat(fd, dentry->d_name, link, sizeof(link));
+
+		if (rc > 0 && (size_t) rc < sizeof(target) && length == rc &&
+		    memcmp(link, target, length) == 0 && access(target, F_OK) == 0)
+			continue;
+
+		unlinkat(fd, dentry->d_name, 0);
+	}
+
+	closedir(dh);
+
+	/* sources that are new */
+	if (!(dh = opendir(project)))
+		return errno;
+
+	rc = 0;
+
+	while (rc == 0 && (dentry = readdir(dh))) {
+		if (dentry->d_name[0] == '.' || (dentry->d_type != DT_REG && dentry->d_type != DT_UNKNOWN))
+			continue;
+
+		rc = snprintf(target, sizeof(target), "%s/%s", project, dentry->d_name);
+		if (rc <= 0 || (size_t) rc >= sizeof(target)) {
+			rc = ENAMETOOLONG;
+			break;
+		}
+
+		rc = 0;
+
+		if (symlinkat(target, fd, dentry->d_name) == -1 && EEXIST != errno)
+			rc = errno;
+	}
+
+	closedir(dh);
+
+	return rc;
+}
+
+/* _scratch_size
+ *
+ * Function adds up the memory taken by everything in the directory 'fd'.
+ */
+unsigned long long
+_scratch_size(int fd)
+{
+	unsigned long long size = 0;
+	struct dirent *dentry;
+	struct stat st;
+	DIR *dh;
+	int sub;
+
+	if ((fd = dup(fd)) == -1)
+		return 0;
+
+	if (!(dh = fdopendir(fd))) {
+		close(fd);
+		return 0;
+	}
+
+	while ((dentry = readdir(dh))) {
+		if (strcmp(dentry->d_name, ".") == 0 ||
+		    strcmp(dentry->d_name, "..") == 0)
+			continue;
+
+		if (fstatat(dirfd(dh), dentry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+			continue;
+
+		size += (unsigned long long) st.st_blocks * 512;
+
+		if (!S_ISDIR(st.st_mode))
+			continue;
+
+		sub = openat(dirfd(dh), dentry->d_name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+		if (sub != -1) {
+			size += _scratch_size(sub);
+			close(sub);
+		}
+	}
+
+	closedir(dh);
+
+	return size;
+}
+
+/* _scratch_evict
+ *
+ * Function drops the least recently used scratch directories not in use
+ * while they take more than BUILD_SCRATCH_SIZE bytes, or while the file
+ * system holding them has less than SCRATCH_RESERVE percent left.
+ */
+void
+_scratch_evict(void)
+{
+	char evicted[NAME_MAX + 1];
+	struct _scratch_entry **oldest;
+	struct _scratch_entry **link;
+	struct _scratch_entry *entry;
+
+	for (;;) {
+		pthread_mutex_lock(&_scratch.lock);
+
+		if (_scratch.size <= BUILD_SCRATCH_SIZE && !_scratch_full()) {
+			pthread_mutex_unlock(&_scratch.lock);
+			return;
+		}
+
+		oldest = NULL;
+		for (link = &_scratch.entries; *link; link = &(*link)->next)
+			if ((*link)->busy == 0 && (!oldest || (*link)->used < (*oldest)->used))
+				oldest = link;
+
+		if (!oldest) {
+			pthread_mutex_unlock(&_scratch.lock);
+			return;
+		}
+
+		entry = *oldest;
+		*oldest = entry->next;
+		_scratch.size -= entry->size;
+		++_scratch.evicted;
+
+		/* out of the way at once, removed without holding the lock */
+		snprintf(evicted, sizeof(evicted), SCRATCH_EVICTED "%u", _scratch.counter++);
+		if (renameat(_scratch.root, entry->name, _scratch.root, evicted) == -1)
+			evicted[0] = '\0';
+
+		pthread_mutex_unlock(&_scratch.lock);
+
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Evicted build scratch directory: %s", entry->name);
+		free(entry);
+
+		if (evicted[0])
+			_scratch_remove(_scratch.root, evicted);
+	}
+}
+
+/* _scratch_full
+ *
+ * Function tells whether the file system of the scratch area is running
+ * out of space.
+ */
+int
+_scratch_full(void)
+{
+	struct statvfs st;
+
+	if (fstatvfs(_scratch.root, &st) == -1 || st.f_blocks == 0)
+		return FALSE;
+
+	return st.f_bavail * 100 < st.f_blocks * SCRATCH_RESERVE;
+}
+
+/* _scratch_remove
+ *
+ * Function removes 'name' from the directory 'dfd', descending into it
+ * first if it is a directory itself.
+ */
+void
+_scratch_remove(int dfd, const char *name)
+{
+	struct dirent *dentry;
+	DIR *dh;
+	int fd;
+
+	if (unlinkat(dfd, name, 0) == 0 || EISDIR != errno)
+		return;
+
+	fd = openat(dfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+	if (fd == -1)
+		return;
+
+	if (!(dh = fdopendir(fd))) {
+		close(fd);
+		return;
+	}
+
+	while ((dentry = readdir(dh))) {
+		if (strcmp(dentry->d_name, ".") == 0 ||
+		    strcmp(dentry->d_name, "..") == 0)
+			continue;
+
+		_scratch_remove(dirfd(dh), dentry->d_name);
+	}
+
+	closedir(dh);
+
+	unlinkat(dfd, name, AT_REMOVEDIR);
+}
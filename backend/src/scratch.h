@@ -0,0 +1,16 @@
+#ifndef CREDENTARIUS_SCRATCH_H
+#define CREDENTARIUS_SCRATCH_H 1
+
+#include <stddef.h>
+
+struct json_t;
+
+int scratch_init(void);
+void scratch_fini(void);
+
+int scratch_acquire(const char *, char *, size_t);
+void scratch_release(const char *, const char *);
+
+void scratch_stats(struct json_t *);
+
+#endif
@@ -0,0 +1,211 @@
+#include "sha256.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SHA256_READ_SIZE (64 * 1024)
+#define SHA256_BLOCK_SIZE 64
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t _sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void _sha256_block(struct sha256 *, const unsigned char *);
+
+void
+sha256_init(struct sha256 *ctx)
+{
+	static const uint32_t initial[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(ctx->state, initial, sizeof(initial));
+	ctx->length = 0;
+	ctx->used = 0;
+}
+
+void
+sha256_update(struct sha256 *ctx, const void *data, size_t length)
+{
+	const unsigned char *input = data;
+	size_t chunk;
+
+	ctx->length += length;
+
+	while (length > 0) {
+		if (ctx->used == 0 && length >= sizeof(ctx->block)) {
+			_sha256_block(ctx, input);
+			input += sizeof(ctx->block);
+			length -= sizeof(ctx->block);
+			continue;
+		}
+
+		chunk = sizeof(ctx->block) - ctx->used;
+		if (chunk > length)
+			chunk = length;
+
+		memcpy(ctx->block + ctx->used, input, chunk);
+		ctx->used += chunk;
+		input += chunk;
+		length -= chunk;
+
+		if (ctx->used == sizeof(ctx->block)) {
+			_sha256_block(ctx, ctx->block);
+			ctx->used = 0;
+		}
+	}
+}
+
+void
+sha256_final(struct sha256 *ctx, unsigned char *digest)
+{
+	uint64_t bits = ctx->length * 8;
+	int i;
+
+	ctx->block[ctx->used++] = 0x80;
+
+	if (ctx->used > 56) {
+		memset(ctx->block + ctx->used, 0, sizeof(ctx->block) - ctx->used);
+		_sha256_block(ctx, ctx->block);
+		ctx->used = 0;
+	}
+
+	memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+	for (i = 0; i < 8; ++i)
+		ctx->block[56 + i] = bits >> (56 - 8 * i);
+	_sha256_block(ctx, ctx->block);
+
+	for (i = 0; i < 32; ++i)
+		digest[i] = ctx->state[i / 4] >> (24 - 8 * (i % 4));
+}
+
+void
+sha256_hex(const unsigned char *digest, char *hex)
+{
+	int i;
+
+	for (i = 0; i < SHA256_SIZE; ++i)
+		snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+}
+
+/* sha256_hmac
+ *
+ * Function computes the HMAC-SHA256 (RFC 2104) of 'length' bytes of 'data'
+ * under the 'size' bytes of 'key' into 'digest'.
+ */
+void
+sha256_hmac(const void *key, size_t size, const void *data, size_t length, unsigned char *digest)
+{
+	unsigned char pad[SHA256_BLOCK_SIZE] = {0};
+	struct sha256 ctx;
+	int i;
+
+	/* longer keys are hashed down first */
+	if (size > sizeof(pad)) {
+		sha256_init(&ctx);
+		sha256_update(&ctx, key, size);
+		sha256_final(&ctx, pad);
+	} else {
+		memcpy(pad, key, size);
+	}
+
+	for (i = 0; i < SHA256_BLOCK_SIZE; ++i)
+		pad[i] ^= 0x36;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, pad, sizeof(pad));
+	sha256_update(&ctx, data, length);
+	sha256_final(&ctx, digest);
+
+	/* from the inner to the outer pad */
+	for (i = 0; i < SHA256_BLOCK_SIZE; ++i)
+		pad[i] ^= 0x36 ^ 0x5c;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, pad, sizeof(pad));
+	sha256_update(&ctx, digest, SHA256_SIZE);
+	sha256_final(&ctx, digest);
+}
+
+/* sha256_fd
+ *
+ * Function hashes the whole content of the file 'fd', reading it from the
+ * start without moving its file offset.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+sha256_fd(int fd, unsigned char *digest)
+{
+	unsigned char buffer[SHA256_READ_SIZE];
+	struct sha256 ctx;
+	ssize_t bread;
+	off_t offset = 0;
+
+	sha256_init(&ctx);
+
+	for (;;) {
+		bread = pread(fd, buffer, sizeof(buffer), offset);
+		if (bread == -1 && EINTR == errno)
+			continue;
+
+		if (bread == -1)
+			return errno;
+
+		if (bread == 0)
+			break;
+
+		sha256_update(&ctx, buffer, bread);
+		offset += bread;
+	}
+
+	sha256_final(&ctx, digest);
+
+	return 0;
+}
+
+/*****************************************************************************/
+
+void
+_sha256_block(struct sha256 *ctx, const unsigned char *block)
+{
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h;
+	uint32_t t1, t2;
+	int i;
+
+	for (i = 0; i < 16; ++i)
+		w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16 |
+		       (uint32_t) block[4 * i + 2] << 8 | block[4 * i + 3];
+
+	for (i = 16; i < 64; ++i)
+		w[i] = w[i - 16] + (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+		       w[i - 7] + (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+	a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+	e = ctx->state[4]; f = ctx->state[5]; g = ctx->state[6]; h = ctx->state[7];
+
+	for (i = 0; i < 64; ++i) {
+		t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + _sha256_k[i] + w[i];
+		t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+	ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
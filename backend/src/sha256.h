@@ -0,0 +1,26 @@
+#ifndef CREDENTARIUS_SHA256_H
+#define CREDENTARIUS_SHA256_H 1
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SHA256_SIZE 32
+#define SHA256_HEX_SIZE (2 * SHA256_SIZE + 1)
+
+struct sha256
+{
+	uint32_t state[8];
+	uint64_t length;
+	unsigned char block[64];
+	size_t used;
+};
+
+void sha256_init(struct sha256 *);
+void sha256_update(struct sha256 *, const void *, size_t);
+void sha256_final(struct sha256 *, unsigned char *);
+void sha256_hex(const unsigned char *, char *);
+void sha256_hmac(const void *, size_t, const void *, size_t, unsigned char *);
+
+int sha256_fd(int, unsigned char *);
+
+#endif
@@ -0,0 +1,376 @@
+#include "skel.h"
+
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <ulfius.h>
+
+#include "blob.h"
+#include "common.h"
+#include "config.h"
+#include "durable.h"
+#include "trash.h"
+
+#define SKEL_STAGING PROJECT_PATH "/.staging"
+#define SKEL_NAME_MAX 32
+
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int running;
+	int staging;
+	unsigned int next;
+	unsigned int ready[SKEL_POOL_SIZE];
+	unsigned int count;
+} _skel = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.staging = -1
+};
+
+static void *_skel_refill(void *);
+static int _skel_stage(unsigned int *);
+static int _skel_populate(int);
+static int _skel_copy(int, int, const char *, const struct stat *);
+static void _skel_discard(const char *);
+
+/* skel_init
+ *
+ * Function prepares the staging area inside the project root and starts the
+ * thread that keeps a pool of ready-made project directories populated from
+ * the skeleton.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success and -1 on failure.
+ */
+int
+skel_init(void)
+{
+	int rc;
+
+	if (mkdir(PROJECT_PATH, S_IRWXU) == -1 && EEXIST != errno) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to create project root: %s", PROJECT_PATH);
+		return -1;
+	}
+
+	/* whatever was staged by a previous run may predate the current skel */
+	rc = trash_put(AT_FDCWD, SKEL_STAGING);
+	if (rc != 0 && ENOENT != rc) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to discard stale staging area: %s", SKEL_STAGING);
+		return -1;
+	}
+
+	if (mkdir(SKEL_STAGING, S_IRWXU) == -1 && EEXIST != errno) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to create staging area: %s", SKEL_STAGING);
+		return -1;
+	}
+
+	_skel.staging = open(SKEL_STAGING, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (_skel.staging == -1) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to open staging area: %s", SKEL_STAGING);
+		return -1;
+	}
+
+	_skel.running = TRUE;
+
+	if (pthread_create(&_skel.thread, NULL, _skel_refill, NULL) != 0) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to start skel staging thread.");
+		_skel.running = FALSE;
+		close(_skel.staging);
+		_skel.staging = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+skel_fini(void)
+{
+	if (_skel.staging == -1)
+		return;
+
+	pthread_mutex_lock(&_skel.lock);
+	_skel.running = FALSE;
+	pthread_cond_signal(&_skel.cond);
+	pthread_mutex_unlock(&_skel.lock);
+
+	pthread_join(_skel.thread, NULL);
+
+	close(_skel.staging);
+	_skel.staging = -1;
+}
+
+/* skel_create
+ *
+ * Function creates the project directory 'path' from the skeleton.
+ *
+ * In the common case a pre-staged directory is renamed into place, which
+ * makes project creation a single system call. If the pool is exhausted a
+ * directory is staged synchronously first. Either way the project appears
+ * fully populated or not at all.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, EEXIST if the project
+ * already exists, or any other errno value on failure.
+ */
+int
+skel_create(const char *path)
+{
+	char name[SKEL_NAME_MAX];
+	unsigned int serial;
+	int staged = FALSE;
+	int rc;
+
+	if (_skel.staging == -1)
+		return ENOENT;
+
+	pthread_mutex_lock(&_skel.lock);
+	if (_skel.count > 0) {
+		serial = _skel.ready[--_skel.count];
+		staged = TRUE;
+		pthread_cond_signal(&_skel.cond);
+	}
+	pthread_mutex_unlock(&_skel.lock);
+
+	if (!staged && (rc = _skel_stage(&serial)) != 0)
+		return rc;
+
+	snprintf(name, sizeof(name), "%u", serial);
+
+	if (renameat2(_skel.staging, name, AT_FDCWD, path, RENAME_NOREPLACE) == -1) {
+		rc = errno;
+
+		/* hand the directory back, it's still perfectly usable */
+		pthread_mutex_lock(&_skel.lock);
+		if ((staged = _skel.count < SKEL_POOL_SIZE))
+			_skel.ready[_skel.count++] = serial;
+		pthread_mutex_unlock(&_skel.lock);
+
+		if (!staged)
+			_skel_discard(name);
+
+		return rc;
+	}
+
+	return durable_parent(path);
+}
+
+/*****************************************************************************/
+
+void *
+_skel_refill(void *data)
+{
+	struct timespec backoff;
+	unsigned int serial;
+
+	UNUSED(data);
+
+	pthread_mutex_lock(&_skel.lock);
+
+	while (_skel.running) {
+		if (_skel.count >= SKEL_POOL_SIZE) {
+			pthread_cond_wait(&_skel.cond, &_skel.lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&_skel.lock);
+
+		if (_skel_stage(&serial) != 0) {
+			/* skel is likely missing, don't spin on it */
+			pthread_mutex_lock(&_skel.lock);
+			clock_gettime(CLOCK_REALTIME, &backoff);
+			backoff.tv_sec += 5;
+			pthread_cond_timedwait(&_skel.cond, &_skel.lock, &backoff);
+			continue;
+		}
+
+		pthread_mutex_lock(&_skel.lock);
+		_skel.ready[_skel.count++] = serial;
+	}
+
+	pthread_mutex_unlock(&_skel.lock);
+
+	return NULL;
+}
+
+/* _skel_stage
+ *
+ * Function creates a new populated directory in the staging area and stores
+ * its serial number in 'serial'.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+_skel_stage(unsigned int *serial)
+{
+	char name[SKEL_NAME_MAX];
+	int dfd;
+	int rc;
+
+	*serial = __sync_fetch_and_add(&_skel.next, 1);
+	snprintf(name, sizeof(name), "%u", *serial);
+
+	if (mkdirat(_skel.staging, name, S_IRWXU) == -1) {
+		rc = errno;
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to create staging directory: %s", name);
+		return rc;
+	}
+
+	dfd = openat(_skel.staging, name, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (dfd == -1) {
+		rc = errno;
+		unlinkat(_skel.staging, name, AT_REMOVEDIR);
+		return rc;
+	}
+
+	rc = _skel_populate(dfd);
+	close(dfd);
+
+	if (rc != 0)
+		_skel_discard(name);
+
+	return rc;
+}
+
+/* _skel_populate
+ *
+ * Function fills the directory 'dfd' with the files found in the skeleton.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+_skel_populate(int dfd)
+{
+	struct dirent *dentry;
+	struct stat fstat;
+	DIR *dh_skel;
+	int rc = 0;
+
+	if (!(dh_skel = opendir(SKEL_PATH))) {
+		rc = errno;
+		y_log_message(Y_LOG_LEVEL_ERROR,
+		    "Failed to iterate through skel directory: %s",
+		    SKEL_PATH);
+		return rc;
+	}
+
+	while ((dentry = readdir(dh_skel))) {
+		switch (dentry->d_type) {
+		case DT_REG:
+		case DT_LNK:
+			if (fstatat(dirfd(dh_skel), dentry->d_name, &fstat, 0) == -1 ||
+			    !S_ISREG(fstat.st_mode)) {
+				y_log_message(Y_LOG_LEVEL_ERROR,
+				    "Failed to query skel directory file: %s",
+				    dentry->d_name);
+				continue;
+			}
+
+			rc = _skel_copy(dirfd(dh_skel), dfd, dentry->d_name, &fstat);
+			if (rc != 0) {
+				y_log_message(Y_LOG_LEVEL_ERROR,
+				    "Failed to copy skel directory file: %s",
+				    dentry->d_name);
+				goto close_skel;
+			}
+			break;
+
+		default: break;
+		}
+	}
+
+close_skel:
+	closedir(dh_skel);
+
+	return rc;
+}
+
+/* _skel_copy
+ *
+ * Function puts a copy of skeleton file 'name' into directory 'dfd'.
+ *
+ * Content already in the blob store is reflinked from there, which also
+ * makes new projects share their skeleton files with every other project.
+ * Without the store the file is reflinked straight from the skeleton where
+ * possible, otherwise copied. It is never hard linked: builds may rewrite
+ * project files in place, which must not reach the skeleton.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+_skel_copy(int skel, int dfd, const char *name, const struct stat *fstat)
+{
+	off_t offset = 0;
+	ssize_t bsent;
+	int fd_skel;
+	int fd_path;
+	int rc = 0;
+
+	fd_skel = openat(skel, name, O_RDONLY|O_CLOEXEC);
+	if (fd_skel == -1)
+		return errno;
+
+	rc = blob_import(fd_skel, fstat->st_size, dfd, name);
+	if (rc != ENOTSUP) {
+		close(fd_skel);
+		return rc;
+	}
+
+	rc = 0;
+
+	fd_path = openat(dfd, name, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, S_IRUSR|S_IWUSR);
+	if (fd_path == -1) {
+		rc = errno;
+		close(fd_skel);
+		return rc;
+	}
+
+	if (ioctl(fd_path, FICLONE, fd_skel) == 0)
+		goto close_files;
+
+	while (offset < fstat->st_size) {
+		bsent = sendfile(fd_path, fd_skel, &offset, fstat->st_size - offset);
+		if (bsent == -1 && EINTR == errno)
+			continue;
+
+		if (bsent <= 0) {
+			rc = bsent == 0 ? EIO : errno;
+			break;
+		}
+	}
+
+close_files:
+	if (fd_path != -1)
+		close(fd_path);
+	close(fd_skel);
+
+	return rc;
+}
+
+/* _skel_discard
+ *
+ * Function moves the staged directory 'name' to the trash.
+ */
+void
+_skel_discard(const char *name)
+{
+	if (trash_put(_skel.staging, name) != 0)
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to discard staging directory: %s", name);
+}
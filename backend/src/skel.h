@@ -0,0 +1,9 @@
+#ifndef CREDENTARIUS_SKEL_H
+#define CREDENTARIUS_SKEL_H 1
+
+int skel_init(void);
+void skel_fini(void);
+
+int skel_create(const char *);
+
+#endif
@@ -0,0 +1,45 @@
+#include "status.h"
+
+#include <jansson.h>
+#include <ulfius.h>
+
+#include "blob.h"
+#include "build.h"
+#include "buildcache.h"
+#include "buildlog.h"
+#include "cache.h"
+#include "common.h"
+#include "durable.h"
+#include "launch.h"
+#include "path.h"
+#include "remote.h"
+#include "scratch.h"
+
+int
+status_get(const struct _u_request *request, struct _u_response *response, void *user_data)
+{
+	json_t *root;
+	int rc;
+
+	UNUSED(request);
+	UNUSED(user_data);
+
+	if (!(root = json_object()))
+		return U_ERROR_MEMORY;
+
+	cache_stats(root);
+	blob_stats(root);
+	build_stats(root);
+	buildcache_stats(root);
+	buildlog_stats(root);
+	durable_stats(root);
+	launch_stats(root);
+	path_stats(root);
+	remote_stats(root);
+	scratch_stats(root);
+
+	rc = ulfius_set_json_response(response, HTTP_OK, root);
+	json_decref(root);
+
+	return rc;
+}
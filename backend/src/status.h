@@ -0,0 +1,9 @@
+#ifndef CREDENTARIUS_STATUS_H
+#define CREDENTARIUS_STATUS_H 1
+
+struct _u_request;
+struct _u_response;
+
+int status_get(const struct _u_request *, struct _u_response *, void *);
+
+#endif
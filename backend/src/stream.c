@@ -0,0 +1,473 @@
+#include "stream.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <strings.h>
+#include <time.h>
+#include <ulfius.h>
+
+#include "common.h"
+
+#define STREAM_BLOCK_SIZE (64 * 1024)
+
+/* more ranges than this and the Range header is ignored */
+#define STREAM_RANGE_MAX 16
+#define STREAM_BOUNDARY_MAX 40
+#define STREAM_PART_HEAD_MAX 256
+
+struct _stream_file
+{
+	int fd;
+	off_t offset;
+	size_t length;
+};
+
+struct _stream_range
+{
+	off_t first;
+	off_t last;
+	char head[STREAM_PART_HEAD_MAX];
+	size_t head_length;
+};
+
+struct _stream_ranges
+{
+	int fd;
+	size_t count;
+	size_t index; /* part being sent, 'count' for the closing boundary */
+	size_t done;  /* bytes of the current head, body or tail sent */
+	int body;
+	char tail[STREAM_BOUNDARY_MAX + 16];
+	size_t tail_length;
+	struct _stream_range ranges[STREAM_RANGE_MAX];
+};
+
+static struct _stream_file *_stream_file_new(int, off_t, size_t);
+static ssize_t _stream_file(void *, uint64_t, char *, size_t);
+static void _stream_file_free(void *);
+static int _stream_range_parse(const char *, off_t, struct _stream_range *);
+static int _stream_range_compare(const void *, const void *);
+static int _stream_ranges_response(struct _u_response *, int, off_t, struct _stream_range *, size_t);
+static ssize_t _stream_ranges(void *, uint64_t, char *, size_t);
+static void _stream_ranges_free(void *);
+static size_t _stream_copy(char *, size_t, const char *, size_t, size_t *);
+
+/* stream_file_response
+ *
+ * Sets up a response that is fed straight from the file descriptor 'fd',
+ * starting at 'offset' and spanning 'length' bytes. Data is read in blocks
+ * as the connection drains, so memory use stays flat regardless of the file
+ * size.
+ *
+ * Ownership of the file descriptor is transferred to the response, even if
+ * the call fails.
+ */
+int
+stream_file_response(struct _u_response *response, unsigned int status, int fd, off_t offset, size_t length)
+{
+	struct _stream_file *stream;
+
+	if (!(stream = _stream_file_new(fd, offset, length)))
+		return U_ERROR_MEMORY;
+
+	return ulfius_set_stream_response(response, status, _stream_file,
+	    _stream_file_free, length, STREAM_BLOCK_SIZE, stream);
+}
+
+/* stream_file_encoded_response
+ *
+ * Same as stream_file_response, but the data is encoded with 'type' on the
+ * way out, so the length of the body is not known in advance.
+ */
+int
+stream_file_encoded_response(struct _u_response *response, unsigned int status, enum compress_t type,
+    int fd, off_t offset, size_t length)
+{
+	struct _stream_file *stream;
+
+	if (type == COMPRESS_IDENTITY)
+		return stream_file_response(response, status, fd, offset, length);
+
+	if (!(stream = _stream_file_new(fd, offset, length)))
+		return U_ERROR_MEMORY;
+
+	return compress_stream_response(response, status, type,
+	    _stream_file, _stream_file_free, stream);
+}
+
+/* stream_range_requested
+ *
+ * Function checks whether the request asks for byte ranges. Ranges apply to
+ * the plain representation, so such requests must not be compressed.
+ */
+int
+stream_range_requested(const struct _u_request *request)
+{
+	return u_map_get_case(request->map_header, "Range") != NULL;
+}
+
+/* stream_range_response
+ *
+ * Sets up a response for the byte ranges of the file 'fd', 'size' bytes
+ * long, that the request asks for in its Range header.
+ *
+ * A single range is answered with 206 and the matching slice of the file,
+ * several ranges with a multipart/byteranges body; overlapping and adjacent
+ * ranges are merged first. Ranges that are all past the end of the file give
+ * a 416. A Range header that can't be parsed, or an If-Range header that
+ * doesn't match the strong entity tag 'etag', gets the whole file with 200.
+ *
+ * Ownership of the file descriptor is transferred to the response, even if
+ * the call fails.
+ */
+int
+stream_range_response(const struct _u_request *request, struct _u_response *response,
+    int fd, off_t size, const char *etag)
+{
+	struct _stream_range ranges[STREAM_RANGE_MAX];
+	char content_range[64];
+	const char *if_range;
+	const char *range;
+	int count;
+	int i;
+
+	range = u_map_get_case(request->map_header, "Range");
+	if_range = u_map_get_case(request->map_header, "If-Range");
+
+	/* no Last-Modified is ever sent, so only entity tags can match */
+	if (!range || (if_range && (!etag || strcmp(if_range, etag) != 0)))
+		return stream_file_response(response, HTTP_OK, fd, 0, size);
+
+	count = _stream_range_parse(range, size, ranges);
+	if (count < 0) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Ignoring invalid range: %s", range);
+		return stream_file_response(response, HTTP_OK, fd, 0, size);
+	}
+
+	if (count == 0) {
+		close(fd);
+		snprintf(content_range, sizeof(content_range), "bytes */%llu", (unsigned long long) size);
+		u_map_put(response->map_header, "Content-Range", content_range);
+		return ulfius_set_empty_response(response, HTTP_RANGE_NOT_SATISFIABLE);
+	}
+
+	qsort(ranges, count, sizeof(ranges[0]), _stream_range_compare);
+
+	for (i = 1; i < count; ++i) {
+		if (ranges[i].first > ranges[i - 1].last + 1)
+			continue;
+
+		if (ranges[i].last > ranges[i - 1].last)
+			ranges[i - 1].last = ranges[i].last;
+
+		memmove(&ranges[i], &ranges[i + 1], (count - i - 1) * sizeof(ranges[0]));
+		--count;
+		--i;
+	}
+
+	if (count > 1)
+		return _stream_ranges_response(response, fd, size, ranges, count);
+
+	snprintf(content_range, sizeof(content_range), "bytes %llu-%llu/%llu",
+	    (unsigned long long) ranges[0].first, (unsigned long long) ranges[0].last,
+	    (unsigned long long) size);
+	u_map_put(response->map_header, "Content-Range", content_range);
+
+	return stream_file_response(response, HTTP_PARTIAL_CONTENT, fd,
+	    ranges[0].first, ranges[0].last - ranges[0].first + 1);
+}
+
+/*****************************************************************************/
+
+struct _stream_file *
+_stream_file_new(int fd, off_t offset, size_t length)
+{
+	struct _stream_file *stream;
+
+	stream = malloc(sizeof(*stream));
+	if (!stream) {
+		close(fd);
+		return NULL;
+	}
+
+	stream->fd = fd;
+	stream->offset = offset;
+	stream->length = length;
+
+	posix_fadvise(fd, offset, length, POSIX_FADV_SEQUENTIAL);
+
+	return stream;
+}
+
+ssize_t
+_stream_file(void *stream_user_data, uint64_t offset, char *out_buf, size_t max)
+{
+	struct _stream_file *stream = stream_user_data;
+	ssize_t bread;
+
+	if (offset >= stream->length)
+		return ULFIUS_STREAM_END;
+
+	if (max > stream->length - offset)
+		max = stream->length - offset;
+
+	do {
+		bread = pread(stream->fd, out_buf, max, stream->offset + offset);
+	} while (bread == -1 && EINTR == errno);
+
+	switch (bread) {
+	case -1:
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to read from file stream.");
+		return ULFIUS_STREAM_ERROR;
+
+	case 0:
+		/* file was truncated under us, content-length can't be honored */
+		y_log_message(Y_LOG_LEVEL_ERROR, "File stream ended prematurely.");
+		return ULFIUS_STREAM_ERROR;
+	}
+
+	return bread;
+}
+
+void
+_stream_file_free(void *stream_user_data)
+{
+	struct _stream_file *stream = stream_user_data;
+	close(stream->fd);
+	free(stream);
+}
+
+/* _stream_range_parse
+ *
+ * Function parses the "bytes=" Range header value 'header' against a file
+ * of 'size' bytes, storing the satisfiable ranges in 'ranges' with their
+ * last byte clamped to the end of the file.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the number of satisfiable ranges, or -1 if the
+ * header is not valid or lists more than STREAM_RANGE_MAX ranges.
+ */
+int
+_stream_range_parse(const char *header, off_t size, struct _stream_range *ranges)
+{
+	unsigned long long first;
+	unsigned long long last;
+	const char *cursor;
+	char *end;
+	int count = 0;
+
+	if (strncasecmp(header, "bytes=", 6) != 0)
+		return -1;
+
+	cursor = header + 6;
+
+	for (;;) {
+		while (*cursor == ' ' || *cursor == '\t')
+			++cursor;
+
+		if (*cursor == '-') {
+			/* suffix range, the last 'n' bytes */
+			if (!isdigit((unsigned char) cursor[1]))
+				return -1;
+
+			last = strtoull(cursor + 1, &end, 10);
+			first = last >= (unsigned long long) size ? 0 : size - last;
+			if (last == 0)
+				first = size;
+
+			last = ULLONG_MAX;
+		} else if (isdigit((unsigned char) *cursor)) {
+			first = strtoull(cursor, &end, 10);
+			if (*end != '-')
+				return -1;
+
+			cursor = end + 1;
+			if (isdigit((unsigned char) *cursor)) {
+				last = strtoull(cursor, &end, 10);
+				if (last < first)
+					return -1;
+			} else {
+				end = (char *) cursor;
+				last = ULLONG_MAX;
+			}
+		} else {
+			return -1;
+		}
+
+		if (first < (unsigned long long) size) {
+			if (count == STREAM_RANGE_MAX)
+				return -1;
+
+			ranges[count].first = first;
+			ranges[count].last = last < (unsigned long long) size ? last : (unsigned long long) size - 1;
+			++count;
+		}
+
+		for (cursor = end; *cursor == ' ' || *cursor == '\t'; ++cursor)
+			;
+
+		if (*cursor == '\0')
+			break;
+
+		if (*cursor++ != ',')
+			return -1;
+	}
+
+	return count;
+}
+
+int
+_stream_range_compare(const void *a, const void *b)
+{
+	const struct _stream_range *left = a;
+	const struct _stream_range *right = b;
+
+	return left->first < right->first ? -1 : left->first > right->first;
+}
+
+/* _stream_ranges_response
+ *
+ * Function sets up a multipart/byteranges response for the 'count' sorted,
+ * non-overlapping 'ranges' of the file 'fd'. The parts are read from the
+ * descriptor as the connection drains, like a plain file stream.
+ */
+int
+_stream_ranges_response(struct _u_response *response, int fd, off_t size,
+    struct _stream_range *ranges, size_t count)
+{
+	static unsigned int counter;
+	char boundary[STREAM_BOUNDARY_MAX];
+	char content_type[STREAM_BOUNDARY_MAX + 64];
+	struct _stream_ranges *stream;
+	const char *type;
+	uint64_t length;
+	size_t i;
+
+	stream = calloc(1, sizeof(*stream));
+	if (!stream) {
+		close(fd);
+		return U_ERROR_MEMORY;
+	}
+
+	type = u_map_get(response->map_header, "Content-Type");
+	if (!type)
+		type = "application/octet-stream";
+
+	snprintf(boundary, sizeof(boundary), "credentarius-%08lx%08x",
+	    (unsigned long) time(NULL), __sync_fetch_and_add(&counter, 1));
+
+	stream->fd = fd;
+	stream->count = count;
+	memcpy(stream->ranges, ranges, count * sizeof(ranges[0]));
+
+	length = stream->tail_length = snprintf(stream->tail, sizeof(stream->tail),
+	    "\r\n--%s--\r\n", boundary);
+
+	for (i = 0; i < count; ++i) {
+		ranges = &stream->ranges[i];
+		ranges->head_length = snprintf(ranges->head, sizeof(ranges->head),
+		    "\r\n--%s\r\nContent-Type: %.128s\r\nContent-Range: bytes %llu-%llu/%llu\r\n\r\n",
+		    boundary, type, (unsigned long long) ranges->first,
+		    (unsigned long long) ranges->last, (unsigned long long) size);
+		length += ranges->head_length + ranges->last - ranges->first + 1;
+	}
+
+	snprintf(content_type, sizeof(content_type), "multipart/byteranges; boundary=%s", boundary);
+	u_map_put(response->map_header, "Content-Type", content_type);
+
+	return ulfius_set_stream_response(response, HTTP_PARTIAL_CONTENT, _stream_ranges,
+	    _stream_ranges_free, length, STREAM_BLOCK_SIZE, stream);
+}
+
+ssize_t
+_stream_ranges(void *stream_user_data, uint64_t offset, char *out_buf, size_t max)
+{
+	struct _stream_ranges *stream = stream_user_data;
+	struct _stream_range *range;
+	size_t produced = 0;
+	size_t remaining;
+	ssize_t bread;
+
+	UNUSED(offset);
+
+	while (produced < max && stream->index <= stream->count) {
+		if (stream->index == stream->count) {
+			produced += _stream_copy(out_buf + produced, max - produced,
+			    stream->tail, stream->tail_length, &stream->done);
+			if (stream->done == stream->tail_length)
+				++stream->index;
+			continue;
+		}
+
+		range = &stream->ranges[stream->index];
+
+		if (!stream->body) {
+			produced += _stream_copy(out_buf + produced, max - produced,
+			    range->head, range->head_length, &stream->done);
+			if (stream->done == range->head_length) {
+				stream->body = TRUE;
+				stream->done = 0;
+			}
+			continue;
+		}
+
+		remaining = range->last - range->first + 1 - stream->done;
+		if (remaining > max - produced)
+			remaining = max - produced;
+
+		do {
+			bread = pread(stream->fd, out_buf + produced, remaining, range->first + stream->done);
+		} while (bread == -1 && EINTR == errno);
+
+		if (bread <= 0) {
+			y_log_message(Y_LOG_LEVEL_ERROR, "Failed to read byte range from file stream.");
+			return ULFIUS_STREAM_ERROR;
+		}
+
+		produced += bread;
+		stream->done += bread;
+
+		if (stream->done == (size_t) (range->last - range->first + 1)) {
+			stream->body = FALSE;
+			stream->done = 0;
+			++stream->index;
+		}
+	}
+
+	return produced > 0 ? (ssize_t) produced : ULFIUS_STREAM_END;
+}
+
+void
+_stream_ranges_free(void *stream_user_data)
+{
+	struct _stream_ranges *stream = stream_user_data;
+	close(stream->fd);
+	free(stream);
+}
+
+/* _stream_copy
+ *
+ * Function copies the unsent rest of 'text' into 'out', at most 'max'
+ * bytes, advancing 'done'.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the number of bytes copied.
+ */
+size_t
+_stream_copy(char *out, size_t max, const char *text, size_t length, size_t *done)
+{
+	size_t chunk = length - *done;
+
+	if (chunk > max)
+		chunk = max;
+
+	memcpy(out, text + *done, chunk);
+	*done += chunk;
+
+	return chunk;
+}
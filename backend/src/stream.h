@@ -0,0 +1,17 @@
+#ifndef CREDENTARIUS_STREAM_H
+#define CREDENTARIUS_STREAM_H 1
+
+#include <sys/types.h>
+
+#include "compress.h"
+
+struct _u_request;
+struct _u_response;
+
+int stream_file_response(struct _u_response *, unsigned int, int, off_t, size_t);
+int stream_file_encoded_response(struct _u_response *, unsigned int, enum compress_t, int, off_t, size_t);
+
+int stream_range_requested(const struct _u_request *);
+int stream_range_response(const struct _u_request *, struct _u_response *, int, off_t, const char *);
+
+#endif
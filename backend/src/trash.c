@@ -0,0 +1,268 @@
+#include "trash.h"
+
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <ulfius.h>
+
+#include "blob.h"
+#include "common.h"
+#include "config.h"
+
+#define TRASH_PATH PROJECT_PATH "/.trash"
+#define TRASH_NAME_MAX 48
+
+/* reaper yields for TRASH_PAUSE_NS after every TRASH_BATCH removals */
+#define TRASH_BATCH 128
+#define TRASH_PAUSE_NS (5 * 1000 * 1000)
+
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int running;
+	int pending;
+	int trash;
+	unsigned int next;
+	unsigned long removed;
+} _trash = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.trash = -1
+};
+
+static void *_trash_reap(void *);
+static int _trash_empty(void);
+static void _trash_remove(int, const char *);
+static void _trash_throttle(void);
+
+/* trash_init
+ *
+ * Function prepares the trash area inside the project root and starts the
+ * reaper thread, which will also dispose of anything left behind by a
+ * previous run.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success and -1 on failure.
+ */
+int
+trash_init(void)
+{
+	if (mkdir(PROJECT_PATH, S_IRWXU) == -1 && EEXIST != errno) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to create project root: %s", PROJECT_PATH);
+		return -1;
+	}
+
+	if (mkdir(TRASH_PATH, S_IRWXU) == -1 && EEXIST != errno) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to create trash area: %s", TRASH_PATH);
+		return -1;
+	}
+
+	_trash.trash = open(TRASH_PATH, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (_trash.trash == -1) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to open trash area: %s", TRASH_PATH);
+		return -1;
+	}
+
+	_trash.running = TRUE;
+	_trash.pending = TRUE;
+
+	if (pthread_create(&_trash.thread, NULL, _trash_reap, NULL) != 0) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to start trash reaper thread.");
+		_trash.running = FALSE;
+		close(_trash.trash);
+		_trash.trash = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+trash_fini(void)
+{
+	if (_trash.trash == -1)
+		return;
+
+	pthread_mutex_lock(&_trash.lock);
+	_trash.running = FALSE;
+	pthread_cond_signal(&_trash.cond);
+	pthread_mutex_unlock(&_trash.lock);
+
+	pthread_join(_trash.thread, NULL);
+
+	close(_trash.trash);
+	_trash.trash = -1;
+}
+
+/* trash_put
+ *
+ * Function moves 'path' (relative to the directory 'dfd', or AT_FDCWD) into
+ * the trash and schedules it for removal.
+ *
+ * The rename is atomic, so the tree disappears from its original location
+ * in one step regardless of its size, and is deleted in the background.
+ * The trash lives inside the project root, so 'path' must be on the same
+ * file system.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+trash_put(int dfd, const char *path)
+{
+	char name[TRASH_NAME_MAX];
+
+	if (_trash.trash == -1)
+		return ENOENT;
+
+	for (;;) {
+		snprintf(name, sizeof(name), "%ld.%u", (long) time(NULL),
+		    __sync_fetch_and_add(&_trash.next, 1));
+
+		if (renameat2(dfd, path, _trash.trash, name, RENAME_NOREPLACE) == 0)
+			break;
+
+		if (EEXIST != errno)
+			return errno;
+	}
+
+	pthread_mutex_lock(&_trash.lock);
+	_trash.pending = TRUE;
+	pthread_cond_signal(&_trash.cond);
+	pthread_mutex_unlock(&_trash.lock);
+
+	return 0;
+}
+
+/*****************************************************************************/
+
+void *
+_trash_reap(void *data)
+{
+	UNUSED(data);
+
+	pthread_mutex_lock(&_trash.lock);
+
+	while (_trash.running) {
+		if (!_trash.pending) {
+			pthread_cond_wait(&_trash.cond, &_trash.lock);
+			continue;
+		}
+
+		_trash.pending = FALSE;
+		pthread_mutex_unlock(&_trash.lock);
+
+		if (_trash_empty() != 0)
+			y_log_message(Y_LOG_LEVEL_ERROR, "Failed to empty trash: %s", TRASH_PATH);
+
+		/* deleted projects were holding most of the blob links */
+		blob_collect();
+
+		pthread_mutex_lock(&_trash.lock);
+	}
+
+	pthread_mutex_unlock(&_trash.lock);
+
+	return NULL;
+}
+
+/* _trash_empty
+ *
+ * Function removes everything currently in the trash.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success and -1 on failure.
+ */
+int
+_trash_empty(void)
+{
+	struct dirent *dentry;
+	DIR *dh;
+	int fd;
+
+	fd = dup(_trash.trash);
+	if (fd == -1)
+		return -1;
+
+	if (!(dh = fdopendir(fd))) {
+		close(fd);
+		return -1;
+	}
+
+	rewinddir(dh);
+
+	while (_trash.running && (dentry = readdir(dh))) {
+		if (strcmp(dentry->d_name, ".") == 0 ||
+		    strcmp(dentry->d_name, "..") == 0)
+			continue;
+
+		_trash_remove(_trash.trash, dentry->d_name);
+	}
+
+	closedir(dh);
+
+	return 0;
+}
+
+/* _trash_remove
+ *
+ * Function removes 'name' from the directory 'dfd', descending into it
+ * first if it is a directory itself.
+ */
+void
+_trash_remove(int dfd, const char *name)
+{
+	struct dirent *dentry;
+	DIR *dh;
+	int fd;
+
+	_trash_throttle();
+
+	if (unlinkat(dfd, name, 0) == 0 || EISDIR != errno)
+		return;
+
+	fd = openat(dfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+	if (fd == -1)
+		return;
+
+	if (!(dh = fdopendir(fd))) {
+		close(fd);
+		return;
+	}
+
+	while (_trash.running && (dentry = readdir(dh))) {
+		if (strcmp(dentry->d_name, ".") == 0 ||
+		    strcmp(dentry->d_name, "..") == 0)
+			continue;
+
+		_trash_remove(dirfd(dh), dentry->d_name);
+	}
+
+	closedir(dh);
+
+	if (unlinkat(dfd, name, AT_REMOVEDIR) == -1 && _trash.running)
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to remove trash directory: %s", name);
+}
+
+/* _trash_throttle
+ *
+ * Function paces the reaper so that large deletions don't starve the
+ * foreground I/O of the server.
+ */
+void
+_trash_throttle(void)
+{
+	struct timespec pause = { 0, TRASH_PAUSE_NS };
+
+	if (++_trash.removed % TRASH_BATCH == 0)
+		nanosleep(&pause, NULL);
+}
@@ -0,0 +1,9 @@
+#ifndef CREDENTARIUS_TRASH_H
+#define CREDENTARIUS_TRASH_H 1
+
+int trash_init(void);
+void trash_fini(void);
+
+int trash_put(int, const char *);
+
+#endif
@@ -0,0 +1,307 @@
+#include "upload.h"
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <ulfius.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "config.h"
+#include "trash.h"
+
+#define UPLOAD_PATH PROJECT_PATH "/.uploads"
+
+/* uploads no endpoint claimed and no data arrived for are dropped */
+#define UPLOAD_IDLE (15 * 60)
+
+struct _upload
+{
+	const struct _u_request *request;
+	const struct upload_sink *sink;
+	void *data;
+	int rc;
+	time_t touched;
+	struct _upload *next;
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	struct _upload *uploads;
+	int directory;
+} _upload = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.directory = -1
+};
+
+static struct _upload *_upload_take(const struct _u_request *);
+static void _upload_put(struct _upload *);
+static void _upload_begin(const struct _u_request *, const struct upload_sink *);
+static void _upload_free(struct _upload *);
+
+/* upload_init
+ *
+ * Function prepares the directory inside the project root that uploads
+ * are written to while they arrive. Anything left there by a previous run
+ * is discarded.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success and -1 on failure.
+ */
+int
+upload_init(void)
+{
+	int rc;
+
+	rc = trash_put(AT_FDCWD, UPLOAD_PATH);
+	if (rc != 0 && ENOENT != rc) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to discard stale uploads: %s", UPLOAD_PATH);
+		return -1;
+	}
+
+	if (mkdir(UPLOAD_PATH, S_IRWXU) == -1 && EEXIST != errno) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to create upload area: %s", UPLOAD_PATH);
+		return -1;
+	}
+
+	_upload.directory = open(UPLOAD_PATH, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (_upload.directory == -1) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to open upload area: %s", UPLOAD_PATH);
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+upload_fini(void)
+{
+	struct _upload *upload;
+
+	while ((upload = _upload.uploads)) {
+		_upload.uploads = upload->next;
+		_upload_free(upload);
+	}
+
+	if (_upload.directory != -1) {
+		close(_upload.directory);
+		_upload.directory = -1;
+	}
+}
+
+/* upload_directory
+ *
+ * Function returns the directory uploads are written to. It lives on the
+ * same file system as the projects, so anything written there can be
+ * renamed into a project.
+ */
+int
+upload_directory(void)
+{
+	return _upload.directory;
+}
+
+/* upload_receive
+ *
+ * ulfius callback for the file parts of multipart/form-data bodies, which
+ * it hands over piece by piece instead of buffering them. 'user_data' is
+ * the table of routes, ended by an empty one, that accept uploads.
+ *
+ * The first piece opens the sink of the route matching the request, and
+ * every piece is written to it right away. The endpoint picks the result
+ * up with upload_claim once the body is complete. A request carries one
+ * file; should it send more, the last one wins.
+ *
+ * Failures are recorded for the endpoint to report rather than aborting
+ * the connection, the rest of the body is then ignored.
+ *
+ * RETURN VALUES
+ *
+ * The function will always return U_OK.
+ */
+int
+upload_receive(const struct _u_request *request, const char *key, const char *filename,
+    const char *content_type, const char *transfer_encoding, const char *data,
+    uint64_t offset, size_t size, void *user_data)
+{
+	const struct upload_route *route;
+	struct _upload *upload;
+
+	UNUSED(key);
+	UNUSED(filename);
+	UNUSED(content_type);
+	UNUSED(transfer_encoding);
+
+	if (offset == 0) {
+		for (route = user_data; route->verb; ++route)
+			if (strcmp(request->http_verb, route->verb) == 0 &&
+			    strncmp(request->http_url, route->prefix, strlen(route->prefix)) == 0)
+				break;
+
+		if (!route->verb) {
+			y_log_message(Y_LOG_LEVEL_DEBUG, "Ignoring upload to %s %s", request->http_verb, request->http_url);
+			return U_OK;
+		}
+
+		_upload_begin(request, route->sink);
+	}
+
+	if (!(upload = _upload_take(request)))
+		return U_OK;
+
+	if (upload->rc == 0 && size > 0 &&
+	    (upload->rc = upload->sink->write(upload->data, data, size)) != 0) {
+		upload->sink->abort(upload->data);
+		upload->data = NULL;
+	}
+
+	_upload_put(upload);
+
+	return U_OK;
+}
+
+/* upload_claim
+ *
+ * Function hands the upload that came with 'request' over to its endpoint,
+ * which then owns the data of 'sink' that was written to.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, ENOENT if the request
+ * carried no upload and its body is to be used instead, EINVAL if it is a
+ * form without a file, or the error that ended the upload, in which case
+ * nothing is handed over.
+ */
+int
+upload_claim(const struct _u_request *request, const struct upload_sink *sink, void **data)
+{
+	const char *content_type;
+	struct _upload *upload;
+	int rc;
+
+	if (!(upload = _upload_take(request))) {
+		content_type = u_map_get_case(request->map_header, "Content-Type");
+
+		/* a form, but without any file part */
+		if (content_type && strncasecmp(content_type, "multipart/form-data", 19) == 0)
+			return EINVAL;
+
+		return ENOENT;
+	}
+
+	rc = upload->sink == sink ? upload->rc : EINVAL;
+	if (rc == 0) {
+		*data = upload->data;
+		upload->data = NULL;
+	}
+
+	_upload_free(upload);
+
+	return rc;
+}
+
+/*****************************************************************************/
+
+/* _upload_take
+ *
+ * Function removes the upload of 'request' from the list, so that its data
+ * can be used without holding the lock.
+ */
+struct _upload *
+_upload_take(const struct _u_request *request)
+{
+	struct _upload **prev;
+	struct _upload *upload;
+
+	pthread_mutex_lock(&_upload.lock);
+
+	for (prev = &_upload.uploads; (upload = *prev); prev = &upload->next) {
+		if (upload->request == request) {
+			*prev = upload->next;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&_upload.lock);
+
+	return upload;
+}
+
+void
+_upload_put(struct _upload *upload)
+{
+	upload->touched = time(NULL);
+
+	pthread_mutex_lock(&_upload.lock);
+	upload->next = _upload.uploads;
+	_upload.uploads = upload;
+	pthread_mutex_unlock(&_upload.lock);
+}
+
+/* _upload_begin
+ *
+ * Function starts a new upload for 'request'. Uploads of requests that
+ * never reached their endpoint, because the client went away, are dropped
+ * here once idle for UPLOAD_IDLE. So is an earlier file of the same
+ * request, or one of a finished request whose address is being reused.
+ */
+void
+_upload_begin(const struct _u_request *request, const struct upload_sink *sink)
+{
+	struct _upload *stale = NULL;
+	struct _upload **prev;
+	struct _upload *upload;
+	time_t idle;
+
+	idle = time(NULL) - UPLOAD_IDLE;
+
+	pthread_mutex_lock(&_upload.lock);
+
+	for (prev = &_upload.uploads; (upload = *prev);) {
+		if (upload->request != request && upload->touched > idle) {
+			prev = &upload->next;
+			continue;
+		}
+
+		*prev = upload->next;
+		upload->next = stale;
+		stale = upload;
+	}
+
+	pthread_mutex_unlock(&_upload.lock);
+
+	while ((upload = stale)) {
+		stale = upload->next;
+		_upload_free(upload);
+	}
+
+	if (!(upload = calloc(1, sizeof(*upload)))) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Out of memory for upload to %s", request->http_url);
+		return;
+	}
+
+	upload->request = request;
+	upload->sink = sink;
+	upload->rc = sink->open(_upload.directory, request, &upload->data);
+	if (upload->rc != 0)
+		upload->data = NULL;
+
+	_upload_put(upload);
+}
+
+void
+_upload_free(struct _upload *upload)
+{
+	if (upload->data)
+		upload->sink->abort(upload->data);
+
+	free(upload);
+}
@@ -0,0 +1,32 @@
+#ifndef CREDENTARIUS_UPLOAD_H
+#define CREDENTARIUS_UPLOAD_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct _u_request;
+
+struct upload_sink
+{
+	int (*open)(int, const struct _u_request *, void **);
+	int (*write)(void *, const char *, size_t);
+	void (*abort)(void *);
+};
+
+struct upload_route
+{
+	const char *verb;
+	const char *prefix;
+	const struct upload_sink *sink;
+};
+
+int upload_init(void);
+void upload_fini(void);
+
+int upload_directory(void);
+
+int upload_receive(const struct _u_request *, const char *, const char *, const char *,
+    const char *, const char *, uint64_t, size_t, void *);
+int upload_claim(const struct _u_request *, const struct upload_sink *, void **);
+
+#endif
@@ -0,0 +1,518 @@
+#include "wire.h"
+
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "config.h"
+#include "sha256.h"
+
+#define WIRE_UNIX "unix:"
+#define WIRE_HEADER_SIZE 5
+#define WIRE_BACKLOG 64
+
+/* bounds of the shared key, anything shorter is too easily guessed */
+#define WIRE_KEY_MIN 16
+#define WIRE_KEY_MAX 1024
+
+#define WIRE_CHALLENGE_SIZE 32
+
+static int _wire_open(const char *, int, unsigned int);
+static int _wire_answer(int);
+static int _wire_unix(const char *, int, unsigned int);
+static int _wire_connect(int, const struct sockaddr *, socklen_t, unsigned int);
+static int _wire_full(int, void *, size_t);
+
+static struct
+{
+	unsigned char key[WIRE_KEY_MAX];
+	size_t size;
+} _wire;
+
+/* wire_init
+ *
+ * Function reads the key shared by the server and its build workers from
+ * BUILD_KEY. Only the owner may have access to the file.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, EPERM if others can access
+ * the file, EINVAL if the key is shorter than WIRE_KEY_MIN bytes or longer
+ * than WIRE_KEY_MAX, or any other errno value on failure.
+ */
+int
+wire_init(void)
+{
+	struct stat st;
+	ssize_t bread;
+	int rc = 0;
+	int fd;
+
+	fd = open(BUILD_KEY, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return errno;
+
+	if (fstat(fd, &st) == -1) {
+		rc = errno;
+		goto close_file;
+	}
+
+	if (st.st_mode & (S_IRWXG|S_IRWXO)) {
+		rc = EPERM;
+		goto close_file;
+	}
+
+	bread = read(fd, _wire.key, sizeof(_wire.key));
+	if (bread == -1) {
+		rc = errno;
+		goto close_file;
+	}
+
+	if (bread < WIRE_KEY_MIN || (size_t) bread != (size_t) st.st_size) {
+		rc = EINVAL;
+		goto close_file;
+	}
+
+	_wire.size = bread;
+
+close_file:
+	close(fd);
+
+	return rc;
+}
+
+
+/* wire_connect
+ *
+ * Function connects to 'address', either "unix:<path>" or "<host>:<port>",
+ * and answers the challenge of the worker there with the shared key, giving
+ * up after 'timeout' milliseconds for each.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the connected socket, or -1 with errno set on
+ * failure.
+ */
+int
+wire_connect(const char *address, unsigned int timeout)
+{
+	int fd;
+	int rc;
+
+	fd = _wire_open(address, FALSE, timeout);
+	if (fd == -1)
+		return -1;
+
+	if ((rc = wire_timeout(fd, timeout)) != 0 || (rc = _wire_answer(fd)) != 0) {
+		close(fd);
+		errno = rc;
+		return -1;
+	}
+
+	return fd;
+}
+
+/* wire_listen
+ *
+ * Function listens on 'address', either "unix:<path>" or "<host>:<port>".
+ * The host may be left out to listen on 127.0.0.1 only, and a socket file
+ * left behind at <path> is replaced.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the listening socket, or -1 with errno set on
+ * failure.
+ */
+int
+wire_listen(const char *address)
+{
+	return _wire_open(address, TRUE, 0);
+}
+
+/* wire_challenge
+ *
+ * Function makes the peer on 'fd' prove that it knows the shared key before
+ * anything else is read from it: it gets a random challenge, and has to
+ * send back its HMAC-SHA256 under the key.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) if the peer knows the key, EACCES if
+ * it doesn't, or any other errno value on failure.
+ */
+int
+wire_challenge(int fd)
+{
+	unsigned char challenge[WIRE_CHALLENGE_SIZE];
+	unsigned char expected[SHA256_SIZE];
+	unsigned char answer[SHA256_SIZE];
+	unsigned char differ = 0;
+	enum wire_t type;
+	size_t length;
+	size_t i;
+	int rc;
+
+	if (getrandom(challenge, sizeof(challenge), 0) != sizeof(challenge))
+		return EIO;
+
+	if ((rc = wire_send(fd, WIRE_HELLO, challenge, sizeof(challenge))) != 0 ||
+	    (rc = wire_recv(fd, &type, answer, sizeof(answer), &length)) != 0)
+		return EMSGSIZE == rc ? EACCES : rc;
+
+	if (type != WIRE_AUTH || length != sizeof(answer))
+		return EACCES;
+
+	sha256_hmac(_wire.key, _wire.size, challenge, sizeof(challenge), expected);
+
+	/* in constant time, not to tell how much of it was right */
+	for (i = 0; i < sizeof(expected); ++i)
+		differ |= expected[i] ^ answer[i];
+
+	return differ ? EACCES : 0;
+}
+
+/* wire_timeout
+ *
+ * Function makes sends and receives on 'fd' fail with EAGAIN after
+ * 'timeout' milliseconds without progress.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+wire_timeout(int fd, unsigned int timeout)
+{
+	struct timeval tv = { timeout / 1000, timeout % 1000 * 1000 };
+
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1 ||
+	    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1)
+		return errno;
+
+	return 0;
+}
+
+/* wire_send
+ *
+ * Function sends a frame of 'type' carrying 'length' bytes of 'data'. A
+ * frame is the type, the big-endian 32-bit length of the payload and the
+ * payload itself.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+wire_send(int fd, enum wire_t type, const void *data, size_t length)
+{
+	unsigned char header[WIRE_HEADER_SIZE];
+	struct iovec iov[2];
+	struct msghdr msg;
+	ssize_t bwritten;
+
+	if (length > WIRE_FRAME_MAX)
+		return EMSGSIZE;
+
+	header[0] = type;
+	wire_put32(header + 1, length);
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = (void *) data;
+	iov[1].iov_len = length;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = length > 0 ? 2 : 1;
+
+	while (msg.msg_iovlen > 0) {
+		bwritten = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (bwritten == -1 && EINTR == errno)
+			continue;
+
+		if (bwritten == -1)
+			return errno;
+
+		while (msg.msg_iovlen > 0 && (size_t) bwritten >= msg.msg_iov->iov_len) {
+			bwritten -= msg.msg_iov->iov_len;
+			++msg.msg_iov;
+			--msg.msg_iovlen;
+		}
+
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + bwritten;
+			msg.msg_iov->iov_len -= bwritten;
+		}
+	}
+
+	return 0;
+}
+
+/* wire_recv
+ *
+ * Function receives the next frame into 'type' and 'data', which has room
+ * for 'size' bytes, and stores the length of its payload in 'length'.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, EPIPE if the peer closed
+ * the connection, EMSGSIZE if the frame doesn't fit, or any other errno
+ * value on failure.
+ */
+int
+wire_recv(int fd, enum wire_t *type, void *data, size_t size, size_t *length)
+{
+	unsigned char header[WIRE_HEADER_SIZE];
+	int rc;
+
+	if ((rc = _wire_full(fd, header, sizeof(header))) != 0)
+		return rc;
+
+	*type = header[0];
+	*length = wire_get32(header + 1);
+
+	if (*length > size)
+		return EMSGSIZE;
+
+	return _wire_full(fd, data, *length);
+}
+
+void
+wire_put32(unsigned char *out, unsigned long value)
+{
+	out[0] = value >> 24;
+	out[1] = value >> 16;
+	out[2] = value >> 8;
+	out[3] = value;
+}
+
+unsigned long
+wire_get32(const unsigned char *in)
+{
+	return (unsigned long) in[0] << 24 | (unsigned long) in[1] << 16 |
+	       (unsigned long) in[2] << 8 | in[3];
+}
+
+/*****************************************************************************/
+
+/* _wire_answer
+ *
+ * Function answers the challenge of the worker on 'fd', see wire_challenge.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+_wire_answer(int fd)
+{
+	unsigned char challenge[WIRE_CHALLENGE_SIZE];
+	unsigned char answer[SHA256_SIZE];
+	enum wire_t type;
+	size_t length;
+	int rc;
+
+	if ((rc = wire_recv(fd, &type, challenge, sizeof(challenge), &length)) != 0)
+		return rc;
+
+	if (type != WIRE_HELLO || length != sizeof(challenge))
+		return EPROTO;
+
+	sha256_hmac(_wire.key, _wire.size, challenge, sizeof(challenge), answer);
+
+	return wire_send(fd, WIRE_AUTH, answer, sizeof(answer));
+}
+
+int
+_wire_open(const char *address, int passive, unsigned int timeout)
+{
+	char host[256];
+	const char *port;
+	struct addrinfo hints;
+	struct addrinfo *result;
+	struct addrinfo *ai;
+	size_t length;
+	int one = 1;
+	int fd = -1;
+	int rc;
+
+	if (strncmp(address, WIRE_UNIX, sizeof(WIRE_UNIX) - 1) == 0)
+		return _wire_unix(address + sizeof(WIRE_UNIX) - 1, passive, timeout);
+
+	/* "host:port", "[v6 address]:port" or ":port" */
+	port = strrchr(address, ':');
+	if (!port) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	length = port++ - address;
+	if (length >= 2 && address[0] == '[' && address[length - 1] == ']') {
+		++address;
+		length -= 2;
+	}
+
+	if (length >= sizeof(host)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memcpy(host, address, length);
+	host[length] = '\0';
+
+	/* without a host, 127.0.0.1 rather than every interface */
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = passive && !host[0] ? AF_INET : AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive && host[0] ? AI_PASSIVE : 0;
+
+	if ((rc = getaddrinfo(host[0] ? host : NULL, port, &hints, &result)) != 0) {
+		errno = EAI_SYSTEM == rc ? errno : EHOSTUNREACH;
+		return -1;
+	}
+
+	for (ai = result; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype|SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd == -1)
+			continue;
+
+		/* build output should go out as soon as it is there */
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		if (passive) {
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, WIRE_BACKLOG) == 0)
+				break;
+		} else {
+			setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+			if (_wire_connect(fd, ai->ai_addr, ai->ai_addrlen, timeout) == 0)
+				break;
+		}
+
+		rc = errno;
+		close(fd);
+		errno = rc;
+		fd = -1;
+	}
+
+	freeaddrinfo(result);
+
+	return fd;
+}
+
+int
+_wire_unix(const char *path, int passive, unsigned int timeout)
+{
+	struct sockaddr_un addr;
+	int fd;
+	int rc;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+
+	if (passive) {
+		if ((unlink(path) == 0 || ENOENT == errno) &&
+		    bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0 &&
+		    listen(fd, WIRE_BACKLOG) == 0)
+			return fd;
+	} else if (_wire_connect(fd, (struct sockaddr *) &addr, sizeof(addr), timeout) == 0) {
+		return fd;
+	}
+
+	rc = errno;
+	close(fd);
+	errno = rc;
+
+	return -1;
+}
+
+/* _wire_connect
+ *
+ * Function connects 'fd' to 'addr' within 'timeout' milliseconds, leaving
+ * the socket in blocking mode.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success and -1 with errno set on
+ * failure.
+ */
+int
+_wire_connect(int fd, const struct sockaddr *addr, socklen_t length, unsigned int timeout)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	socklen_t size = sizeof(int);
+	int flags;
+	int rc;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags|O_NONBLOCK) == -1)
+		return -1;
+
+	if (connect(fd, addr, length) == -1) {
+		if (EINPROGRESS != errno)
+			return -1;
+
+		while ((rc = poll(&pfd, 1, timeout)) == -1 && EINTR == errno);
+
+		if (rc == 0)
+			errno = ETIMEDOUT;
+		if (rc <= 0)
+			return -1;
+
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &rc, &size) == -1)
+			return -1;
+
+		if (rc != 0) {
+			errno = rc;
+			return -1;
+		}
+	}
+
+	return fcntl(fd, F_SETFL, flags) == -1 ? -1 : 0;
+}
+
+int
+_wire_full(int fd, void *data, size_t length)
+{
+	ssize_t bread;
+	size_t done = 0;
+
+	while (done < length) {
+		bread = recv(fd, (char *) data + done, length - done, 0);
+		if (bread == -1 && EINTR == errno)
+			continue;
+
+		if (bread == -1)
+			return errno;
+
+		if (bread == 0)
+			return EPIPE;
+
+		done += bread;
+	}
+
+	return 0;
+}
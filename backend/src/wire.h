@@ -0,0 +1,44 @@
+#ifndef CREDENTARIUS_WIRE_H
+#define CREDENTARIUS_WIRE_H 1
+
+#include <stddef.h>
+
+/* largest payload of a single frame */
+#define WIRE_FRAME_MAX (64 * 1024)
+
+/* a worker says something at least this often while building */
+#define WIRE_KEEPALIVE_MS 5000
+
+enum wire_t
+{
+	/* worker to server on connection, then server to worker */
+	WIRE_HELLO = 'h', /* random challenge */
+	WIRE_AUTH  = 'a', /* HMAC-SHA256 of the challenge under the shared key */
+
+	/* server to worker */
+	WIRE_PING  = 'p', /* empty */
+	WIRE_BUILD = 'b', /* project name, NUL, fingerprint */
+	WIRE_DATA  = 'd', /* a piece of the snapshot, or of an artifact */
+	WIRE_END   = 'e', /* end of the snapshot */
+
+	/* worker to server */
+	WIRE_PONG  = 'P', /* builds running and waiting, capacity */
+	WIRE_LOG   = 'l', /* build output, empty to keep the connection alive */
+	WIRE_FILE  = 'f', /* artifact name, its content follows in WIRE_DATA */
+	WIRE_EXIT  = 'x'  /* exit status of make, ends the build */
+};
+
+int wire_init(void);
+
+int wire_connect(const char *, unsigned int);
+int wire_listen(const char *);
+int wire_challenge(int);
+int wire_timeout(int, unsigned int);
+
+int wire_send(int, enum wire_t, const void *, size_t);
+int wire_recv(int, enum wire_t *, void *, size_t, size_t *);
+
+void wire_put32(unsigned char *, unsigned long);
+unsigned long wire_get32(const unsigned char *);
+
+#endif
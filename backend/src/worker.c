@@ -0,0 +1,758 @@
+#include "worker.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ulfius.h>
+#include <unistd.h>
+
+#include "archive.h"
+#include "artifact.h"
+#include "build.h"
+#include "common.h"
+#include "config.h"
+#include "launch.h"
+#include "sha256.h"
+#include "wire.h"
+
+/* a server that says nothing for this long is taken for gone */
+#define WORKER_TIMEOUT_MS (6 * WIRE_KEEPALIVE_MS)
+#define WORKER_BLOCK_SIZE 4096
+
+#define WORKER_FAILED "Failed to start the build.\n"
+
+/* a build running, or about to, in the directory of project 'name' */
+struct _worker_job
+{
+	const char *name;
+	struct _worker_job *next;
+};
+
+static void *_worker_serve(void *);
+static void _worker_build(int, const char *, size_t);
+static int _worker_receive(int, int);
+static int _worker_claim(int, struct _worker_job *);
+static void _worker_release(struct _worker_job *);
+static int _worker_sync(int, int);
+static int _worker_same(int, int, const char *);
+static int _worker_stream(int, struct launch *);
+static void _worker_finish(int, int, int);
+static void _worker_tidy(void);
+static void _worker_discard(int, const char *);
+static void _worker_stop(int);
+
+static const char *const _worker_all[] = { "all", NULL };
+static const char *const _worker_clean_all[] = { "clean", "all", NULL };
+
+static const char *const _worker_artifacts[] = {
+	ARTIFACT_FIRMWARE,
+	ARTIFACT_MAP,
+	ARTIFACT_ELF
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	volatile sig_atomic_t running;
+	char path[PATH_MAX];
+	int root;
+	unsigned int capacity;
+	unsigned int busy;
+	unsigned int waiting;
+	unsigned int next;
+	struct _worker_job *jobs;
+} _worker = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.running = TRUE,
+	.root = -1
+};
+
+/* worker_main
+ *
+ * Function is the main loop of a build worker, started as
+ *
+ *   credentarius --build-worker <address> <directory>
+ *
+ * It listens on 'address', either "unix:<path>" or "[<host>]:<port>", for
+ * servers handing it builds, and keeps a directory of sources and objects
+ * for each project below 'directory', ideally on tmpfs. BUILD_WORKERS builds
+ * run at once, or one per online processor if that is zero; the others wait
+ * their turn.
+ *
+ * A build runs whatever the Makefile of the project says, so anyone who
+ * may hand the worker builds may run commands as its user. Without a host
+ * the worker only listens on loopback, and only servers that prove they
+ * know the key in BUILD_KEY are heard. The key doesn't encrypt anything:
+ * across machines, the connection must stay on a trusted network or go
+ * through a tunnel.
+ *
+ * Several workers may run on the same machine, each with a directory of
+ * its own.
+ *
+ * RETURN VALUES
+ *
+ * The function will return the exit code of the worker.
+ */
+int
+worker_main(int argc, char **argv)
+{
+	struct sigaction action;
+	sigset_t signals;
+	sigset_t mask;
+	pthread_t thread;
+	long capacity = BUILD_WORKERS;
+	int listener;
+	int rc = EXIT_FAILURE;
+	int fd;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: credentarius " WORKER_MODE " <address> <directory>\n");
+		return EXIT_FAILURE;
+	}
+
+	y_init_logs("credentarius-worker", Y_LOG_MODE_CONSOLE, Y_LOG_LEVEL_DEBUG, NULL, "Starting build worker");
+
+	/* no SA_RESTART, accept must return to notice */
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = _worker_stop;
+	sigaction(SIGHUP, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGQUIT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (capacity <= 0)
+		capacity = sysconf(_SC_NPROCESSORS_ONLN);
+	_worker.capacity = capacity > 0 ? capacity : 1;
+
+	if ((mkdir(argv[1], S_IRWXU) == -1 && EEXIST != errno) || !realpath(argv[1], _worker.path) ||
+	    (_worker.root = open(_worker.path, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to open build directory: %s", argv[1]);
+		goto cleanup_logs;
+	}
+
+	if ((rc = wire_init()) != 0) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to read build worker key %s: %s", BUILD_KEY, strerror(rc));
+		rc = EXIT_FAILURE;
+		goto close_root;
+	}
+
+	_worker_tidy();
+
+	if (launch_init() != 0)
+		goto close_root;
+
+	listener = wire_listen(argv[0]);
+	if (listener == -1) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to listen on %s: %s", argv[0], strerror(errno));
+		goto cleanup_launch;
+	}
+
+	y_log_message(Y_LOG_LEVEL_INFO, "Listening on %s, running %u builds at once.", argv[0], _worker.capacity);
+
+	/* the signals are for this thread, to stop accepting */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGHUP);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGQUIT);
+	sigaddset(&signals, SIGTERM);
+
+	while (_worker.running) {
+		fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (EINTR != errno)
+				y_log_message(Y_LOG_LEVEL_ERROR, "Failed to accept connection: %s", strerror(errno));
+			continue;
+		}
+
+		pthread_sigmask(SIG_BLOCK, &signals, &mask);
+		if (pthread_create(&thread, NULL, _worker_serve, (void *) (intptr_t) fd) == 0) {
+			pthread_detach(thread);
+		} else {
+			y_log_message(Y_LOG_LEVEL_ERROR, "Failed to start connection thread.");
+			close(fd);
+		}
+		pthread_sigmask(SIG_SETMASK, &mask, NULL);
+	}
+
+	close(listener);
+	rc = EXIT_SUCCESS;
+
+	y_log_message(Y_LOG_LEVEL_INFO, "Stopping, %u builds cut short.", _worker.busy);
+
+cleanup_launch:
+	launch_fini();
+
+close_root:
+	close(_worker.root);
+
+cleanup_logs:
+	y_close_logs();
+
+	return rc;
+}
+
+/*****************************************************************************/
+
+/* _worker_serve
+ *
+ * Thread answers the one request coming in on a connection: a ping, or a
+ * build, once the server proved it knows the shared key.
+ */
+void *
+_worker_serve(void *data)
+{
+	char request[NAME_MAX + SHA256_HEX_SIZE + 1];
+	unsigned char pong[8];
+	enum wire_t type;
+	size_t length;
+	int fd = (intptr_t) data;
+
+	if (wire_timeout(fd, WORKER_TIMEOUT_MS) != 0)
+		goto close_connection;
+
+	if (wire_challenge(fd) != 0) {
+		y_log_message(Y_LOG_LEVEL_WARNING, "Refused connection without the build worker key.");
+		goto close_connection;
+	}
+
+	if (wire_recv(fd, &type, request, sizeof(request) - 1, &length) != 0)
+		goto close_connection;
+
+	switch (type) {
+	case WIRE_PING:
+		pthread_mutex_lock(&_worker.lock);
+		wire_put32(pong, _worker.busy + _worker.waiting);
+		wire_put32(pong + 4, _worker.capacity);
+		pthread_mutex_unlock(&_worker.lock);
+
+		wire_send(fd, WIRE_PONG, pong, sizeof(pong));
+		break;
+
+	case WIRE_BUILD:
+		request[length] = '\0';
+		_worker_build(fd, request, length);
+		break;
+
+	default:
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Unexpected request '%c'.", type);
+		break;
+	}
+
+close_connection:
+	close(fd);
+
+	return NULL;
+}
+
+/* _worker_build
+ *
+ * Function runs the build asked for by 'request', "<name>\0<fingerprint>",
+ * on the connection 'fd'.
+ *
+ * The snapshot of the sources is taken in right away, into a directory of
+ * its own. Once the build may run, the files that changed replace the
+ * sources of the project directory, see _worker_sync, so that make only
+ * recompiles what actually changed since the last build here.
+ */
+void
+_worker_build(int fd, const char *request, size_t length)
+{
+	char temp[NAME_MAX + 1];
+	char path[PATH_MAX];
+	struct _worker_job job;
+	struct launch launch;
+	const char *fingerprint;
+	int status;
+	int clean;
+	int dfd;
+	int tfd;
+	int rc;
+
+	fingerprint = request + strlen(request) + 1;
+
+	if (request[0] == '\0' || request[0] == '.' || strchr(request, '/') ||
+	    strlen(request) >= length || strlen(request) > NAME_MAX - 16 ||
+	    (fingerprint[0] && strlen(fingerprint) != SHA256_HEX_SIZE - 1)) {
+		y_log_message(Y_LOG_LEVEL_DEBUG, "Malformed build request.");
+		return;
+	}
+
+	snprintf(temp, sizeof(temp), ".%s.%u", request, __sync_fetch_and_add(&_worker.next, 1));
+
+	rc = snprintf(path, sizeof(path), "%s/%s", _worker.path, request);
+	if (rc <= 0 || (size_t) rc >= sizeof(path))
+		return;
+
+	if (mkdirat(_worker.root, temp, S_IRWXU) == -1 ||
+	    (tfd = openat(_worker.root, temp, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to create snapshot directory: %s", temp);
+		return;
+	}
+
+	if ((rc = _worker_receive(fd, tfd)) != 0) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to receive snapshot of project '%s': %s", request, strerror(rc));
+		goto discard;
+	}
+
+	job.name = request;
+	if (_worker_claim(fd, &job) != 0)
+		goto discard;
+
+	if ((mkdirat(_worker.root, request, S_IRWXU) == -1 && EEXIST != errno) ||
+	    (dfd = openat(_worker.root, request, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to open project directory: %s", path);
+		goto release;
+	}
+
+	if (_worker_sync(dfd, tfd) != 0) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to update sources of project '%s'.", request);
+		goto close_project;
+	}
+
+	clean = !fingerprint[0] || build_stale(path, fingerprint);
+
+	rc = launch_make(path, clean ? _worker_clean_all : _worker_all, &launch);
+	if (rc != 0) {
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to start build: %s", strerror(rc));
+		goto close_project;
+	}
+
+	y_log_message(Y_LOG_LEVEL_DEBUG, "Build started%s: %s", clean ? " from scratch" : "", request);
+
+	rc = _worker_stream(fd, &launch);
+
+	close(launch.fd);
+	status = launch_wait(&launch);
+
+	if (clean && fingerprint[0])
+		build_commit(path, fingerprint);
+
+	if (rc == 0)
+		_worker_finish(fd, dfd, status);
+
+	close(dfd);
+	_worker_release(&job);
+	goto discard;
+
+close_project:
+	close(dfd);
+
+release:
+	_worker_release(&job);
+
+	if (wire_send(fd, WIRE_LOG, WORKER_FAILED, sizeof(WORKER_FAILED) - 1) == 0)
+		_worker_finish(fd, -1, -1);
+
+discard:
+	close(tfd);
+	_worker_discard(_worker.root, temp);
+}
+
+/* _worker_receive
+ *
+ * Function extracts the snapshot coming in on 'fd' into the directory
+ * 'tfd'.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value on failure.
+ */
+int
+_worker_receive(int fd, int tfd)
+{
+	char buffer[WIRE_FRAME_MAX];
+	struct archive_reader *reader;
+	enum wire_t type;
+	size_t length;
+	int rc;
+
+	if (!(reader = archive_reader_open(tfd, TRUE)))
+		return ENOMEM;
+
+	for (;;) {
+		if ((rc = wire_recv(fd, &type, buffer, sizeof(buffer), &length)) != 0 ||
+		    type == WIRE_END)
+			break;
+
+		if (type != WIRE_DATA) {
+			rc = EPROTO;
+			break;
+		}
+
+		if ((rc = archive_reader_feed(reader, buffer, length)) != 0)
+			break;
+	}
+
+	return archive_reader_close(reader, rc);
+}
+
+/* _worker_claim
+ *
+ * Function waits until 'job' may run, that is when fewer than the capacity
+ * of builds are running and none of them in the same project directory.
+ * Meanwhile the server on 'fd' is told every WIRE_KEEPALIVE_MS that the
+ * build is still coming.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success or an errno value if the
+ * server went away.
+ */
+int
+_worker_claim(int fd, struct _worker_job *job)
+{
+	struct timespec deadline;
+	struct _worker_job *other;
+	int keepalive = TRUE;
+	int rc = 0;
+
+	pthread_mutex_lock(&_worker.lock);
+	++_worker.waiting;
+
+	for (;;) {
+		for (other = _worker.jobs; other && strcmp(other->name, job->name) != 0; other = other->next)
+			;
+
+		if (!other && _worker.busy < _worker.capacity)
+			break;
+
+		if (keepalive) {
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += WIRE_KEEPALIVE_MS / 1000;
+			keepalive = FALSE;
+		}
+
+		if (pthread_cond_timedwait(&_worker.cond, &_worker.lock, &deadline) != ETIMEDOUT)
+			continue;
+
+		pthread_mutex_unlock(&_worker.lock);
+		rc = wire_send(fd, WIRE_LOG, NULL, 0);
+		pthread_mutex_lock(&_worker.lock);
+
+		if (rc != 0)
+			break;
+
+		keepalive = TRUE;
+	}
+
+	--_worker.waiting;
+
+	if (rc == 0) {
+		++_worker.busy;
+		job->next = _worker.jobs;
+		_worker.jobs = job;
+	}
+
+	pthread_mutex_unlock(&_worker.lock);
+
+	return rc;
+}
+
+void
+_worker_release(struct _worker_job *job)
+{
+	struct _worker_job **link;
+
+	pthread_mutex_lock(&_worker.lock);
+
+	for (link = &_worker.jobs; *link != job; link = &(*link)->next)
+		;
+
+	*link = job->next;
+	--_worker.busy;
+
+	pthread_cond_broadcast(&_worker.cond);
+	pthread_mutex_unlock(&_worker.lock);
+}
+
+/* _worker_sync
+ *
+ * Function replaces the sources in the project directory 'dfd' by those of
+ * the snapshot directory 'tfd', leaving the hidden files and directories of
+ * the build alone.
+ *
+ * Sources that didn't change are kept as they are. The others are stamped
+ * with the time here rather than the one in the snapshot: that has whole
+ * seconds only and comes from the server's clock, so it could be older than
+ * an object built from the previous content, and make would miss the edit.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success and -1 on failure.
+ */
+int
+_worker_sync(int dfd, int tfd)
+{
+	struct timespec now[2];
+	struct dirent *dentry;
+	struct stat fstat;
+	DIR *dh;
+	int rc = 0;
+	int fd;
+
+	/* sources gone from the project must go from here too */
+	if ((fd = dup(dfd)) == -1 || !(dh = fdopendir(fd))) {
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+
+	while ((dentry = readdir(dh))) {
+		if (dentry->d_name[0] == '.')
+			continue;
+
+		if (fstatat(dfd, dentry->d_name, &fstat, AT_SYMLINK_NOFOLLOW) == 0 &&
+		    !S_ISDIR(fstat.st_mode) &&
+		    fstatat(tfd, dentry->d_name, &fstat, AT_SYMLINK_NOFOLLOW) == -1 && ENOENT == errno)
+			unlinkat(dfd, dentry->d_name, 0);
+	}
+
+	closedir(dh);
+
+	if ((fd = dup(tfd)) == -1 || !(dh = fdopendir(fd))) {
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+
+	/* finer than the file system's own clock, so past anything built yet */
+	clock_gettime(CLOCK_REALTIME, &now[0]);
+	now[1] = now[0];
+
+	while (rc == 0 && (dentry = readdir(dh))) {
+		if (dentry->d_name[0] == '.' || _worker_same(dfd, tfd, dentry->d_name))
+			continue;
+
+		if (utimensat(tfd, dentry->d_name, now, AT_SYMLINK_NOFOLLOW) == -1 ||
+		    renameat(tfd, dentry->d_name, dfd, dentry->d_name) == -1)
+			rc = -1;
+	}
+
+	closedir(dh);
+
+	return rc;
+}
+
+/* _worker_same
+ *
+ * Function tells whether the file 'name' is a regular file with the same
+ * content in both the directories 'dfd' and 'tfd'.
+ */
+int
+_worker_same(int dfd, int tfd, const char *name)
+{
+	char kept[WORKER_BLOCK_SIZE];
+	char sent[WORKER_BLOCK_SIZE];
+	struct stat kst;
+	struct stat sst;
+	ssize_t bread;
+	int same = FALSE;
+	int kfd;
+	int sfd;
+
+	kfd = openat(dfd, name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	if (kfd == -1)
+		return FALSE;
+
+	sfd = openat(tfd, name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	if (sfd == -1)
+		goto close_kept;
+
+	if (fstat(kfd, &kst) == -1 || fstat(sfd, &sst) == -1 ||
+	    !S_ISREG(kst.st_mode) || !S_ISREG(sst.st_mode) || kst.st_size != sst.st_size)
+		goto close_sent;
+
+	for (;;) {
+		bread = read(kfd, kept, sizeof(kept));
+		if (bread == -1 || read(sfd, sent, bread) != bread || memcmp(kept, sent, bread) != 0)
+			break;
+
+		if (bread == 0) {
+			same = TRUE;
+			break;
+		}
+	}
+
+close_sent:
+	close(sfd);
+
+close_kept:
+	close(kfd);
+
+	return same;
+}
+
+/* _worker_stream
+ *
+ * Function sends the output of the build 'launch' to the server on 'fd'
+ * until make exits. If the server hangs up, the build is stopped.
+ *
+ * RETURN VALUES
+ *
+ * The function will return zero (0) on success, or EPIPE if the server
+ * went away.
+ */
+int
+_worker_stream(int fd, struct launch *launch)
+{
+	char buffer[WORKER_BLOCK_SIZE];
+	struct pollfd pfd[2];
+	ssize_t bread;
+	int gone = FALSE;
+	int rc;
+
+	pfd[0].fd = launch->fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = fd;
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		rc = poll(pfd, gone ? 1 : 2, WIRE_KEEPALIVE_MS);
+		if (rc == -1 && EINTR == errno)
+			continue;
+
+		if (rc == -1)
+			break;
+
+		/* the server sends nothing more unless it is cancelling */
+		if (!gone && (pfd[1].revents ||
+		    (rc == 0 && wire_send(fd, WIRE_LOG, NULL, 0) != 0))) {
+			kill(-launch->pid, SIGTERM);
+			gone = TRUE;
+		}
+
+		if (!pfd[0].revents)
+			continue;
+
+		bread = read(launch->fd, buffer, sizeof(buffer));
+		if (bread == -1 && (EINTR == errno || EAGAIN == errno))
+			continue;
+
+		if (bread <= 0)
+			break;
+
+		if (!gone && wire_send(fd, WIRE_LOG, buffer, bread) != 0) {
+			kill(-launch->pid, SIGTERM);
+			gone = TRUE;
+		}
+	}
+
+	return gone ? EPIPE : 0;
+}
+
+/* _worker_finish
+ *
+ * Function sends the artifacts found in the project directory 'dfd', if
+ * any, and then the exit 'status' of make, which ends the build.
+ */
+void
+_worker_finish(int fd, int dfd, int status)
+{
+	char buffer[WIRE_FRAME_MAX];
+	unsigned char exit[4];
+	ssize_t bread = 0;
+	size_t i;
+	int afd;
+	int rc;
+
+	for (i = 0; dfd != -1 && i < sizeof(_worker_artifacts) / sizeof(_worker_artifacts[0]); ++i) {
+		afd = openat(dfd, _worker_artifacts[i], O_RDONLY|O_CLOEXEC);
+		if (afd == -1)
+			continue;
+
+		rc = wire_send(fd, WIRE_FILE, _worker_artifacts[i], strlen(_worker_artifacts[i]));
+		while (rc == 0 && (bread = read(afd, buffer, sizeof(buffer))) > 0)
+			rc = wire_send(fd, WIRE_DATA, buffer, bread);
+
+		close(afd);
+
+		/* without the exit status, the server throws the artifact away */
+		if (rc != 0 || bread == -1) {
+			y_log_message(Y_LOG_LEVEL_ERROR, "Failed to send build artifact: %s", _worker_artifacts[i]);
+			return;
+		}
+	}
+
+	wire_put32(exit, (uint32_t) status);
+	wire_send(fd, WIRE_EXIT, exit, sizeof(exit));
+}
+
+/* _worker_tidy
+ *
+ * Function throws away the snapshots a previous run left behind.
+ */
+void
+_worker_tidy(void)
+{
+	struct dirent *dentry;
+	DIR *dh;
+	int fd;
+
+	if ((fd = dup(_worker.root)) == -1)
+		return;
+
+	if (!(dh = fdopendir(fd))) {
+		close(fd);
+		return;
+	}
+
+	while ((dentry = readdir(dh)))
+		if (dentry->d_name[0] == '.' && strcmp(dentry->d_name, ".") != 0 &&
+		    strcmp(dentry->d_name, "..") != 0)
+			_worker_discard(_worker.root, dentry->d_name);
+
+	closedir(dh);
+}
+
+/* _worker_discard
+ *
+ * Function removes the snapshot directory 'name' and the files in it.
+ */
+void
+_worker_discard(int root, const char *name)
+{
+	struct dirent *dentry;
+	DIR *dh;
+	int fd;
+
+	fd = openat(root, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+	if (fd == -1)
+		return;
+
+	if (!(dh = fdopendir(fd))) {
+		close(fd);
+		return;
+	}
+
+	while ((dentry = readdir(dh)))
+		if (strcmp(dentry->d_name, ".") != 0 && strcmp(dentry->d_name, "..") != 0)
+			unlinkat(fd, dentry->d_name, 0);
+
+	closedir(dh);
+
+	if (unlinkat(root, name, AT_REMOVEDIR) == -1)
+		y_log_message(Y_LOG_LEVEL_ERROR, "Failed to remove snapshot directory: %s", name);
+}
+
+void
+_worker_stop(int signal)
+{
+	UNUSED(signal);
+
+	_worker.running = FALSE;
+}
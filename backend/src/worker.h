@@ -0,0 +1,9 @@
+#ifndef CREDENTARIUS_WORKER_H
+#define CREDENTARIUS_WORKER_H 1
+
+/* argument making the executable run as a build worker */
+#define WORKER_MODE "--build-worker"
+
+int worker_main(int, char **);
+
+#endif